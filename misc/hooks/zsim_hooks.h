@@ -14,6 +14,8 @@
 #define ZSIM_MAGIC_OP_HEARTBEAT         (1028)
 #define ZSIM_MAGIC_OP_WORK_BEGIN        (1029) //ubik
 #define ZSIM_MAGIC_OP_WORK_END          (1030) //ubik
+#define ZSIM_MAGIC_OP_OFFLOAD_BEGIN     (1034)
+#define ZSIM_MAGIC_OP_OFFLOAD_END       (1035)
 
 #ifdef __x86_64__
 #define HOOKS_STR  "HOOKS"
@@ -22,11 +24,22 @@ static inline void zsim_magic_op(uint64_t op) {
     __asm__ __volatile__("xchg %%rcx, %%rcx;" : : "c"(op));
     COMPILER_BARRIER();
 }
+
+//Magic op with an argument, passed in rdx
+static inline void zsim_magic_op_arg(uint64_t op, uint64_t arg) {
+    COMPILER_BARRIER();
+    __asm__ __volatile__("xchg %%rcx, %%rcx;" : : "c"(op), "d"(arg));
+    COMPILER_BARRIER();
+}
 #else
 #define HOOKS_STR  "NOP-HOOKS"
 static inline void zsim_magic_op(uint64_t op) {
     //NOP
 }
+
+static inline void zsim_magic_op_arg(uint64_t op, uint64_t arg) {
+    //NOP
+}
 #endif
 
 static inline void zsim_roi_begin() {
@@ -46,4 +59,8 @@ static inline void zsim_heartbeat() {
 static inline void zsim_work_begin() { zsim_magic_op(ZSIM_MAGIC_OP_WORK_BEGIN); }
 static inline void zsim_work_end() { zsim_magic_op(ZSIM_MAGIC_OP_WORK_END); }
 
+//Near-data offload: run the region on the cores of the NUMA node that owns data (needs sys.ndpOffload.enable)
+static inline void zsim_offload_begin(const void* data) { zsim_magic_op_arg(ZSIM_MAGIC_OP_OFFLOAD_BEGIN, (uint64_t)data); }
+static inline void zsim_offload_end() { zsim_magic_op(ZSIM_MAGIC_OP_OFFLOAD_END); }
+
 #endif /*__ZSIM_HOOKS_H__*/
@@ -0,0 +1,48 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#define SHARED_LINES 1024
+#define READ_LINES (16 * 1024)
+#define PRIVATE_BYTES (512 * 1024)
+#define ITER 32
+
+struct alignas(64) Line {
+    std::atomic<long> count;
+};
+
+static Line shared[SHARED_LINES];
+static long readOnly[READ_LINES * 8];
+
+// Threads concurrently update the same lines while streaming over private data bigger than their caches, so that
+// writebacks of dirty lines race with invalidations and directory evictions of the lines the other threads share.
+static void worker(int tid, long* result) {
+    std::vector<char> priv(PRIVATE_BYTES);
+    long sum = 0;
+    for (int j = 0; j < ITER; j++) {
+        for (int i = 0; i < SHARED_LINES; i++) shared[(i + tid * 64) % SHARED_LINES].count++;
+        for (size_t i = 0; i < priv.size(); i += 64) priv[i] += j;
+        for (int i = 0; i < READ_LINES; i++) sum += readOnly[((i + tid * 256) % READ_LINES) * 8];
+    }
+    *result = sum;
+}
+
+int main(int argc, char* argv[]) {
+    int threads = (argc > 1) ? atoi(argv[1]) : 8;
+
+    for (int i = 0; i < READ_LINES; i++) readOnly[i * 8] = 1;
+
+    std::vector<long> results(threads);
+    std::vector<std::thread> th;
+    for (int t = 0; t < threads; t++) th.emplace_back(worker, t, &results[t]);
+    for (int t = 0; t < threads; t++) th[t].join();
+
+    for (int i = 0; i < SHARED_LINES; i++) assert(shared[i].count == (long)threads * ITER);
+    for (int t = 0; t < threads; t++) assert(results[t] == (long)ITER * READ_LINES);
+
+    printf("%d threads done\n", threads);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include <thread>
+#include <vector>
+
+#include <numa.h>
+
+#include "../hooks/zsim_hooks.h"
+
+#define ELEMS (256*1024)
+#define ITERS 4
+
+// Each thread sums the array of every node, offloading each sum to the node that owns the array.
+static void worker(int tid, const std::vector<long*>& arrays, long* result) {
+    long sum = 0;
+    for (int it = 0; it < ITERS; it++) {
+        for (size_t n = 0; n < arrays.size(); n++) {
+            const long* a = arrays[(n + tid) % arrays.size()];
+            zsim_offload_begin(a);
+            for (int i = 0; i < ELEMS; i++) sum += a[i];
+            zsim_offload_end();
+        }
+    }
+    *result = sum;
+}
+
+int main(int argc, char* argv[]) {
+    if (numa_available() < 0) {
+        printf("NUMA not available\n");
+        return 1;
+    }
+    int nodes = numa_max_node() + 1;
+    int threads = (argc > 1) ? atoi(argv[1]) : nodes;
+
+    zsim_roi_begin();
+
+    std::vector<long*> arrays;
+    for (int n = 0; n < nodes; n++) {
+        long* a = (long*)numa_alloc_onnode(ELEMS * sizeof(long), n);
+        assert(a);
+        for (int i = 0; i < ELEMS; i++) a[i] = n;
+        arrays.push_back(a);
+    }
+
+    std::vector<long> results(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) workers.emplace_back(worker, t, std::cref(arrays), &results[t]);
+    for (auto& w : workers) w.join();
+
+    long expected = (long)ITERS * ELEMS * nodes * (nodes - 1) / 2;
+    for (int t = 0; t < threads; t++) {
+        if (results[t] != expected) {
+            printf("Thread %d: sum %ld, expected %ld\n", t, results[t], expected);
+            return 1;
+        }
+    }
+
+    for (int n = 0; n < nodes; n++) numa_free(arrays[n], ELEMS * sizeof(long));
+
+    zsim_roi_end();
+    printf("%d threads offloaded to %d nodes\n", threads, nodes);
+    return 0;
+}
@@ -2,8 +2,10 @@
 #define ADDRESS_MAP_H_
 
 #include <bitset>
+#include <utility>
 #include "constants.h"
 #include "g_std/g_unordered_map.h"
+#include "g_std/g_vector.h"
 #include "locks.h"
 #include "memory_hierarchy.h"
 #include "numa_map.h"
@@ -114,20 +116,25 @@ class CoherentParentMap : public GlobAlloc {
 /**
  * Hash the address by splitting into four 16-bit chunks and XOR together.
  *
- * Same as the hash used in MESIBottomCC::getParentId().
+ * Same as the hash used in MESIBottomCC::getParentId(), with single-line chunks.
  */
 class XOR16bHashAddressMap : public AddressMap {
     private:
         const uint32_t total;
+        const uint32_t chunkBits;  // log2 of the chunk size in lines
 
     public:
-        explicit XOR16bHashAddressMap(uint32_t _total) : total(_total) {}
+        explicit XOR16bHashAddressMap(uint32_t _total, Address _chunkNumLines = 1)
+            : total(_total), chunkBits(ilog2(_chunkNumLines))
+        {
+            assert(isPow2(_chunkNumLines));
+        }
 
         uint32_t getTotal() const { return total; }
 
         uint32_t getMap(Address lineAddr) const {
             uint32_t res = 0;
-            uint64_t tmp = lineAddr;
+            uint64_t tmp = lineAddr >> chunkBits;
             for (uint32_t i = 0; i < 4; i++) {
                 res ^= (uint32_t) ( ((uint64_t)0xffff) & tmp);
                 tmp = tmp >> 16;
@@ -158,22 +165,27 @@ class StaticInterleavingAddressMap : public AddressMap {
 /**
  * Map address according to NUMA.
  *
+ * The node of the page picks a slice of the terminals, and the node map interleaves the lines within the slice, e.g.,
+ * across the vaults or channels of the node. The node map must be static.
+ *
  * zinfo->numaMap must be valid. Otherwise assume a single node.
  */
-
-
 class NUMAAddressMap : public AddressMap {
     private:
         const uint32_t total;
         const uint32_t nodes;
-        XOR16bHashAddressMap* nodeMap;
+        AddressMap* nodeMap;
 
     public:
-        NUMAAddressMap(uint32_t _total)
+        // Default to XOR hashing of lines within a node.
+        explicit NUMAAddressMap(uint32_t _total, AddressMap* _nodeMap = nullptr)
             : total(_total), nodes(zinfo->numaMap ? zinfo->numaMap->getMaxNode() + 1 : 1) {
             if (total % nodes != 0)
                 panic("NUMAAddressMap: total terminals (%u) must be a multiple of NUMA nodes (%u)", total, nodes);
-            nodeMap = new XOR16bHashAddressMap(total / nodes);
+            nodeMap = _nodeMap ? _nodeMap : new XOR16bHashAddressMap(total / nodes);
+            if (nodeMap->getTotal() != total / nodes)
+                panic("NUMAAddressMap: node map has %u terminals, expected %u", nodeMap->getTotal(), total / nodes);
+            if (nodeMap->isDynamic()) panic("NUMAAddressMap: node map must be static");
         }
 
         ~NUMAAddressMap() { 
@@ -189,11 +201,60 @@ class NUMAAddressMap : public AddressMap {
             return n * total / nodes + nodeMap->getMap(lineAddr);
         }
 
+        // The terminal of lineAddr if its page were on the given node.
+        uint32_t getMapOfNode(Address lineAddr, uint32_t node) const {
+            assert(node < nodes);
+            return node * total / nodes + nodeMap->getMap(lineAddr);
+        }
+
+        uint32_t getNodeOfMap(uint32_t map) const {
+            assert(map < total);
+            return map / (total / nodes);
+        }
+
         bool isDynamic() const override { return true; }
 };
 
+/**
+ * Stripe designated hot ranges across all terminals with a separate map, e.g., to spread a shared structure over all
+ * NUMA nodes at fine granularity. All other addresses use the base map.
+ */
+class HotRangeAddressMap : public AddressMap {
+    private:
+        AddressMap* baseMap;
+        AddressMap* hotMap;
+        g_vector<std::pair<Address, Address>> ranges;  // [start, end) line addresses
+        Address minLine;  // bounds of all ranges, for a quick check
+        Address maxLine;
+
+    public:
+        HotRangeAddressMap(AddressMap* _baseMap, AddressMap* _hotMap) : baseMap(_baseMap), hotMap(_hotMap) {
+            if (hotMap->getTotal() != baseMap->getTotal())
+                panic("HotRangeAddressMap: hot map has %u terminals, expected %u", hotMap->getTotal(), baseMap->getTotal());
+            minLine = -1uL;
+            maxLine = 0;
+        }
+
+        void addRange(Address startLine, Address endLine) {
+            assert(startLine < endLine);
+            ranges.push_back(std::make_pair(startLine, endLine));
+            minLine = MIN(minLine, startLine);
+            maxLine = MAX(maxLine, endLine);
+        }
 
+        uint32_t getTotal() const { return baseMap->getTotal(); }
 
+        uint32_t getMap(Address lineAddr) const {
+            if (lineAddr >= minLine && lineAddr < maxLine) {
+                for (const auto& r : ranges) {
+                    if (lineAddr >= r.first && lineAddr < r.second) return hotMap->getMap(lineAddr);
+                }
+            }
+            return baseMap->getMap(lineAddr);
+        }
+
+        bool isDynamic() const override { return baseMap->isDynamic() || hotMap->isDynamic(); }
+};
 
 #endif  // ADDRESS_MAP_H_
 
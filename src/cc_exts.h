@@ -72,8 +72,8 @@ class MESIBypassCC : public MESICC {
         BypassRule* bypass;
 
     public:
-        MESIBypassCC(uint32_t _numLines, BypassRule* _bypass, bool _nonInclusiveHack, g_string& _name)
-            : MESICC(_numLines, _nonInclusiveHack, _name), bypass(_bypass) {}
+        MESIBypassCC(uint32_t _numLines, BypassRule* _bypass, g_string& _name)
+            : MESICC(_numLines, _name), bypass(_bypass) {}
 
         void initStats(AggregateStat* cacheStat) {
             MESICC::initStats(cacheStat);
@@ -225,8 +225,8 @@ class MESIDirectoryHubCC : public MESICC {
         PAD();
 
     public:
-        MESIDirectoryHubCC(uint32_t _numLines, bool _nonInclusiveHack, const g_string& filterAccStr, bool _filterInv, g_string& _name)
-            : MESICC(_numLines, _nonInclusiveHack, _name), filterAcc(parseFilterAcc(filterAccStr)), filterInv(_filterInv), selfId(-1u), bottomLock(nullptr)
+        MESIDirectoryHubCC(uint32_t _numLines, const g_string& filterAccStr, bool _filterInv, g_string& _name)
+            : MESICC(_numLines, _name), filterAcc(parseFilterAcc(filterAccStr)), filterInv(_filterInv), selfId(-1u), bottomLock(nullptr)
         {
             futex_init(&nopStatsLock);
         }
@@ -502,6 +502,12 @@ class MESIDirectoryHubCC : public MESICC {
         }
 
     protected:
+        /* A recalled line has no sharers left, and the hub keeps no line without sharers, so evict it right away. */
+        void processRecall(const MemReq& req, Address lineAddr, uint32_t lineId, bool writeback, uint64_t cycle) {
+            MESICC::processRecall(req, lineAddr, lineId, writeback, cycle);
+            evictOffPath(req, lineAddr, lineId, cycle);
+        }
+
         /* Find a child that can forward the given line to the receiver. */
         uint32_t findForwarder(uint32_t lineId, uint32_t recvId) {
             // Find the closest sharer.
@@ -537,8 +543,8 @@ class MESIBroadcastHubCC : public MESIDirectoryHubCC<false> {
         const uint32_t banksPerChild;
 
     public:
-        MESIBroadcastHubCC(uint32_t _numLines, uint32_t _banksPerChild, bool _nonInclusiveHack, const g_string& filterAccStr, bool _filterInv, g_string& _name)
-            : BaseCC(_numLines, _nonInclusiveHack, filterAccStr, _filterInv, _name), banksPerChild(_banksPerChild) {}
+        MESIBroadcastHubCC(uint32_t _numLines, uint32_t _banksPerChild, const g_string& filterAccStr, bool _filterInv, g_string& _name)
+            : BaseCC(_numLines, filterAccStr, _filterInv, _name), banksPerChild(_banksPerChild) {}
 
         uint64_t processAccess(const MemReq& req, int32_t lineId, uint64_t startCycle, uint64_t* getDoneCycle = nullptr) {
             // Check whether the requesting child has sufficient permission or we need to broadcast.
@@ -25,7 +25,12 @@
 
 #include "coherence_ctrls.h"
 #include "cache.h"
+#include "event_recorder.h"
+#include "hash.h"
+#include "mtrand.h"
 #include "network.h"
+#include "timing_event.h"
+#include "zsim.h"
 
 /* Do a simple XOR block hash on address to determine its bank. Hacky for now,
  * should probably have a class that deals with this with a real hash function
@@ -186,17 +191,38 @@ void MESIBottomCC::processInval(Address lineAddr, uint32_t lineId, InvType type,
 }
 
 
-uint64_t MESIBottomCC::processNonInclusiveWriteback(Address lineAddr, AccessType type, uint64_t cycle, MESIState* state, uint32_t srcId, uint32_t flags) {
-    if (!nonInclusiveHack) panic("Non-inclusive %s on line 0x%lx, this cache should be inclusive", AccessTypeName(type), lineAddr);
+/* MESITopCC implementation */
 
-    //info("Non-inclusive wback, forwarding");
-    MemReq req = {lineAddr, type, selfId, state, cycle, &ccLock, *state, srcId, flags | MemReq::NONINCLWB};
-    uint64_t respCycle = parents[getParentId(lineAddr)]->access(req);
-    return respCycle;
-}
+MESITopCC::MESITopCC(uint32_t _numLines, const DirectoryParams& _dir)
+    : numLines(_numLines), dir(_dir), dirSetMask(0), lineDirIds(nullptr),
+      dirLineIds(nullptr), dirLineAddrs(nullptr), dirTimestamps(nullptr), dirTimestamp(1), dirUsedEntries(0), dirRnd(nullptr)
+{
+    uint32_t numEntries = numLines;
+    if (dir.isSparse()) {
+        numEntries = dir.entries;
+        assert(dir.ways > 0 && numEntries % dir.ways == 0);
+        uint32_t numSets = numEntries / dir.ways;
+        assert_msg(isPow2(numSets), "Sparse directory must have a power of 2 # sets, but it has %d", numSets);
+        dirSetMask = numSets - 1;
+        assert(dir.hf);
+
+        lineDirIds = gm_calloc<int32_t>(numLines);
+        for (uint32_t i = 0; i < numLines; i++) lineDirIds[i] = -1;
+        dirLineIds = gm_calloc<int32_t>(numEntries);
+        for (uint32_t i = 0; i < numEntries; i++) dirLineIds[i] = -1;
+        dirLineAddrs = gm_calloc<Address>(numEntries);
+        dirTimestamps = gm_calloc<uint64_t>(numEntries);
+        if (dir.repl == DirectoryParams::Rand) dirRnd = new MTRand(0x5D1AC7 + (uint64_t)this);
+    }
 
+    array = gm_calloc<Entry>(numEntries);
+    for (uint32_t i = 0; i < numEntries; i++) {
+        array[i].clear();
+    }
+    noEntry.clear();
 
-/* MESITopCC implementation */
+    futex_init(&ccLock);
+}
 
 void MESITopCC::init(const g_vector<BaseCache*>& _children, Network* network, const char* name) {
     if (_children.size() > MAX_CACHE_CHILDREN) {
@@ -210,9 +236,22 @@ void MESITopCC::init(const g_vector<BaseCache*>& _children, Network* network, co
     }
 }
 
-uint64_t MESITopCC::sendInvalidates(Address lineAddr, uint32_t lineId, InvType type, bool* reqWriteback, uint64_t cycle, uint32_t srcId) {
+void MESITopCC::initStats(AggregateStat* parentStat) {
+    if (!dir.isSparse()) return;
+    profDirAllocs.init("dirAllocs", "Sparse directory entry allocations");
+    profDirRecalls.init("dirRecalls", "Sparse directory entries recalled to make space");
+    profDirRecallInvs.init("dirRecallInvs", "Invalidations sent to children due to recalls");
+    profDirRecallWbs.init("dirRecallWbs", "Recalls that caused a writeback from children");
+    profDirUsedEntries.init("dirEntries", "Sparse directory entries in use", &dirUsedEntries);
+    parentStat->append(&profDirAllocs);
+    parentStat->append(&profDirRecalls);
+    parentStat->append(&profDirRecallInvs);
+    parentStat->append(&profDirRecallWbs);
+    parentStat->append(&profDirUsedEntries);
+}
+
+uint64_t MESITopCC::sendInvalidates(Address lineAddr, Entry* e, InvType type, bool* reqWriteback, uint64_t cycle, uint32_t srcId) {
     //Send down downgrades/invalidates
-    Entry* e = &array[lineId];
 
     //Don't propagate downgrades if sharers are not exclusive.
     if (type == INVX && !e->isExclusive()) {
@@ -246,21 +285,108 @@ uint64_t MESITopCC::sendInvalidates(Address lineAddr, uint32_t lineId, InvType t
     return maxCycle;
 }
 
+void MESITopCC::freeEntryIfEmpty(uint32_t lineId) {
+    if (!dir.isSparse()) return;
+    int32_t dirId = lineDirIds[lineId];
+    if (dirId == -1 || !array[dirId].isEmpty()) return;
+    array[dirId].clear();
+    dirLineIds[dirId] = -1;
+    dirLineAddrs[dirId] = 0;
+    dirTimestamps[dirId] = 0;
+    lineDirIds[lineId] = -1;
+    dirUsedEntries--;
+}
+
+uint32_t MESITopCC::findDirVictim(uint32_t first) {
+    uint32_t bestId = first;
+    for (uint32_t id = first; id < first + dir.ways; id++) {
+        if (dirLineIds[id] == -1 || array[id].isEmpty()) return id;  // free or empty entries first
+        switch (dir.repl) {
+            case DirectoryParams::LRU:
+                if (dirTimestamps[id] < dirTimestamps[bestId]) bestId = id;
+                break;
+            case DirectoryParams::FewestSharers:
+                if (array[id].numSharers < array[bestId].numSharers ||
+                        (array[id].numSharers == array[bestId].numSharers && dirTimestamps[id] < dirTimestamps[bestId])) {
+                    bestId = id;
+                }
+                break;
+            case DirectoryParams::Rand:
+                break;
+            default: panic("!?");
+        }
+    }
+    if (dir.repl == DirectoryParams::Rand) bestId = first + dirRnd->randInt(dir.ways - 1);
+    return bestId;
+}
+
+void MESITopCC::allocEntry(Address lineAddr, uint32_t lineId, Address* recallLineAddr, int32_t* recallLineId,
+        bool* recallWriteback, uint64_t cycle, uint32_t srcId) {
+    assert(dir.isSparse());
+    *recallLineId = -1;
+    if (lineDirIds[lineId] != -1) {
+        assert(dirLineAddrs[lineDirIds[lineId]] == lineAddr);
+        dirTimestamps[lineDirIds[lineId]] = dirTimestamp++;
+        return;
+    }
+
+    uint32_t set = dir.hf->hash(0, lineAddr) & dirSetMask;
+    uint32_t dirId = findDirVictim(set * dir.ways);
+    int32_t victimLineId = dirLineIds[dirId];
+    if (victimLineId != -1) {
+        Entry* e = &array[dirId];
+        if (!e->isEmpty()) {
+            // Recall: invalidate all sharers of the victim entry. Like evictions, this is off the critical path.
+            profDirRecalls.inc();
+            profDirRecallInvs.inc(e->numSharers);
+            bool writeback = false;
+            sendInvalidates(dirLineAddrs[dirId], e, INV, &writeback, cycle, srcId);
+            assert(e->isEmpty());
+            if (writeback) profDirRecallWbs.inc();
+
+            *recallLineAddr = dirLineAddrs[dirId];
+            *recallLineId = victimLineId;
+            *recallWriteback = writeback;
+        }
+        lineDirIds[victimLineId] = -1;
+        dirUsedEntries--;
+    }
+
+    array[dirId].clear();
+    dirLineIds[dirId] = lineId;
+    dirLineAddrs[dirId] = lineAddr;
+    dirTimestamps[dirId] = dirTimestamp++;
+    lineDirIds[lineId] = dirId;
+    dirUsedEntries++;
+    profDirAllocs.inc();
+}
 
 uint64_t MESITopCC::processEviction(Address wbLineAddr, uint32_t lineId, bool* reqWriteback, uint64_t cycle, uint32_t srcId) {
-    if (nonInclusiveHack) {
-        // Don't invalidate anything, just clear our entry
-        array[lineId].clear();
-        return cycle;
+    //Send down invalidates
+    uint64_t respCycle = sendInvalidates(wbLineAddr, getEntry(lineId), INV, reqWriteback, cycle, srcId);
+    freeEntryIfEmpty(lineId);
+    return respCycle;
+}
+
+void MESITopCC::moveLine(uint32_t fromId, uint32_t toId) {
+    if (dir.isSparse()) {
+        freeEntryIfEmpty(toId);
+        assert(lineDirIds[toId] == -1);
+        int32_t dirId = lineDirIds[fromId];
+        lineDirIds[toId] = dirId;
+        lineDirIds[fromId] = -1;
+        if (dirId != -1) dirLineIds[dirId] = toId;
     } else {
-        //Send down invalidates
-        return sendInvalidates(wbLineAddr, lineId, INV, reqWriteback, cycle, srcId);
+        assert(array[toId].isEmpty());
+        array[toId] = array[fromId];
+        array[fromId].clear();
     }
 }
 
 uint64_t MESITopCC::processAccess(Address lineAddr, uint32_t lineId, AccessType type, uint32_t childId, bool haveExclusive,
                                   MESIState* childState, bool* inducedWriteback, uint64_t cycle, uint32_t srcId, uint32_t flags) {
-    Entry* e = &array[lineId];
+    Entry* e = getEntry(lineId);
+    assert(e != &noEntry || IsPut(type)); //sparse directories allocate entries before GETs
     uint64_t respCycle = cycle;
     switch (type) {
         case PUTX:
@@ -277,6 +403,7 @@ uint64_t MESITopCC::processAccess(Address lineAddr, uint32_t lineId, AccessType
             e->sharers[childId] = false;
             e->numSharers--;
             *childState = I;
+            freeEntryIfEmpty(lineId);
             break;
         case GETS:
             if (e->isEmpty() && haveExclusive && !(flags & MemReq::NOEXCL)) {
@@ -291,7 +418,7 @@ uint64_t MESITopCC::processAccess(Address lineAddr, uint32_t lineId, AccessType
 
                 if (e->isExclusive()) {
                     //Downgrade the exclusive sharer
-                    respCycle = sendInvalidates(lineAddr, lineId, INVX, inducedWriteback, cycle, srcId);
+                    respCycle = sendInvalidates(lineAddr, e, INVX, inducedWriteback, cycle, srcId);
                 }
 
                 assert_msg(!e->isExclusive(), "Can't have exclusivity here. isExcl=%d excl=%d numSharers=%d", e->isExclusive(), e->exclusive, e->numSharers);
@@ -313,7 +440,7 @@ uint64_t MESITopCC::processAccess(Address lineAddr, uint32_t lineId, AccessType
             }
 
             // Invalidate all other copies
-            respCycle = sendInvalidates(lineAddr, lineId, INV, inducedWriteback, cycle, srcId);
+            respCycle = sendInvalidates(lineAddr, e, INV, inducedWriteback, cycle, srcId);
 
             // Set current sharer, mark exclusive
             e->sharers[childId] = true;
@@ -332,31 +459,179 @@ uint64_t MESITopCC::processAccess(Address lineAddr, uint32_t lineId, AccessType
 }
 
 uint64_t MESITopCC::processInval(Address lineAddr, uint32_t lineId, InvType type, bool* reqWriteback, uint64_t cycle, uint32_t srcId) {
-    if (type == FWD) {//if it's a FWD, we should be inclusive for now, so we must have the line, just invLat works
-        assert(!nonInclusiveHack); //dsm: ask me if you see this failing and don't know why
+    if (type == FWD) {//if it's a FWD, we must have the line or track it in a directory-only entry, just invLat works
         return cycle;
     } else {
         //Just invalidate or downgrade down to children as needed
-        return sendInvalidates(lineAddr, lineId, type, reqWriteback, cycle, srcId);
+        //NOTE: Invalidations do not hold our lock, and may interleave with an access that has already allocated an
+        //entry for this line (e.g., while it writes back a recalled line), so emptied entries are not freed here, but
+        //reused by allocEntry() or freed by later evictions
+        return sendInvalidates(lineAddr, getEntry(lineId), type, reqWriteback, cycle, srcId);
     }
 }
 
-uint64_t MESITopCC::processNonInclusiveWritebackToMovedLine(Address lineAddr, AccessType type, uint64_t cycle, MESIState* childState, uint32_t flags) {
-    if (!nonInclusiveHack) panic("Non-inclusive %s on line 0x%lx, this cache should be inclusive", AccessTypeName(type), lineAddr);
 
-    switch (type) {
-        case PUTX:
-            if (flags & MemReq::PUTX_KEEPEXCL) {
-                assert(*childState == M);
-                *childState = E;
-                break;
+/* MESICC implementation (non-inclusive and exclusive caches) */
+
+void MESICC::setInclusion(InclusionPolicy _inclusion, uint32_t _dirOnlyEntries, uint32_t _dirOnlyWays, HashFamily* _dirOnlyHf) {
+    assert(!bcc && !tcc);
+    inclusion = _inclusion;
+    if (inclusion == INCLUSIVE) return;
+
+    dirOnlyEntries = _dirOnlyEntries;
+    dirOnlyWays = _dirOnlyWays;
+    //Accesses to a line in a directory-only entry may need to allocate another entry in the same set
+    assert_msg(dirOnlyWays >= 2 && dirOnlyEntries % dirOnlyWays == 0, "[%s] Invalid directory-only entries %d / ways %d",
+            name.c_str(), dirOnlyEntries, dirOnlyWays);
+    uint32_t numSets = dirOnlyEntries / dirOnlyWays;
+    assert_msg(isPow2(numSets), "[%s] Directory-only entries must have a power of 2 # sets, but they have %d", name.c_str(), numSets);
+    dirOnlySetMask = numSets - 1;
+    dirOnlyHf = _dirOnlyHf;
+    assert(dirOnlyHf);
+
+    dirOnlyAddrs = gm_calloc<Address>(dirOnlyEntries);
+    for (uint32_t i = 0; i < dirOnlyEntries; i++) dirOnlyAddrs[i] = INVALID_ADDR;
+    dirOnlyTimestamps = gm_calloc<uint64_t>(dirOnlyEntries);
+}
+
+bool MESICC::allocatesOnAccess(const MemReq& req) {
+    switch (inclusion) {
+        case INCLUSIVE:
+            return true;
+        case NON_INCLUSIVE:
+            return req.type != PUTS;  //clean writebacks of dropped lines are not worth allocating
+        case EXCLUSIVE:
+            if (IsGet(req.type)) return req.flags & MemReq::PREFETCH;  //prefetches have no child to hand the line to
+            if (req.type == PUTX) return true;
+            {
+                //PUTS: allocate once the last sharer evicts the line
+                int32_t entry = lookupDirOnly(req.lineAddr);
+                assert(entry != -1);
+                uint32_t lineId = numLines + entry;
+                return tcc->numSharers(lineId) == 1 && tcc->isSharer(lineId, req.childId);
             }
-            // NO break in general
-        case PUTS:
-            *childState = I;
-            break;
         default: panic("!?");
     }
-    return cycle;
+    return false;
 }
 
+int32_t MESICC::findLine(const MemReq& req, int32_t lineId, uint64_t cycle) {
+    //Exclusive caches hand lines over to children, so GETs are served from directory-only entries
+    bool handOver = (inclusion == EXCLUSIVE) && IsGet(req.type) && !(req.flags & MemReq::PREFETCH);
+    int32_t entry = lookupDirOnly(req.lineAddr);
+    if (lineId != -1 && bcc->isValid(lineId)) {
+        assert(entry == -1);
+        if (!handOver) return lineId;
+        entry = allocDirOnly(req, req.lineAddr, cycle);
+        //The line may have been invalidated while allocating; move its state (even if invalid) anyway
+        uint32_t dirOnlyId = numLines + entry;
+        bcc->moveLine(lineId, dirOnlyId);
+        tcc->moveLine(lineId, dirOnlyId);
+        if (bcc->isValid(dirOnlyId)) profDirOnlyAllocs.inc();
+        return dirOnlyId;
+    }
+
+    if (entry == -1) {
+        //Children do not hold the line either. Fill the data line, or on exclusive caches, a directory-only entry
+        if (!handOver) {
+            assert(lineId != -1);
+            return lineId;
+        }
+        return numLines + allocDirOnly(req, req.lineAddr, cycle);
+    }
+
+    uint32_t dirOnlyId = numLines + entry;
+    if (lineId != -1 && !handOver && allocatesOnAccess(req)) {
+        bcc->moveLine(dirOnlyId, lineId);
+        tcc->moveLine(dirOnlyId, lineId);
+        freeDirOnly(entry);
+        profDirOnlyFills.inc();
+        return lineId;
+    }
+
+    dirOnlyTimestamps[entry] = dirOnlyTimestamp++;
+    if (IsGet(req.type) && bcc->isValid(dirOnlyId)) profDirOnlyHits.inc();
+    return dirOnlyId;
+}
+
+bool MESICC::moveToDirOnly(const MemReq& req, Address lineAddr, uint32_t lineId, uint64_t cycle) {
+    assert(lineId < numLines);
+    uint32_t entry = allocDirOnly(req, lineAddr, cycle);
+    if (!bcc->isValid(lineId)) {
+        assert(tcc->numSharers(lineId) == 0);
+        freeDirOnly(entry);
+        return false;
+    }
+    bcc->moveLine(lineId, numLines + entry);
+    tcc->moveLine(lineId, numLines + entry);
+    profDirOnlyAllocs.inc();
+    return true;
+}
+
+int32_t MESICC::lookupDirOnly(Address lineAddr) {
+    if (!dirOnlyEntries) return -1;
+    uint32_t first = (dirOnlyHf->hash(0, lineAddr) & dirOnlySetMask) * dirOnlyWays;
+    for (uint32_t e = first; e < first + dirOnlyWays; e++) {
+        if (dirOnlyAddrs[e] == lineAddr) return e;
+    }
+    return -1;
+}
+
+uint32_t MESICC::allocDirOnly(const MemReq& req, Address lineAddr, uint64_t cycle) {
+    assert(lookupDirOnly(lineAddr) == -1);
+    uint32_t first = (dirOnlyHf->hash(0, lineAddr) & dirOnlySetMask) * dirOnlyWays;
+    uint32_t victim = -1u;
+    for (uint32_t e = first; e < first + dirOnlyWays; e++) {
+        if (dirOnlyAddrs[e] == INVALID_ADDR) {
+            victim = e;
+            break;
+        }
+        if (dirOnlyAddrs[e] == req.lineAddr) continue;  //never evict the line being accessed
+        if (!bcc->isValid(numLines + e) && tcc->numSharers(numLines + e) == 0) {
+            victim = e;  //invalidated by the parent, nothing to write back
+            break;
+        }
+        if (victim == -1u || dirOnlyTimestamps[e] < dirOnlyTimestamps[victim]) victim = e;
+    }
+    assert(victim != -1u);
+
+    if (dirOnlyAddrs[victim] != INVALID_ADDR) {
+        if (bcc->isValid(numLines + victim)) {
+            profDirOnlyEvictions.inc();
+            profDirOnlyEvictionInvs.inc(tcc->numSharers(numLines + victim));
+        }
+        evictDirOnly(req, victim, cycle);
+    }
+
+    dirOnlyAddrs[victim] = lineAddr;
+    dirOnlyTimestamps[victim] = dirOnlyTimestamp++;
+    dirOnlyUsedEntries++;
+    return victim;
+}
+
+void MESICC::evictDirOnly(const MemReq& req, uint32_t entry, uint64_t cycle) {
+    assert(dirOnlyAddrs[entry] != INVALID_ADDR);
+    evictOffPath(req, dirOnlyAddrs[entry], numLines + entry, cycle);
+    freeDirOnly(entry);
+}
+
+void MESICC::freeDirOnly(uint32_t entry) {
+    assert(!bcc->isValid(numLines + entry) && tcc->numSharers(numLines + entry) == 0);
+    dirOnlyAddrs[entry] = INVALID_ADDR;
+    dirOnlyTimestamps[entry] = 0;
+    dirOnlyUsedEntries--;
+}
+
+void MESICC::evictOffPath(const MemReq& req, Address lineAddr, uint32_t lineId, uint64_t cycle) {
+    //The access may already have a record, and the eviction may create another one
+    EventRecorder* evRec = zinfo->eventRecorders[req.srcId];
+    TimingRecord accRec;
+    accRec.clear();
+    if (unlikely(evRec && evRec->hasRecord())) accRec = evRec->popRecord();
+    processEviction(req, lineAddr, lineId, cycle);
+    TimingRecord wbRec;
+    wbRec.clear();
+    if (unlikely(evRec && evRec->hasRecord())) wbRec = evRec->popRecord();
+    if (accRec.isValid()) evRec->pushRecord(accRec);
+    if (wbRec.isValid()) StitchOffPathRecord(evRec, wbRec, req.cycle);
+}
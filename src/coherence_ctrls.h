@@ -27,6 +27,7 @@
 #define COHERENCE_CTRLS_H_
 
 #include <bitset>
+#include "bithacks.h"
 #include "constants.h"
 #include "g_std/g_string.h"
 #include "g_std/g_vector.h"
@@ -74,6 +75,8 @@ class CC : public GlobAlloc {
  */
 
 class Cache;
+class HashFamily;
+class MTRand;
 class Network;
 
 /* NOTE: To avoid virtual function overheads, there is no BottomCC interface, since we only have a MESI controller for now */
@@ -86,7 +89,8 @@ class MESIBottomCC : public GlobAlloc {
         uint32_t numLines;
         uint32_t selfId;
 
-        //Profiling counters
+        //Profiling counters. Updated with the bank's ccLock held, so unlike shared stats updated without a lock (e.g.,
+        //memory controllers), they do not need sharding
         Counter profGETSHit, profGETSMiss, profGETXHit, profGETXMissIM /*from invalid*/, profGETXMissSM /*from S, i.e. upgrade misses*/;
         Counter profPUTS, profPUTX /*received from downstream*/;
         Counter profINV, profINVX, profFWD /*received from upstream*/;
@@ -94,14 +98,12 @@ class MESIBottomCC : public GlobAlloc {
         // TODO: Measuring writebacks is messy, do if needed
         Counter profGETNextLevelLat, profGETNetLat;
 
-        bool nonInclusiveHack;
-
         PAD();
         lock_t ccLock;
         PAD();
 
     public:
-        MESIBottomCC(uint32_t _numLines, uint32_t _selfId, bool _nonInclusiveHack) : numLines(_numLines), selfId(_selfId), nonInclusiveHack(_nonInclusiveHack) {
+        MESIBottomCC(uint32_t _numLines, uint32_t _selfId) : numLines(_numLines), selfId(_selfId) {
             array = gm_calloc<MESIState>(numLines);
             for (uint32_t i = 0; i < numLines; i++) {
                 array[i] = I;
@@ -152,7 +154,12 @@ class MESIBottomCC : public GlobAlloc {
 
         void processInval(Address lineAddr, uint32_t lineId, InvType type, bool* reqWriteback);
 
-        uint64_t processNonInclusiveWriteback(Address lineAddr, AccessType type, uint64_t cycle, MESIState* state, uint32_t srcId, uint32_t flags);
+        //Moves the state of a line to another (invalid) lineId, e.g., between the data array and directory-only entries
+        inline void moveLine(uint32_t fromId, uint32_t toId) {
+            assert(array[toId] == I);
+            array[toId] = array[fromId];
+            array[fromId] = I;
+        }
 
         inline void lock() {
             futex_lock(&ccLock);
@@ -174,6 +181,29 @@ class MESIBottomCC : public GlobAlloc {
 };
 
 
+/* Directory organization of a MESITopCC. By default (entries == 0), the directory is perfect: there is one entry
+ * per data line, so the directory is as large and as associative as the data array. A sparse directory instead
+ * has its own capacity, associativity and replacement policy. Entries are allocated when a line gets its first
+ * sharer and freed when it loses its last one (or reused, if invalidations from the parent emptied it); allocating
+ * an entry in a full set recalls a victim entry, i.e., invalidates all of its sharers, while the data line itself
+ * stays in the cache.
+ */
+struct DirectoryParams {
+    enum ReplType {
+        LRU,            // least recently allocated/accessed entry
+        FewestSharers,  // entry with the fewest sharers (fewest recall invalidations), LRU among ties
+        Rand,
+    };
+
+    uint32_t entries;  // 0 for a perfect directory
+    uint32_t ways;
+    ReplType repl;
+    HashFamily* hf;    // set index hash
+
+    DirectoryParams() : entries(0), ways(0), repl(LRU), hf(nullptr) {}
+    bool isSparse() const { return entries != 0; }
+};
+
 //Implements the "top" part: Keeps directory information, handles downgrades and invalidates
 class MESITopCC : public GlobAlloc {
     private:
@@ -188,38 +218,46 @@ class MESITopCC : public GlobAlloc {
                 sharers.reset();
             }
 
-            bool isEmpty() {
+            bool isEmpty() const {
                 return numSharers == 0;
             }
 
-            bool isExclusive() {
+            bool isExclusive() const {
                 return (numSharers == 1) && (exclusive);
             }
         };
 
-        Entry* array;
+        Entry* array;  // indexed by lineId with a perfect directory, by directory entry id with a sparse one
         g_vector<BaseCache*> children;
         g_vector<uint32_t> childrenRTTs;
         uint32_t numLines;
 
-        bool nonInclusiveHack;
+        // Sparse directory state, unused with a perfect directory
+        DirectoryParams dir;
+        uint32_t dirSetMask;
+        int32_t* lineDirIds;     // data lineId -> directory entry id, -1 if the line has no entry (i.e., no sharers)
+        int32_t* dirLineIds;     // directory entry id -> data lineId, -1 if the entry is free
+        Address* dirLineAddrs;   // directory entry id -> line address
+        uint64_t* dirTimestamps; // directory entry id -> last access, for replacement
+        uint64_t dirTimestamp;
+        uint64_t dirUsedEntries;
+        MTRand* dirRnd;
+        Entry noEntry;           // always empty, returned for lines without a directory entry
+
+        Counter profDirAllocs, profDirRecalls, profDirRecallInvs, profDirRecallWbs;
+        ProxyStat profDirUsedEntries;
 
         PAD();
         lock_t ccLock;
         PAD();
 
     public:
-        MESITopCC(uint32_t _numLines, bool _nonInclusiveHack) : numLines(_numLines), nonInclusiveHack(_nonInclusiveHack) {
-            array = gm_calloc<Entry>(numLines);
-            for (uint32_t i = 0; i < numLines; i++) {
-                array[i].clear();
-            }
-
-            futex_init(&ccLock);
-        }
+        MESITopCC(uint32_t _numLines, const DirectoryParams& _dir = DirectoryParams());
 
         void init(const g_vector<BaseCache*>& _children, Network* network, const char* name);
 
+        void initStats(AggregateStat* parentStat);
+
         uint64_t processEviction(Address wbLineAddr, uint32_t lineId, bool* reqWriteback, uint64_t cycle, uint32_t srcId);
 
         uint64_t processAccess(Address lineAddr, uint32_t lineId, AccessType type, uint32_t childId, bool haveExclusive,
@@ -227,7 +265,17 @@ class MESITopCC : public GlobAlloc {
 
         uint64_t processInval(Address lineAddr, uint32_t lineId, InvType type, bool* reqWriteback, uint64_t cycle, uint32_t srcId);
 
-        uint64_t processNonInclusiveWritebackToMovedLine(Address lineAddr, AccessType type, uint64_t cycle, MESIState* childState, uint32_t flags);
+        //Moves the sharers of a line to another lineId without sharers
+        void moveLine(uint32_t fromId, uint32_t toId);
+
+        /* Sparse directory: makes sure lineId has a directory entry before a GETS/GETX is processed. If this needs a
+         * victim entry, its sharers are invalidated, and the victim data line and whether sharers wrote back dirty
+         * data are returned (*recallLineId is -1 if nothing was recalled). Recalls are off the critical path.
+         */
+        void allocEntry(Address lineAddr, uint32_t lineId, Address* recallLineAddr, int32_t* recallLineId,
+                bool* recallWriteback, uint64_t cycle, uint32_t srcId);
+
+        inline bool isSparse() const { return dir.isSparse(); }
 
         inline void lock() {
             futex_lock(&ccLock);
@@ -238,16 +286,31 @@ class MESITopCC : public GlobAlloc {
         }
 
         /* Replacement policy query interface */
-        inline uint32_t numSharers(uint32_t lineId) {
-            return array[lineId].numSharers;
+        inline uint32_t numSharers(uint32_t lineId) const {
+            return getEntry(lineId)->numSharers;
         }
 
         /* Additional sharer info probe. */
-        inline bool hasExclusiveSharer(uint32_t lineId) const { return array[lineId].isExclusive(); }
-        inline bool isSharer(uint32_t lineId, uint32_t childId) const { return array[lineId].sharers[childId]; }
+        inline bool hasExclusiveSharer(uint32_t lineId) const { return getEntry(lineId)->isExclusive(); }
+        inline bool isSharer(uint32_t lineId, uint32_t childId) const { return getEntry(lineId)->sharers[childId]; }
 
     private:
-        uint64_t sendInvalidates(Address lineAddr, uint32_t lineId, InvType type, bool* reqWriteback, uint64_t cycle, uint32_t srcId);
+        inline const Entry* getEntry(uint32_t lineId) const {
+            if (!dir.isSparse()) return &array[lineId];
+            int32_t dirId = lineDirIds[lineId];
+            return (dirId == -1)? &noEntry : &array[dirId];
+        }
+
+        inline Entry* getEntry(uint32_t lineId) {
+            return const_cast<Entry*>(static_cast<const MESITopCC*>(this)->getEntry(lineId));
+        }
+
+        // Frees lineId's directory entry if it has no sharers left; no-op with a perfect directory
+        void freeEntryIfEmpty(uint32_t lineId);
+
+        uint32_t findDirVictim(uint32_t first);
+
+        uint64_t sendInvalidates(Address lineAddr, Entry* e, InvType type, bool* reqWriteback, uint64_t cycle, uint32_t srcId);
 };
 
 static inline bool CheckForMESIRace(AccessType& type, MESIState* state, MESIState initialState) {
@@ -279,33 +342,107 @@ static inline bool CheckForMESIRace(AccessType& type, MESIState* state, MESIStat
     return skipAccess;
 }
 
+/* Inclusion policy of a non-terminal cache w.r.t. its children:
+ *  - INCLUSIVE: children only hold lines in our data array, so evictions invalidate children.
+ *  - NON_INCLUSIVE: misses fill the data array as usual, but evictions do not invalidate children, and dirty
+ *    writebacks of lines we have dropped are allocated again.
+ *  - EXCLUSIVE (victim cache): misses and hits hand the line to the child and do not keep it here; lines are
+ *    allocated when children write them back, i.e., on PUTXs and on the PUTS of the last sharer.
+ * Lines held by children but not by the data array keep their coherence state and sharers in directory-only
+ * entries, a separate set-associative tag store, so the directory stays inclusive of children. Evicting a
+ * directory-only entry invalidates its sharers.
+ */
+enum InclusionPolicy {INCLUSIVE, NON_INCLUSIVE, EXCLUSIVE};
+
 // Non-terminal CC; accepts GETS/X and PUTS/X accesses
 class MESICC : public CC {
     protected:
         MESITopCC* tcc;
         MESIBottomCC* bcc;
         uint32_t numLines;
-        bool nonInclusiveHack;
+        InclusionPolicy inclusion;
+        DirectoryParams dirParams;
         g_string name;
 
+        // Directory-only entries, used by non-inclusive and exclusive caches. Entry i is tracked by bcc and tcc
+        // as lineId numLines + i.
+        uint32_t dirOnlyEntries;
+        uint32_t dirOnlyWays;
+        uint32_t dirOnlySetMask;
+        HashFamily* dirOnlyHf;
+        Address* dirOnlyAddrs;       // entry -> line address, or INVALID_ADDR if the entry is free
+        uint64_t* dirOnlyTimestamps; // entry -> last access, for replacement
+        uint64_t dirOnlyTimestamp;
+        uint64_t dirOnlyUsedEntries;
+
+        Counter profDirOnlyAllocs, profDirOnlyFills, profDirOnlyHits, profDirOnlyEvictions, profDirOnlyEvictionInvs;
+        ProxyStat profDirOnlyUsedEntries;
+
+        // Prefetch pollution filter (see Srinath et al., HPCA 2007): a direct-mapped table of lines evicted by prefetch
+        // fills, cleared when the line is fetched again. Demand misses that find their line there were caused by
+        // polluting prefetches. We keep full addresses instead of FDP's bits, which saturate on streaming workloads.
+        Address* pfPollutionFilter;
+        uint32_t pfPollutionMask;
+        Counter profPrefetchPollution;
+
+        static const Address INVALID_ADDR = ~((Address)0);
+
     public:
         //Initialization
-        MESICC(uint32_t _numLines, bool _nonInclusiveHack, g_string& _name) : tcc(nullptr), bcc(nullptr),
-            numLines(_numLines), nonInclusiveHack(_nonInclusiveHack), name(_name) {}
+        MESICC(uint32_t _numLines, g_string& _name) : tcc(nullptr), bcc(nullptr), numLines(_numLines),
+            inclusion(INCLUSIVE), name(_name), dirOnlyEntries(0), dirOnlyWays(0), dirOnlySetMask(0), dirOnlyHf(nullptr),
+            dirOnlyAddrs(nullptr), dirOnlyTimestamps(nullptr), dirOnlyTimestamp(1), dirOnlyUsedEntries(0),
+            pfPollutionFilter(nullptr), pfPollutionMask(0) {}
+
+        //Must be called before setChildren()
+        void setDirectoryParams(const DirectoryParams& _dirParams) {
+            assert(!tcc);
+            dirParams = _dirParams;
+        }
+
+        //Must be called before setParents() and setChildren(). Non-inclusive and exclusive caches need directory-only entries.
+        void setInclusion(InclusionPolicy _inclusion, uint32_t _dirOnlyEntries, uint32_t _dirOnlyWays, HashFamily* _dirOnlyHf);
+
+        //Tracks lines evicted by prefetches to count polluting prefetches; entries must be a power of 2 (0 disables)
+        void setPrefetchPollutionFilter(uint32_t entries) {
+            if (!entries) return;
+            if (!isPow2(entries)) panic("[%s] Prefetch pollution filter needs a power of 2 entries, %d given", name.c_str(), entries);
+            pfPollutionFilter = gm_calloc<Address>(entries);
+            for (uint32_t i = 0; i < entries; i++) pfPollutionFilter[i] = INVALID_ADDR;
+            pfPollutionMask = entries - 1;
+        }
 
         void setParents(uint32_t childId, const g_vector<MemObject*>& parents, Network* network) {
-            bcc = new MESIBottomCC(numLines, childId, nonInclusiveHack);
+            bcc = new MESIBottomCC(numLines + dirOnlyEntries, childId);
             bcc->init(parents, network, name.c_str());
         }
 
         void setChildren(const g_vector<BaseCache*>& children, Network* network) {
-            tcc = new MESITopCC(numLines, nonInclusiveHack);
+            tcc = new MESITopCC(numLines + dirOnlyEntries, dirParams);
             tcc->init(children, network, name.c_str());
         }
 
         void initStats(AggregateStat* cacheStat) {
-            //no tcc stats
             bcc->initStats(cacheStat);
+            tcc->initStats(cacheStat);  //only sparse directories have stats
+            if (inclusion != INCLUSIVE) {
+                profDirOnlyAllocs.init("dirOnlyAllocs", "Lines dropped from the data array but still held by children");
+                profDirOnlyFills.init("dirOnlyFills", "Lines moved from directory-only entries back to the data array");
+                profDirOnlyHits.init("dirOnlyHits", "Accesses to lines held by children but not by the data array");
+                profDirOnlyEvictions.init("dirOnlyEvictions", "Directory-only entries evicted to make space");
+                profDirOnlyEvictionInvs.init("dirOnlyEvictionInvs", "Invalidations sent to children due to directory-only evictions");
+                profDirOnlyUsedEntries.init("dirOnlyEntries", "Directory-only entries in use", &dirOnlyUsedEntries);
+                cacheStat->append(&profDirOnlyAllocs);
+                cacheStat->append(&profDirOnlyFills);
+                cacheStat->append(&profDirOnlyHits);
+                cacheStat->append(&profDirOnlyEvictions);
+                cacheStat->append(&profDirOnlyEvictionInvs);
+                cacheStat->append(&profDirOnlyUsedEntries);
+            }
+            if (pfPollutionFilter) {
+                profPrefetchPollution.init("pfPollution", "Demand misses on lines evicted by prefetches");
+                cacheStat->append(&profPrefetchPollution);
+            }
         }
 
         //Access methods
@@ -331,19 +468,21 @@ class MESICC : public CC {
         }
 
         bool shouldAllocate(const MemReq& req) {
-            if ((req.type == GETS) || (req.type == GETX)) {
-                return true;
-            } else {
-                assert((req.type == PUTS) || (req.type == PUTX));
-                if (!nonInclusiveHack) {
-                    panic("[%s] We lost inclusion on this line! 0x%lx, type %s, childId %d, childState %s", name.c_str(),
-                            req.lineAddr, AccessTypeName(req.type), req.childId, MESIStateName(*req.state));
-                }
-                return false;
+            if (inclusion == INCLUSIVE && IsPut(req.type)) {
+                panic("[%s] We lost inclusion on this line! 0x%lx, type %s, childId %d, childState %s", name.c_str(),
+                        req.lineAddr, AccessTypeName(req.type), req.childId, MESIStateName(*req.state));
             }
+            return allocatesOnAccess(req);
         }
 
         uint64_t processEviction(const MemReq& triggerReq, Address wbLineAddr, int32_t lineId, uint64_t startCycle) {
+            if (inclusion != INCLUSIVE && (uint32_t)lineId < numLines && bcc->isValid(lineId) && tcc->numSharers(lineId)) {
+                //Children still hold the line; drop the data only, and keep tracking the line in a directory-only entry
+                if (moveToDirOnly(triggerReq, wbLineAddr, lineId, startCycle)) return startCycle;
+            }
+            if (pfPollutionFilter && (triggerReq.flags & MemReq::PREFETCH) && (uint32_t)lineId < numLines && bcc->isValid(lineId)) {
+                pfPollutionFilter[pollutionIdx(wbLineAddr)] = wbLineAddr;
+            }
             bool lowerLevelWriteback = false;
             uint64_t evCycle = tcc->processEviction(wbLineAddr, lineId, &lowerLevelWriteback, startCycle, triggerReq.srcId); //1. if needed, send invalidates/downgrades to lower level
             evCycle = bcc->processEviction(wbLineAddr, lineId, lowerLevelWriteback, evCycle, triggerReq.srcId); //2. if needed, write back line to upper level
@@ -351,43 +490,59 @@ class MESICC : public CC {
         }
 
         uint64_t processAccess(const MemReq& req, int32_t lineId, uint64_t startCycle, uint64_t* getDoneCycle = nullptr) {
-            uint64_t respCycle = startCycle;
-            //Handle non-inclusive writebacks by bypassing
-            //NOTE: Most of the time, these are due to evictions, so the line is not there. But the second condition can trigger in NUCA-initiated
-            //invalidations. The alternative with this would be to capture these blocks, since we have space anyway. This is so rare is doesn't matter,
-            //but if we do proper NI/EX mid-level caches backed by directories, this may start becoming more common (and it is perfectly acceptable to
-            //upgrade without any interaction with the parent... the child had the permissions!)
-            if (lineId == -1 || (((req.type == PUTS) || (req.type == PUTX)) && !bcc->isValid(lineId))) { //can only be a non-inclusive wback
-                assert(nonInclusiveHack);
-                assert((req.type == PUTS) || (req.type == PUTX));
-                respCycle = bcc->processNonInclusiveWriteback(req.lineAddr, req.type, startCycle, req.state, req.srcId, req.flags);
-            } else if (((req.type == PUTS) || (req.type == PUTX)) && !tcc->isSharer(lineId, req.childId)) {
-                assert(nonInclusiveHack);
-                // NOTE(gaomy): This could happen when the line was evicted from this level, and then refetched back to another place in this level.
-                // In such a case, although we hit in a valid line, but the sharer info we have does not include the previous sharers before the eviction.
-                // We need to skip this level, and also there is no need to access the parent since we already have the line.
-                respCycle = tcc->processNonInclusiveWritebackToMovedLine(req.lineAddr, req.type, startCycle, req.state, req.flags);
-            } else {
-                //Prefetches are side requests and get handled a bit differently
-                bool isPrefetch = req.flags & MemReq::PREFETCH;
-                assert(!isPrefetch || req.type == GETS);
-                uint32_t flags = req.flags & ~MemReq::PREFETCH; //always clear PREFETCH, this flag cannot propagate up
-
-                //if needed, fetch line or upgrade miss from upper level
-                respCycle = bcc->processAccess(req.lineAddr, lineId, req.type, startCycle, req.srcId, flags);
-                if (getDoneCycle) *getDoneCycle = respCycle;
-                if (!isPrefetch) { //prefetches only touch bcc; the demand request from the core will pull the line to lower level
-                    //At this point, the line is in a good state w.r.t. upper levels
-                    bool lowerLevelWriteback = false;
-                    //change directory info, invalidate other children if needed, tell requester about its state
-                    respCycle = tcc->processAccess(req.lineAddr, lineId, req.type, req.childId, bcc->isExclusive(lineId), req.state,
-                            &lowerLevelWriteback, respCycle, req.srcId, flags);
-                    if (lowerLevelWriteback) {
-                        //Essentially, if tcc induced a writeback, bcc may need to do an E->M transition to reflect that the cache now has dirty data
-                        bcc->processWritebackOnAccess(req.lineAddr, lineId, req.type);
+            if (inclusion != INCLUSIVE) {
+                if (IsPut(req.type)) {
+                    //Making space for this writeback may have evicted other lines, which releases our locks (see
+                    //processEviction()), so the child may have been invalidated since startAccess(). Recheck races.
+                    MemReq putReq = req;
+                    if (CheckForMESIRace(putReq.type, putReq.state, putReq.initialState)) {
+                        int32_t entry = lookupDirOnly(req.lineAddr);
+                        if (entry != -1 && tcc->numSharers(numLines + entry) == 0) evictDirOnly(req, entry, startCycle);
+                        return startCycle;
                     }
+                    if (putReq.type != req.type) return processAccess(putReq, lineId, startCycle, getDoneCycle);
+                }
+                //The line may be tracked in a directory-only entry instead of the data array
+                lineId = findLine(req, lineId, startCycle);
+            }
+            assert_msg(lineId != -1, "[%s] %s on line 0x%lx without a lineId", name.c_str(), AccessTypeName(req.type), req.lineAddr);
+
+            //Prefetches are side requests and get handled a bit differently
+            bool isPrefetch = req.flags & MemReq::PREFETCH;
+            assert(!isPrefetch || req.type == GETS);
+            uint32_t flags = req.flags & ~MemReq::PREFETCH; //always clear PREFETCH, this flag cannot propagate up
+
+            if (pfPollutionFilter && IsGet(req.type) && !bcc->isValid(lineId)) {
+                Address& evictedLineAddr = pfPollutionFilter[pollutionIdx(req.lineAddr)];
+                if (evictedLineAddr == req.lineAddr) {
+                    if (!isPrefetch) profPrefetchPollution.inc();
+                    evictedLineAddr = INVALID_ADDR;
                 }
             }
+
+            //Sparse directories may need to recall another line, which may write back to the upper level; do so before
+            //fetching this line so that we do not release our locks once it is in a good state
+            if (!isPrefetch && tcc->isSparse()) allocDirEntry(req, lineId, startCycle);
+
+            //if needed, fetch line or upgrade miss from upper level
+            uint64_t respCycle = bcc->processAccess(req.lineAddr, lineId, req.type, startCycle, req.srcId, flags);
+            if (getDoneCycle) *getDoneCycle = respCycle;
+            if (!isPrefetch) { //prefetches only touch bcc; the demand request from the core will pull the line to lower level
+                //At this point, the line is in a good state w.r.t. upper levels
+                bool lowerLevelWriteback = false;
+                //change directory info, invalidate other children if needed, tell requester about its state
+                respCycle = tcc->processAccess(req.lineAddr, lineId, req.type, req.childId, bcc->isExclusive(lineId), req.state,
+                        &lowerLevelWriteback, respCycle, req.srcId, flags);
+                if (lowerLevelWriteback) {
+                    //Essentially, if tcc induced a writeback, bcc may need to do an E->M transition to reflect that the cache now has dirty data
+                    bcc->processWritebackOnAccess(req.lineAddr, lineId, req.type);
+                }
+            }
+
+            if (inclusion != INCLUSIVE && (uint32_t)lineId >= numLines && tcc->numSharers(lineId) == 0) {
+                //Neither data nor sharers left, give the line up (only after PUTs, so the child is not affected)
+                evictDirOnly(req, lineId - numLines, respCycle);
+            }
             return respCycle;
         }
 
@@ -408,6 +563,13 @@ class MESICC : public CC {
         }
 
         uint64_t processInv(const InvReq& req, int32_t lineId, uint64_t startCycle) {
+            if (inclusion != INCLUSIVE && (lineId == -1 || !bcc->isValid(lineId))) {
+                //The line may only be held by children. NOTE: We never free directory-only entries here, as an access
+                //may be waiting on the parent for this line; invalid entries are reused or freed by accesses instead.
+                int32_t entry = lookupDirOnly(req.lineAddr);
+                if (entry != -1) lineId = numLines + entry;
+            }
+            assert_msg(lineId != -1, "[%s] Invalidate on non-existing address 0x%lx type %s", name.c_str(), req.lineAddr, InvTypeName(req.type));
             uint64_t respCycle = tcc->processInval(req.lineAddr, lineId, req.type, req.writeback, startCycle, req.srcId); //send invalidates or downgrades to children
             bcc->processInval(req.lineAddr, lineId, req.type, req.writeback); //adjust our own state
 
@@ -418,6 +580,49 @@ class MESICC : public CC {
         //Repl policy interface
         uint32_t numSharers(uint32_t lineId) {return tcc->numSharers(lineId);}
         bool isValid(uint32_t lineId) {return bcc->isValid(lineId);}
+
+    protected:
+        inline uint32_t pollutionIdx(Address lineAddr) const { return (lineAddr ^ (lineAddr >> 16)) & pfPollutionMask; }
+
+        void allocDirEntry(const MemReq& req, uint32_t lineId, uint64_t cycle) {
+            Address recallLineAddr = 0;
+            int32_t recallLineId = -1;
+            bool recallWriteback = false;
+            tcc->allocEntry(req.lineAddr, lineId, &recallLineAddr, &recallLineId, &recallWriteback, cycle, req.srcId);
+            if (recallLineId != -1) processRecall(req, recallLineAddr, recallLineId, recallWriteback, cycle);
+        }
+
+        //Called after a sparse directory recalled all sharers of a line. The line stays here, but absorbs any dirty
+        //data written back by the sharers. Lines in directory-only entries have no data left, so they are evicted.
+        virtual void processRecall(const MemReq& req, Address lineAddr, uint32_t lineId, bool writeback, uint64_t cycle) {
+            if (writeback) bcc->processWritebackOnAccess(lineAddr, lineId, PUTX);
+            if (lineId >= numLines) evictDirOnly(req, lineId - numLines, cycle);
+        }
+
+        //Evicts a line while processing an access to another one. Like evictions in Cache::access(), this is off the
+        //critical path, and must keep the single-record invariant.
+        void evictOffPath(const MemReq& req, Address lineAddr, uint32_t lineId, uint64_t cycle);
+
+        //Whether req should be served from (and if needed, allocated in) the data array
+        bool allocatesOnAccess(const MemReq& req);
+
+        //Returns the lineId that tracks req's line, which may be a directory-only entry. Moves the line to the data
+        //array if req allocates, and to a directory-only entry on exclusive cache GETs.
+        int32_t findLine(const MemReq& req, int32_t lineId, uint64_t cycle);
+
+        //Moves a valid data line to a directory-only entry; returns false if the line was invalidated meanwhile
+        bool moveToDirOnly(const MemReq& req, Address lineAddr, uint32_t lineId, uint64_t cycle);
+
+        int32_t lookupDirOnly(Address lineAddr);
+
+        //Returns a free directory-only entry for lineAddr, evicting another one if needed. NOTE: Evictions write back
+        //to the parent, which releases our bcc lock, so callers must not have given the line to a child yet.
+        uint32_t allocDirOnly(const MemReq& req, Address lineAddr, uint64_t cycle);
+
+        //Invalidates the sharers of the entry, writes it back if needed, and frees it
+        void evictDirOnly(const MemReq& req, uint32_t entry, uint64_t cycle);
+
+        void freeDirOnly(uint32_t entry);
 };
 
 // Terminal CC, i.e., without children --- accepts GETS/X, but not PUTS/X
@@ -432,7 +637,7 @@ class MESITerminalCC : public CC {
         MESITerminalCC(uint32_t _numLines, const g_string& _name) : bcc(nullptr), numLines(_numLines), name(_name) {}
 
         void setParents(uint32_t childId, const g_vector<MemObject*>& parents, Network* network) {
-            bcc = new MESIBottomCC(numLines, childId, false /*inclusive*/);
+            bcc = new MESIBottomCC(numLines, childId);
             bcc->init(parents, network, name.c_str());
         }
 
@@ -499,6 +704,7 @@ class MESITerminalCC : public CC {
         }
 
         uint64_t processInv(const InvReq& req, int32_t lineId, uint64_t startCycle) {
+            assert_msg(lineId != -1, "[%s] Invalidate on non-existing address 0x%lx type %s", name.c_str(), req.lineAddr, InvTypeName(req.type));
             bcc->processInval(req.lineAddr, lineId, req.type, req.writeback); //adjust our own state
             bcc->unlock();
             return startCycle; //no extra delay in terminal caches
@@ -96,7 +96,7 @@ ContentionSim::ContentionSim(uint32_t _numDomains, uint32_t _numSimThreads) {
         PIN_SpawnInternalThread(SimThreadTrampoline, this, 1024*1024, nullptr);
     }
 
-    lastCrossing = gm_calloc<CrossingEventInfo>(numDomains*numDomains*MAX_THREADS); //TODO: refine... this allocs too much
+    lastCrossing = gm_calloc<CrossingTable>(MAX_THREADS);
 }
 
 void ContentionSim::postInit() {
@@ -133,6 +133,25 @@ void ContentionSim::initStats(AggregateStat* parentStat) {
         domStat->append(&domains[i].profTime);
         objStat->append(domStat);
     }
+
+    profCrossings.init("xings", "Crossing events by source domain", numDomains);
+    objStat->append(&profCrossings);
+    auto xingsPerPhaseStat = makeLambdaStat([this]() {
+        uint64_t xings = 0;
+        for (uint32_t i = 0; i < numDomains; i++) xings += profCrossings.count(i);
+        return zinfo->numPhases? xings / zinfo->numPhases : 0;
+    });
+    xingsPerPhaseStat->init("xingsPerPhase", "Crossing events per phase");
+    objStat->append(xingsPerPhaseStat);
+    auto xingTableStat = makeLambdaStat([this]() {
+        uint64_t bytes = MAX_THREADS*sizeof(CrossingTable);
+        for (uint32_t i = 0; i < MAX_THREADS; i++) {
+            if (lastCrossing[i].entries) bytes += (lastCrossing[i].mask + 1)*sizeof(CrossingTable::Entry);
+        }
+        return bytes;
+    });
+    xingTableStat->init("xingTableBytes", "Memory used to track the last crossing of each source and domain pair");
+    objStat->append(xingTableStat);
     parentStat->append(objStat);
 }
 
@@ -204,6 +223,7 @@ void ContentionSim::enqueueSynced(TimingEvent* ev, uint64_t cycle) {
 }
 
 void ContentionSim::enqueueCrossing(CrossingEvent* ev, uint64_t cycle, uint32_t srcId, uint32_t srcDomain, uint32_t dstDomain, EventRecorder* evRec) {
+    profCrossings.inc(srcId, srcDomain);
     CrossingStack& cs = evRec->getCrossingStack();
     bool isFirst = cs.empty();
     bool isResp = false;
@@ -223,7 +243,7 @@ void ContentionSim::enqueueCrossing(CrossingEvent* ev, uint64_t cycle, uint32_t
     if (isResp) {
         req->parentEv->addChild(ev, evRec);
     } else {
-        CrossingEventInfo* last = &lastCrossing[(srcId*numDomains + srcDomain)*numDomains + dstDomain];
+        CrossingEventInfo* last = getLastCrossing(srcId, srcDomain, dstDomain);
         uint64_t srcDomCycle = domains[srcDomain].curCycle;
         if (last->cycle > srcDomCycle && last->cycle <= cycle) { //NOTE: With the OOO model, last->cycle > cycle is now possible, since requests are issued in instruction order -> ooo
             //Chain to previous req
@@ -241,6 +261,31 @@ void ContentionSim::enqueueCrossing(CrossingEvent* ev, uint64_t cycle, uint32_t
     }
 }
 
+ContentionSim::CrossingEventInfo* ContentionSim::addCrossingEntry(CrossingTable& t, uint32_t key) {
+    //Keep the table at most half full, so probes stay short
+    if (!t.entries || 2*(t.used + 1) > t.mask + 1) {
+        CrossingTable::Entry* oldEntries = t.entries;
+        uint32_t oldSize = oldEntries? t.mask + 1 : 0;
+        uint32_t size = oldEntries? 2*oldSize : 8;
+        t.entries = gm_calloc<CrossingTable::Entry>(size);
+        t.mask = size - 1;
+        for (uint32_t i = 0; i < oldSize; i++) {
+            if (!oldEntries[i].key) continue;
+            uint32_t pos = CrossingTable::hash(oldEntries[i].key);
+            while (t.entries[pos & t.mask].key) pos++;
+            t.entries[pos & t.mask] = oldEntries[i];
+        }
+        if (oldEntries) gm_free(oldEntries);
+    }
+
+    uint32_t pos = CrossingTable::hash(key);
+    while (t.entries[pos & t.mask].key) pos++;
+    CrossingTable::Entry& e = t.entries[pos & t.mask];
+    e.key = key;
+    t.used++;
+    return &e.info;
+}
+
 void ContentionSim::simThreadLoop(uint32_t thid) {
     info("Started contention simulation thread %d", thid);
 #if 0
@@ -60,7 +60,39 @@ class ContentionSim : public GlobAlloc {
             CrossingEvent* ev; //only valid if the source's curCycle < cycle (otherwise this may be already executed or recycled)
         };
 
-        CrossingEventInfo* lastCrossing; //indexed by [srcId*doms*doms + srcDom*doms + dstDom]
+        /* Last crossing of each (srcDomain, dstDomain) pair a source has used. Sources use few pairs, so instead of a
+         * dense doms*doms array per source, each has a small open-addressing hash table that grows as needed. Like
+         * the dense array, only the source's thread accesses it, and entries are never removed.
+         */
+        struct CrossingTable {
+            struct Entry {
+                uint32_t key; //srcDom*doms + dstDom + 1; 0 if empty
+                CrossingEventInfo info;
+            };
+            Entry* entries; //nullptr until the first crossing
+            uint32_t mask; //entries - 1, a power of 2
+            uint32_t used;
+
+            static inline uint32_t hash(uint32_t key) {return (key * 0x9E3779B1u) >> 16;}
+        };
+
+        CrossingTable* lastCrossing; //indexed by srcId
+
+        // Returns the last crossing info of the pair; zeroed (cycle 0) if the source never crossed between these domains
+        inline CrossingEventInfo* getLastCrossing(uint32_t srcId, uint32_t srcDomain, uint32_t dstDomain) {
+            CrossingTable& t = lastCrossing[srcId];
+            uint32_t key = srcDomain*numDomains + dstDomain + 1;
+            if (t.entries) {
+                for (uint32_t pos = CrossingTable::hash(key);; pos++) {
+                    CrossingTable::Entry& e = t.entries[pos & t.mask];
+                    if (e.key == key) return &e.info;
+                    if (e.key == 0) break;
+                }
+            }
+            return addCrossingEntry(t, key);
+        }
+
+        CrossingEventInfo* addCrossingEntry(CrossingTable& t, uint32_t key);
 
         struct DomainData : public GlobAlloc {
             PrioQueue<TimingEvent, PQ_BLOCKS> pq;
@@ -125,6 +157,8 @@ class ContentionSim : public GlobAlloc {
         //lock_t testLock;
         lock_t postMortemLock;
 
+        ShardedVectorCounter profCrossings;  // [source domain], sharded by source id
+
     public:
         ContentionSim(uint32_t _numDomains, uint32_t _numSimThreads);
 
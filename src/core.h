@@ -29,6 +29,7 @@
 #include <stdint.h>
 #include "decoder.h"
 #include "g_std/g_string.h"
+#include "memory_hierarchy.h"
 #include "stats.h"
 
 struct BblInfo {
@@ -84,6 +85,12 @@ class Core : public GlobAlloc {
         virtual void leave() {}
         virtual void join() {}
 
+        //Charge cycles to the running thread for work the core does not model (e.g., offload launches)
+        virtual void stall(uint64_t cycles) {}
+
+        //Copy lines of physical addresses (with procMask) for the running thread, e.g., pages migrated by syscalls
+        virtual void copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines) {}
+
         //Contention simulation interface
         virtual bool needsCSim() const { return false; }
         virtual void cSimStart() {}
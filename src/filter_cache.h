@@ -28,8 +28,11 @@
 
 #include "bithacks.h"
 #include "cache.h"
+#include "event_recorder.h"
 #include "galloc.h"
+#include "mmu.h"
 #include "numa_map.h"
+#include "timing_event.h"
 #include "zsim.h"
 
 /* Extends Cache with an L0 direct-mapped cache, optimized to hell for hits
@@ -59,6 +62,9 @@ class FilterCache : public Cache {
         uint32_t srcId; //should match the core
         uint32_t reqFlags;
 
+        MMU* mmu;  // shared by the L1s of the core; null if translation is free
+        FilterCache* walkCache;  // L1D of the core, which page walks read through
+
         lock_t filterLock;
         uint64_t fGETSHit, fGETXHit;
 
@@ -75,6 +81,8 @@ class FilterCache : public Cache {
             fGETSHit = fGETXHit = 0;
             srcId = -1;
             reqFlags = 0;
+            mmu = nullptr;
+            walkCache = nullptr;
         }
 
         void setSourceId(uint32_t id) {
@@ -85,6 +93,11 @@ class FilterCache : public Cache {
             reqFlags = flags;
         }
 
+        void setMMU(MMU* _mmu, FilterCache* _walkCache) {
+            mmu = _mmu;
+            walkCache = _walkCache;
+        }
+
         void initStats(AggregateStat* parentStat) {
             AggregateStat* cacheStat = new AggregateStat();
             cacheStat->init(name.c_str(), "Filter cache stats");
@@ -131,9 +144,17 @@ class FilterCache : public Cache {
         uint64_t replace(Address vLineAddr, uint32_t idx, bool isLoad, uint64_t curCycle) {
             Address pLineAddr = procMask | vLineAddr;
             MESIState dummyState = MESIState::I;
+            TimingRecord walkRec;
+            walkRec.clear();
+            if (mmu) curCycle = translate(vLineAddr, curCycle, walkRec);  // before taking filterLock, see readWalkLines()
             futex_lock(&filterLock);
             MemReq req = {pLineAddr, isLoad? GETS : GETX, 0, &dummyState, curCycle, &filterLock, dummyState, srcId, reqFlags};
             uint64_t respCycle  = access(req);
+            if (unlikely(walkRec.isValid())) {
+                // The access must follow the walk in the weave phase too
+                chainRecord(walkRec, respCycle);
+                zinfo->eventRecorders[srcId]->pushRecord(walkRec);
+            }
 
             //Due to the way we do the locking, at this point the old address might be invalidated, but we have the new address guaranteed until we release the lock
 
@@ -165,6 +186,89 @@ class FilterCache : public Cache {
             return respCycle;
         }
 
+        // Copy lines one after another, reading each source line and then writing the destination one. Addresses are
+        // physical, and translation is free. Return the cycle the last write is done. Like a load, the accesses leave a
+        // single timing record.
+        uint64_t copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines, uint64_t curCycle) {
+            futex_lock(&filterLock);
+            TimingRecord copyRec;
+            copyRec.clear();
+            uint64_t cycle = curCycle;
+            for (uint32_t i = 0; i < numLines; i++) {
+                MESIState state = MESIState::I;
+                MemReq readReq = {srcLineAddr + i, GETS, 0, &state, cycle, &filterLock, state, srcId, reqFlags};
+                cycle = access(readReq);
+                chainRecord(copyRec, cycle);
+
+                state = MESIState::I;
+                MemReq writeReq = {dstLineAddr + i, GETX, 0, &state, cycle, &filterLock, state, srcId, reqFlags};
+                cycle = access(writeReq);
+                chainRecord(copyRec, cycle);
+            }
+            if (copyRec.isValid()) zinfo->eventRecorders[srcId]->pushRecord(copyRec);
+            futex_unlock(&filterLock);
+            return cycle;
+        }
+
+        // Read page table lines one after another, as data loads of this cache, and append their records to walkRec.
+        // Takes filterLock, so the caller must not hold the lock of any L1 of the core. Return the cycle the last read
+        // is done.
+        uint64_t readWalkLines(const Address* lines, uint32_t numLines, uint64_t curCycle, TimingRecord& walkRec) {
+            futex_lock(&filterLock);
+            uint64_t cycle = curCycle;
+            for (uint32_t i = 0; i < numLines; i++) {
+                MESIState state = MESIState::I;
+                MemReq req = {lines[i], GETS, 0, &state, cycle, &filterLock, state, srcId, reqFlags};
+                cycle = access(req);
+                chainRecord(walkRec, cycle);
+            }
+            futex_unlock(&filterLock);
+            return cycle;
+        }
+
+    private:
+        // Look up the TLBs, and walk the page table on a miss, reading its entries through the L1D, also for
+        // instruction fetches. Return the cycle the translation is done. The walk accesses leave a single timing
+        // record in walkRec, if any.
+        uint64_t translate(Address vLineAddr, uint64_t curCycle, TimingRecord& walkRec) {
+            Address walkLines[MMU::LEVELS];
+            uint32_t numWalkLines;
+            uint64_t startCycle = curCycle + mmu->translate(vLineAddr, reqFlags & MemReq::IFETCH, walkLines, &numWalkLines);
+            if (likely(!numWalkLines)) return startCycle;
+
+            uint64_t cycle = walkCache->readWalkLines(walkLines, numWalkLines, startCycle, walkRec);
+            mmu->walkDone(cycle - startCycle);
+            return cycle;
+        }
+
+        // Append the record of the last access, done at respCycle, to rec. Accesses without a record become delays.
+        void chainRecord(TimingRecord& rec, uint64_t respCycle) {
+            EventRecorder* evRec = zinfo->eventRecorders[srcId];
+            if (!evRec) return;  // core without weave-phase models
+            TimingRecord next;
+            next.clear();
+            if (evRec->hasRecord()) next = evRec->popRecord();
+            if (!rec.isValid()) {
+                rec = next;  // starts later, the core covers the gap
+                return;
+            }
+
+            TimingEvent* end = rec.endEvent;
+            uint64_t nextReqCycle = next.isValid() ? next.reqCycle : respCycle;
+            if (nextReqCycle > rec.respCycle) {
+                DelayEvent* dEv = new (evRec) DelayEvent(nextReqCycle - rec.respCycle);
+                dEv->setMinStartCycle(rec.respCycle);
+                end = end->addChild(dEv, evRec);
+            }
+            if (next.isValid()) {
+                end->addChild(next.startEvent, evRec);
+                end = next.endEvent;
+            }
+            rec.endEvent = end;
+            rec.respCycle = respCycle;
+        }
+
+    public:
         void contextSwitch() {
             futex_lock(&filterLock);
             for (uint32_t i = 0; i < numSets; i++) filterArray[i].clear();
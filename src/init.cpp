@@ -59,10 +59,14 @@
 #include "mem_interconnect_event_recorder.h"
 #include "mem_interconnect_interface.h"
 #include "mem_router.h"
+#include "mmu.h"
+#include "ndp_offload.h"
 #include "network.h"
 #include "null_core.h"
 #include "numa_map.h"
+#include "numa_migration_cost.h"
 #include "ooo_core.h"
+#include "page_migration.h"
 #include "part_repl_policies.h"
 #include "pin_cmd.h"
 #include "prefetcher.h"
@@ -95,6 +99,42 @@ extern void EndOfPhaseActions(); //in zsim.cpp
  * follow the layout of zinfo, top-down.
  */
 
+/* Weave domain assignment. By default, each kind of component (the memory controllers, the banks of a cache group,
+ * the routers of an interconnect level, the cores of a group) is spread over domains by index, so components that
+ * talk to each other often end up in different domains, and every interaction between them is a crossing. With
+ * sim.domainAssignment = "Topology", components are spread over NUMA nodes by index instead, the way the NUMA address
+ * map places memory controllers, and cores use their NUMAMap node; the domain of each node holds all its components.
+ */
+static uint32_t GetNodeDomain(uint32_t node) {
+    return node * zinfo->numDomains / (zinfo->numaMap->getMaxNode() + 1);
+}
+
+// Domain of the idx-th of num components of a kind
+static uint32_t GetDomain(uint32_t idx, uint32_t num) {
+    if (!zinfo->topologyDomains) return idx * zinfo->numDomains / num;
+    return GetNodeDomain(idx * (zinfo->numaMap->getMaxNode() + 1) / num);
+}
+
+// Domain of the idx-th of num cores of a group, with global index coreIdx
+static uint32_t GetCoreDomain(uint32_t coreIdx, uint32_t idx, uint32_t num) {
+    if (!zinfo->topologyDomains) return idx * zinfo->numDomains / num;
+    uint32_t node = zinfo->numaMap->getNodeOfCore(coreIdx);
+    assert(node != NUMAMap::INVALID_NODE);  // rejected upfront
+    return GetNodeDomain(node);
+}
+
+// Set index hash of directory structures (sparse directories, directory-only entries)
+static HashFamily* BuildSetHash(const string& hashType, uint32_t numSets, const string& seedStr, const g_string& name) {
+    if (hashType == "None") {
+        return new IdHashFamily;
+    } else if (hashType == "H3") {
+        size_t seed = std::hash<std::string>()(seedStr);
+        return new H3HashFamily(1, 31 - __builtin_clz(numSets), 0xD1EC7 + seed);
+    } else {
+        panic("%s: Invalid %s hash %s", name.c_str(), seedStr.c_str(), hashType.c_str());
+    }
+}
+
 BaseCache* BuildCacheBank(Config& config, const string& prefix, g_string& name, uint32_t bankSize, bool isTerminal, uint32_t domain) {
     string type = config.get<const char*>(prefix + "type", "Simple");
     // Shortcut for TraceDriven type
@@ -178,6 +218,32 @@ BaseCache* BuildCacheBank(Config& config, const string& prefix, g_string& name,
         rp = new NRUReplPolicy(numLines, candidates);
     } else if (replType == "Rand") {
         rp = new RandReplPolicy(candidates);
+    } else if (replType == "SRRIP" || replType == "BRRIP" || replType == "DRRIP" || replType == "SHiP") {
+        uint32_t rrpvBits = config.get<uint32_t>(prefix + "repl.rrpvBits", 2);
+        uint32_t brripThrottle = config.get<uint32_t>(prefix + "repl.brripThrottle", 32);
+        uint32_t leaderSets = config.get<uint32_t>(prefix + "repl.leaderSets", 32);
+        uint32_t pselBits = config.get<uint32_t>(prefix + "repl.pselBits", 10);
+
+        RRIPReplPolicy::Insertion insertion;
+        string insType = (replType == "SHiP")? config.get<const char*>(prefix + "repl.insertion", "SRRIP") : replType;
+        if (insType == "SRRIP") insertion = RRIPReplPolicy::SRRIP;
+        else if (insType == "BRRIP") insertion = RRIPReplPolicy::BRRIP;
+        else if (insType == "DRRIP") insertion = RRIPReplPolicy::DRRIP;
+        else panic("%s: Invalid repl.insertion %s (SRRIP, BRRIP or DRRIP)", name.c_str(), insType.c_str());
+
+        if (replType == "SHiP") {
+            string sigType = config.get<const char*>(prefix + "repl.signature", "Core");
+            SHiPReplPolicy::Signature sig;
+            if (sigType == "Core") sig = SHiPReplPolicy::CORE;
+            else if (sigType == "Region") sig = SHiPReplPolicy::REGION;
+            else panic("%s: Invalid repl.signature %s (Core or Region)", name.c_str(), sigType.c_str());
+            uint32_t shctEntries = config.get<uint32_t>(prefix + "repl.shctEntries", 16384);
+            uint32_t shctBits = config.get<uint32_t>(prefix + "repl.shctBits", 3);
+            uint32_t regionBits = config.get<uint32_t>(prefix + "repl.regionBits", 8); //in lines; 16KB regions with 64B lines
+            rp = new SHiPReplPolicy(numLines, ways, rrpvBits, insertion, brripThrottle, leaderSets, pselBits, sig, shctEntries, shctBits, regionBits);
+        } else {
+            rp = new RRIPReplPolicy(numLines, ways, rrpvBits, insertion, brripThrottle, leaderSets, pselBits);
+        }
     } else if (replType == "WayPart" || replType == "Vantage" || replType == "IdealLRUPart") {
         if (replType == "WayPart" && arrayType != "SetAssoc") panic("WayPart replacement requires SetAssoc array");
 
@@ -269,9 +335,60 @@ BaseCache* BuildCacheBank(Config& config, const string& prefix, g_string& name,
     uint32_t accLat = (isTerminal)? 0 : latency; //terminal caches has no access latency b/c it is assumed accLat is hidden by the pipeline
     uint32_t invLat = latency;
 
-    // Inclusion?
-    bool nonInclusiveHack = config.get<bool>(prefix + "nonInclusiveHack", false);
-    if (nonInclusiveHack) assert(type == "Simple" && !isTerminal);
+    // Inclusion policy. Non-inclusive and exclusive caches track lines that only their children hold in
+    // directory-only entries (by default, as many as data lines)
+    InclusionPolicy inclusion = INCLUSIVE;
+    string inclusionType = config.get<const char*>(prefix + "inclusion.type", "Inclusive");
+    if (config.get<bool>(prefix + "nonInclusiveHack", false)) {
+        warn("%s: nonInclusiveHack is deprecated, use inclusion.type = \"NonInclusive\"", name.c_str());
+        inclusionType = "NonInclusive";
+    }
+    if (inclusionType == "NonInclusive") {
+        inclusion = NON_INCLUSIVE;
+    } else if (inclusionType == "Exclusive") {
+        inclusion = EXCLUSIVE;
+    } else if (inclusionType != "Inclusive") {
+        panic("%s: Invalid inclusion.type %s", name.c_str(), inclusionType.c_str());
+    }
+    uint32_t dirOnlyEntries = 0;
+    uint32_t dirOnlyWays = 0;
+    HashFamily* dirOnlyHf = nullptr;
+    if (inclusion != INCLUSIVE) {
+        if (type != "Simple" || isTerminal) panic("%s: only Simple non-terminal caches can be %s", name.c_str(), inclusionType.c_str());
+        dirOnlyEntries = config.get<uint32_t>(prefix + "inclusion.dirOnlyEntries", numLines);
+        dirOnlyWays = config.get<uint32_t>(prefix + "inclusion.dirOnlyWays", MAX(ways, 2u));
+        if (dirOnlyWays < 2 || dirOnlyEntries < dirOnlyWays || dirOnlyEntries % dirOnlyWays != 0 || !isPow2(dirOnlyEntries / dirOnlyWays)) {
+            panic("%s: %d directory-only entries with %d ways must have a power of two sets and at least 2 ways", name.c_str(),
+                    dirOnlyEntries, dirOnlyWays);
+        }
+        dirOnlyHf = BuildSetHash(config.get<const char*>(prefix + "inclusion.dirOnlyHash", "None"), dirOnlyEntries / dirOnlyWays,
+                prefix + "inclusion", name);
+    }
+
+    // Directory organization
+    DirectoryParams dirParams;
+    string dirType = config.get<const char*>(prefix + "directory.type", "Perfect");
+    if (dirType == "Sparse") {
+        if (isTerminal) panic("%s: terminal caches have no directory", name.c_str());
+        // Coverage is the ratio of directory entries to data lines
+        double coverage = config.get<double>(prefix + "directory.coverage", 1.0);
+        dirParams.ways = config.get<uint32_t>(prefix + "directory.ways", ways);
+        dirParams.entries = (uint32_t)(coverage * numLines);
+        if (dirParams.ways == 0 || dirParams.entries < dirParams.ways || dirParams.entries % dirParams.ways != 0 ||
+                !isPow2(dirParams.entries / dirParams.ways)) {
+            panic("%s: sparse directory with %d entries and %d ways must have a power of two sets", name.c_str(),
+                    dirParams.entries, dirParams.ways);
+        }
+        string dirRepl = config.get<const char*>(prefix + "directory.repl", "LRU");
+        if (dirRepl == "LRU") dirParams.repl = DirectoryParams::LRU;
+        else if (dirRepl == "FewestSharers") dirParams.repl = DirectoryParams::FewestSharers;
+        else if (dirRepl == "Rand") dirParams.repl = DirectoryParams::Rand;
+        else panic("%s: Invalid directory.repl %s", name.c_str(), dirRepl.c_str());
+        dirParams.hf = BuildSetHash(config.get<const char*>(prefix + "directory.hash", "None"), dirParams.entries / dirParams.ways,
+                prefix + "directory", name);
+    } else if (dirType != "Perfect") {
+        panic("%s: Invalid directory.type %s", name.c_str(), dirType.c_str());
+    }
 
     // Finally, build the cache
     Cache* cache;
@@ -285,11 +402,11 @@ BaseCache* BuildCacheBank(Config& config, const string& prefix, g_string& name,
         bool filterInv = config.get<bool>(prefix + "protocol.filterInv", false);
         if (protocolType == "Directory") {
             bool forwarding = config.get<bool>(prefix + "protocol.forwarding", true);
-            if (forwarding) cc = new MESIDirectoryHubCC<true>(numLines, nonInclusiveHack, filterAccStr, filterInv, name);
-            else cc = new MESIDirectoryHubCC<false>(numLines, nonInclusiveHack, filterAccStr, filterInv, name);
+            if (forwarding) cc = new MESIDirectoryHubCC<true>(numLines, filterAccStr, filterInv, name);
+            else cc = new MESIDirectoryHubCC<false>(numLines, filterAccStr, filterInv, name);
         } else if (protocolType == "Broadcast") {
             uint32_t banksPerChild = config.get<uint32_t>(prefix + "protocol.banksPerChild", 1);
-            cc = new MESIBroadcastHubCC(numLines, banksPerChild, nonInclusiveHack, filterAccStr, filterInv, name);
+            cc = new MESIBroadcastHubCC(numLines, banksPerChild, filterAccStr, filterInv, name);
         } else {
             panic("Invalid coherence protocol %s", protocolType.c_str());
         }
@@ -321,9 +438,15 @@ BaseCache* BuildCacheBank(Config& config, const string& prefix, g_string& name,
         } else {
             panic("Invalid bypass rule %s", bypassRule.c_str());
         }
-        cc = new MESIBypassCC(numLines, bypass, nonInclusiveHack, name);
+        cc = new MESIBypassCC(numLines, bypass, name);
     } else {
-        cc = new MESICC(numLines, nonInclusiveHack, name);
+        cc = new MESICC(numLines, name);
+    }
+    if (!isTerminal) {
+        static_cast<MESICC*>(cc)->setDirectoryParams(dirParams);
+        static_cast<MESICC*>(cc)->setInclusion(inclusion, dirOnlyEntries, dirOnlyWays, dirOnlyHf);
+        // Counts demand misses caused by prefetches from children; only useful with prefetchers below this cache
+        static_cast<MESICC*>(cc)->setPrefetchPollutionFilter(config.get<uint32_t>(prefix + "pfPollutionFilter", 0));
     }
     rp->setCC(cc);
     if (!isTerminal) {
@@ -542,13 +665,34 @@ CacheGroup* BuildCacheGroup(Config& config, const string& name, bool isTerminal)
     bool isPrefetcher = config.get<bool>(prefix + "isPrefetcher", false);
     if (isPrefetcher) { //build a prefetcher group
         uint32_t prefetchers = config.get<uint32_t>(prefix + "prefetchers", 1);
+        string pfType = config.get<const char*>(prefix + "type", "Stream");
+        PrefetcherParams pfParams;
+        pfParams.degree = config.get<uint32_t>(prefix + "degree", pfParams.degree);
+        pfParams.distance = config.get<uint32_t>(prefix + "distance", pfParams.distance);
+        pfParams.trackerEntries = config.get<uint32_t>(prefix + "trackerEntries", pfParams.trackerEntries);
+        pfParams.throttle = config.get<bool>(prefix + "throttle.enabled", pfParams.throttle);
+        pfParams.throttleInterval = config.get<uint32_t>(prefix + "throttle.interval", pfParams.throttleInterval);
+        pfParams.accHigh = config.get<double>(prefix + "throttle.accHigh", pfParams.accHigh);
+        pfParams.accLow = config.get<double>(prefix + "throttle.accLow", pfParams.accLow);
+        pfParams.lateThreshold = config.get<double>(prefix + "throttle.lateThreshold", pfParams.lateThreshold);
+        pfParams.latencyThreshold = config.get<uint32_t>(prefix + "throttle.latencyThreshold", pfParams.latencyThreshold);
+        if (pfParams.throttle && pfParams.throttleInterval == 0) panic("%s: throttle.interval must be non-zero", name.c_str());
+
         cg.resize(prefetchers);
         for (vector<BaseCache*>& bg : cg) bg.resize(1);
         for (uint32_t i = 0; i < prefetchers; i++) {
             stringstream ss;
             ss << name << "-" << i;
             g_string pfName(ss.str().c_str());
-            cg[i][0] = new StreamPrefetcher(pfName);
+            if (pfType == "Stream") {
+                cg[i][0] = new StreamPrefetcher(pfName, pfParams);
+            } else if (pfType == "BestOffset") {
+                cg[i][0] = new BestOffsetPrefetcher(pfName, pfParams, config.get<uint32_t>(prefix + "rrEntries", 256));
+            } else if (pfType == "IMP") {
+                cg[i][0] = new IndirectPrefetcher(pfName, pfParams, config.get<uint32_t>(prefix + "indexBytes", 4));
+            } else {
+                panic("%s: Invalid prefetcher type %s (Stream, BestOffset or IMP)", name.c_str(), pfType.c_str());
+            }
         }
         return cgp;
     }
@@ -573,7 +717,7 @@ CacheGroup* BuildCacheGroup(Config& config, const string& name, bool isTerminal)
                 ss << "b" << j;
             }
             g_string bankName(ss.str().c_str());
-            uint32_t domain = (i*banks + j)*zinfo->numDomains/(caches*banks); //(banks > 1)? nextDomain() : (i*banks + j)*zinfo->numDomains/(caches*banks);
+            uint32_t domain = GetDomain(i*banks + j, caches*banks); //(banks > 1)? nextDomain() : (i*banks + j)*zinfo->numDomains/(caches*banks);
             cg[i][j] = BuildCacheBank(config, prefix, bankName, bankSize, isTerminal, domain);
         }
     }
@@ -594,6 +738,17 @@ RoutingAlgorithm* BuildRoutingAlgorithm(Config& config, const string& prefix) {
         uint32_t dimX = config.get<uint32_t>(prefix + "dimX");
         uint32_t dimY = config.get<uint32_t>(prefix + "dimY");
         ra = new Mesh2DDimensionOrderRoutingAlgorithm(dimX, dimY);
+    } else if (type == "Mesh2DAdaptive") {
+        uint32_t dimX = config.get<uint32_t>(prefix + "dimX");
+        uint32_t dimY = config.get<uint32_t>(prefix + "dimY");
+        string turnModelStr = config.get<const char*>(prefix + "turnModel", "OddEven");
+        Mesh2DAdaptiveRoutingAlgorithm::TurnModel turnModel = Mesh2DAdaptiveRoutingAlgorithm::OddEven;
+        if (turnModelStr == "WestFirst") turnModel = Mesh2DAdaptiveRoutingAlgorithm::WestFirst;
+        else if (turnModelStr == "OddEven") turnModel = Mesh2DAdaptiveRoutingAlgorithm::OddEven;
+        else if (turnModelStr == "Minimal") turnModel = Mesh2DAdaptiveRoutingAlgorithm::Minimal;
+        else panic("Unknown turn model %s for Mesh2DAdaptive routing", turnModelStr.c_str());
+        bool congestionAware = config.get<bool>(prefix + "congestionAware", false);
+        ra = new Mesh2DAdaptiveRoutingAlgorithm(dimX, dimY, turnModel, congestionAware);
     } else if (type == "Star") {
         uint32_t chains = config.get<uint32_t>(prefix + "chains");
         uint32_t length = config.get<uint32_t>(prefix + "length");
@@ -602,6 +757,20 @@ RoutingAlgorithm* BuildRoutingAlgorithm(Config& config, const string& prefix) {
         auto levelSizes = ParseList<uint32_t>(config.get<const char*>(prefix + "levelSizes"));
         bool onlyLeafTerminals = config.get<bool>(prefix + "onlyLeafTerminals", true);
         ra = new TreeRoutingAlgorithm(levelSizes, onlyLeafTerminals);
+    } else if (type == "Torus2D") {
+        uint32_t dimX = config.get<uint32_t>(prefix + "dimX");
+        uint32_t dimY = config.get<uint32_t>(prefix + "dimY");
+        ra = new Torus2DRoutingAlgorithm(dimX, dimY);
+    } else if (type == "FlattenedButterfly2D") {
+        uint32_t dimX = config.get<uint32_t>(prefix + "dimX");
+        uint32_t dimY = config.get<uint32_t>(prefix + "dimY");
+        ra = new FlattenedButterfly2DRoutingAlgorithm(dimX, dimY);
+    } else if (type == "Dragonfly") {
+        uint32_t groups = config.get<uint32_t>(prefix + "groups");
+        uint32_t routersPerGroup = config.get<uint32_t>(prefix + "routersPerGroup");
+        uint32_t globalPorts = config.get<uint32_t>(prefix + "globalPorts", 1);
+        uint32_t concentration = config.get<uint32_t>(prefix + "concentration", 1);
+        ra = new DragonflyRoutingAlgorithm(groups, routersPerGroup, globalPorts, concentration);
     } else {
         panic("Unknown routing algorithm %s", type.c_str());
     }
@@ -609,28 +778,60 @@ RoutingAlgorithm* BuildRoutingAlgorithm(Config& config, const string& prefix) {
     return ra;
 }
 
-AddressMap* BuildAddressMap(Config& config, const string& prefix, uint32_t numParents) {
+AddressMap* BuildAddressMap(Config& config, const string& prefix, uint32_t numParents, const char* defaultType = "XOR16b") {
     AddressMap* am = nullptr;
-    string type = config.get<const char*>(prefix + "type", "XOR16b");
+    string type = config.get<const char*>(prefix + "type", defaultType);
     if (type == "XOR16b") {
-        am = new XOR16bHashAddressMap(numParents);
+        uint64_t chunkSize = config.get<uint64_t>(prefix + "chunkSize", zinfo->lineSize);
+        if (chunkSize % zinfo->lineSize != 0 || !isPow2(chunkSize / zinfo->lineSize)) {
+            panic("XOR16bHashAddressMap: chunkSize (%lu) must be a power-of-2 multiple of line size", chunkSize);
+        }
+        am = new XOR16bHashAddressMap(numParents, chunkSize / zinfo->lineSize);
     } else if (type == "StaticInterleaving") {
-        uint64_t chunkSize = config.get<uint64_t>(prefix + "chunkSize");
+        uint64_t chunkSize = config.get<uint64_t>(prefix + "chunkSize", zinfo->lineSize);
         if (chunkSize % zinfo->lineSize != 0) {
             panic("StaticInterleavingAddressMap: chunkSize (%lu) must be a multiple of line size", chunkSize);
         }
         am = new StaticInterleavingAddressMap(chunkSize / zinfo->lineSize, numParents);
-    } else if (type == "NUMA") { 
+    } else if (type == "NUMA") {
         if (!zinfo->numaMap) panic("NUMA address map requires a NUMA system");
-        am = new NUMAAddressMap(numParents);
+        // Interleaving within each node, e.g., across its vaults or channels at line or 256 B granularity
+        uint32_t nodes = zinfo->numaMap->getMaxNode() + 1;
+        if (numParents % nodes != 0)
+            panic("NUMAAddressMap: total terminals (%u) must be a multiple of NUMA nodes (%u)", numParents, nodes);
+        AddressMap* nodeMap = BuildAddressMap(config, prefix + "nodeMap.", numParents / nodes);
+        am = new NUMAAddressMap(numParents, nodeMap);
     } else {
         panic("Unknown address map %s", type.c_str());
     }
     assert(am);
+
+    // Hot ranges of virtual addresses, striped across all parents regardless of the map above
+    if (config.exists(prefix + "hotRanges")) {
+        AddressMap* hotMap = BuildAddressMap(config, prefix + "hotMap.", numParents, "StaticInterleaving");
+        HotRangeAddressMap* hram = new HotRangeAddressMap(am, hotMap);
+        vector<const char*> rangeNames;
+        config.subgroups(prefix + "hotRanges", rangeNames);
+        uint32_t lineShift = ilog2(zinfo->lineSize);
+        for (const char* r : rangeNames) {
+            string rPrefix = prefix + "hotRanges." + r + ".";
+            uint64_t start = config.get<uint64_t>(rPrefix + "start");
+            uint64_t size = config.get<uint64_t>(rPrefix + "size");
+            uint32_t proc = config.get<uint32_t>(rPrefix + "proc", 0);
+            if (!size) panic("Address map %s: hot range %s is empty", prefix.c_str(), r);
+            if (proc >= zinfo->numProcs) panic("Address map %s: hot range %s of invalid process %u", prefix.c_str(), r, proc);
+            // Same as the vAddr -> pLineAddr logic in filter_cache.h
+            Address procLineMask = ((Address)proc) << (64 - lineShift);
+            Address startLine = procLineMask | (start >> lineShift);
+            Address endLine = procLineMask | (((start + size - 1) >> lineShift) + 1);
+            hram->addRange(startLine, endLine);
+        }
+        am = hram;
+    }
     return am;
 }
 
-vector<MemRouter*> BuildMemRouterGroup(Config& config, const string& prefix, uint32_t numRouters, uint32_t numPorts, const g_string& name) {
+vector<MemRouter*> BuildMemRouterGroup(Config& config, const string& prefix, uint32_t numRouters, uint32_t numPorts, uint32_t numVCClasses, const g_string& name) {
     vector<MemRouter*> rg(numRouters, nullptr);
     string type = config.get<const char*>(prefix + "type", "Simple");
     if (type == "Simple") {
@@ -658,12 +859,22 @@ vector<MemRouter*> BuildMemRouterGroup(Config& config, const string& prefix, uin
         uint32_t processWidth = config.get<uint32_t>(prefix + "processWidth", 1);
         if (portWidth % 8) panic("Port width for router %s must be a multiple of 8 bits.", name.c_str());
         uint32_t bytesPerCycle = portWidth / 8;
+        // Finite buffers with credit-based flow control, 0 VCs for infinite buffers.
+        uint32_t numVCs = config.get<uint32_t>(prefix + "vcs", 0);
+        uint32_t bufferDepth = config.get<uint32_t>(prefix + "vcBufferDepth", 4);
+        uint32_t creditDelay = config.get<uint32_t>(prefix + "creditDelay", 1);
+        // Let packets stalled in a cyclic buffer dependency take their slot anyway. Breaks flow control, and is
+        // ignored by builds with assertions, which panic instead.
+        bool creditEscape = config.get<bool>(prefix + "creditEscape", false);
+        if (numVCs && numVCs < numVCClasses)
+            panic("Router %s needs at least %u VCs for deadlock-free routing", name.c_str(), numVCClasses);
         for (uint32_t i = 0; i < numRouters; i++) {
             stringstream ss;
             ss << name << "-r" << i;
             g_string routerName(ss.str().c_str());
-            uint32_t domain = i * zinfo->numDomains / numRouters;
-            rg[i] = new TimingMemRouter(numPorts, latency, bytesPerCycle, processWidth, routerName, domain);
+            uint32_t domain = GetDomain(i, numRouters);
+            rg[i] = new TimingMemRouter(numPorts, latency, bytesPerCycle, processWidth, routerName, domain,
+                    numVCs, numVCs ? numVCClasses : 1, bufferDepth, creditDelay, creditEscape);
         }
     } else {
         panic("Unknown router type %s", type.c_str());
@@ -672,6 +883,22 @@ vector<MemRouter*> BuildMemRouterGroup(Config& config, const string& prefix, uin
     return rg;
 }
 
+MemRouterEnergyModel* BuildMemRouterEnergyModel(Config& config, const string& prefix, const g_string& name) {
+    // All energies are given in pJ, and kept in fJ
+    double routerPicoJoulePerFlit = config.get<double>(prefix + "routerPicoJoulePerFlit", 0);
+    double linkPicoJoulePerBitPerMm = config.get<double>(prefix + "linkPicoJoulePerBitPerMm", 0);
+    double linkLengthMm = config.get<double>(prefix + "linkLengthMm", 1.0);
+    double serdesPicoJoulePerBit = config.get<double>(prefix + "serdesPicoJoulePerBit", 0);  // off-chip links only
+    uint32_t flitBytes = config.get<uint32_t>(prefix + "flitBytes", 16);
+    if (routerPicoJoulePerFlit == 0 && linkPicoJoulePerBitPerMm == 0 && serdesPicoJoulePerBit == 0) return nullptr;
+    if (routerPicoJoulePerFlit < 0 || linkPicoJoulePerBitPerMm < 0 || linkLengthMm < 0 || serdesPicoJoulePerBit < 0)
+        panic("Router class %s: energy parameters must not be negative", name.c_str());
+    if (flitBytes == 0) panic("Router class %s: flit size must be positive", name.c_str());
+
+    return new MemRouterEnergyModel((uint64_t)(routerPicoJoulePerFlit * 1000 + 0.5), flitBytes,
+            (uint64_t)(linkPicoJoulePerBitPerMm * linkLengthMm * 1000 + 0.5), (uint64_t)(serdesPicoJoulePerBit * 1000 + 0.5), name);
+}
+
 static void InitSystem(Config& config) {
     unordered_map<string, string> parentMap; //child -> parent
     unordered_map<string, vector<vector<string>>> childMap; //parent -> children (a parent may have multiple children)
@@ -690,6 +917,16 @@ static void InitSystem(Config& config) {
     string networkFile = config.get<const char*>("sys.networkFile", "");
     Network* network = (networkFile != "")? new Network(networkFile.c_str()) : nullptr;
 
+    if (zinfo->topologyDomains) {
+        if (!zinfo->numaMap) panic("Topology-aware domain assignment requires a NUMA system (sys.numa)");
+        uint32_t numNodes = zinfo->numaMap->getMaxNode() + 1;
+        if (numNodes < zinfo->numDomains) warn("Only %d of %d weave domains are used, one per NUMA node", numNodes, zinfo->numDomains);
+        for (uint32_t c = 0; c < zinfo->numCores; c++) {
+            if (zinfo->numaMap->getNodeOfCore(c) == NUMAMap::INVALID_NODE)
+                panic("Topology-aware domain assignment: core %d is in no NUMA node, check the cpumaps of the patched root", c);
+        }
+    }
+
     // Build the caches
     vector<const char*> cacheGroupNames;
     config.subgroups("sys.caches", cacheGroupNames);
@@ -758,7 +995,7 @@ static void InitSystem(Config& config) {
         ss << "mem-" << i;
         g_string name(ss.str().c_str());
         //uint32_t domain = nextDomain(); //i*zinfo->numDomains/memControllers;
-        uint32_t domain = i*zinfo->numDomains/memControllers;
+        uint32_t domain = GetDomain(i, memControllers);
         mems[i] = BuildMemoryController(config, zinfo->lineSize, zinfo->freqMHz, domain, name);
     }
 
@@ -776,6 +1013,10 @@ static void InitSystem(Config& config) {
     config.subgroups("sys.interconnects", interconnectNames);
     vector<string> routerGroupNames;
     unordered_map<string, vector<MemRouter*>> routerGroupMap;
+    vector<MemInterconnect*> interconnects;
+    vector<MemRouterEnergyModel*> routerEnergyModels;
+    vector<PageMigrationEngine*> pageMigrationEngines;
+    vector<MemInterconnectInterface*> interconnectInterfaces;
 
     for (const char* net : interconnectNames) {
         for (auto& grp : cacheGroupNames) if (string(grp).find(net) == 0)
@@ -815,7 +1056,12 @@ static void InitSystem(Config& config) {
                 stringstream ss;
                 ss << net << "-l" << l;
                 g_string rgName(ss.str().c_str());
-                auto rg = BuildMemRouterGroup(config, levelPrefixList[l] + "routers.", numRouters, numPorts, rgName);
+                auto rg = BuildMemRouterGroup(config, levelPrefixList[l] + "routers.", numRouters, numPorts, ra->getNumVCClasses(), rgName);
+                MemRouterEnergyModel* em = BuildMemRouterEnergyModel(config, levelPrefixList[l] + "routers.energy.", rgName);
+                if (em) {
+                    for (auto r : rg) r->setEnergyModel(em);
+                    routerEnergyModels.push_back(em);
+                }
                 routers.insert(routers.end(), rg.begin(), rg.end());
                 routerGroupNames.push_back(rgName.c_str());
                 routerGroupMap[rgName.c_str()] = rg;
@@ -823,7 +1069,24 @@ static void InitSystem(Config& config) {
 
             uint32_t ccHeaderSize = config.get<uint32_t>(prefix + "ccHeaderSize", 0);
 
-            interconnect = new MemInterconnect(ra, routers, ccHeaderSize, net);
+            string ptType = config.get<const char*>(prefix + "pathTable", "Auto");
+            MemInterconnect::PathTableMode ptMode = MemInterconnect::PT_AUTO;
+            if (ptType == "Auto") ptMode = MemInterconnect::PT_AUTO;
+            else if (ptType == "Full") ptMode = MemInterconnect::PT_FULL;
+            else if (ptType == "Lazy") ptMode = MemInterconnect::PT_LAZY;
+            else if (ptType == "None") ptMode = MemInterconnect::PT_NONE;
+            else panic("Invalid path table type %s for interconnect %s", ptType.c_str(), net);
+
+            bool trafficStats = config.get<bool>(prefix + "trafficStats", false);
+            if (trafficStats) {
+                uint64_t bytes = MemInterconnect::trafficStatsBytes(ra->getNumTerminals(), ra->getNumRouters(), ra->getNumPorts());
+                if (bytes > (64ul << 20)) {
+                    warn("Interconnect %s: traffic stats for %u terminals take %ld MB", net, ra->getNumTerminals(), bytes >> 20);
+                }
+            }
+
+            interconnect = new MemInterconnect(ra, routers, ccHeaderSize, net, ptMode, trafficStats);
+            interconnects.push_back(interconnect);
         }
 
         // Build all interfaces.
@@ -847,8 +1110,33 @@ static void InitSystem(Config& config) {
 
             bool centralizedParents = config.get<bool>(prefix + itfc + ".centralizedParents", false);
             bool ignoreInvLatency = config.get<bool>(prefix + itfc + ".ignoreInvLatency", false);
-
-            auto interface = new MemInterconnectInterface(interconnect, idx, am, centralizedParents, ignoreInvLatency);
+            bool multicastInvs = config.get<bool>(prefix + itfc + ".multicastInvalidates", false);
+
+            auto interface = new MemInterconnectInterface(interconnect, idx, am, centralizedParents, ignoreInvLatency, multicastInvs);
+            interconnectInterfaces.push_back(interface);
+
+            // NUMA locality of the accesses to memory, off by default as it adds work to every memory access.
+            string amType = config.get<const char*>(prefix + itfc + ".addressMap.type", "XOR16b");
+            if (parent == "mem" && amType == "NUMA" && config.get<bool>("sys.mem.localityStats", false)) interface->enableLocalityStats();
+
+            // Page migration.
+            if (config.get<bool>(prefix + itfc + ".pageMigration.enable", false)) {
+                string pmPrefix = prefix + itfc + ".pageMigration.";
+                if (parent != "mem" || amType != "NUMA" || config.exists(prefix + itfc + ".addressMap.hotRanges"))
+                    panic("Interconnect %s interface %u: page migration requires memory parents with NUMA address map and no hot ranges", net, idx);
+                PageMigrationEngine::Params pmParams;
+                pmParams.epochPhases = config.get<uint32_t>(pmPrefix + "epochPhases", 100);
+                pmParams.samplingRate = config.get<uint32_t>(pmPrefix + "samplingRate", 16);
+                pmParams.hotThreshold = config.get<uint32_t>(pmPrefix + "hotThreshold", 4);  // in sampled accesses
+                pmParams.maxPagesPerEpoch = config.get<uint32_t>(pmPrefix + "maxPagesPerEpoch", 64);
+                pmParams.copyLinesPerAccess = config.get<uint32_t>(pmPrefix + "copyLinesPerAccess", 1);
+                pmParams.replicate = config.get<bool>(pmPrefix + "replicate", false);
+                stringstream pmName;
+                pmName << net << "-i" << idx;
+                auto pm = new PageMigrationEngine(zinfo->numaMap->getMaxNode() + 1, pmParams, g_string(pmName.str().c_str()));
+                interface->setPageMigration(pm, static_cast<NUMAAddressMap*>(am));
+                pageMigrationEngines.push_back(pm);
+            }
 
             // Connect to children through endpoints.
 
@@ -1013,6 +1301,7 @@ static void InitSystem(Config& config) {
         //Instantiate the cores
         vector<const char*> coreGroupNames;
         unordered_map <string, vector<Core*>> coreMap;
+        unordered_map <string, vector<MMU*>> mmuMap;
         config.subgroups("sys.cores", coreGroupNames);
 
         uint32_t coreIdx = 0;
@@ -1052,6 +1341,24 @@ static void InitSystem(Config& config) {
                 if (!assignedCaches.count(icache)) panic("%s: Invalid icache parameter %s", group, icache.c_str());
                 if (!assignedCaches.count(dcache)) panic("%s: Invalid dcache parameter %s", group, dcache.c_str());
 
+                // TLBs and page walks; translation is free if disabled
+                bool useTLB = config.get<bool>(prefix + "tlb.enable", false);
+                MMU::Params tlbParams;
+                if (useTLB) {
+                    tlbParams.itlbEntries = config.get<uint32_t>(prefix + "tlb.itlbEntries", 128);
+                    tlbParams.itlbWays = config.get<uint32_t>(prefix + "tlb.itlbWays", 8);
+                    tlbParams.itlbHugeEntries = config.get<uint32_t>(prefix + "tlb.itlbHugeEntries", 8);
+                    tlbParams.itlbHugeWays = config.get<uint32_t>(prefix + "tlb.itlbHugeWays", 8);
+                    tlbParams.dtlbEntries = config.get<uint32_t>(prefix + "tlb.dtlbEntries", 64);
+                    tlbParams.dtlbWays = config.get<uint32_t>(prefix + "tlb.dtlbWays", 4);
+                    tlbParams.dtlbHugeEntries = config.get<uint32_t>(prefix + "tlb.dtlbHugeEntries", 32);
+                    tlbParams.dtlbHugeWays = config.get<uint32_t>(prefix + "tlb.dtlbHugeWays", 4);
+                    tlbParams.stlbEntries = config.get<uint32_t>(prefix + "tlb.stlbEntries", 1536);
+                    tlbParams.stlbWays = config.get<uint32_t>(prefix + "tlb.stlbWays", 12);
+                    tlbParams.stlbLatency = config.get<uint32_t>(prefix + "tlb.stlbLatency", 9);
+                    tlbParams.pwcEntries = config.get<uint32_t>(prefix + "tlb.pwcEntries", 32);
+                }
+
                 for (uint32_t j = 0; j < cores; j++) {
                     stringstream ss;
                     ss << group << "-" << j;
@@ -1079,18 +1386,26 @@ static void InitSystem(Config& config) {
                     dc->setSourceId(coreIdx);
                     assignedCaches[dcache]++;
 
+                    if (useTLB) {
+                        MMU* mmu = new MMU(tlbParams, coreIdx, name);
+                        ic->setMMU(mmu, dc);
+                        dc->setMMU(mmu, dc);
+                        mmuMap[group].push_back(mmu);
+                    }
+
                     //Build the core
                     if (type == "Simple") {
                         core = new (&simpleCores[j]) SimpleCore(ic, dc, name);
                     } else if (type == "Timing") {
-                        uint32_t domain = j*zinfo->numDomains/cores;
+                        uint32_t domain = GetCoreDomain(coreIdx, j, cores);
                         TimingCore* tcore = new (&timingCores[j]) TimingCore(ic, dc, domain, name);
                         zinfo->eventRecorders[coreIdx] = tcore->getEventRecorder();
                         zinfo->eventRecorders[coreIdx]->setSourceId(coreIdx);
                         core = tcore;
                     } else {
                         assert(type == "OOO");
-                        OOOCore* ocore = new (&oooCores[j]) OOOCore(ic, dc, name);
+                        uint32_t domain = zinfo->topologyDomains? GetCoreDomain(coreIdx, j, cores) : 0;
+                        OOOCore* ocore = new (&oooCores[j]) OOOCore(ic, dc, domain, name);
                         zinfo->eventRecorders[coreIdx] = ocore->getEventRecorder();
                         zinfo->eventRecorders[coreIdx]->setSourceId(coreIdx);
                         core = ocore;
@@ -1131,6 +1446,15 @@ static void InitSystem(Config& config) {
             for (Core* core : coreMap[group]) core->initStats(groupStat);
             zinfo->rootStat->append(groupStat);
         }
+
+        //Init stats: TLBs
+        for (const char* group : coreGroupNames) {
+            if (!mmuMap.count(group)) continue;
+            AggregateStat* groupStat = new AggregateStat(true);
+            groupStat->init(gm_strdup((string(group) + "-tlb").c_str()), "TLB stats");
+            for (MMU* mmu : mmuMap[group]) mmu->initStats(groupStat);
+            zinfo->rootStat->append(groupStat);
+        }
     } else {  // trace-driven: create trace driver and proxy caches
         vector<TraceDriverProxyCache*> proxies;
         for (const char* grp : cacheGroupNames) {
@@ -1171,6 +1495,25 @@ static void InitSystem(Config& config) {
     zinfo->rootStat->append(memStat);
 
     // Init stats: interconnects.
+    if (!interconnects.empty()) {
+        AggregateStat* itcnStat = new AggregateStat();
+        itcnStat->init("interconnects", "Interconnect stats");
+        for (auto interconnect : interconnects) interconnect->initStats(itcnStat);
+        for (auto interface : interconnectInterfaces) interface->initStats(itcnStat);
+        if (!routerEnergyModels.empty()) {
+            AggregateStat* energyStat = new AggregateStat();
+            energyStat->init("energy", "Interconnect energy stats, per router class");
+            for (auto em : routerEnergyModels) em->initStats(energyStat);
+            itcnStat->append(energyStat);
+        }
+        zinfo->rootStat->append(itcnStat);
+    }
+    if (!pageMigrationEngines.empty()) {
+        AggregateStat* pmStat = new AggregateStat();
+        pmStat->init("pageMigration", "Page migration stats");
+        for (auto pm : pageMigrationEngines) pm->initStats(pmStat);
+        zinfo->rootStat->append(pmStat);
+    }
     for (auto group : routerGroupNames) {
         AggregateStat* groupStat = new AggregateStat(true);
         groupStat->init(gm_strdup(group.c_str()), "Router stats");
@@ -1181,7 +1524,7 @@ static void InitSystem(Config& config) {
     // Initialize interconnect event recorders.
     zinfo->memInterconnectEventRecorders = gm_calloc<MemInterconnectEventRecorder*>(zinfo->numCores);
     for (uint32_t i = 0; i < zinfo->numCores; i++) {
-        uint32_t domain = i * zinfo->numDomains / zinfo->numCores;
+        uint32_t domain = GetCoreDomain(i, i, zinfo->numCores);
         zinfo->memInterconnectEventRecorders[i] = new MemInterconnectEventRecorder(zinfo->eventRecorders[i], domain);
     }
 
@@ -1194,6 +1537,8 @@ static void InitSystem(Config& config) {
 
 static void InitNUMA(Config& config) {
     zinfo->numaMap = nullptr;
+    zinfo->ndpOffload = nullptr;
+    zinfo->numaMigrationCost = nullptr;
     auto useNUMA = config.get<bool>("sys.numa", false);
     if (useNUMA) {
         if (zinfo->traceDriven) {
@@ -1216,7 +1561,32 @@ static void InitNUMA(Config& config) {
             }
         }
 
-        zinfo->numaMap = new NUMAMap(patchRoot, zinfo->numCores);
+        // Transparent huge pages, e.g., 2 MB or 1 GB; 0 to place base pages only.
+        uint64_t hugePageSize = config.get<uint64_t>("sys.numaHugePageSize", 0);
+        uint32_t hugePageShift = 0;
+        if (hugePageSize) {
+            if (!isPow2(hugePageSize) || hugePageSize <= zinfo->pageSize)
+                panic("NUMA huge page size (%lu) must be a power of two larger than the page size (%u)", hugePageSize, zinfo->pageSize);
+            hugePageShift = ilog2(hugePageSize) - ilog2(zinfo->pageSize);
+        }
+
+        zinfo->numaMap = new NUMAMap(patchRoot, zinfo->numCores, hugePageShift);
+        zinfo->numaMap->initStats(zinfo->rootStat);
+
+        // Near-data offload magic ops; they are ignored if disabled.
+        if (config.get<bool>("sys.ndpOffload.enable", false)) {
+            uint32_t launchCycles = config.get<uint32_t>("sys.ndpOffload.launchCycles", 200);
+            uint32_t returnCycles = config.get<uint32_t>("sys.ndpOffload.returnCycles", 200);
+            zinfo->ndpOffload = new NDPOffload(launchCycles, returnCycles);
+            zinfo->ndpOffload->initStats(zinfo->rootStat);
+        }
+
+        // Copy cost of the pages migrated by syscalls; otherwise, they only change the map.
+        if (config.get<bool>("sys.numaMigrationCost.enable", false)) {
+            uint32_t pageCycles = config.get<uint32_t>("sys.numaMigrationCost.pageCycles", 1000);
+            zinfo->numaMigrationCost = new NUMAMigrationCost(pageCycles);
+            zinfo->numaMigrationCost->initStats(zinfo->rootStat);
+        }
     }
 }
 
@@ -1342,6 +1712,9 @@ void SimInit(const char* configFile, const char* outputDir, uint32_t shmid) {
     }
 
     zinfo->numDomains = config.get<uint32_t>("sim.domains", 1);
+    string domainAssignment = config.get<const char*>("sim.domainAssignment", "Index");
+    if (domainAssignment != "Index" && domainAssignment != "Topology") panic("Invalid sim.domainAssignment %s (Index or Topology)", domainAssignment.c_str());
+    zinfo->topologyDomains = domainAssignment == "Topology";
     uint32_t numSimThreads = config.get<uint32_t>("sim.contentionThreads", MAX((uint32_t)1, zinfo->numDomains/2)); //gives a bit of parallelism, TODO tune
     zinfo->contentionSim = new ContentionSim(zinfo->numDomains, numSimThreads);
     zinfo->contentionSim->initStats(zinfo->rootStat);
@@ -1387,7 +1760,12 @@ void SimInit(const char* configFile, const char* outputDir, uint32_t shmid) {
         assert(parallelism > 0); //jeez...
 
         uint32_t schedQuantum = config.get<uint32_t>("sim.schedQuantum", 10000); //phases
-        zinfo->sched = new Scheduler(EndOfPhaseActions, parallelism, zinfo->numCores, schedQuantum);
+        //Random: random context in the mask on time slices; Locality: last context, then nearest NUMA node
+        string schedPolicy = config.get<const char*>("sim.schedPolicy", "Random");
+        if (schedPolicy != "Random" && schedPolicy != "Locality") panic("Invalid sim.schedPolicy %s (Random or Locality)", schedPolicy.c_str());
+        //Time the scheduling decisions on the host; adds two clock reads to each one
+        bool schedProfiling = config.get<bool>("sim.schedProfiling", false);
+        zinfo->sched = new Scheduler(EndOfPhaseActions, parallelism, zinfo->numCores, schedQuantum, schedPolicy == "Locality", schedProfiling);
     } else {
         zinfo->sched = nullptr;
     }
@@ -1430,8 +1808,11 @@ void SimInit(const char* configFile, const char* outputDir, uint32_t shmid) {
     //Caches, cores, memory controllers
     InitSystem(config);
 
-    //Sched stats (deferred because of circular deps)
-    if (zinfo->sched) zinfo->sched->initStats(zinfo->rootStat);
+    //Sched nodes and stats (deferred because of circular deps)
+    if (zinfo->sched) {
+        zinfo->sched->initNodes();
+        zinfo->sched->initStats(zinfo->rootStat);
+    }
 
     zinfo->processStats = new ProcessStats(zinfo->rootStat);
 
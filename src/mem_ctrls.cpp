@@ -72,17 +72,18 @@ MD1Memory::MD1Memory(uint32_t requestSize, uint32_t megacyclesPerSecond, uint32_
     zeroLoadLatency = _zeroLoadLatency;
 
     smoothedPhaseAccesses = 0.0;
-    curPhaseAccesses = 0;
+    curPhaseAccesses.init(1);
     curLatency = zeroLoadLatency;
 
-    futex_init(&updateLock);
+    zinfo->eventQueue->insert(new UpdateEvent(this), 0);
 }
 
+// Called at the end of each phase, while no thread accesses, so zinfo->numPhases is the phase that just finished
 void MD1Memory::updateLatency() {
-    uint32_t phaseCycles = (zinfo->numPhases - lastPhase)*(zinfo->phaseLength);
+    uint32_t phaseCycles = (zinfo->numPhases + 1 - lastPhase)*(zinfo->phaseLength);
     if (phaseCycles < 10000) return; //Skip with short phases
 
-    smoothedPhaseAccesses =  (curPhaseAccesses*0.5) + (smoothedPhaseAccesses*0.5);
+    smoothedPhaseAccesses =  (curPhaseAccesses.drain(0)*0.5) + (smoothedPhaseAccesses*0.5);
     double requestsPerCycle = smoothedPhaseAccesses/((double)phaseCycles);
     double load = requestsPerCycle/maxRequestsPerCycle;
 
@@ -101,42 +102,31 @@ void MD1Memory::updateLatency() {
     profLoad.inc(intLoad);
     profUpdates.inc();
 
-    curPhaseAccesses = 0;
-    __sync_synchronize();
-    lastPhase = zinfo->numPhases;
+    lastPhase = zinfo->numPhases + 1;
 }
 
 uint64_t MD1Memory::access(MemReq& req) {
-    if (zinfo->numPhases > lastPhase) {
-        futex_lock(&updateLock);
-        //Recheck, someone may have updated already
-        if (zinfo->numPhases > lastPhase) {
-            updateLatency();
-        }
-        futex_unlock(&updateLock);
-    }
-
     switch (req.type) {
         case PUTX:
             //Dirty wback
-            profWrites.atomicInc();
-            profTotalWrLat.atomicInc(curLatency);
-            __sync_fetch_and_add(&curPhaseAccesses, 1);
+            profWrites.inc(req.srcId);
+            profTotalWrLat.inc(req.srcId, curLatency);
+            curPhaseAccesses.add(req.srcId, 0, 1);
             //Note no break
         case PUTS:
             //Not a real access -- memory must treat clean wbacks as if they never happened.
             *req.state = I;
             break;
         case GETS:
-            profReads.atomicInc();
-            profTotalRdLat.atomicInc(curLatency);
-            __sync_fetch_and_add(&curPhaseAccesses, 1);
+            profReads.inc(req.srcId);
+            profTotalRdLat.inc(req.srcId, curLatency);
+            curPhaseAccesses.add(req.srcId, 0, 1);
             *req.state = req.is(MemReq::NOEXCL)? S : E;
             break;
         case GETX:
-            profReads.atomicInc();
-            profTotalRdLat.atomicInc(curLatency);
-            __sync_fetch_and_add(&curPhaseAccesses, 1);
+            profReads.inc(req.srcId);
+            profTotalRdLat.inc(req.srcId, curLatency);
+            curPhaseAccesses.add(req.srcId, 0, 1);
             *req.state = M;
             break;
 
@@ -26,6 +26,7 @@
 #ifndef MEM_CTRLS_H_
 #define MEM_CTRLS_H_
 
+#include "event_queue.h"
 #include "g_std/g_string.h"
 #include "memory_hierarchy.h"
 #include "pad.h"
@@ -49,9 +50,10 @@ class SimpleMemory : public MemObject {
 /* Implements a memory controller with limited bandwidth, throttling latency
  * using an M/D/1 queueing model.
  */
+/* Latency is refreshed at the end of each phase by a periodic event, so access() does not lock */
 class MD1Memory : public MemObject {
     private:
-        uint64_t lastPhase;
+        uint64_t lastPhase;  // first phase whose accesses are not yet accounted for
         double maxRequestsPerCycle;
         double smoothedPhaseAccesses;
         uint32_t zeroLoadLatency;
@@ -59,19 +61,26 @@ class MD1Memory : public MemObject {
 
         PAD();
 
-        Counter profReads;
-        Counter profWrites;
-        Counter profTotalRdLat;
-        Counter profTotalWrLat;
+        ShardedCounter profReads;
+        ShardedCounter profWrites;
+        ShardedCounter profTotalRdLat;
+        ShardedCounter profTotalWrLat;
         Counter profLoad;
         Counter profUpdates;
         Counter profClampedLoads;
-        uint32_t curPhaseAccesses;
+        ShardedAccumulator curPhaseAccesses;
 
         g_string name; //barely used
-        lock_t updateLock;
         PAD();
 
+        class UpdateEvent : public Event {
+            private:
+                MD1Memory* mem;
+            public:
+                explicit UpdateEvent(MD1Memory* _mem) : Event(1), mem(_mem) {}
+                void callback() { mem->updateLatency(); }
+        };
+
     public:
         MD1Memory(uint32_t lineSize, uint32_t megacyclesPerSecond, uint32_t megabytesPerSecond, uint32_t _zeroLoadLatency, g_string& _name);
 
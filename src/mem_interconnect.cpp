@@ -1,4 +1,5 @@
 #include "mem_interconnect.h"
+#include <algorithm>
 #include <sstream>
 #include "log.h"
 #include "mem_interconnect_event_recorder.h"
@@ -7,14 +8,164 @@
 #include "zsim.h"
 
 #define INTERCONNECT_MAX_HOPS 100 /* avoid livelock */
+#define PATH_TABLE_FULL_MAX_TERMINALS 256 /* above this, PT_AUTO fills rows lazily */
 
-MemInterconnect::MemInterconnect(RoutingAlgorithm* _ra, const g_vector<MemRouter*>& _routers, uint32_t _ccHeaderSize, const g_string& _name)
-    : ra(_ra), routers(_routers), numTerminals(_ra->getNumTerminals()), ccHeaderSize(_ccHeaderSize), name(_name)
+//#define DEBUG(args...) info(args)
+#define DEBUG(args...)
+
+MemInterconnect::MemInterconnect(RoutingAlgorithm* _ra, const g_vector<MemRouter*>& _routers, uint32_t _ccHeaderSize, const g_string& _name,
+        PathTableMode _ptMode, bool _trafficStats)
+    : ra(_ra), routers(_routers), numTerminals(_ra->getNumTerminals()), ccHeaderSize(_ccHeaderSize), name(_name), ptMode(_ptMode),
+      multicast(false), trafficStats(_trafficStats), numPorts(_ra->getNumPorts())
 {
     assert(ra->getNumRouters() == routers.size());
 
     needsCSim = false;
     for (auto& r : routers) needsCSim |= r->needsCSim();
+
+    ra->setLoadFeedback(this);
+    if (!ra->isDeterministic()) {
+        for (auto& r : routers) r->enableLoadTracking();
+    }
+
+    bool packable = ra->getNumRouters() <= (1u << 16) && ra->getNumPorts() <= (1u << 16) && ra->getNumVCClasses() <= (1u << 8);
+    if (ptMode == PT_AUTO) {
+        if (!packable || !ra->isDeterministic()) ptMode = PT_NONE;
+        else ptMode = (numTerminals <= PATH_TABLE_FULL_MAX_TERMINALS) ? PT_FULL : PT_LAZY;
+    } else if (ptMode != PT_NONE && !packable) {
+        panic("[mem_interconnect] %s: %u routers / %u ports / %u VC classes do not fit in the path table, use pathTable = \"None\"",
+                name.c_str(), ra->getNumRouters(), ra->getNumPorts(), ra->getNumVCClasses());
+    } else if (ptMode != PT_NONE && !ra->isDeterministic()) {
+        panic("[mem_interconnect] %s: adaptive routing cannot use a path table, use pathTable = \"None\"", name.c_str());
+    }
+
+    pathRows = nullptr;
+    maxPathLen = 0;
+    if (ptMode != PT_NONE) {
+        pathRows = gm_calloc<PathRow*>(numTerminals);
+    }
+    if (ptMode == PT_FULL) {
+        uint64_t totalHops = 0;
+        for (uint32_t s = 0; s < numTerminals; s++) {
+            PathRow* row = buildPathRow(s);
+            for (uint32_t d = 0; d < numTerminals; d++) {
+                maxPathLen = MAX(maxPathLen, row->offsets[d+1] - row->offsets[d]);
+            }
+            totalHops += row->offsets[numTerminals];
+            pathRows[s] = row;
+        }
+        DEBUG("[mem_interconnect] %s: precomputed %u x %u paths, %lu hops, max path length %u",
+                name.c_str(), numTerminals, numTerminals, totalHops, maxPathLen);
+    }
+}
+
+void MemInterconnect::initStats(AggregateStat* parentStat) {
+    AggregateStat* itcnStat = new AggregateStat();
+    itcnStat->init(name.c_str(), "Interconnect stats");
+
+    // Lazy and per-hop routing do not know the longest path upfront; bound it by the livelock limit
+    uint32_t numBins = (ptMode == PT_FULL) ? maxPathLen + 1 : INTERCONNECT_MAX_HOPS + 1;
+    profPathLen.init("pathLen", "Packet path length distribution (hops)", numBins);
+    itcnStat->append(&profPathLen);
+
+    if (ptMode == PT_FULL) {
+        profPairPathLen.init("pairPathLen", "Path length distribution over all (src, dst) pairs (hops)", numBins);
+        for (uint32_t s = 0; s < numTerminals; s++) {
+            const PathRow* row = pathRows[s];
+            for (uint32_t d = 0; d < numTerminals; d++) profPairPathLen.inc(row->offsets[d+1] - row->offsets[d]);
+        }
+        itcnStat->append(&profPairPathLen);
+    }
+    if (multicast) {
+        const char* mcastNames[] = {"inv", "ack"};
+        profMcastSavedHops.init("mcastSavedHops", "Hops saved by multicast invalidates and ack aggregation", 2, mcastNames);
+        itcnStat->append(&profMcastSavedHops);
+    }
+
+    if (ptMode == PT_LAZY) {
+        profRowFills.init("rowFills", "Path table rows filled on demand");
+        itcnStat->append(&profRowFills);
+    }
+
+    if (trafficStats) {
+        uint64_t numPairs = (uint64_t)numTerminals * numTerminals;
+        uint64_t numLinks = (uint64_t)routers.size() * numPorts;
+        if (numPairs > UINT32_MAX || numLinks > UINT32_MAX) {
+            panic("Interconnect %s: too many terminals (%u) or links (%ld) for traffic stats", name.c_str(), numTerminals, numLinks);
+        }
+        profTrafficBytes.init("trafficBytes", "Bytes from src to dst terminal, [src][dst]", numPairs);
+        profTrafficPackets.init("trafficPkts", "Packets from src to dst terminal, [src][dst]", numPairs);
+        profLinkBytes.init("linkBytes", "Bytes sent through each link, [router][port]", numLinks);
+        profLinkPackets.init("linkPkts", "Packets sent through each link, [router][port]", numLinks);
+        profLinkCycles.init("linkCycles", "Bound-phase hop latency of packets through each link, [router][port]", numLinks);
+        itcnStat->append(&profTrafficBytes);
+        itcnStat->append(&profTrafficPackets);
+        itcnStat->append(&profLinkBytes);
+        itcnStat->append(&profLinkPackets);
+        itcnStat->append(&profLinkCycles);
+
+        auto linkLoad = [this](uint32_t link) -> uint64_t {
+            return routers[link / numPorts]->getPortLoad(link % numPorts);
+        };
+        auto linkLoadStat = makeLambdaVectorStat(linkLoad, numLinks);
+        linkLoadStat->init("linkLoad", "Link load in the previous phase (%), [router][port]");
+        itcnStat->append(linkLoadStat);
+    }
+
+    parentStat->append(itcnStat);
+}
+
+uint32_t MemInterconnect::getPortLoad(uint32_t routerId, uint32_t portId) {
+    assert(routerId < routers.size());
+    return routers[routerId]->getPortLoad(portId);
+}
+
+MemInterconnect::PathRow* MemInterconnect::buildPathRow(uint32_t srcId) {
+    PathRow* row = new PathRow();
+    row->offsets = gm_calloc<uint32_t>(numTerminals + 1);
+
+    g_vector<PathHop> hops;
+    for (uint32_t dstId = 0; dstId < numTerminals; dstId++) {
+        row->offsets[dstId] = hops.size();
+        uint32_t nhops = 0;
+        uint32_t curId = srcId;
+        while (curId != dstId && nhops < INTERCONNECT_MAX_HOPS) {
+            uint32_t nextId = -1;
+            uint32_t portId = -1;
+            ra->nextHop(curId, dstId, &nextId, &portId);
+            assert(nextId < ra->getNumRouters());
+            assert(portId < ra->getNumPorts());
+            hops.push_back({(uint16_t)curId, (uint16_t)portId, (uint8_t)ra->getVCClass(curId, dstId)});
+            curId = nextId;
+            nhops++;
+        }
+        if (nhops >= INTERCONNECT_MAX_HOPS) {
+            panic("[mem_interconnect] Routing from %u to %u takes more than %u hops!", srcId, dstId, INTERCONNECT_MAX_HOPS);
+        }
+    }
+    row->offsets[numTerminals] = hops.size();
+
+    row->hops = gm_calloc<PathHop>(MAX(hops.size(), (size_t)1));
+    std::copy(hops.begin(), hops.end(), row->hops);
+    return row;
+}
+
+inline const MemInterconnect::PathRow* MemInterconnect::getPathRow(uint32_t srcId) {
+    PathRow* row = pathRows[srcId];
+    if (unlikely(!row)) {
+        assert(ptMode == PT_LAZY);
+        // Racing fillers compute identical rows; the first to publish wins
+        row = buildPathRow(srcId);
+        if (__sync_bool_compare_and_swap(&pathRows[srcId], nullptr, row)) {
+            profRowFills.atomicInc();
+        } else {
+            gm_free(row->offsets);
+            gm_free(row->hops);
+            delete row;
+            row = pathRows[srcId];
+        }
+    }
+    return row;
 }
 
 uint64_t MemInterconnect::accessRequest(const MemReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId) {
@@ -23,8 +174,10 @@ uint64_t MemInterconnect::accessRequest(const MemReq& req, uint64_t cycle, uint3
 
     auto itcnRec = zinfo->memInterconnectEventRecorders[req.srcId];
 
+    MemMsgClass msgClass = (req.type == PUTS || req.type == PUTX) ? MSG_WRITEBACK : MSG_REQUEST;
+
     if (needsCSim) itcnRec->startRequest<true>(cycle, req.lineAddr, req.type);
-    cycle = travel(srcId, dstId, size, cycle, req.is(MemReq::PIGGYBACK), req.srcId);
+    cycle = travel(srcId, dstId, size, cycle, req.is(MemReq::PIGGYBACK), msgClass, req.srcId);
     if (needsCSim) itcnRec->endRequest<true>(cycle);
 
     return cycle;
@@ -37,60 +190,136 @@ uint64_t MemInterconnect::accessResponse(const MemReq& req, uint64_t cycle, uint
     auto itcnRec = zinfo->memInterconnectEventRecorders[req.srcId];
 
     if (needsCSim) cycle = itcnRec->startResponse<true>(cycle);
-    cycle = travel(srcId, dstId, size, cycle, req.is(MemReq::PIGGYBACK), req.srcId);
+    cycle = travel(srcId, dstId, size, cycle, req.is(MemReq::PIGGYBACK), MSG_RESPONSE, req.srcId);
     if (needsCSim) itcnRec->endResponse<true>(cycle);
 
     return cycle;
 }
 
-uint64_t MemInterconnect::invalidateRequest(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId) {
+uint64_t MemInterconnect::invalidateRequest(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId, MulticastTree* mcast) {
     uint64_t size = ccHeaderSize;  // request
     if (req.type == FWD) size += (1 << lineBits);  // data
 
     auto itcnRec = zinfo->memInterconnectEventRecorders[req.srcId];
 
     if (needsCSim) itcnRec->startRequest<false>(cycle);
-    cycle = travel(srcId, dstId, size, cycle, req.is(InvReq::PIGGYBACK), req.srcId);
+    cycle = travel(srcId, dstId, size, cycle, req.is(InvReq::PIGGYBACK), MSG_INVALIDATE, req.srcId, mcast);
     if (needsCSim) itcnRec->endRequest<false>(cycle);
 
     return cycle;
 }
 
-uint64_t MemInterconnect::invalidateResponse(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId) {
+uint64_t MemInterconnect::invalidateResponse(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId, MulticastTree* mcast) {
     uint64_t size = ccHeaderSize;  // acknowledgment
     // NOTE(gaomy): with a broadcast cc hub, req.writeback could be nullptr, and inv filter does not help here as it is behind interconnect.
-    if (req.writeback && *req.writeback) size += (1 << lineBits);  // data written back
+    bool dirty = req.writeback && *req.writeback;
+    if (dirty) size += (1 << lineBits);  // data written back
 
     auto itcnRec = zinfo->memInterconnectEventRecorders[req.srcId];
 
     if (needsCSim) cycle = itcnRec->startResponse<false>(cycle);
-    cycle = travel(srcId, dstId, size, cycle, req.is(InvReq::PIGGYBACK), req.srcId);
+    cycle = travel(srcId, dstId, size, cycle, req.is(InvReq::PIGGYBACK), dirty ? MSG_WRITEBACK : MSG_INVALIDATE, req.srcId,
+            dirty ? nullptr : mcast, true);
     if (needsCSim) itcnRec->endResponse<false>(cycle);
 
     return cycle;
 }
 
-uint64_t MemInterconnect::travel(uint32_t srcId, uint32_t dstId, size_t size, uint64_t cycle, bool piggyback, uint32_t srcCoreId) {
+uint64_t MemInterconnect::travel(uint32_t srcId, uint32_t dstId, size_t size, uint64_t cycle, bool piggyback, MemMsgClass msgClass, uint32_t srcCoreId,
+        MulticastTree* mcast, bool fanIn) {
     assert(srcId < numTerminals);
     assert(dstId < numTerminals);
 
     uint64_t respCycle = cycle;
-    uint32_t nhops = 0;
-    uint32_t curId = srcId;
-    while (curId != dstId && nhops < INTERCONNECT_MAX_HOPS) {
-        uint32_t nextId = -1;
-        uint32_t portId = -1;
-        ra->nextHop(curId, dstId, &nextId, &portId);
-        assert(nextId < ra->getNumRouters());
-        assert(portId < ra->getNumPorts());
-        respCycle = routers[curId]->transfer(respCycle, size, portId, nextId == dstId, piggyback, srcCoreId);
-        curId = nextId;
-        nhops++;
+    uint32_t nhops = 0;  // hops actually traveled
+
+    if (pathRows) {
+        const PathRow* row = getPathRow(srcId);
+        uint32_t first = row->offsets[dstId];
+        uint32_t last = row->offsets[dstId+1];
+        for (uint32_t h = first; h < last; h++) {
+            const PathHop& hop = row->hops[h];
+            if (!travelHop(hop.routerId, hop.portId, hop.vcClass, h + 1 == last, size, piggyback, msgClass, srcCoreId,
+                        mcast, fanIn, &respCycle, &nhops)) break;
+        }
+    } else {
+        uint32_t curId = srcId;
+        uint32_t steps = 0;
+        while (curId != dstId && steps < INTERCONNECT_MAX_HOPS) {
+            uint32_t nextId = -1;
+            uint32_t portId = -1;
+            ra->nextHop(curId, dstId, &nextId, &portId);
+            assert(nextId < ra->getNumRouters());
+            assert(portId < ra->getNumPorts());
+            uint32_t vcClass = ra->getVCClass(curId, dstId);
+            if (!travelHop(curId, portId, vcClass, nextId == dstId, size, piggyback, msgClass, srcCoreId,
+                        mcast, fanIn, &respCycle, &nhops)) break;
+            curId = nextId;
+            steps++;
+        }
+        if (steps >= INTERCONNECT_MAX_HOPS) {
+            panic("[mem_interconnect] Routing from %u to %u takes more than %u hops!", srcId, dstId, INTERCONNECT_MAX_HOPS);
+        }
     }
-    if (nhops >= INTERCONNECT_MAX_HOPS) {
-        panic("[mem_interconnect] Routing from %u to %u takes more than %u hops!", srcId, dstId, INTERCONNECT_MAX_HOPS);
+    profPathLen.inc(srcCoreId, nhops);
+
+    // A multicast packet whose whole path was shared with or aggregated into earlier ones never leaves the source
+    bool sent = !mcast || nhops || !mcast->savedHops;
+
+    if (mcast) {
+        profMcastSavedHops.inc(srcCoreId, fanIn ? 1 : 0, mcast->savedHops);
+        if (fanIn) {
+            // The ack has reached the parent or joined an earlier one, so the path to the parent from each router it
+            // traveled through is now known.
+            uint32_t totalHops = nhops + mcast->savedHops;
+            for (uint32_t r : mcast->pending) {
+                auto& j = mcast->joins[r];
+                j.cycle = respCycle - j.cycle;
+                j.hops = totalHops - j.hops;
+            }
+            mcast->pending.clear();
+        }
+        mcast->savedHops = 0;
+    }
+
+    if (trafficStats && sent) {
+        uint32_t pair = srcId * numTerminals + dstId;
+        profTrafficBytes.atomicInc(pair, size);
+        if (!piggyback) profTrafficPackets.atomicInc(pair);
     }
 
     return respCycle;
 }
 
+inline bool MemInterconnect::travelHop(uint32_t routerId, uint32_t portId, uint32_t vcClass, bool lastHop, size_t size, bool piggyback,
+        MemMsgClass msgClass, uint32_t srcCoreId, MulticastTree* mcast, bool fanIn, uint64_t* cycle, uint32_t* nhops) {
+    uint32_t link = routerId * numPorts + portId;
+    if (mcast) {
+        if (!fanIn) {
+            auto it = mcast->links.find(link);
+            if (it != mcast->links.end()) {
+                // Already sent through this link by the multicast; branch off from there.
+                *cycle = it->second;
+                mcast->savedHops++;
+                return true;
+            }
+        } else {
+            auto it = mcast->joins.find(routerId);
+            if (it != mcast->joins.end()) {
+                // Aggregate with the ack that already went through this router, which waits for this one.
+                *cycle += it->second.cycle;
+                mcast->savedHops = it->second.hops;
+                return false;
+            }
+            mcast->joins[routerId] = {*cycle, *nhops};
+            mcast->pending.push_back(routerId);
+        }
+    }
+
+    uint64_t hopCycle = *cycle;
+    *cycle = routers[routerId]->transfer(*cycle, size, portId, vcClass, lastHop, piggyback, msgClass, srcCoreId);
+    if (trafficStats) recordHop(routerId, portId, size, piggyback, *cycle - hopCycle, srcCoreId);
+    if (mcast && !fanIn) mcast->links[link] = *cycle;
+    (*nhops)++;
+    return true;
+}
@@ -2,33 +2,94 @@
 #define MEM_INTERCONNECT_H_
 
 #include "g_std/g_string.h"
+#include "g_std/g_unordered_map.h"
 #include "g_std/g_vector.h"
+#include "mem_router.h"
 #include "memory_hierarchy.h"
+#include "routing_algorithm.h"
 #include "stats.h"
 
-class MemRouter;
-class RoutingAlgorithm;
-
 /**
  * An interconnect contains the topology and routers.
  *
  * Neighboring memory hierarchy levels interact with the interconnect through an interface.
  */
-class MemInterconnect : public GlobAlloc {
+class MemInterconnect : public GlobAlloc, public RoutingLoadFeedback {
     public:
-        MemInterconnect(RoutingAlgorithm* _ra, const g_vector<MemRouter*>& _routers, uint32_t _ccHeaderSize, const g_string& _name);
+        /**
+         * Path table modes.
+         *
+         * Routing is deterministic, so the (src, dst) hop sequences can be computed once instead of calling
+         * RoutingAlgorithm::nextHop() on every hop of every packet. Full precomputes all rows at init; Lazy fills
+         * the row of a source terminal on its first packet (for big networks where most pairs are never used);
+         * None keeps per-hop routing. Auto picks Full or Lazy based on the number of terminals, and None for
+         * adaptive routing algorithms whose paths depend on the load.
+         */
+        enum PathTableMode {
+            PT_NONE,
+            PT_FULL,
+            PT_LAZY,
+            PT_AUTO,
+        };
+
+        /**
+         * State of one in-network multicast of invalidates from a parent to its children.
+         *
+         * Invalidates of the same multicast share the links they have in common from the parent, i.e., a link is only
+         * traversed by the first invalidate that uses it, and the others branch off at the cycle it left through the
+         * link. Their clean acknowledgments are aggregated at the routers where they join the path of an earlier
+         * acknowledgment, and continue to the parent as a single packet, so the latency of the rest of the path is
+         * reused. Dirty acknowledgments carry data and are never aggregated.
+         */
+        struct MulticastTree {
+            struct Join {
+                uint64_t cycle;  // arrival of the ack at the router, then latency from the router to the parent
+                uint32_t hops;  // hops from the source of the ack to the router, then from the router to the parent
+            };
+            g_unordered_map<uint32_t, uint64_t> links;  // link [router][port] -> cycle the invalidate left through it
+            g_unordered_map<uint32_t, Join> joins;  // router -> path of the aggregated ack from it to the parent
+            g_vector<uint32_t> pending;  // routers of the ack in flight, whose joins are not final yet
+            uint32_t savedHops;  // of the packet in flight
+
+            MulticastTree() : savedHops(0) {}
+
+            void clear() {
+                links.clear();
+                joins.clear();
+            }
+        };
+
+        MemInterconnect(RoutingAlgorithm* _ra, const g_vector<MemRouter*>& _routers, uint32_t _ccHeaderSize, const g_string& _name,
+                PathTableMode _ptMode = PT_AUTO, bool _trafficStats = false);
+
+        void initStats(AggregateStat* parentStat);
 
         const char* getName() { return name.c_str(); }
 
         uint32_t getNumTerminals() const { return numTerminals; }
 
+        // Called by interfaces that multicast invalidates, before initStats()
+        void enableMulticast() { multicast = true; }
+
+        // Memory taken by the optional traffic stats
+        static uint64_t trafficStatsBytes(uint32_t numTerminals, uint32_t numRouters, uint32_t numPorts) {
+            uint64_t numPairs = (uint64_t)numTerminals * numTerminals;
+            uint64_t numLinks = (uint64_t)numRouters * numPorts;
+            uint64_t linkRowBytes = (numLinks * sizeof(uint64_t) + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+            return 2 * numPairs * sizeof(uint64_t) + 3 * linkRowBytes * STATS_SHARDS;
+        }
+
         uint64_t accessRequest(const MemReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId);
 
         uint64_t accessResponse(const MemReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId);
 
-        uint64_t invalidateRequest(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId);
+        // With a multicast tree, the invalidate is part of a multicast, and its response the acknowledgment to aggregate.
+        uint64_t invalidateRequest(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId, MulticastTree* mcast = nullptr);
 
-        uint64_t invalidateResponse(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId);
+        uint64_t invalidateResponse(const InvReq& req, uint64_t cycle, uint32_t srcId, uint32_t dstId, MulticastTree* mcast = nullptr);
+
+        // Adaptive routing feedback.
+        uint32_t getPortLoad(uint32_t routerId, uint32_t portId);
 
     private:
         RoutingAlgorithm* ra;
@@ -40,9 +101,63 @@ class MemInterconnect : public GlobAlloc {
 
         const g_string name;
 
+        // Path table. One row per source terminal, in CSR form: the hops to dstId are
+        // hops[offsets[dstId]] ... hops[offsets[dstId+1]-1], each the router to transfer at, its output port and VC class.
+        struct PathHop {
+            uint16_t routerId;
+            uint16_t portId;
+            uint8_t vcClass;
+        };
+        struct PathRow : GlobAlloc {
+            uint32_t* offsets;
+            PathHop* hops;
+        };
+        PathTableMode ptMode;
+        PathRow* volatile* pathRows;  // nullptr if PT_NONE; entries are nullptr until filled in PT_LAZY
+        uint32_t maxPathLen;  // valid for PT_FULL only
+
+        bool multicast;  // some interface multicasts invalidates
+
+        // Stats
+        ShardedVectorCounter profPathLen;  // hops per packet
+        VectorCounter profPairPathLen;  // hops per (src, dst) pair, PT_FULL only
+        Counter profRowFills;
+        ShardedVectorCounter profMcastSavedHops;  // hops not traversed thanks to multicast, for invalidates and acks, if multicast
+
+        // Optional traffic stats, flattened [src][dst] and [router][port]. Link utilization over time is the
+        // difference of linkBytes between periodic stats dumps; linkLoad samples the routers' own load estimate.
+        const bool trafficStats;
+        const uint32_t numPorts;
+        // The [src][dst] matrices are quadratic in the number of terminals, so they are not sharded. Each row is
+        // mostly updated by the cores behind its src terminal, so atomic adds see little contention.
+        VectorCounter profTrafficBytes;
+        VectorCounter profTrafficPackets;
+        ShardedVectorCounter profLinkBytes;
+        ShardedVectorCounter profLinkPackets;
+        ShardedVectorCounter profLinkCycles;  // bound-phase latency of each hop, per output link
+
     private:
         // Travel a packet through the routers in the interconnect.
-        uint64_t travel(uint32_t srcId, uint32_t dstId, size_t size, uint64_t cycle, bool piggyback, uint32_t srcCoreId);
+        // A multicast tree makes the packet an invalidate that shares links with the multicast, or, if fanIn, an
+        // acknowledgment to aggregate.
+        uint64_t travel(uint32_t srcId, uint32_t dstId, size_t size, uint64_t cycle, bool piggyback, MemMsgClass msgClass, uint32_t srcCoreId,
+                MulticastTree* mcast = nullptr, bool fanIn = false);
+
+        // Move the packet through one hop. Return false if the packet needs not travel further.
+        inline bool travelHop(uint32_t routerId, uint32_t portId, uint32_t vcClass, bool lastHop, size_t size, bool piggyback,
+                MemMsgClass msgClass, uint32_t srcCoreId, MulticastTree* mcast, bool fanIn, uint64_t* cycle, uint32_t* nhops);
+
+        // Route from srcId to every terminal.
+        PathRow* buildPathRow(uint32_t srcId);
+
+        inline const PathRow* getPathRow(uint32_t srcId);
+
+        inline void recordHop(uint32_t routerId, uint32_t portId, size_t size, bool piggyback, uint64_t cycles, uint32_t srcCoreId) {
+            uint32_t link = routerId * numPorts + portId;
+            profLinkBytes.inc(srcCoreId, link, size);
+            if (!piggyback) profLinkPackets.inc(srcCoreId, link);
+            profLinkCycles.inc(srcCoreId, link, cycles);
+        }
 
     public:
         using GlobAlloc::operator new;
@@ -39,17 +39,20 @@ class MemInterconnectEventRecorder : public GlobAlloc {
         struct RoutingEntry : InListNode<RoutingEntry> {
             MemRouter* router;
             uint8_t portId;
+            uint8_t vcClass;
             uint8_t piggyback;
             uint8_t procDelay;
             uint16_t outDelay;
             uint16_t preDelay;
-            RoutingEntry(MemRouter* _router, uint32_t _portId, bool _piggyback, uint32_t _procDelay, uint32_t _outDelay, uint32_t _preDelay) {
+            RoutingEntry(MemRouter* _router, uint32_t _portId, uint32_t _vcClass, bool _piggyback, uint32_t _procDelay, uint32_t _outDelay, uint32_t _preDelay) {
                 assert(_portId < (1u << 8));
+                assert(_vcClass < (1u << 8));
                 assert(_procDelay < (1u << 8));
                 assert(_outDelay < (1u << 16));
                 assert(_preDelay < (1u << 16));
                 router = _router;
                 portId = static_cast<uint8_t>(_portId);
+                vcClass = static_cast<uint8_t>(_vcClass);
                 piggyback = _piggyback ? 1 : 0;
                 procDelay = static_cast<uint8_t>(_procDelay);
                 outDelay = static_cast<uint16_t>(_outDelay);
@@ -69,10 +72,11 @@ class MemInterconnectEventRecorder : public GlobAlloc {
             const uint64_t id;
             uint64_t minDoneCycle;
             InList<RoutingEntry> entries;
+            MemRouterFlowState flowState;
 
         public:
             MemInterconnectEvent(uint64_t _id, uint64_t startCycle, int32_t domain = -1)
-                : TimingEvent(0, 0, domain), id(_id), minDoneCycle(startCycle), entries()
+                : TimingEvent(0, 0, domain), id(_id), minDoneCycle(startCycle), entries(), flowState()
             {
                 setMinStartCycle(startCycle);
             }
@@ -91,15 +95,22 @@ class MemInterconnectEventRecorder : public GlobAlloc {
 
             void simulate(uint64_t startCycle) {
                 auto e = entries.front();
-                entries.pop_front();  // does not invalidate the popped entry
-                bool lastHop = entries.empty();
+                if (!e) {
+                    assert(startCycle >= minDoneCycle);
+                    done(startCycle);
+                    return;
+                }
+                bool lastHop = e->next == nullptr;
                 uint64_t doneCycle = startCycle;
-                if (e) {
-                    doneCycle += e->preDelay;
-                    doneCycle = e->router->simulate(e->portId, e->procDelay, e->outDelay, lastHop, e->piggyback == 1, doneCycle);
-                    // info("[MemInterconnectEvent %lu] Hop at %s port %u, starts at %lu, finishes at %lu", id, e->router->getName(), e->portId, startCycle, doneCycle);
-                    slab::freeElem(e, sizeof(RoutingEntry));
+                if (!flowState.stallCycle) doneCycle += e->preDelay;
+                doneCycle = e->router->simulate(e->portId, e->vcClass, e->procDelay, e->outDelay, lastHop, e->piggyback == 1, doneCycle, &flowState);
+                // info("[MemInterconnectEvent %lu] Hop at %s port %u, starts at %lu, finishes at %lu", id, e->router->getName(), e->portId, startCycle, doneCycle);
+                if (flowState.stallCycle) {  // stalled for credits, retry the hop
+                    requeue(doneCycle);
+                    return;
                 }
+                entries.pop_front();  // does not invalidate the popped entry
+                slab::freeElem(e, sizeof(RoutingEntry));
                 if (lastHop) {  // all done
                     assert(doneCycle >= minDoneCycle);
                     done(doneCycle);
@@ -238,8 +249,8 @@ class MemInterconnectEventRecorder : public GlobAlloc {
             : reAlloc(), event(nullptr), eventId(0), evRec(_evRec), invStashRecs(),
               stack(16), sp(0), domain(_domain) {}
 
-        void addHop(MemRouter* router, uint32_t portId, bool piggyback, uint32_t procDelay, uint32_t outDelay, uint64_t startCycle, uint64_t doneCycle) {
-            auto e = new (reAlloc) RoutingEntry(router, portId, piggyback, procDelay, outDelay, startCycle - event->getDoneCycle());
+        void addHop(MemRouter* router, uint32_t portId, uint32_t vcClass, bool piggyback, uint32_t procDelay, uint32_t outDelay, uint64_t startCycle, uint64_t doneCycle) {
+            auto e = new (reAlloc) RoutingEntry(router, portId, vcClass, piggyback, procDelay, outDelay, startCycle - event->getDoneCycle());
             event->addHop(e, doneCycle);
         }
 
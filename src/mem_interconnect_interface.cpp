@@ -1,12 +1,23 @@
 #include "mem_interconnect_interface.h"
 #include <sstream>
 #include "address_map.h"
+#include "bithacks.h"
 #include "mem_interconnect.h"
+#include "numa_map.h"
+#include "page_migration.h"
+#include "timing_event.h"
+#include "zsim.h"
 
 MemInterconnectInterface::MemInterconnectInterface(MemInterconnect* _interconnect, uint32_t _index, AddressMap* _am,
-        bool _centralizedParents, bool _ignoreInvLatency)
-    : interconnect(_interconnect), index(_index), am(_am), centralizedParents(_centralizedParents), ignoreInvLatency(_ignoreInvLatency)
+        bool _centralizedParents, bool _ignoreInvLatency, bool _multicastInvs)
+    : interconnect(_interconnect), index(_index), am(_am), centralizedParents(_centralizedParents), ignoreInvLatency(_ignoreInvLatency),
+      multicastInvs(_multicastInvs), pageMigration(nullptr), numaAm(nullptr), localityStats(false), numNodes(0)
 {
+    if (multicastInvs) {
+        mcastStates.resize(zinfo->numCores, nullptr);
+        interconnect->enableMulticast();
+    }
+
     // Lazily initialize after all children and parents are connected.
     numTerminals = 0;
     numParents = 0;
@@ -22,38 +33,176 @@ BaseCache* MemInterconnectInterface::getEndpoint(BaseCache* child, const g_strin
     return e;
 }
 
+void MemInterconnectInterface::setPageMigration(PageMigrationEngine* _pageMigration, NUMAAddressMap* _numaAm) {
+    assert(_numaAm == am);
+    pageMigration = _pageMigration;
+    numaAm = _numaAm;
+}
+
+void MemInterconnectInterface::enableLocalityStats() {
+    assert(zinfo->numaMap);
+    localityStats = true;
+    numNodes = zinfo->numaMap->getMaxNode() + 1;
+
+    // Remote nodes at the shortest remote distance in the system are one hop away; farther ones, multiple hops.
+    uint32_t oneHopDistance = -1u;
+    for (uint32_t i = 0; i < numNodes; i++) {
+        for (uint32_t j = 0; j < numNodes; j++) {
+            if (i != j) oneHopDistance = MIN(oneHopDistance, zinfo->numaMap->getNodeDistance(i, j));
+        }
+    }
+    nodeClasses.resize(numNodes * numNodes);
+    for (uint32_t i = 0; i < numNodes; i++) {
+        for (uint32_t j = 0; j < numNodes; j++) {
+            LocalityClass c = MULTI_HOP;
+            if (i == j) c = LOCAL;
+            else if (zinfo->numaMap->getNodeDistance(i, j) <= oneHopDistance) c = ONE_HOP;
+            nodeClasses[i * numNodes + j] = c;
+        }
+    }
+}
+
+void MemInterconnectInterface::initStats(AggregateStat* parentStat) {
+    if (!numParents) return;  // never connected
+    std::stringstream ss;
+    ss << interconnect->getName() << "-i" << index;
+    AggregateStat* itfcStat = new AggregateStat();
+    itfcStat->init(gm_strdup(ss.str().c_str()), "Interconnect interface stats");
+
+    // Address map balance
+    uint32_t numSlots = groups.size() * numParents;
+    profParentAccesses.init("parentAccesses", "Accesses to each parent, [group][parent]", numSlots);
+    itfcStat->append(&profParentAccesses);
+    auto terminalAccesses = [this](uint32_t t) {
+        uint64_t sum = 0;
+        for (uint32_t g = 0; g < groups.size(); g++) {
+            for (uint32_t p = 0; p < numParents; p++) {
+                if (getParentTerminalId(g, p) == t) sum += profParentAccesses.count(g * numParents + p);
+            }
+        }
+        return sum;
+    };
+    auto terminalAccessesStat = makeLambdaVectorStat(terminalAccesses, interconnect->getNumTerminals());
+    terminalAccessesStat->init("terminalAccesses", "Accesses to the parents at each terminal");
+    itfcStat->append(terminalAccessesStat);
+    auto parentImbalanceStat = makeLambdaStat([this, numSlots]() {
+        uint64_t total = 0;
+        uint64_t max = 0;
+        for (uint32_t i = 0; i < numSlots; i++) {
+            uint64_t c = profParentAccesses.count(i);
+            total += c;
+            max = MAX(max, c);
+        }
+        return total ? 100 * max * numSlots / total : 0;
+    });
+    parentImbalanceStat->init("parentImbalance", "Accesses to the busiest parent over the mean (%)");
+    itfcStat->append(parentImbalanceStat);
+
+    // NUMA locality of demand accesses
+    if (localityStats) {
+        profNodeAccesses.init("nodeAccesses", "Demand accesses per (requesting node, home node), [requesting][home]", numNodes * numNodes);
+        itfcStat->append(&profNodeAccesses);
+        auto nodeLocalPctStat = makeLambdaVectorStat([this](uint32_t n) {
+            uint64_t total = 0;
+            for (uint32_t h = 0; h < numNodes; h++) total += profNodeAccesses.count(n * numNodes + h);
+            return total ? 100 * profNodeAccesses.count(n * numNodes + n) / total : 0;
+        }, numNodes);
+        nodeLocalPctStat->init("nodeLocalPct", "Demand accesses of each requesting node served by its own node (%)");
+        itfcStat->append(nodeLocalPctStat);
+        static const char* classNames[] = {"local", "oneHop", "multiHop"};
+        profLocalityCycles.init("localityCycles", "Demand access latency, by home node distance", NUM_LOCALITY_CLASSES, classNames);
+        itfcStat->append(&profLocalityCycles);
+        profLocalityLatency.init("localityLatency", "Demand access latency histograms (log2(cycles) bins), [local, one-hop, multi-hop][bin]",
+                NUM_LOCALITY_CLASSES * 16);
+        itfcStat->append(&profLocalityLatency);
+    }
+
+    parentStat->append(itfcStat);
+}
+
 uint64_t MemInterconnectInterface::accessParent(MemReq& req, uint32_t groupId) {
     uint64_t respCycle = req.cycle;
 
     // Determine child and parent.
     const uint32_t childId = req.childId;
-    const uint32_t parentId = groups[groupId].map->preAccess(req.lineAddr, childId, req);
+    uint32_t parentId = groups[groupId].map->preAccess(req.lineAddr, childId, req);
+
+    // Reads to replicated pages go to the local replica if any; writes collapse the replicas.
+    // Cores in no node (not covered by the cpumaps of the patched root) have no local replica, and are neither
+    // sampled for migration nor issue migration copies.
+    const uint32_t node = (pageMigration || localityStats) ? zinfo->numaMap->getNodeOfCore(req.srcId) : 0;
+    const bool hasNode = node != NUMAMap::INVALID_NODE;
+    uint64_t collapsed = 0;
+    if (pageMigration && pageMigration->isReplicating()) {
+        const Address pageAddr = req.lineAddr >> (pageBits - lineBits);
+        if (req.type == GETS) {
+            uint64_t replicas = zinfo->numaMap->getReplicasOfPage(pageAddr);
+            if (replicas) {
+                bool local = hasNode && (replicas & (1uL << node));
+                if (local) parentId = numaAm->getMapOfNode(req.lineAddr, node);
+                pageMigration->replicaRead(req.srcId, local);
+            }
+        } else if (req.type == GETX || req.type == PUTX) {
+            collapsed = zinfo->numaMap->collapseReplicas(pageAddr);
+            if (collapsed) pageMigration->replicasCollapsed(pageAddr, __builtin_popcountl(collapsed));
+        }
+    }
+
+    profParentAccesses.inc(req.srcId, groupId * numParents + parentId);
 
     // Travel through the interconnect.
     respCycle = accReqTravel(req, respCycle, groupId, parentId, childId);
+    const uint64_t arrivalCycle = respCycle;
 
     // Access.
     MemReq req2 = req;
     req2.cycle = respCycle;
     if (isRemote(groupId, parentId, childId)) req2.set(MemReq::REMOTE);
     respCycle = groups[groupId].parents[parentId]->access(req2);
+    const uint64_t parentRespCycle = respCycle;
 
     groups[groupId].map->postAccess(req.lineAddr, childId, req);
 
     // Travel through the interconnect.
     respCycle = accRespTravel(req, respCycle, groupId, parentId, childId);
 
+    if (pageMigration) {
+        if (unlikely(collapsed)) {
+            uint64_t ackCycle = invalidateReplicas(req, respCycle, groupId, parentId, collapsed, arrivalCycle);
+            if (ackCycle > parentRespCycle) respCycle += ackCycle - parentRespCycle;
+        }
+        if (hasNode) {
+            if (req.type != PUTS) pageMigration->sample(req.lineAddr, req.srcId, node, numaAm->getNodeOfMap(parentId), req.type != GETS);
+            issueMigrationCopies(req, respCycle, groupId, node);
+        }
+    }
+
+    if (localityStats && (req.type == GETS || req.type == GETX)) recordLocality(req.srcId, node, parentId, respCycle - req.cycle);
+
     return respCycle;
 }
 
+void MemInterconnectInterface::recordLocality(uint32_t srcId, uint32_t node, uint32_t parentId, uint64_t latency) {
+    if (node == NUMAMap::INVALID_NODE) return;  // memory-less node
+    const uint32_t homeNode = parentId / (numParents / numNodes);
+    const uint32_t c = nodeClasses[node * numNodes + homeNode];
+    profNodeAccesses.inc(srcId, node * numNodes + homeNode);
+    profLocalityCycles.inc(srcId, c, latency);
+    profLocalityLatency.inc(srcId, c * 16 + (latency ? MIN(15u, ilog2(latency)) : 0));
+}
+
 uint64_t MemInterconnectInterface::invalidateChild(const InvReq& req, uint32_t groupId, BaseCache* child, uint32_t childId) {
     uint64_t respCycle = req.cycle;
 
     // Determine child and parent.
     const uint32_t parentId = groups[groupId].map->preInvalidate(req.lineAddr, childId, req);
 
+    // Forwards carry data to a single child; only invalidates and downgrades are multicast.
+    MemInterconnect::MulticastTree* mcast = nullptr;
+    if (multicastInvs && req.type != FWD) mcast = getMulticastTree(req, getParentTerminalId(groupId, parentId));
+
     // Travel through the interconnect.
-    respCycle = invReqTravel(req, respCycle, groupId, parentId, childId);
+    respCycle = invReqTravel(req, respCycle, groupId, parentId, childId, mcast);
 
     // Invalidate.
     InvReq req2 = req;
@@ -64,7 +213,7 @@ uint64_t MemInterconnectInterface::invalidateChild(const InvReq& req, uint32_t g
     groups[groupId].map->postInvalidate(req.lineAddr, childId, req);
 
     // Travel through the interconnect.
-    respCycle = invRespTravel(req, respCycle, groupId, parentId, childId);
+    respCycle = invRespTravel(req, respCycle, groupId, parentId, childId, mcast);
 
     return respCycle;
 }
@@ -83,22 +232,135 @@ uint64_t MemInterconnectInterface::accRespTravel(const MemReq& req, uint64_t cyc
     return interconnect->accessResponse(req, cycle, srcId, dstId);
 }
 
-uint64_t MemInterconnectInterface::invReqTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId) {
+uint64_t MemInterconnectInterface::invReqTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId,
+        MemInterconnect::MulticastTree* mcast) {
     if (ignoreInvLatency) return cycle;
 
     // Parent -> child.
     const uint32_t srcId = getParentTerminalId(groupId, parentId);
     const uint32_t dstId = getChildTerminalId(groupId, childId);
-    return interconnect->invalidateRequest(req, cycle, srcId, dstId);
+    return interconnect->invalidateRequest(req, cycle, srcId, dstId, mcast);
 }
 
-uint64_t MemInterconnectInterface::invRespTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId) {
+uint64_t MemInterconnectInterface::invRespTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId,
+        MemInterconnect::MulticastTree* mcast) {
     if (ignoreInvLatency) return cycle;
 
     // Child -> parent.
     const uint32_t srcId = getChildTerminalId(groupId, childId);
     const uint32_t dstId = getParentTerminalId(groupId, parentId);
-    return interconnect->invalidateResponse(req, cycle, srcId, dstId);
+    return interconnect->invalidateResponse(req, cycle, srcId, dstId, mcast);
+}
+
+MemInterconnect::MulticastTree* MemInterconnectInterface::getMulticastTree(const InvReq& req, uint32_t parentTerminalId) {
+    assert(req.srcId < mcastStates.size());
+    MulticastState* ms = mcastStates[req.srcId];
+    if (unlikely(!ms)) ms = mcastStates[req.srcId] = new MulticastState();
+    if (ms->lineAddr != req.lineAddr || ms->type != req.type || ms->writeback != req.writeback || ms->cycle != req.cycle
+            || ms->parentTerminalId != parentTerminalId) {
+        // A new multicast.
+        ms->lineAddr = req.lineAddr;
+        ms->type = req.type;
+        ms->writeback = req.writeback;
+        ms->cycle = req.cycle;
+        ms->parentTerminalId = parentTerminalId;
+        ms->tree.clear();
+    }
+    return &ms->tree;
+}
+
+TimingRecord MemInterconnectInterface::beginOffPath(const MemReq& req) {
+    EventRecorder* evRec = zinfo->eventRecorders[req.srcId];
+    TimingRecord demandRec;
+    demandRec.clear();
+    if (evRec && evRec->hasRecord()) demandRec = evRec->popRecord();
+    return demandRec;
+}
+
+void MemInterconnectInterface::stitchOffPath(const MemReq& req, TimingRecord& offRec) {
+    // Merge the records of the off-path accesses, all starting no earlier than req
+    EventRecorder* evRec = zinfo->eventRecorders[req.srcId];
+    if (!evRec || !evRec->hasRecord()) return;
+    TimingRecord rec = evRec->popRecord();
+    if (offRec.isValid()) {
+        evRec->pushRecord(offRec);
+        StitchOffPathRecord(evRec, rec, req.cycle);
+        offRec = evRec->popRecord();
+    } else {
+        offRec = rec;
+    }
+}
+
+void MemInterconnectInterface::endOffPath(const MemReq& req, uint64_t respCycle, TimingRecord& demandRec, TimingRecord& offRec) {
+    EventRecorder* evRec = zinfo->eventRecorders[req.srcId];
+    if (offRec.isValid()) {
+        if (!demandRec.isValid()) {
+            // The demand has no record, so model its latency as a fixed delay
+            DelayEvent* dEv = new (evRec) DelayEvent(respCycle - req.cycle);
+            dEv->setMinStartCycle(req.cycle);
+            demandRec = {req.lineAddr, req.cycle, respCycle, req.type, dEv, dEv};
+        }
+        evRec->pushRecord(demandRec);
+        StitchOffPathRecord(evRec, offRec, req.cycle);
+    } else if (demandRec.isValid()) {
+        evRec->pushRecord(demandRec);
+    }
+}
+
+void MemInterconnectInterface::issueMigrationCopies(const MemReq& req, uint64_t respCycle, uint32_t groupId, uint32_t node) {
+    Address lineAddr;
+    uint32_t srcNode;
+    if (!pageMigration->nextCopy(node, &lineAddr, &srcNode)) return;
+
+    TimingRecord demandRec = beginOffPath(req);
+    TimingRecord offRec;
+    offRec.clear();
+    uint32_t copies = 0;
+    do {
+        const uint32_t srcParent = numaAm->getMapOfNode(lineAddr, srcNode);
+        const uint32_t dstParent = numaAm->getMapOfNode(lineAddr, node);
+        const uint32_t srcTerminalId = getParentTerminalId(groupId, srcParent);
+        const uint32_t dstTerminalId = getParentTerminalId(groupId, dstParent);
+
+        // Read from the old memory controller.
+        MESIState state = I;
+        MemReq readReq = {lineAddr, GETS, 0, &state, req.cycle, nullptr, I, req.srcId, 0};
+        uint64_t cycle = interconnect->accessRequest(readReq, req.cycle, dstTerminalId, srcTerminalId);
+        readReq.cycle = cycle;
+        cycle = groups[groupId].parents[srcParent]->access(readReq);
+        cycle = interconnect->accessResponse(readReq, cycle, srcTerminalId, dstTerminalId);
+        stitchOffPath(req, offRec);
+
+        // Write to the new one, which is local.
+        state = M;
+        MemReq writeReq = {lineAddr, PUTX, 0, &state, cycle, nullptr, M, req.srcId, 0};
+        groups[groupId].parents[dstParent]->access(writeReq);
+        stitchOffPath(req, offRec);
+    } while (++copies < pageMigration->getCopyLinesPerAccess() && pageMigration->nextCopy(node, &lineAddr, &srcNode));
+    endOffPath(req, respCycle, demandRec, offRec);
+}
+
+uint64_t MemInterconnectInterface::invalidateReplicas(const MemReq& req, uint64_t respCycle, uint32_t groupId, uint32_t homeParentId,
+        uint64_t replicas, uint64_t cycle) {
+    TimingRecord demandRec = beginOffPath(req);
+    TimingRecord offRec;
+    offRec.clear();
+    uint64_t ackCycle = cycle;
+    const uint32_t homeTerminalId = getParentTerminalId(groupId, homeParentId);
+    for (uint32_t n = 0; replicas >> n; n++) {
+        if (!(replicas & (1uL << n))) continue;
+        const uint32_t replicaTerminalId = getParentTerminalId(groupId, numaAm->getMapOfNode(req.lineAddr, n));
+
+        // A dataless request and ack, like an upgrade.
+        MESIState state = S;
+        MemReq invReq = {req.lineAddr, GETX, 0, &state, cycle, nullptr, S, req.srcId, 0};
+        uint64_t c = interconnect->accessRequest(invReq, cycle, homeTerminalId, replicaTerminalId);
+        c = interconnect->accessResponse(invReq, c, replicaTerminalId, homeTerminalId);
+        stitchOffPath(req, offRec);
+        ackCycle = MAX(ackCycle, c);
+    }
+    endOffPath(req, respCycle, demandRec, offRec);
+    return ackCycle;
 }
 
 uint32_t MemInterconnectInterface::getParentGroupId(const g_vector<MemObject*>& parents) {
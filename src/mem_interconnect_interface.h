@@ -2,12 +2,16 @@
 #define MEM_INTERCONNECT_INTERFACE_H_
 
 #include "g_std/g_string.h"
+#include "event_recorder.h"
 #include "g_std/g_vector.h"
+#include "mem_interconnect.h"
 #include "memory_hierarchy.h"
+#include "stats.h"
 
 class AddressMap;
 class CoherentParentMap;
-class MemInterconnect;
+class NUMAAddressMap;
+class PageMigrationEngine;
 
 /**
  * An interface of an interconnect to neighboring parent/child memory hierarchy levels.
@@ -17,11 +21,22 @@ class MemInterconnect;
 class MemInterconnectInterface : public GlobAlloc {
     public:
         MemInterconnectInterface(MemInterconnect* _interconnect, uint32_t _index, AddressMap* _am,
-                bool _centralizedParents, bool _ignoreInvLatency);
+                bool _centralizedParents, bool _ignoreInvLatency, bool _multicastInvs = false);
 
         // Construct and return the endpoint associated with the given child cache.
         BaseCache* getEndpoint(BaseCache* child, const g_string& name);
 
+        // Sample the accesses to the parents for page migration, and issue the page copies. The parents must be the
+        // memory controllers, mapped by the given NUMA address map.
+        void setPageMigration(PageMigrationEngine* _pageMigration, NUMAAddressMap* _numaAm);
+
+        // Count the accesses per requesting and home NUMA node. The parents must be the memory controllers, laid out
+        // node by node like NUMAAddressMap does.
+        void enableLocalityStats();
+
+        // Must be called after all children and parents are connected.
+        void initStats(AggregateStat* parentStat);
+
     protected:
 
         /**
@@ -85,9 +100,12 @@ class MemInterconnectInterface : public GlobAlloc {
 
         virtual uint64_t accRespTravel(const MemReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId);
 
-        virtual uint64_t invReqTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId);
+        // mcast is the multicast the invalidate belongs to, if any.
+        virtual uint64_t invReqTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId,
+                MemInterconnect::MulticastTree* mcast);
 
-        virtual uint64_t invRespTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId);
+        virtual uint64_t invRespTravel(const InvReq& req, uint64_t cycle, uint32_t groupId, uint32_t parentId, uint32_t childId,
+                MemInterconnect::MulticastTree* mcast);
 
     protected:
 
@@ -128,6 +146,53 @@ class MemInterconnectInterface : public GlobAlloc {
             return getParentTerminalId(groupId, parentId) != getChildTerminalId(groupId, childId);
         }
 
+        /* Multicast invalidates. */
+
+        // A parent sends the invalidates of a line to all its children back to back, with the same request cycle and
+        // writeback flag; consecutive invalidates from the same core with the same such fields form one multicast.
+        // This is a heuristic: two distinct invalidation rounds that match on all of lineAddr, type, writeback pointer,
+        // cycle and parent (e.g., with a writeback flag reused at the same stack address) are wrongly merged into one
+        // multicast, and the second round shares links and acks it never contended for.
+        struct MulticastState : GlobAlloc {
+            Address lineAddr;
+            InvType type;
+            bool* writeback;
+            uint64_t cycle;
+            uint32_t parentTerminalId;
+            MemInterconnect::MulticastTree tree;
+
+            MulticastState() : lineAddr(0), type(INV), writeback(nullptr), cycle(0), parentTerminalId(-1) {}
+        };
+
+        MemInterconnect::MulticastTree* getMulticastTree(const InvReq& req, uint32_t parentTerminalId);
+
+        /* Page migration. */
+
+        // Accesses off the critical path of req, which responds at respCycle: save the timing record of req, merge the
+        // record of each access with stitchOffPath(), then restore them all.
+        TimingRecord beginOffPath(const MemReq& req);
+        void stitchOffPath(const MemReq& req, TimingRecord& offRec);
+        void endOffPath(const MemReq& req, uint64_t respCycle, TimingRecord& demandRec, TimingRecord& offRec);
+
+        // Copy the next lines of the pages migrated or replicated to the node of the requester, off the critical path.
+        // Each line is read from its old memory controller to the new one over the interconnect, and written there.
+        // Copies only advance on accesses from the new home node, so a node whose cores stop accessing memory through
+        // this interface leaves its pending copies in flight (the pages are already remapped, only the traffic is lost).
+        void issueMigrationCopies(const MemReq& req, uint64_t respCycle, uint32_t groupId, uint32_t node);
+
+        // Invalidate the replicas on the given nodes (a bitmask) of the page of req, a write that reaches its home
+        // parent at cycle. Return the cycle when all acks are back at the home. The bound phase delays the write until
+        // then; the weave phase models the invalidate traffic off the critical path.
+        uint64_t invalidateReplicas(const MemReq& req, uint64_t respCycle, uint32_t groupId, uint32_t homeParentId,
+                uint64_t replicas, uint64_t cycle);
+
+        /* Locality stats. */
+
+        enum LocalityClass {LOCAL, ONE_HOP, MULTI_HOP, NUM_LOCALITY_CLASSES};
+
+        // Record a demand access from a core of node to parentId, which took latency cycles.
+        void recordLocality(uint32_t srcId, uint32_t node, uint32_t parentId, uint64_t latency);
+
     protected:
         MemInterconnect* interconnect;
         const uint32_t index;
@@ -151,6 +216,21 @@ class MemInterconnectInterface : public GlobAlloc {
 
         const bool centralizedParents;
         const bool ignoreInvLatency;
+        const bool multicastInvs;
+
+        g_vector<MulticastState*> mcastStates;  // per core, lazily allocated
+
+        PageMigrationEngine* pageMigration;
+        NUMAAddressMap* numaAm;  // same as am if page migration is enabled
+
+        ShardedVectorCounter profParentAccesses;  // [group][parent], sharded by source core
+
+        bool localityStats;
+        uint32_t numNodes;
+        g_vector<LocalityClass> nodeClasses;  // [requesting node][home node], by NUMA distance
+        ShardedVectorCounter profNodeAccesses;  // [requesting node][home node]
+        ShardedVectorCounter profLocalityLatency;  // [class][log2(cycles) bin]
+        ShardedVectorCounter profLocalityCycles;  // [class]
 
     public:
         using GlobAlloc::operator new;
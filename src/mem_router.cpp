@@ -14,40 +14,166 @@ void TimingMemRouter::initStats(AggregateStat* parentStat) {
     routerStat->append(&profQueuingProcCycles);
     routerStat->append(&profQueuingOutCycles);
 
+    if (numVCs) {
+        profCreditSends.init("creditSends", "Packets sent with credits through output ports", numPorts);
+        profCreditStalls.init("creditStalls", "Packets stalled for credits at output ports", numPorts);
+        profCreditStallCycles.init("creditStallCycles", "Cycles stalled for credits at output ports", numPorts);
+        profBufferOccupancy.init("bufOccupancy", "Occupied downstream buffer slots seen by each send, sum over sends", numPorts);
+        profCreditEscapes.init("creditEscapes", "Packets that gave up waiting for credits after too many stalls", numPorts);
+        routerStat->append(&profCreditSends);
+        routerStat->append(&profCreditStalls);
+        routerStat->append(&profCreditStallCycles);
+        routerStat->append(&profBufferOccupancy);
+        routerStat->append(&profCreditEscapes);
+    }
+
     parentStat->append(routerStat);
 }
 
-uint64_t TimingMemRouter::transfer(uint64_t cycle, uint64_t size, uint32_t portId, bool lastHop, bool piggyback, uint32_t srcCoreId) {
+uint64_t TimingMemRouter::transfer(uint64_t cycle, uint64_t size, uint32_t portId, uint32_t vcClass, bool lastHop, bool piggyback, MemMsgClass msgClass,
+        uint32_t srcCoreId) {
     // Bound phase delays.
     uint32_t procDelay = latency;
     uint32_t outDelay = lastHop ? (size + bytesPerCycle - 1) / bytesPerCycle : 0;
-    if (!piggyback) profTrans.atomicInc();
-    profSize.atomicInc(size);
+    countTransfer(size, lastHop, piggyback, msgClass, srcCoreId);
+    if (trackLoad) curTransData.add(srcCoreId, portId, size);
     uint64_t respCycle = cycle + procDelay + outDelay;
 
     // Create events.
     auto itcnRec = zinfo->memInterconnectEventRecorders[srcCoreId];
     assert(itcnRec);
-    itcnRec->addHop(this, portId, piggyback, procDelay, outDelay, cycle, respCycle);
+    itcnRec->addHop(this, portId, vcClass, piggyback, procDelay, outDelay, cycle, respCycle);
 
     return respCycle;
 }
 
-uint64_t TimingMemRouter::simulate(uint32_t portId, uint32_t procDelay, uint32_t outDelay, bool lastHop, bool piggyback, uint64_t startCycle) {
-    // Process.
-    uint64_t procStartCycle = startCycle;
-    if (!piggyback) {
-        procStartCycle = procDisp.dispatch(startCycle);
-        profQueuingProcCycles.inc(procStartCycle - startCycle);
+void TimingMemRouter::enableLoadTracking() {
+    if (trackLoad) return;
+    trackLoad = true;
+    curTransData.init(numPorts);
+    zinfo->eventQueue->insert(new LoadUpdateEvent(this), 0);
+}
+
+void TimingMemRouter::updatePortLoads() {
+    // Only accounts for transfers of routed packets, so it is the offered load rather than the occupancy.
+    for (uint32_t p = 0; p < numPorts; p++) {
+        uint64_t data = curTransData.drain(p);
+        portLoads[p] = MIN((uint64_t)100, 100 * data / zinfo->phaseLength / bytesPerCycle);
+    }
+}
+
+uint64_t TimingMemRouter::simulate(uint32_t portId, uint32_t vcClass, uint32_t procDelay, uint32_t outDelay, bool lastHop, bool piggyback,
+        uint64_t startCycle, MemRouterFlowState* fs) {
+    uint64_t procDoneCycle;
+    if (!fs->stallCycle) {
+        // Process.
+        uint64_t procStartCycle = startCycle;
+        if (!piggyback) {
+            procStartCycle = procDisp.dispatch(startCycle);
+            profQueuingProcCycles.inc(procStartCycle - startCycle);
+        }
+        procDoneCycle = procStartCycle + procDelay;
+        DEBUG("%s TimingMemRouter: simProc: %lu -> %lu", name.c_str(), startCycle, procDoneCycle);
+    } else {
+        // Resumed after a credit stall.
+        procDoneCycle = fs->stallCycle;
+    }
+
+    // Credit for the downstream buffer. Piggybacked packets and ejection do not take buffer slots.
+    uint64_t outReadyCycle = std::max(procDoneCycle, startCycle);
+    MemRouterCreditSlot* slot = nullptr;
+    if (numVCs && !lastHop && !piggyback) {
+        bool force = fs->stallRetries >= MAX_CREDIT_RETRIES;
+        if (force) {
+#ifdef NASSERT
+            bool escape = creditEscape;
+#else
+            bool escape = false;  // builds with assertions always stop here, the escape breaks flow control
+#endif
+            if (!escape) {
+                panic("%s: packet stalled %u times for credits at port %u, the routing is not deadlock-free with its VC "
+                        "classes", name.c_str(), fs->stallRetries, portId);
+            }
+            profCreditEscapes.inc(portId);
+            if (!creditEscapeWarned) {
+                warn("%s: packet stalled %u times for credits, likely a cyclic buffer dependency; taking the slot anyway",
+                        name.c_str(), fs->stallRetries);
+                creditEscapeWarned = true;
+            }
+        }
+        uint64_t creditCycle = acquireCredit(portId, vcClass, outReadyCycle, force, &slot);
+        if (!slot) {
+            if (!fs->stallCycle) profCreditStalls.inc(portId);
+            fs->stallCycle = procDoneCycle;
+            fs->stallRetries++;
+            // Still holding the upstream slot, push back its estimated release.
+            if (ownsCredit(fs)) {
+                fs->credit->freeCycle = std::max(fs->credit->freeCycle & ~CREDIT_PENDING, creditCycle + creditDelay) | CREDIT_PENDING;
+            }
+            DEBUG("%s TimingMemRouter: credit stall (%u): %lu -> %lu", name.c_str(), portId, outReadyCycle, creditCycle);
+            return creditCycle;
+        }
+        outReadyCycle = creditCycle;
+        if (outReadyCycle > procDoneCycle) profCreditStallCycles.inc(portId, outReadyCycle - procDoneCycle);
     }
-    uint64_t procDoneCycle = procStartCycle + procDelay;
-    DEBUG("%s TimingMemRouter: simProc: %lu -> %lu", name.c_str(), startCycle, procDoneCycle);
+    fs->stallCycle = 0;
+    fs->stallRetries = 0;
 
     // Output port.
-    uint64_t outStartCycle = std::max(procDoneCycle, lastOutDoneCycle[portId]);
+    uint64_t outStartCycle = std::max(outReadyCycle, lastOutDoneCycle[portId]);
     profQueuingOutCycles.inc(portId, outStartCycle - procDoneCycle);
     lastOutDoneCycle[portId] = outStartCycle + outDelay;
     DEBUG("%s TimingMemRouter: simOut (%u): %lu -> %lu-%lu", name.c_str(), portId, procDoneCycle, outStartCycle, lastOutDoneCycle[portId]);
+
+    // Leaving this router frees the upstream buffer slot, unless another packet already took it at its estimate.
+    if (ownsCredit(fs)) {
+        fs->credit->freeCycle = std::max(fs->credit->freeCycle & ~CREDIT_PENDING, outStartCycle + creditDelay);
+    }
+    fs->credit = slot;
+    fs->creditOwner = slot ? slot->owner : 0;
+
     return lastHop ? lastOutDoneCycle[portId] : outStartCycle;
 }
 
+uint64_t TimingMemRouter::acquireCredit(uint32_t portId, uint32_t vcClass, uint64_t cycle, bool force, MemRouterCreditSlot** slot) {
+    assert(vcClass * vcsPerClass < numVCs);
+    // Packets leave the downstream router in any order, so credits return out of order. Pick the slot that frees up
+    // first, preferring known releases on ties. Waiting on the oldest slot instead made packets depend on unrelated
+    // stalled packets, and these false dependencies could close a cycle of stalls that the network does not have.
+    MemRouterCreditSlot* best = nullptr;
+    uint32_t bestVC = 0;
+    uint64_t bestCycle = -1uL;
+    bool bestPending = true;
+    for (uint32_t vc = vcClass * vcsPerClass; vc < (vcClass + 1) * vcsPerClass; vc++) {
+        MemRouterCreditSlot* slots = &credits[(portId * numVCs + vc) * bufferDepth];
+        for (uint32_t i = 0; i < bufferDepth; i++) {
+            uint64_t c = slots[i].freeCycle & ~CREDIT_PENDING;
+            bool pending = slots[i].freeCycle & CREDIT_PENDING;
+            if (!best || c < bestCycle || (c == bestCycle && bestPending && !pending)) {
+                best = &slots[i];
+                bestVC = vc;
+                bestCycle = c;
+                bestPending = pending;
+            }
+        }
+    }
+    assert(best);
+    if (bestPending && bestCycle > cycle && !force) {
+        // The release is not known yet, retry when it should be.
+        *slot = nullptr;
+        return bestCycle;
+    }
+
+    MemRouterCreditSlot* slots = &credits[(portId * numVCs + bestVC) * bufferDepth];
+    uint32_t occupied = 0;
+    for (uint32_t i = 0; i < bufferDepth; i++) occupied += ((slots[i].freeCycle & ~CREDIT_PENDING) > cycle) ? 1 : 0;
+    profCreditSends.inc(portId);
+    profBufferOccupancy.inc(portId, occupied);
+
+    // Take the slot, with a pending release until the downstream hop is simulated.
+    uint64_t sendCycle = std::max(cycle, bestCycle);
+    best->freeCycle = (sendCycle + latency + creditDelay) | CREDIT_PENDING;
+    best->owner++;
+    *slot = best;
+    return sendCycle;
+}
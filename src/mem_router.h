@@ -1,33 +1,127 @@
 #ifndef MEM_ROUTER_H_
 #define MEM_ROUTER_H_
 
+#include "event_queue.h"
 #include "g_std/g_string.h"
-#include "locks.h"
 #include "memory_hierarchy.h"
 #include "stats.h"
 #include "zsim.h"
 
+/**
+ * Downstream buffer slot of a router output VC, for credit-based flow control.
+ */
+struct MemRouterCreditSlot {
+    uint64_t freeCycle;  // cycle the slot becomes free, ORed with a pending flag while it is only estimated
+    uint64_t owner;  // bumped on every take, so that a previous holder does not update the slot of the next one
+};
+
+/**
+ * Flow control state of a packet, carried by its interconnect event across hops.
+ */
+struct MemRouterFlowState {
+    MemRouterCreditSlot* credit;  // upstream buffer slot taken by the packet, if any
+    uint64_t creditOwner;  // owner value of the slot when the packet took it
+    uint64_t stallCycle;  // if non-zero, the packet is stalled at the output stage since this cycle, and must be resumed
+    uint32_t stallRetries;  // credit stalls of the current hop
+    MemRouterFlowState() : credit(nullptr), creditOwner(0), stallCycle(0), stallRetries(0) {}
+};
+
+/**
+ * Coherence message classes carried by the interconnect, for energy accounting.
+ */
+enum MemMsgClass {
+    MSG_REQUEST,  // GETS/GETX
+    MSG_RESPONSE,  // data and acknowledgments of GETS/GETX/PUTS/PUTX
+    MSG_INVALIDATE,  // invalidations and forwards, and their acknowledgments
+    MSG_WRITEBACK,  // PUTS/PUTX, and dirty data in invalidation responses
+    MSG_CLASSES
+};
+
+/**
+ * Energy of a router class, i.e., the routers of one interconnect level. Each hop costs the router traversal energy
+ * per flit and the output link energy per bit: the wire energy over the link length, plus the SerDes energy if the
+ * link is off-chip (e.g., the inter-stack links of an upper level). A path of N hops goes through N+1 routers, so the
+ * last hop also pays the traversal of the destination router.
+ *
+ * Energy is accumulated in fJ per message class, shared by all the routers of the class.
+ */
+class MemRouterEnergyModel : public GlobAlloc {
+    private:
+        const uint64_t routerFemtoJoulePerFlit;
+        const uint32_t flitBytes;
+        const uint64_t linkFemtoJoulePerBit;  // over the whole link length
+        const uint64_t serdesFemtoJoulePerBit;
+
+        ShardedVectorCounter profRouterEnergy;
+        ShardedVectorCounter profLinkEnergy;
+        ShardedVectorCounter profSerDesEnergy;
+
+        const g_string name;
+
+    public:
+        MemRouterEnergyModel(uint64_t _routerFemtoJoulePerFlit, uint32_t _flitBytes, uint64_t _linkFemtoJoulePerBit,
+                uint64_t _serdesFemtoJoulePerBit, const g_string& _name)
+            : routerFemtoJoulePerFlit(_routerFemtoJoulePerFlit), flitBytes(_flitBytes), linkFemtoJoulePerBit(_linkFemtoJoulePerBit),
+              serdesFemtoJoulePerBit(_serdesFemtoJoulePerBit), name(_name)
+        {
+            assert(flitBytes);
+        }
+
+        void initStats(AggregateStat* parentStat) {
+            static const char* msgClassNames[] = {"req", "resp", "inv", "wb"};
+            AggregateStat* energyStat = new AggregateStat();
+            energyStat->init(name.c_str(), "Router class energy stats");
+            profRouterEnergy.init("eRouter", "Router traversal energy (fJ)", MSG_CLASSES, msgClassNames);
+            profLinkEnergy.init("eLink", "Link wire energy (fJ)", MSG_CLASSES, msgClassNames);
+            profSerDesEnergy.init("eSerDes", "Link SerDes energy (fJ)", MSG_CLASSES, msgClassNames);
+            energyStat->append(&profRouterEnergy);
+            energyStat->append(&profLinkEnergy);
+            energyStat->append(&profSerDesEnergy);
+            parentStat->append(energyStat);
+        }
+
+        inline void account(uint64_t size, bool lastHop, MemMsgClass msgClass, uint32_t srcCoreId) {
+            uint64_t flits = (size + flitBytes - 1) / flitBytes;
+            uint64_t routers = lastHop ? 2 : 1;
+            uint64_t bits = size * 8;
+            profRouterEnergy.inc(srcCoreId, msgClass, routers * flits * routerFemtoJoulePerFlit);
+            profLinkEnergy.inc(srcCoreId, msgClass, bits * linkFemtoJoulePerBit);
+            profSerDesEnergy.inc(srcCoreId, msgClass, bits * serdesFemtoJoulePerBit);
+        }
+};
+
 class MemRouter : public GlobAlloc {
     protected:
         const uint32_t numPorts;
 
-        Counter profTrans;
-        Counter profSize;
+        ShardedCounter profTrans;
+        ShardedCounter profSize;
+
+        MemRouterEnergyModel* energyModel;  // nullptr if energy is not modeled
 
         const g_string name;
 
     public:
-        MemRouter(uint32_t _numPorts, const g_string& _name) : numPorts(_numPorts), name(_name) {}
+        MemRouter(uint32_t _numPorts, const g_string& _name) : numPorts(_numPorts), energyModel(nullptr), name(_name) {}
         const char* getName() const { return name.c_str(); }
         uint32_t getNumPorts() const { return numPorts; }
 
+        void setEnergyModel(MemRouterEnergyModel* em) { energyModel = em; }
+
         virtual void initStats(AggregateStat* parentStat) {
             parentStat->append(initBaseStats());
         }
 
         /* Bound phase. */
 
-        virtual uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, bool lastHop, bool piggyback, uint32_t srcCoreId) = 0;
+        virtual uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, uint32_t vcClass, bool lastHop, bool piggyback, MemMsgClass msgClass,
+                uint32_t srcCoreId) = 0;
+
+        // Load of the output port in the previous phase, in percentage of its bandwidth. Used by adaptive routing.
+        virtual uint32_t getPortLoad(uint32_t portId) { return 0; }
+
+        // Called at init if the routing algorithm uses getPortLoad(), for routers that do not track the load anyway.
+        virtual void enableLoadTracking() {}
 
         /* Weave phase. */
 
@@ -35,9 +129,19 @@ class MemRouter : public GlobAlloc {
 
         virtual bool needsCSim() const { return false; }
 
-        virtual uint64_t simulate(uint32_t portId, uint32_t procDelay, uint32_t outDelay, bool lastHop, bool piggyback, uint64_t startCycle) { panic("%s: not implemented!", name.c_str()); }
+        // Routers with flow control release the upstream buffer slot in fs when the packet leaves, and replace it with
+        // the slot taken downstream. If the packet has to wait for a credit, fs->stallCycle is set, and the hop must be
+        // simulated again at the returned cycle.
+        virtual uint64_t simulate(uint32_t portId, uint32_t vcClass, uint32_t procDelay, uint32_t outDelay, bool lastHop, bool piggyback,
+                uint64_t startCycle, MemRouterFlowState* fs) { panic("%s: not implemented!", name.c_str()); }
 
     protected:
+        inline void countTransfer(uint64_t size, bool lastHop, bool piggyback, MemMsgClass msgClass, uint32_t srcCoreId) {
+            if (!piggyback) profTrans.inc(srcCoreId);
+            profSize.inc(srcCoreId, size);
+            if (energyModel) energyModel->account(size, lastHop, msgClass, srcCoreId);
+        }
+
         AggregateStat* initBaseStats() {
             AggregateStat* routerStat = new AggregateStat();
             routerStat->init(name.c_str(), "Router stats");
@@ -62,15 +166,18 @@ class SimpleMemRouter : public MemRouter {
         SimpleMemRouter(uint32_t numPorts, uint64_t _latency, const g_string& name)
             : MemRouter(numPorts, name), latency(_latency) {}
 
-        uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, bool lastHop, bool piggyback, uint32_t srcCoreId) {
-            if (!piggyback) profTrans.atomicInc();
-            profSize.atomicInc(size);
+        uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, uint32_t vcClass, bool lastHop, bool piggyback, MemMsgClass msgClass,
+                uint32_t srcCoreId) {
+            countTransfer(size, lastHop, piggyback, msgClass, srcCoreId);
             return cycle + latency;
         }
 };
 
 /**
  * Router with limited bandwidth for ports and throttling latency based on M/D/1 queueing model.
+ *
+ * The queuing factors are refreshed at the end of each phase by a periodic event, while no thread transfers, so
+ * transfer() only reads them and accumulates the port data in per-shard counters, without locking.
  */
 class MD1MemRouter : public MemRouter {
     private:
@@ -78,22 +185,31 @@ class MD1MemRouter : public MemRouter {
         const uint32_t bytesPerCycle;  // per port
 
         // Use for coarse-grained queuing latency factor update.
-        lock_t updateLock;
-        uint32_t lastPhase;
+        uint64_t lastPhase;  // first phase whose data are not yet accounted for
         g_vector<uint32_t> queuingFactorsX100;
-        g_vector<uint64_t> curTransData;
+        ShardedAccumulator curTransData;
         g_vector<uint64_t> smoothedTransData;
+        g_vector<uint32_t> portLoads;
 
         Counter profClampedLoads;
         VectorCounter profLoadHist;  // 10% bin
 
+        class UpdateEvent : public Event {
+            private:
+                MD1MemRouter* router;
+            public:
+                explicit UpdateEvent(MD1MemRouter* _router) : Event(1), router(_router) {}
+                void callback() { router->updateQueuingFactors(); }
+        };
+
     public:
         MD1MemRouter(uint32_t numPorts, uint64_t _latency, uint32_t _bytesPerCycle, const g_string& name)
             : MemRouter(numPorts, name), latency(_latency), bytesPerCycle(_bytesPerCycle),
-              lastPhase(0), queuingFactorsX100(numPorts, 100), curTransData(numPorts, 0),
-              smoothedTransData(numPorts, 0)
+              lastPhase(0), queuingFactorsX100(numPorts, 100),
+              smoothedTransData(numPorts, 0), portLoads(numPorts, 0)
         {
-            futex_init(&updateLock);
+            curTransData.init(numPorts);
+            zinfo->eventQueue->insert(new UpdateEvent(this), 0);
         }
 
         void initStats(AggregateStat* parentStat) {
@@ -107,39 +223,31 @@ class MD1MemRouter : public MemRouter {
             parentStat->append(routerStat);
         }
 
-        uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, bool lastHop, bool piggyback, uint32_t srcCoreId) {
+        uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, uint32_t vcClass, bool lastHop, bool piggyback, MemMsgClass msgClass,
+                uint32_t srcCoreId) {
             assert(portId < numPorts);
 
-            // Update queuing factors.
-            // Double-checked locking.
-            if (zinfo->numPhases > lastPhase) {
-                futex_lock(&updateLock);
-                if (zinfo->numPhases > lastPhase) {
-                    updateQueuingFactors();
-                    // Need barrier here, see http://www.aristeia.com/Papers/DDJ_Jul_Aug_2004_revised.pdf
-                    __sync_synchronize();
-                    lastPhase = zinfo->numPhases;
-                }
-                futex_unlock(&updateLock);
-            }
-
-            __sync_fetch_and_add(&curTransData[portId], size);
-            if (!piggyback) profTrans.atomicInc();
-            profSize.atomicInc(size);
+            curTransData.add(srcCoreId, portId, size);
+            countTransfer(size, lastHop, piggyback, msgClass, srcCoreId);
 
             uint32_t serializeDelay = (size + bytesPerCycle - 1) / bytesPerCycle;
             uint32_t queuingDelay = size / bytesPerCycle * queuingFactorsX100[portId] / 100;
             return cycle + latency + queuingDelay + (lastHop ? serializeDelay : 0);
         }
 
+        uint32_t getPortLoad(uint32_t portId) {
+            assert(portId < numPorts);
+            return portLoads[portId];
+        }
+
     private:
+        // Called at the end of each phase, i.e., zinfo->numPhases is the phase that just finished.
         void updateQueuingFactors() {
-            uint32_t phaseCycles = (zinfo->numPhases - lastPhase) * zinfo->phaseLength;
+            uint32_t phaseCycles = (zinfo->numPhases + 1 - lastPhase) * zinfo->phaseLength;
             if (phaseCycles < 10000) return; //Skip with short phases
 
             for (uint32_t portId = 0; portId < numPorts; portId++) {
-                smoothedTransData[portId] = (curTransData[portId] + smoothedTransData[portId]) / 2;
-                curTransData[portId] = 0;
+                smoothedTransData[portId] = (curTransData.drain(portId) + smoothedTransData[portId]) / 2;
                 uint32_t load = 100 * smoothedTransData[portId] / phaseCycles / bytesPerCycle;
                 // Clamp load
                 if (load > 95) {
@@ -147,8 +255,10 @@ class MD1MemRouter : public MemRouter {
                     profClampedLoads.inc();
                 }
                 profLoadHist.inc(load / 10);
+                portLoads[portId] = load;
                 queuingFactorsX100[portId] = 50 * load / (100 - load);
             }
+            lastPhase = zinfo->numPhases + 1;
         }
 };
 
@@ -158,6 +268,16 @@ class MemRouterOutEvent;
 
 /**
  * Router timing model with limited bandwidth for ports.
+ *
+ * Optionally models finite input buffers with virtual channels (VCs) and credit-based flow control. Each output port
+ * tracks the buffer slots of the downstream router input as credits, i.e., the cycles at which they become free. A
+ * packet must get a credit on one VC of its VC class before leaving through the port, and releases the credit of its
+ * upstream slot (after the credit return delay) when it leaves this router. Stalls thus hold the upstream slot, and
+ * propagate back to the source. Injection and ejection buffers are infinite.
+ *
+ * A slot taken by a packet has a pending release cycle estimated as the router latency, until the downstream hop is
+ * simulated and sets the actual one. A packet that finds only pending credits stalls and is resimulated at the
+ * estimated cycle, by when the release is known.
  */
 class TimingMemRouter : public MemRouter {
     private:
@@ -193,25 +313,89 @@ class TimingMemRouter : public MemRouter {
         ProcDispatcher procDisp;
         g_vector<uint64_t> lastOutDoneCycle;
 
+        // Virtual channels and credits. numVCs == 0 means infinite buffers.
+        const uint32_t numVCs;  // per port
+        const uint32_t vcsPerClass;
+        const uint32_t bufferDepth;  // packets per VC
+        const uint32_t creditDelay;
+        g_vector<MemRouterCreditSlot> credits;  // [port][vc][slot]
+        static const uint64_t CREDIT_PENDING = 1uL << 63;
+        // Stalled packets wait on each other's estimated releases. That can only be cyclic if the routing is not
+        // deadlock-free with the VC classes, and would then stall the packets forever, so past this many retries of a
+        // hop, panic, or if creditEscape is set (only honored without assertions), take the slot at its estimate.
+        static const uint32_t MAX_CREDIT_RETRIES = 256;
+        const bool creditEscape;
+        bool creditEscapeWarned;
+
+        // Bound phase port load, for adaptive routing. Only tracked if enabled, and updated at the end of each phase
+        // by a periodic event, while no thread transfers.
+        bool trackLoad;
+        ShardedAccumulator curTransData;
+        g_vector<uint32_t> portLoads;
+
+        class LoadUpdateEvent : public Event {
+            private:
+                TimingMemRouter* router;
+            public:
+                explicit LoadUpdateEvent(TimingMemRouter* _router) : Event(1), router(_router) {}
+                void callback() { router->updatePortLoads(); }
+        };
+
         // Stats.
         Counter profQueuingProcCycles;
         VectorCounter profQueuingOutCycles;
+        VectorCounter profCreditSends;
+        VectorCounter profCreditStalls;
+        VectorCounter profCreditStallCycles;
+        VectorCounter profCreditEscapes;
+        VectorCounter profBufferOccupancy;  // sum of occupied downstream slots seen by each send
 
         int32_t domain;
 
     public:
-        TimingMemRouter(uint32_t numPorts, uint64_t _latency, uint32_t _bytesPerCycle, uint32_t _processWidth, const g_string& name, const int32_t _domain)
+        TimingMemRouter(uint32_t numPorts, uint64_t _latency, uint32_t _bytesPerCycle, uint32_t _processWidth, const g_string& name, const int32_t _domain,
+                uint32_t _numVCs = 0, uint32_t _numVCClasses = 1, uint32_t _bufferDepth = 0, uint32_t _creditDelay = 0,
+                bool _creditEscape = false)
             : MemRouter(numPorts, name), latency(_latency), bytesPerCycle(_bytesPerCycle),
-              procDisp(_processWidth), lastOutDoneCycle(numPorts, 0), domain(_domain)
-        {}
+              procDisp(_processWidth), lastOutDoneCycle(numPorts, 0),
+              numVCs(_numVCs), vcsPerClass(_numVCs / _numVCClasses), bufferDepth(_bufferDepth), creditDelay(_creditDelay),
+              credits(numPorts * _numVCs * _bufferDepth, {0, 0}), creditEscape(_creditEscape), creditEscapeWarned(false), trackLoad(false), portLoads(numPorts, 0), domain(_domain)
+        {
+            if (numVCs && (vcsPerClass == 0 || numVCs % _numVCClasses))
+                panic("%s: %u VCs cannot be evenly split into %u VC classes", name.c_str(), numVCs, _numVCClasses);
+            if (numVCs && bufferDepth == 0) panic("%s: VC buffer depth must be positive", name.c_str());
+        }
 
         void initStats(AggregateStat* parentStat);
 
-        uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, bool lastHop, bool piggyback, uint32_t srcCoreId);
+        uint64_t transfer(uint64_t cycle, uint64_t size, uint32_t portId, uint32_t vcClass, bool lastHop, bool piggyback, MemMsgClass msgClass,
+                uint32_t srcCoreId);
+
+        uint32_t getPortLoad(uint32_t portId) {
+            assert(portId < numPorts);
+            return portLoads[portId];
+        }
+
+        void enableLoadTracking();
 
         bool needsCSim() const { return true; }
 
-        uint64_t simulate(uint32_t portId, uint32_t procDelay, uint32_t outDelay, bool lastHop, bool piggyback, uint64_t startCycle);
+        uint64_t simulate(uint32_t portId, uint32_t vcClass, uint32_t procDelay, uint32_t outDelay, bool lastHop, bool piggyback,
+                uint64_t startCycle, MemRouterFlowState* fs);
+
+    private:
+        // Get a credit for the slot that frees up first among the VCs of the class at the port. Return the cycle the
+        // credit is available, and the taken slot in slot. If the slot release is still pending, return the estimated
+        // cycle without taking it, unless force is set.
+        uint64_t acquireCredit(uint32_t portId, uint32_t vcClass, uint64_t cycle, bool force, MemRouterCreditSlot** slot);
+
+        // Whether the packet still owns the upstream slot it took.
+        static inline bool ownsCredit(const MemRouterFlowState* fs) {
+            return fs->credit && fs->credit->owner == fs->creditOwner;
+        }
+
+        // Called at the end of each phase.
+        void updatePortLoads();
 };
 
 #endif  // MEM_ROUTER_H_
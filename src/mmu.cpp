@@ -0,0 +1,145 @@
+#include "mmu.h"
+#include "bithacks.h"
+#include "core.h"
+#include "numa_map.h"
+#include "zsim.h"
+
+TLBArray::TLBArray(uint32_t numEntries, uint32_t _numWays)
+    : numWays(_numWays), setMask(numEntries / _numWays - 1), curUse(0)
+{
+    if (numWays == 0 || numEntries % numWays != 0 || !isPow2(numEntries / numWays)) {
+        panic("TLB with %d entries and %d ways must have a power-of-two number of sets", numEntries, numWays);
+    }
+    entries = gm_memalign<Entry>(CACHE_LINE_BYTES, numEntries);
+    for (uint32_t i = 0; i < numEntries; i++) entries[i] = {(Address)-1L, 0};
+}
+
+void TLBArray::insert(Address tag) {
+    Entry* set = &entries[(tag & setMask) * numWays];
+    Entry* victim = &set[0];
+    for (uint32_t w = 1; w < numWays; w++) {
+        if (set[w].lastUse < victim->lastUse) victim = &set[w];
+    }
+    victim->tag = tag;
+    victim->lastUse = ++curUse;
+}
+
+MMU::MMU(const Params& _params, uint32_t _coreIdx, const g_string& _name)
+    : params(_params), coreIdx(_coreIdx), hugeShift(zinfo->numaMap ? zinfo->numaMap->getHugePageShift() : 0),
+      levelBits(ilog2(zinfo->pageSize) - 3), name(_name)
+{
+    itlb = new TLBArray(params.itlbEntries, params.itlbWays);
+    dtlb = new TLBArray(params.dtlbEntries, params.dtlbWays);
+    itlbHuge = hugeShift ? new TLBArray(params.itlbHugeEntries, params.itlbHugeWays) : nullptr;
+    dtlbHuge = hugeShift ? new TLBArray(params.dtlbHugeEntries, params.dtlbHugeWays) : nullptr;
+    stlb = new TLBArray(params.stlbEntries, params.stlbWays);
+    pwc[0] = nullptr;  // leaf entries are cached in the TLBs
+    for (uint32_t l = 1; l < LEVELS; l++) pwc[l] = new TLBArray(params.pwcEntries, params.pwcEntries);
+}
+
+void MMU::initStats(AggregateStat* parentStat) {
+    AggregateStat* mmuStat = new AggregateStat();
+    mmuStat->init(name.c_str(), "TLB stats");
+    profITLBMisses.init("itlbMisses", "L1 instruction TLB misses");
+    profDTLBMisses.init("dtlbMisses", "L1 data TLB misses");
+    profSTLBHits.init("stlbHits", "L2 TLB hits");
+    profWalks.init("walks", "Page walks (L2 TLB misses)");
+    profHugeWalks.init("hugeWalks", "Page walks to huge pages");
+    profPWCHits.init("pwcHits", "Page walks that skipped upper levels on page-walk cache hits");
+    profWalkAccesses.init("walkAccesses", "Page table entries read by walks");
+    profWalkCycles.init("walkCycles", "Cycles spent in page walks");
+    profWalkLatency.init("walkLatency", "Page walk latency histogram (log2(cycles) bins)", 16);
+    mmuStat->append(&profITLBMisses);
+    mmuStat->append(&profDTLBMisses);
+    mmuStat->append(&profSTLBHits);
+    mmuStat->append(&profWalks);
+    mmuStat->append(&profHugeWalks);
+    mmuStat->append(&profPWCHits);
+    mmuStat->append(&profWalkAccesses);
+    mmuStat->append(&profWalkCycles);
+    mmuStat->append(&profWalkLatency);
+
+    // Misses per thousand instructions of the core, in thousandths
+    auto mpki = [this](const Counter& misses) {
+        uint64_t instrs = zinfo->cores[coreIdx]->getInstrs();
+        return instrs ? 1000 * 1000 * misses.get() / instrs : 0;
+    };
+    auto itlbMPKIStat = makeLambdaStat([this, mpki]() { return mpki(profITLBMisses); });
+    itlbMPKIStat->init("itlbMPKI", "L1 instruction TLB misses per 1000 instructions (x1000)");
+    auto dtlbMPKIStat = makeLambdaStat([this, mpki]() { return mpki(profDTLBMisses); });
+    dtlbMPKIStat->init("dtlbMPKI", "L1 data TLB misses per 1000 instructions (x1000)");
+    auto stlbMPKIStat = makeLambdaStat([this, mpki]() { return mpki(profWalks); });
+    stlbMPKIStat->init("stlbMPKI", "L2 TLB misses per 1000 instructions (x1000)");
+    mmuStat->append(itlbMPKIStat);
+    mmuStat->append(dtlbMPKIStat);
+    mmuStat->append(stlbMPKIStat);
+    parentStat->append(mmuStat);
+}
+
+uint32_t MMU::translate(Address vLineAddr, bool ifetch, Address* walkLines, uint32_t* numWalkLines) {
+    *numWalkLines = 0;
+    const Address vpn = vLineAddr >> (pageBits - lineBits);
+    const Address tag = (procMask | vLineAddr) >> (pageBits - lineBits);  // same as NUMAMap page addresses
+    const Address hugeTag = tag >> hugeShift;
+
+    TLBArray* l1 = ifetch ? itlb : dtlb;
+    TLBArray* l1Huge = ifetch ? itlbHuge : dtlbHuge;
+    if (l1->lookup(tag) || (hugeShift && l1Huge->lookup(hugeTag))) return 0;
+    (ifetch ? profITLBMisses : profDTLBMisses).inc();
+
+    if (stlb->lookup(tag << 1)) {
+        profSTLBHits.inc();
+        l1->insert(tag);
+        return params.stlbLatency;
+    }
+    if (hugeShift && stlb->lookup((hugeTag << 1) | 1)) {
+        profSTLBHits.inc();
+        l1Huge->insert(hugeTag);
+        return params.stlbLatency;
+    }
+
+    // Page walk. Huge pages are mapped by level 1 entries.
+    const bool huge = hugeShift && zinfo->numaMap->isInHugePage(tag);
+    const uint32_t leaf = huge ? 1 : 0;
+    uint32_t top = LEVELS;  // levels below top are read
+    for (uint32_t l = leaf + 1; l < LEVELS; l++) {
+        if (pwc[l]->lookup(tag >> (levelBits * l))) {
+            top = l;
+            profPWCHits.inc();
+            break;
+        }
+    }
+
+    uint32_t n = 0;
+    for (uint32_t l = top; l-- > leaf;) {
+        Address tableLine = getTableLine(l, vpn);
+        if (zinfo->numaMap) zinfo->numaMap->allocateFromCore(tableLine << lineBits, coreIdx);
+        walkLines[n++] = procMask | tableLine;
+        if (l > leaf) pwc[l]->insert(tag >> (levelBits * l));
+    }
+    *numWalkLines = n;
+
+    if (huge) {
+        stlb->insert((hugeTag << 1) | 1);
+        l1Huge->insert(hugeTag);
+        profHugeWalks.inc();
+    } else {
+        stlb->insert(tag << 1);
+        l1->insert(tag);
+    }
+    profWalks.inc();
+    profWalkAccesses.inc(n);
+    return params.stlbLatency;
+}
+
+void MMU::walkDone(uint64_t cycles) {
+    profWalkCycles.inc(cycles);
+    profWalkLatency.inc(cycles ? MIN(15u, ilog2(cycles)) : 0);
+}
+
+Address MMU::getTableLine(uint32_t level, Address vpn) const {
+    // The tables of each level are laid out back to back, one page each, in a region above the 48-bit user address
+    // space. Entries are 8 bytes.
+    Address entry = vpn >> (levelBits * level);
+    return (1uL << (48 - lineBits)) | ((Address)level << (46 - lineBits)) | (entry >> (lineBits - 3));
+}
@@ -0,0 +1,105 @@
+#ifndef MMU_H_
+#define MMU_H_
+
+#include "g_std/g_string.h"
+#include "galloc.h"
+#include "memory_hierarchy.h"
+#include "stats.h"
+
+/* Set-associative array of translations with LRU replacement, tagged by page number (of any page size). */
+class TLBArray : public GlobAlloc {
+    private:
+        struct Entry {
+            Address tag;
+            uint64_t lastUse;
+        };
+        Entry* entries;
+        const uint32_t numWays;
+        const uint32_t setMask;
+        uint64_t curUse;
+
+    public:
+        TLBArray(uint32_t numEntries, uint32_t _numWays);
+
+        inline bool lookup(Address tag) {
+            Entry* set = &entries[(tag & setMask) * numWays];
+            for (uint32_t w = 0; w < numWays; w++) {
+                if (set[w].tag == tag) {
+                    set[w].lastUse = ++curUse;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void insert(Address tag);
+};
+
+/**
+ * Per-core address translation: split L1 TLBs for instructions and data, each with an array per page size, a unified
+ * L2 TLB, and page-walk caches for the upper levels of a 4-level radix page table.
+ *
+ * Translations are checked on filter cache misses, i.e., the filter array acts as a tiny TLB too. L1 TLB hits are
+ * overlapped with the L1 cache access; L1 misses pay the L2 TLB latency. L2 misses walk the page table, reading the
+ * entries not in the page-walk caches one after another through the L1 data cache, see FilterCache. Page
+ * tables live in a private region of each process address space, and are placed in NUMA nodes like data.
+ *
+ * Huge pages are the ones NUMAMap maps as such (sys.numaHugePageSize); all other pages are base pages (sys.pageSize).
+ * Entries are tagged with the process, so there is no need to flush them on context switches.
+ */
+class MMU : public GlobAlloc {
+    public:
+        static const uint32_t LEVELS = 4;
+
+        struct Params {
+            uint32_t itlbEntries, itlbWays;
+            uint32_t itlbHugeEntries, itlbHugeWays;
+            uint32_t dtlbEntries, dtlbWays;
+            uint32_t dtlbHugeEntries, dtlbHugeWays;
+            uint32_t stlbEntries, stlbWays;
+            uint32_t stlbLatency;
+            uint32_t pwcEntries;  // per cached level, fully associative
+        };
+
+    private:
+        const Params params;
+        const uint32_t coreIdx;
+        const uint32_t hugeShift;  // huge page size in base pages, as a shift; 0 without huge pages
+        const uint32_t levelBits;  // page number bits translated per page table level
+        g_string name;
+
+        TLBArray* itlb;
+        TLBArray* itlbHuge;
+        TLBArray* dtlb;
+        TLBArray* dtlbHuge;
+        TLBArray* stlb;  // tags have the huge page bit as LSB
+        TLBArray* pwc[LEVELS];  // caches the entries of levels 1 and up, i.e., the ones that point to tables
+
+        Counter profITLBMisses;
+        Counter profDTLBMisses;
+        Counter profSTLBHits;
+        Counter profWalks;
+        Counter profHugeWalks;
+        Counter profPWCHits;
+        Counter profWalkAccesses;
+        Counter profWalkCycles;
+        VectorCounter profWalkLatency;  // log2(cycles) bins
+
+    public:
+        MMU(const Params& _params, uint32_t _coreIdx, const g_string& _name);
+
+        void initStats(AggregateStat* parentStat);
+
+        // Translate the line of the calling process. Return the cycles the TLBs add to the access. On an L2 TLB miss,
+        // fill walkLines with the page table lines to read in order (with procMask), and set numWalkLines; the caller
+        // must issue them and report the walk latency with walkDone(). Otherwise, numWalkLines is 0.
+        uint32_t translate(Address vLineAddr, bool ifetch, Address* walkLines, uint32_t* numWalkLines);
+
+        void walkDone(uint64_t cycles);
+
+    private:
+        // Page table line that holds the entry of level for the base page number
+        Address getTableLine(uint32_t level, Address vpn) const;
+};
+
+#endif  // MMU_H_
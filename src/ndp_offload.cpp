@@ -0,0 +1,102 @@
+#include "ndp_offload.h"
+#include "numa_map.h"
+#include "scheduler.h"
+#include "zsim.h"
+
+//#define DEBUG(args...) info(args)
+#define DEBUG(args...)
+
+NDPOffload::NDPOffload(uint32_t _launchCycles, uint32_t _returnCycles)
+    : launchCycles(_launchCycles), returnCycles(_returnCycles)
+{
+    if (!zinfo->numaMap) panic("NDP offload requires a NUMA system");
+    futex_init(&lock);
+}
+
+void NDPOffload::initStats(AggregateStat* parentStat) {
+    AggregateStat* ndpStat = new AggregateStat();
+    ndpStat->init("ndpOffload", "Near-data offload stats");
+    profOffloads.init("offloads", "Offloaded regions");
+    profLocalOffloads.init("localOffloads", "Offloads already running on the node of their data");
+    profRemoteOffloads.init("remoteOffloads", "Offloads migrated to the node of their data");
+    profUnplacedOffloads.init("unplacedOffloads", "Offloads run in place, as their data page was not placed yet");
+    profNestedOffloads.init("nestedOffloads", "Offloads ignored, as the thread was already offloading");
+    profReturns.init("returns", "Offloads migrated back at their end");
+    profUnmatchedEnds.init("unmatchedEnds", "Offload ends ignored, as the thread was not offloading");
+    profStallCycles.init("stallCycles", "Cycles charged to cores for offload launches and returns");
+    profNodeOffloads.init("nodeOffloads", "Offloads per data node", zinfo->numaMap->getMaxNode() + 1);
+    ndpStat->append(&profOffloads);
+    ndpStat->append(&profLocalOffloads);
+    ndpStat->append(&profRemoteOffloads);
+    ndpStat->append(&profUnplacedOffloads);
+    ndpStat->append(&profNestedOffloads);
+    ndpStat->append(&profReturns);
+    ndpStat->append(&profUnmatchedEnds);
+    ndpStat->append(&profStallCycles);
+    ndpStat->append(&profNodeOffloads);
+    parentStat->append(ndpStat);
+}
+
+bool NDPOffload::begin(uint32_t pid, uint32_t tid, uint32_t cid, Address addr, g_vector<bool>& mask) {
+    NUMAMap* numaMap = zinfo->numaMap;
+    uint32_t node = numaMap->lookupNodeOfPage(numaMap->getPageAddress(addr));
+    uint64_t gid = (((uint64_t)pid) << 32) | tid;
+
+    futex_lock(&lock);
+    if (threads.find(gid) != threads.end()) {
+        futex_unlock(&lock);
+        profNestedOffloads.atomicInc();
+        return false;
+    }
+
+    ThreadState& ts = threads[gid];
+    ts.migrated = false;
+    profOffloads.inc();
+    if (node == NUMAMap::INVALID_NODE) {
+        profUnplacedOffloads.inc();
+    } else {
+        profNodeOffloads.inc(node);
+        if (cid < zinfo->numCores && numaMap->getNodeOfCore(cid) == node) {
+            profLocalOffloads.inc();
+        } else {
+            profRemoteOffloads.inc();
+            ts.migrated = true;
+        }
+    }
+    futex_unlock(&lock);
+    if (!ts.migrated) return false;
+
+    // Run on the cores of the node within the current mask, or on any of them if none is allowed
+    // NOTE: ts stays valid, only the thread itself inserts or erases its entry
+    ts.savedMask = zinfo->sched->getMask(pid, tid);
+    mask.assign(zinfo->numCores, false);
+    bool allowed = false;
+    for (uint32_t c = 0; c < zinfo->numCores; c++) {
+        if (numaMap->getNodeOfCore(c) == node && ts.savedMask[c]) mask[c] = allowed = true;
+    }
+    if (!allowed) {
+        for (uint32_t c = 0; c < zinfo->numCores; c++) mask[c] = numaMap->getNodeOfCore(c) == node;
+    }
+    DEBUG("[%u/%u] Offload to node %u for address 0x%lx", pid, tid, node, addr);
+    return true;
+}
+
+bool NDPOffload::end(uint32_t pid, uint32_t tid, g_vector<bool>& mask) {
+    uint64_t gid = (((uint64_t)pid) << 32) | tid;
+    futex_lock(&lock);
+    auto it = threads.find(gid);
+    if (it == threads.end()) {
+        futex_unlock(&lock);
+        profUnmatchedEnds.atomicInc();
+        return false;
+    }
+    bool migrated = it->second.migrated;
+    if (migrated) {
+        mask = it->second.savedMask;
+        profReturns.inc();
+    }
+    threads.erase(it);
+    futex_unlock(&lock);
+    DEBUG("[%u/%u] Offload end%s", pid, tid, migrated ? ", migrating back" : "");
+    return migrated;
+}
@@ -0,0 +1,67 @@
+#ifndef NDP_OFFLOAD_H_
+#define NDP_OFFLOAD_H_
+
+#include "g_std/g_unordered_map.h"
+#include "g_std/g_vector.h"
+#include "locks.h"
+#include "memory_hierarchy.h"
+#include "stats.h"
+
+/**
+ * Near-data offload of code regions to the cores of the NUMA node that owns their data.
+ *
+ * A thread marks an offload region with the OFFLOAD_BEGIN and OFFLOAD_END magic ops (see misc/hooks/zsim_hooks.h),
+ * giving the address of the data the region works on. At the beginning, the thread is restricted to the cores of the
+ * node that owns the page of that address, and migrated there through the scheduler if it runs elsewhere. At the end,
+ * its original mask is restored, and it migrates back. Each migration charges a fixed launch or return latency to the
+ * core the thread joins next.
+ *
+ * Offloads do not nest. The node is looked up without placing the page, so hints to untouched pages run in place.
+ */
+class NDPOffload : public GlobAlloc {
+    private:
+        const uint32_t launchCycles;
+        const uint32_t returnCycles;
+
+        struct ThreadState {
+            g_vector<bool> savedMask;  // mask to restore at the end, if migrated
+            bool migrated;
+        };
+        g_unordered_map<uint64_t, ThreadState> threads;  // offloading threads, indexed by ((pid << 32) | tid)
+        lock_t lock;
+
+        Counter profOffloads;
+        Counter profLocalOffloads;
+        Counter profRemoteOffloads;
+        Counter profUnplacedOffloads;
+        Counter profNestedOffloads;
+        Counter profReturns;
+        Counter profUnmatchedEnds;
+        Counter profStallCycles;
+        VectorCounter profNodeOffloads;
+
+    public:
+        NDPOffload(uint32_t _launchCycles, uint32_t _returnCycles);
+
+        void initStats(AggregateStat* parentStat);
+
+        /* Called by the thread itself. cid is the core it runs on, or -1 if it has left its core. */
+
+        // Begin an offload to the node of the data at addr. Return true and set the new mask if the thread must migrate.
+        bool begin(uint32_t pid, uint32_t tid, uint32_t cid, Address addr, g_vector<bool>& mask);
+
+        // End the offload of the thread. Return true and set the restored mask if the thread must migrate back.
+        bool end(uint32_t pid, uint32_t tid, g_vector<bool>& mask);
+
+        uint32_t getLaunchCycles() const { return launchCycles; }
+        uint32_t getReturnCycles() const { return returnCycles; }
+
+        // Record the cycles charged to a core for a launch or return.
+        void stalled(uint64_t cycles) { profStallCycles.atomicInc(cycles); }
+
+        // Use glob mem.
+        using GlobAlloc::operator new;
+        using GlobAlloc::operator delete;
+};
+
+#endif  // NDP_OFFLOAD_H_
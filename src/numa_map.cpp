@@ -1,4 +1,5 @@
 #include <bitset>
+#include <sys/mman.h>
 #include "numa_map.h"
 #include "constants.h"
 #include "g_std/g_map.h"
@@ -22,6 +23,18 @@ class PageMap : public GlobAlloc {
             return chunk && chunk->isPresent(pageAddr);
         }
 
+        bool anyPresent(Address pageAddr, size_t pageCount) {
+            while (pageCount > 0) {
+                Address nextPageAddr = nextChunkPageAddr(pageAddr);
+                size_t cnt = std::min(pageCount, nextPageAddr - pageAddr);
+                auto chunk = findChunk(pageAddr);
+                if (chunk && chunk->anyPresent(pageAddr, cnt)) return true;
+                pageCount -= cnt;
+                pageAddr = nextPageAddr;
+            }
+            return false;
+        }
+
         uint32_t get(const Address pageAddr) {
             auto chunk = findChunk(pageAddr);
             return chunk ? chunk->lookup(pageAddr) : NUMAMap::INVALID_NODE;
@@ -42,6 +55,55 @@ class PageMap : public GlobAlloc {
             return ignoredCount;
         }
 
+        void getMappedRanges(const Address beginPageAddr, const Address endPageAddr, g_vector<NUMAMap::MappedRange>& ranges) {
+            futex_lock(&futex);
+            for (auto& kv : pageMaps) {
+                if (((kv.first + 1) << CHUNK_BITS) <= beginPageAddr || (kv.first << CHUNK_BITS) >= endPageAddr) continue;
+                kv.second.mappedRanges(beginPageAddr, endPageAddr, ranges);
+            }
+            futex_unlock(&futex);
+        }
+
+        // Stats. Walk all chunks, so only call when dumping stats.
+
+        uint64_t getNumRanges() {
+            uint64_t ranges = 0;
+            futex_lock(&futex);
+            for (auto& kv : pageMaps) ranges += kv.second.numRanges();
+            futex_unlock(&futex);
+            return ranges;
+        }
+
+        uint64_t getPagesOfNode(const uint32_t node) {
+            uint64_t pages = 0;
+            futex_lock(&futex);
+            for (auto& kv : pageMaps) pages += kv.second.pagesOfNode(node);
+            futex_unlock(&futex);
+            return pages;
+        }
+
+        // Approximate, counting the chunk bitmaps and the range tree nodes.
+        uint64_t getMemoryUsage() {
+            const uint64_t rangeBytes = sizeof(std::pair<Address, PageRange>) + 4 * sizeof(void*);  // plus rb-tree node
+            futex_lock(&futex);
+            uint64_t chunks = pageMaps.size();
+            futex_unlock(&futex);
+            return sizeof(PageMap) + chunks * (sizeof(PageChunk) + 2 * sizeof(void*)) + getNumRanges() * rangeBytes;
+        }
+
+        void move(Address pageAddr, size_t pageCount, const uint32_t node) {
+            if (pageCount == 0) return;
+            assert(node != NUMAMap::INVALID_NODE);
+            DEBUG("[PageMap] move %lx (%lu) -> %u", pageAddr, pageCount, node);
+            while (pageCount > 0) {
+                Address nextPageAddr = nextChunkPageAddr(pageAddr);
+                size_t cnt = std::min(pageCount, nextPageAddr - pageAddr);
+                findChunk(pageAddr, true)->move(pageAddr, cnt, node);
+                pageCount -= cnt;
+                pageAddr = nextPageAddr;
+            }
+        }
+
         void remove(Address pageAddr, size_t pageCount) {
             if (pageCount == 0) return;
             DEBUG("[PageMap] remove %lx (%lu)", pageAddr, pageCount);
@@ -118,6 +180,14 @@ class PageMap : public GlobAlloc {
                 return p;
             }
 
+            bool anyPresent(Address pageAddr, size_t pageCount) {
+                bool p = false;
+                futex_lock(&futex);
+                for (size_t i = 0; i < pageCount && !p; i++) p = pmap[(pageAddr & CHUNK_MASK) + i];
+                futex_unlock(&futex);
+                return p;
+            }
+
             uint32_t lookup(Address pageAddr) {
                 // Look up in chunk to get the node for the page.
                 uint32_t node = NUMAMap::INVALID_NODE;
@@ -130,12 +200,13 @@ class PageMap : public GlobAlloc {
                 return node;
             }
 
-            size_t add(Address pageAddr, size_t pageCount, const uint32_t node) {
+            // The Locked variants must be called with the chunk lock held.
+
+            size_t addLocked(Address pageAddr, size_t pageCount, const uint32_t node) {
                 // Add to chunk and keep the order, and merge if necessary.
                 // Return number of pages that already exist and thus are ignored.
                 size_t ignoredCount = 0;
                 auto newpr = PageRange(pageAddr, pageCount, node);
-                futex_lock(&futex);
                 for (size_t i = 0; i < pageCount; i++) {
                     pmap.set((pageAddr & CHUNK_MASK) + i);
                 }
@@ -213,14 +284,12 @@ class PageMap : public GlobAlloc {
                 // Push to the end.
                 if (newpr.count()) safeInsertBefore(it, newpr);
                 verify();
-                futex_unlock(&futex);
                 return ignoredCount;
             }
 
-            void remove(Address pageAddr, size_t pageCount) {
+            void removeLocked(Address pageAddr, size_t pageCount) {
                 // Remove lazily from chunk, and split if necessary.
                 auto rempr = PageRange(pageAddr, pageCount, NUMAMap::INVALID_NODE, true);
-                futex_lock(&futex);
                 for (size_t i = 0; i < pageCount; i++) {
                     pmap.set((pageAddr & CHUNK_MASK) + i, false);
                 }
@@ -279,7 +348,55 @@ class PageMap : public GlobAlloc {
                     }
                 }
                 verify();
+            }
+
+            size_t add(Address pageAddr, size_t pageCount, const uint32_t node) {
+                futex_lock(&futex);
+                size_t ignoredCount = addLocked(pageAddr, pageCount, node);
+                futex_unlock(&futex);
+                return ignoredCount;
+            }
+
+            void remove(Address pageAddr, size_t pageCount) {
+                futex_lock(&futex);
+                removeLocked(pageAddr, pageCount);
+                futex_unlock(&futex);
+            }
+
+            // Remove and add back under the same lock, so that concurrent lookups see either the old or the new node.
+            void move(Address pageAddr, size_t pageCount, const uint32_t node) {
+                futex_lock(&futex);
+                removeLocked(pageAddr, pageCount);
+                size_t ignoredCount = addLocked(pageAddr, pageCount, node);
+                assert(ignoredCount == 0);
+                futex_unlock(&futex);
+            }
+
+            size_t numRanges() {
+                futex_lock(&futex);
+                size_t ranges = chunk.size();
+                futex_unlock(&futex);
+                return ranges;
+            }
+
+            void mappedRanges(const Address beginPageAddr, const Address endPageAddr, g_vector<NUMAMap::MappedRange>& ranges) {
+                futex_lock(&futex);
+                for (const auto& kv : chunk) {
+                    const auto& pr = kv.second;
+                    if (pr.removed) continue;
+                    Address begin = std::max(pr.pageAddrBegin, beginPageAddr);
+                    Address end = std::min(pr.pageAddrEnd, endPageAddr);
+                    if (begin < end) ranges.push_back({begin, end - begin, pr.node});
+                }
+                futex_unlock(&futex);
+            }
+
+            uint64_t pagesOfNode(const uint32_t node) {
+                uint64_t pages = 0;
+                futex_lock(&futex);
+                for (const auto& kv : chunk) if (kv.second.node == node && !kv.second.removed) pages += kv.second.count();
                 futex_unlock(&futex);
+                return pages;
             }
 
             void verify() const {
@@ -377,15 +494,23 @@ class PageMap : public GlobAlloc {
 
 constexpr uint32_t NUMAMap::INVALID_NODE;
 
-NUMAMap::NUMAMap(const char* _patchRoot, const uint32_t numCores)
+NUMAMap::NUMAMap(const char* _patchRoot, const uint32_t numCores, const uint32_t _hugePageShift)
     : patchRoot(_patchRoot == nullptr ? "" : _patchRoot),
-      coreNodeMap(numCores, INVALID_NODE), pageNodeMap(new PageMap())
+      coreNodeMap(numCores, INVALID_NODE), pageNodeMap(new PageMap()), hugePageShift(_hugePageShift), hugePagesMapped(0),
+      replicaPages(0), maxReplicaPages(0)
 {
     // Use patched root to figure out NUMA core map.
     if (patchRoot.empty()) panic("NUMA needs to patch the root path in the main process!");
     uint32_t node = 0;
     while (parseBitmap(node) == 0 && node < 1024 /*avoid inf loop*/) { node++; }
     maxNode = node - 1;
+    nodeDistances.resize((maxNode + 1) * (maxNode + 1));
+    for (node = 0; node <= maxNode; node++) {
+        if (parseDistances(node) != 0) {
+            warn("No valid NUMA distances for node %u in patched root, assuming 20 to other nodes", node);
+            for (uint32_t n = 0; n <= maxNode; n++) nodeDistances[node * (maxNode + 1) + n] = (n == node) ? 10 : 20;
+        }
+    }
     for (uint32_t cid = 0; cid < numCores; cid++) {
         if (coreNodeMap[cid] == INVALID_NODE) {
             warn("Core %u has no associated NUMA node", cid);
@@ -393,6 +518,42 @@ NUMAMap::NUMAMap(const char* _patchRoot, const uint32_t numCores)
     }
 
     futex_init(&lock);
+    futex_init(&hugeLock);
+    futex_init(&replicaLock);
+
+    hugeLeaves = nullptr;
+    if (hugePageShift) {
+        const uint32_t hugeBits = ilog2(zinfo->pageSize) + hugePageShift;
+        if (hugeBits >= 48) panic("NUMA huge pages (2^%u bytes) must be smaller than the address space", hugeBits);
+        hugeProcShift = 64 - hugeBits;
+        hugeRegionBits = 48 - hugeBits;
+        uint64_t numLeaves = (((uint64_t)zinfo->numProcs << hugeRegionBits) + (1uL << HUGE_LEAF_BITS) - 1) >> HUGE_LEAF_BITS;
+        hugeLeaves = gm_calloc<volatile uint64_t*>(numLeaves);
+    }
+}
+
+void NUMAMap::initStats(AggregateStat* parentStat) {
+    AggregateStat* numaStat = new AggregateStat();
+    numaStat->init("numa", "NUMA memory map stats");
+    auto nodePagesStat = makeLambdaVectorStat([this](uint32_t n) { return pageNodeMap->getPagesOfNode(n); }, maxNode + 1);
+    nodePagesStat->init("nodePages", "Mapped pages on each node");
+    profBaseAllocs.init("baseAllocs", "Base pages placed on first touch");
+    profHugeAllocs.init("hugeAllocs", "Huge pages placed on first touch");
+    profHugeSplits.init("hugeSplits", "Huge pages split by partial unmaps or placements");
+    auto hugePagesStat = makeLambdaStat([this]() { return hugePagesMapped; });
+    hugePagesStat->init("hugePages", "Currently mapped huge pages");
+    auto rangesStat = makeLambdaStat([this]() { return pageNodeMap->getNumRanges(); });
+    rangesStat->init("pageRanges", "Page ranges in the page map, including unmapped ones kept for writebacks");
+    auto mapBytesStat = makeLambdaStat([this]() { return pageNodeMap->getMemoryUsage(); });
+    mapBytesStat->init("mapBytes", "Approximate simulator memory used by the page map");
+    numaStat->append(nodePagesStat);
+    numaStat->append(&profBaseAllocs);
+    numaStat->append(&profHugeAllocs);
+    numaStat->append(&profHugeSplits);
+    numaStat->append(hugePagesStat);
+    numaStat->append(rangesStat);
+    numaStat->append(mapBytesStat);
+    parentStat->append(numaStat);
 }
 
 uint32_t NUMAMap::getNodeOfPage(const Address pageAddr) {
@@ -401,6 +562,22 @@ uint32_t NUMAMap::getNodeOfPage(const Address pageAddr) {
     return node;
 }
 
+uint32_t NUMAMap::lookupNodeOfPage(const Address pageAddr) {
+    return pageNodeMap->get(pageAddr);
+}
+
+void NUMAMap::getMappedRanges(const Address beginPageAddr, const Address endPageAddr, g_vector<MappedRange>& ranges) {
+    pageNodeMap->getMappedRanges(beginPageAddr, endPageAddr, ranges);
+}
+
+// Whether the aligned huge page region of the virtual address lies within mapped memory of this process. Like THP,
+// regions that span beyond their VMA are placed page by page. Page table lines, above the user address space, are
+// never mapped. msync() fails with ENOMEM on unmapped ranges, and MS_ASYNC is otherwise a no-op.
+static bool isHugeRegionMapped(const Address addr, const uint32_t hugeBits) {
+    const Address begin = addr & ~((1uL << hugeBits) - 1);
+    return msync(reinterpret_cast<void*>(begin), 1uL << hugeBits, MS_ASYNC) == 0;
+}
+
 void NUMAMap::allocateFromCore(const Address addr, const uint32_t cid) {
     auto pageAddr = getPageAddress(addr);
     if (unlikely(!pageNodeMap->isPresent(pageAddr))) {
@@ -408,20 +585,197 @@ void NUMAMap::allocateFromCore(const Address addr, const uint32_t cid) {
         uint32_t pid = zinfo->sched->getScheduledPid(cid);
         uint32_t tid = zinfo->sched->getScheduledTid(cid);
         assert_msg(pid != -1u && tid != -1u, "Core %u has no thread running! Who is allocating the line?", cid);
-        addPagesThreadPolicy(pageAddr, 1, pid, tid, cid);  // adding pages could race
+        Address hugePageAddr = pageAddr >> hugePageShift;
+        if (hugePageShift && isHugePageEligible(hugePageAddr) && isHugeRegionMapped(addr, pageBits + hugePageShift)) {
+            // Place the whole huge page.
+            addPagesThreadPolicy(hugePageAddr << hugePageShift, 1uL << hugePageShift, pid, tid, cid);  // adding pages could race
+            futex_lock(&hugeLock);
+            auto it = hugePageStates.find(hugePageAddr);
+            if (it == hugePageStates.end()) {
+                hugePageStates[hugePageAddr] = HUGE_MAPPED;
+                setHugeMapped(hugePageAddr, true);
+                hugePagesMapped++;
+                profHugeAllocs.inc();
+            }
+            futex_unlock(&hugeLock);
+        } else {
+            addPagesThreadPolicy(pageAddr, 1, pid, tid, cid);  // adding pages could race
+            profBaseAllocs.atomicInc();
+        }
         assert(pageNodeMap->isPresent(pageAddr));
     }
 }
 
 size_t NUMAMap::addPagesToNode(const Address pageAddr, const size_t pageCount, const uint32_t node) {
+    splitHugePages(pageAddr, pageCount, false);
     return pageNodeMap->add(pageAddr, pageCount, node);
 }
 
 void NUMAMap::removePages(const Address pageAddr, const size_t pageCount) {
+    splitHugePages(pageAddr, pageCount, true);
+    removeReplicas(pageAddr, pageCount);
     pageNodeMap->remove(pageAddr, pageCount);
 }
 
+void NUMAMap::movePagesToNode(const Address pageAddr, const size_t pageCount, const uint32_t node) {
+    splitHugePages(pageAddr, pageCount, false);
+    removeReplicas(pageAddr, pageCount);
+    pageNodeMap->move(pageAddr, pageCount, node);
+}
+
+bool NUMAMap::addReplica(const Address pageAddr, const uint32_t node) {
+    assert_msg(maxNode < 64, "Page replication supports up to 64 NUMA nodes");
+    assert(node <= maxNode);
+    uint32_t home = pageNodeMap->get(pageAddr);
+    if (home == INVALID_NODE || home == node) return false;
+    bool added = false;
+    futex_lock(&replicaLock);
+    uint64_t& replicas = pageReplicaMap[pageAddr];
+    if (!(replicas & (1uL << node))) {
+        replicas |= 1uL << node;
+        replicaPages++;
+        if (replicaPages > maxReplicaPages) maxReplicaPages = replicaPages;
+        added = true;
+    }
+    futex_unlock(&replicaLock);
+    return added;
+}
+
+uint64_t NUMAMap::lookupReplicas(const Address pageAddr, bool collapse) {
+    uint64_t replicas = 0;
+    futex_lock(&replicaLock);
+    auto it = pageReplicaMap.find(pageAddr);
+    if (it != pageReplicaMap.end()) {
+        replicas = it->second;
+        if (collapse) {
+            replicaPages -= __builtin_popcountl(replicas);
+            pageReplicaMap.erase(it);
+        }
+    }
+    futex_unlock(&replicaLock);
+    return replicas;
+}
+
+void NUMAMap::removeReplicas(const Address pageAddr, const size_t pageCount) {
+    if (likely(!replicaPages)) return;
+    futex_lock(&replicaLock);
+    if (pageCount < pageReplicaMap.size()) {
+        for (Address p = pageAddr; p < pageAddr + pageCount; p++) {
+            auto it = pageReplicaMap.find(p);
+            if (it == pageReplicaMap.end()) continue;
+            replicaPages -= __builtin_popcountl(it->second);
+            pageReplicaMap.erase(it);
+        }
+    } else {
+        for (auto it = pageReplicaMap.begin(); it != pageReplicaMap.end();) {
+            if (it->first >= pageAddr && it->first < pageAddr + pageCount) {
+                replicaPages -= __builtin_popcountl(it->second);
+                it = pageReplicaMap.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+    futex_unlock(&replicaLock);
+}
+
+bool NUMAMap::isInHugePage(const Address pageAddr) {
+    if (!hugePageShift) return false;
+    const uint64_t bit = getHugeBit(pageAddr >> hugePageShift);
+    if (bit == -1uL) return false;
+    const volatile uint64_t* leaf = hugeLeaves[bit >> HUGE_LEAF_BITS];
+    return leaf && ((leaf[(bit & ((1uL << HUGE_LEAF_BITS) - 1)) / 64] >> (bit % 64)) & 1);
+}
+
+void NUMAMap::setHugeMapped(const Address hugePageAddr, bool mapped) {
+    const uint64_t bit = getHugeBit(hugePageAddr);
+    assert(bit != -1uL);  // not eligible
+    volatile uint64_t* leaf = hugeLeaves[bit >> HUGE_LEAF_BITS];
+    if (!leaf) {
+        if (!mapped) return;
+        leaf = gm_calloc<uint64_t>((1uL << HUGE_LEAF_BITS) / 64);
+        hugeLeaves[bit >> HUGE_LEAF_BITS] = leaf;  // zeroed before published
+    }
+    volatile uint64_t& word = leaf[(bit & ((1uL << HUGE_LEAF_BITS) - 1)) / 64];
+    if (mapped) word |= 1uL << (bit % 64);
+    else word &= ~(1uL << (bit % 64));
+}
+
+bool NUMAMap::isHugePageEligible(const Address hugePageAddr) {
+    if (getHugeBit(hugePageAddr) == -1uL) return false;
+    futex_lock(&hugeLock);
+    auto it = hugePageStates.find(hugePageAddr);
+    bool eligible = it == hugePageStates.end() || it->second == HUGE_MAPPED;
+    futex_unlock(&hugeLock);
+    return eligible;
+}
+
+void NUMAMap::splitHugePages(const Address pageAddr, const size_t pageCount, bool unmap) {
+    if (!hugePageShift || !pageCount) return;
+    const Address mask = (1uL << hugePageShift) - 1;
+    const Address first = pageAddr >> hugePageShift;
+    const Address last = (pageAddr + pageCount - 1) >> hugePageShift;
+    const bool firstPartial = (pageAddr & mask) || (first == last && ((pageAddr + pageCount) & mask));
+    const bool lastPartial = ((pageAddr + pageCount) & mask);
+
+    auto split = [this](Address h) {
+        auto it = hugePageStates.find(h);
+        if (it == hugePageStates.end()) {
+            hugePageStates[h] = HUGE_SPLIT;
+        } else if (it->second == HUGE_MAPPED) {
+            it->second = HUGE_SPLIT;
+            setHugeMapped(h, false);
+            hugePagesMapped--;
+            profHugeSplits.inc();
+            DEBUG("[NUMAMap] split huge page %lx", h << hugePageShift);
+        }
+    };
+
+    futex_lock(&hugeLock);
+    if (firstPartial) split(first);
+    if (lastPartial && last != first) split(last);
+
+    if (unmap) {
+        // Fully unmapped regions can be placed as huge pages again.
+        const Address begin = firstPartial ? first + 1 : first;
+        const Address end = lastPartial ? last : last + 1;
+        auto forget = [this](g_unordered_map<Address, HugePageState>::iterator it) {
+            if (it->second == HUGE_MAPPED) {
+                setHugeMapped(it->first, false);
+                hugePagesMapped--;
+            }
+            return hugePageStates.erase(it);
+        };
+        // So can partially unmapped regions left with no other mapped pages, e.g., unmapped page by page.
+        auto forgetIfEmpty = [&](Address h) {
+            const Address regionBegin = h << hugePageShift;
+            const Address regionEnd = (h + 1) << hugePageShift;
+            const Address unmapBegin = std::max(pageAddr, regionBegin);
+            const Address unmapEnd = std::min(pageAddr + pageCount, regionEnd);
+            if (pageNodeMap->anyPresent(regionBegin, unmapBegin - regionBegin)) return;
+            if (pageNodeMap->anyPresent(unmapEnd, regionEnd - unmapEnd)) return;
+            auto it = hugePageStates.find(h);
+            if (it != hugePageStates.end()) forget(it);
+        };
+        if (firstPartial) forgetIfEmpty(first);
+        if (lastPartial && last != first) forgetIfEmpty(last);
+        if (begin < end && end - begin < hugePageStates.size()) {
+            for (Address h = begin; h < end; h++) {
+                auto it = hugePageStates.find(h);
+                if (it != hugePageStates.end()) forget(it);
+            }
+        } else if (begin < end) {
+            for (auto it = hugePageStates.begin(); it != hugePageStates.end();) {
+                if (it->first >= begin && it->first < end) it = forget(it);
+                else it++;
+            }
+        }
+    }
+    futex_unlock(&hugeLock);
+}
+
 size_t NUMAMap::addPagesThreadPolicy(const Address pageAddr, const size_t pageCount, const uint32_t pid, const uint32_t tid, const uint32_t cid, NUMAPolicy* policy) {
+    splitHugePages(pageAddr, pageCount, false);
     if (!policy) {
         // Use the policy of the thread.
         uint64_t gid = (((uint64_t)pid) << 32) | tid;
@@ -531,6 +885,37 @@ int NUMAMap::parseBitmap(const uint32_t node) {
     return 0;
 }
 
+int NUMAMap::parseDistances(const uint32_t node) {
+    size_t fnLen = patchRoot.size() + 128;
+    char* fname = new char[fnLen];
+    snprintf(fname, fnLen, "%s/sys/devices/system/node/node%u/distance", patchRoot.c_str(), node);
+    FILE* f = fopen(fname, "r");
+    delete[] fname;
+    if (!f) return -1;
+
+    char* line = nullptr;
+    size_t len = 0;
+    int ret = getline(&line, &len, f);
+    fclose(f);
+    if (ret < 0) return -1;
+
+    // One distance per node, separated by spaces.
+    char* p = line;
+    for (uint32_t n = 0; n <= maxNode; n++) {
+        char* endp;
+        uint32_t d = strtoul(p, &endp, 10);
+        if (endp == p) {
+            free(line);
+            return -1;
+        }
+        nodeDistances[node * (maxNode + 1) + n] = d;
+        p = endp;
+    }
+
+    free(line);
+    return 0;
+}
+
 bool NUMAMap::tryAddPagesLocal(const Address pageAddr, const size_t pageCount, uint32_t node, bool strict, size_t& ignoredCount) {
     if (node == INVALID_NODE) {
         // This core does not belong to any node, i.e., memory-less node.
@@ -542,7 +927,7 @@ bool NUMAMap::tryAddPagesLocal(const Address pageAddr, const size_t pageCount, u
 
     if (strict) {
         // TODO: fail if not enough memory.
-        ignoredCount += addPagesToNode(pageAddr, pageCount, node);
+        ignoredCount += pageNodeMap->add(pageAddr, pageCount, node);
         return true;
     }
 
@@ -558,12 +943,19 @@ bool NUMAMap::tryAddPagesLocal(const Address pageAddr, const size_t pageCount, u
 bool NUMAMap::tryAddPagesInterleaved(const Address pageAddr, const size_t pageCount, NUMAPolicy* policy, size_t& ignoredCount) {
     assert(policy && policy->getMode() == MPOL_INTERLEAVE);
     size_t igcnt = 0;
-    for (size_t pa = pageAddr; pa < pageAddr + pageCount; pa++) {
+    for (size_t pa = pageAddr; pa < pageAddr + pageCount;) {
+        // Interleave huge pages as a whole.
+        size_t cnt = 1;
+        if (hugePageShift && isHugePageEligible(pa >> hugePageShift)) {
+            Address next = ((pa >> hugePageShift) + 1) << hugePageShift;
+            cnt = std::min(next, pageAddr + pageCount) - pa;
+        }
         bool success = false;
         for (size_t t = 0; t <= maxNode && !success; t++) {
-            success = tryAddPagesLocal(pa, 1, policy->updateNext(), true, igcnt);
+            success = tryAddPagesLocal(pa, cnt, policy->updateNext(), true, igcnt);
         }
         if (!success) return false;
+        pa += cnt;
     }
     assert(igcnt <= pageCount);
     ignoredCount += igcnt;
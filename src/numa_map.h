@@ -9,6 +9,7 @@
 #include "g_std/g_vector.h"
 #include "locks.h"
 #include "memory_hierarchy.h"
+#include "stats.h"
 #include "zsim.h"  // for lineBits
 
 class NUMAPolicy : public GlobAlloc {
@@ -63,8 +64,18 @@ class NUMAMap : public GlobAlloc {
     public:
         static constexpr uint32_t INVALID_NODE = -1u;
 
+        struct MappedRange {
+            Address pageAddr;
+            size_t pageCount;
+            uint32_t node;
+        };
+
     public:
-        NUMAMap(const char* _patchRoot, const uint32_t numCores);
+        // With huge pages, i.e., 2^_hugePageShift base pages, first-touch and interleaved placement work at huge page
+        // granularity. Partial unmaps and placements split the huge pages they cover into base pages.
+        NUMAMap(const char* _patchRoot, const uint32_t numCores, const uint32_t _hugePageShift = 0);
+
+        void initStats(AggregateStat* parentStat);
 
         uint32_t getMaxNode() const {
             return maxNode;
@@ -74,12 +85,24 @@ class NUMAMap : public GlobAlloc {
             return coreNodeMap[cid];
         }
 
+        // ACPI SLIT distance between nodes, 10 being local, from the patched root; 20 for remote nodes if unknown.
+        uint32_t getNodeDistance(const uint32_t node1, const uint32_t node2) const {
+            return nodeDistances[node1 * (maxNode + 1) + node2];
+        }
+
         uint32_t getNodeOfLineAddr(const Address lineAddr) {
             return getNodeOfPage(lineAddr >> (pageBits - lineBits));
         }
 
         uint32_t getNodeOfPage(const Address pageAddr);
 
+        // Same as getNodeOfPage(), but return INVALID_NODE if the page has not been allocated.
+        uint32_t lookupNodeOfPage(const Address pageAddr);
+
+        // Append the mapped (i.e., allocated and not removed) pages in [beginPageAddr, endPageAddr) to ranges, in no
+        // particular order. Walks the chunks of the page map, so keep the calls infrequent.
+        void getMappedRanges(const Address beginPageAddr, const Address endPageAddr, g_vector<MappedRange>& ranges);
+
         inline Address getPageAddress(const Address addr) {
             // NOTE: this must be equivalent to vAddr -> pLineAddr logic in filter_cache.h.
             return (addr >> pageBits) | (procMask >> (pageBits - lineBits));
@@ -92,6 +115,36 @@ class NUMAMap : public GlobAlloc {
         size_t addPagesToNode(const Address pageAddr, const size_t pageCount, const uint32_t node);
         // Remove given pages from NUMA map.
         void removePages(const Address pageAddr, const size_t pageCount);
+        // Move given pages to NUMA node, whether they exist or not. Drop their replicas. Concurrent lookups of each page
+        // see either its old or its new node.
+        void movePagesToNode(const Address pageAddr, const size_t pageCount, const uint32_t node);
+
+        // Huge page size in base pages, as a shift; 0 if disabled.
+        uint32_t getHugePageShift() const { return hugePageShift; }
+        // Whether the page is mapped as part of a huge page.
+        bool isInHugePage(const Address pageAddr);
+
+        /* Read-only page replication.
+         *
+         * The node of a page above is its home. A replicated page also has read-only copies on other nodes, which
+         * serve the reads from these nodes. The first write collapses the page back to its home.
+         */
+
+        // Add a replica of an allocated page on node. Return false if the page is absent or already on node.
+        bool addReplica(const Address pageAddr, const uint32_t node);
+        // Return the nodes of the page replicas, as a bitmask excluding the home; 0 if not replicated.
+        inline uint64_t getReplicasOfPage(const Address pageAddr) {
+            if (likely(!replicaPages)) return 0;
+            return lookupReplicas(pageAddr, false);
+        }
+        // Drop all replicas of the page. Return the nodes that held them.
+        inline uint64_t collapseReplicas(const Address pageAddr) {
+            if (likely(!replicaPages)) return 0;
+            return lookupReplicas(pageAddr, true);
+        }
+        // Footprint of replicas, in pages, excluding the home copies.
+        uint64_t getReplicaPages() const { return replicaPages; }
+        uint64_t getMaxReplicaPages() const { return maxReplicaPages; }
 
         // Add given pages according to the policy, from the thread running on the core. If no policy is given, use the policy of the thread.
         // Return the pages that already exist and thus are ignored.
@@ -139,12 +192,43 @@ class NUMAMap : public GlobAlloc {
         const g_string patchRoot;
         // Core-to-node map.
         g_vector<uint32_t> coreNodeMap;
+        // Node-to-node distances, row-major.
+        g_vector<uint32_t> nodeDistances;
 
         /* NUMA memory map. */
 
         // Page-to-node map.
         PageMap* pageNodeMap;
 
+        /* Transparent huge pages. */
+
+        // Huge page size in base pages, as a shift; 0 if disabled.
+        const uint32_t hugePageShift;
+        // Huge page regions that are mapped as huge pages, or split into base pages. Split regions, and the ones not
+        // in the map that are placed by explicit ranges, are placed page by page. Indexed by pageAddr >> hugePageShift.
+        enum HugePageState {HUGE_MAPPED, HUGE_SPLIT};
+        g_unordered_map<Address, HugePageState> hugePageStates;
+        uint64_t hugePagesMapped;
+        lock_t hugeLock;
+
+        // Lock-free copy of the HUGE_MAPPED states for isInHugePage(), called on every page walk. A bitmap over the
+        // huge page regions of each process's 48-bit user address space, in leaves of 2^HUGE_LEAF_BITS regions that
+        // are allocated on first use and never freed. Written with hugeLock held.
+        static constexpr uint32_t HUGE_LEAF_BITS = 15;
+        uint32_t hugeProcShift;  // of the process index in huge page region addresses
+        uint32_t hugeRegionBits;  // huge page regions per process, as a shift
+        volatile uint64_t* volatile* hugeLeaves;
+
+        Counter profHugeAllocs;
+        Counter profBaseAllocs;
+        Counter profHugeSplits;
+
+        // Page-to-replica nodes map, for replicated pages only.
+        g_unordered_map<Address, uint64_t> pageReplicaMap;
+        volatile uint64_t replicaPages;
+        uint64_t maxReplicaPages;
+        lock_t replicaLock;
+
         /* Thread NUMA policy. */
 
         g_unordered_map<uint64_t, NUMAPolicy> threadPolicy;  // indexed by ((pid << 32) | tid)
@@ -156,6 +240,9 @@ class NUMAMap : public GlobAlloc {
         // Implemented after lib numactl-2.0.11 libnuma.c:numa_parse_bitmap_v2().
         int parseBitmap(const uint32_t node);
 
+        // Parse /sys/devices/system/node/nodeN/distance to initialize the distances from the node.
+        int parseDistances(const uint32_t node);
+
         // NUMA "local allocation". See Linux doc set_mempolicy(2).
         // If strict, do not consider nearby nodes.
         // Return if success. Also update ignored page counts only if success.
@@ -164,6 +251,28 @@ class NUMAMap : public GlobAlloc {
         // Interleave the page allocation across the allowed NUMA nodes. Update the next node to allocate in the policy.
         // Return if success. Also update ignored page counts only if success.
         bool tryAddPagesInterleaved(const Address pageAddr, const size_t pageCount, NUMAPolicy* policy, size_t& ignoredCount);
+
+        uint64_t lookupReplicas(const Address pageAddr, bool collapse);
+
+        // Whether pages in the huge page region can be placed as a huge page.
+        bool isHugePageEligible(const Address hugePageAddr);
+
+        // Index of the huge page region in the bitmap of hugeLeaves, or -1 if outside the user address space.
+        inline uint64_t getHugeBit(const Address hugePageAddr) const {
+            const uint64_t proc = hugePageAddr >> hugeProcShift;
+            const Address region = hugePageAddr & ((1uL << hugeProcShift) - 1);
+            if (proc >= zinfo->numProcs || (region >> hugeRegionBits)) return -1uL;
+            return (proc << hugeRegionBits) | region;
+        }
+
+        // Set or clear the bit of the huge page region. Must be called with hugeLock held.
+        void setHugeMapped(const Address hugePageAddr, bool mapped);
+
+        // Split the huge page regions partially covered by given pages, and forget the fully covered ones if unmapped.
+        void splitHugePages(const Address pageAddr, const size_t pageCount, bool unmap);
+
+        // Drop the replicas of given pages.
+        void removeReplicas(const Address pageAddr, const size_t pageCount);
 };
 
 #endif  // NUMA_MAP_H_
@@ -0,0 +1,59 @@
+#include "numa_migration_cost.h"
+#include "core.h"
+#include "numa_map.h"
+#include "zsim.h"
+
+// Pending copies of each thread. Not glob, since tids are per process, like pendingStalls in zsim.cpp; the vectors
+// are only accessed by the thread itself.
+struct PendingCopy {
+    Address pageAddr;
+    uint32_t srcNode;
+};
+static g_vector<PendingCopy> pending[MAX_THREADS];
+
+NUMAMigrationCost::NUMAMigrationCost(uint32_t _pageCycles) : pageCycles(_pageCycles) {
+    if (!zinfo->numaMap) panic("NUMA migration cost requires a NUMA system");
+}
+
+void NUMAMigrationCost::initStats(AggregateStat* parentStat) {
+    AggregateStat* costStat = new AggregateStat();
+    costStat->init("numaMigration", "NUMA syscall page migration stats");
+    profPages.init("pages", "Pages copied by migration syscalls");
+    profLines.init("lines", "Lines copied by migration syscalls");
+    profCycles.init("cycles", "Cycles charged to threads for copies, including the per-page overhead");
+    costStat->append(&profPages);
+    costStat->append(&profLines);
+    costStat->append(&profCycles);
+    parentStat->append(costStat);
+}
+
+void NUMAMigrationCost::queue(uint32_t tid, Address pageAddr, uint32_t srcNode) {
+    pending[tid].push_back({pageAddr, srcNode});
+}
+
+void NUMAMigrationCost::charge(uint32_t tid, Core* core) {
+    if (likely(pending[tid].empty())) return;
+
+    NUMAMap* numaMap = zinfo->numaMap;
+    const Address aliasBit = 1uL << (ALIAS_BIT - pageBits);
+    const uint32_t linesPerPage = 1 << (pageBits - lineBits);
+    const uint64_t startCycles = core->getCycles();
+
+    g_vector<PendingCopy>& copies = pending[tid];
+    for (const PendingCopy& c : copies) {
+        Address srcPageAddr = c.pageAddr | aliasBit;
+        numaMap->addPagesToNode(srcPageAddr, 1, c.srcNode);
+        core->copyLines(srcPageAddr << (pageBits - lineBits), c.pageAddr << (pageBits - lineBits), linesPerPage);
+        numaMap->removePages(srcPageAddr, 1);  // still maps its cached lines
+    }
+    core->stall(copies.size() * pageCycles);
+
+    profPages.atomicInc(copies.size());
+    profLines.atomicInc(copies.size() * linesPerPage);
+    profCycles.atomicInc(core->getCycles() - startCycles);
+    copies.clear();
+}
+
+void NUMAMigrationCost::drop(uint32_t tid) {
+    pending[tid].clear();
+}
@@ -0,0 +1,53 @@
+#ifndef NUMA_MIGRATION_COST_H_
+#define NUMA_MIGRATION_COST_H_
+
+#include "constants.h"
+#include "g_std/g_vector.h"
+#include "memory_hierarchy.h"
+#include "stats.h"
+
+class Core;
+
+/**
+ * Cost of the page migrations that threads request with the mbind, move_pages and migrate_pages syscalls.
+ *
+ * The syscalls update NUMAMap right away, and queue the pages that changed node. When the thread gets back to its
+ * core, its core copies each page line by line through its L1 data cache: it reads the line of the old frame, which
+ * misses down to the memory of the old node, and then writes the line of the new frame, which invalidates the copies
+ * of the line cached by other cores, like a flush of the old mapping. Accesses are serialized, so the thread pays the
+ * full hierarchy and interconnect latency of each one. On top of that, the thread pays a fixed kernel overhead per
+ * page (unmap, TLB shootdown, and remap).
+ *
+ * Only the pages of the calling process are covered, as move_pages and migrate_pages only support pid 0.
+ *
+ * The old frame is an alias page placed on the old node, in a region of each process address space above the user
+ * and page table ones. Lines cached with the old mapping keep their original parents until evicted, see
+ * CoherentParentMap.
+ */
+class NUMAMigrationCost : public GlobAlloc {
+    private:
+        static const uint32_t ALIAS_BIT = 49;  // virtual address bit of the old frame aliases
+
+        const uint32_t pageCycles;
+
+        Counter profPages;
+        Counter profLines;
+        Counter profCycles;
+
+    public:
+        explicit NUMAMigrationCost(uint32_t _pageCycles);
+
+        void initStats(AggregateStat* parentStat);
+
+        // Queue the copy of a page of the thread that moved from srcNode. Called from syscalls. The queues are per
+        // process, as tids are, so tid is the one of the calling process.
+        void queue(uint32_t tid, Address pageAddr, uint32_t srcNode);
+
+        // Copy the queued pages of the thread on the core it runs on, and charge it.
+        void charge(uint32_t tid, Core* core);
+
+        // Drop the queued pages of a thread that finishes, so that a later thread with the same tid is not charged.
+        void drop(uint32_t tid);
+};
+
+#endif  // NUMA_MIGRATION_COST_H_
@@ -55,7 +55,7 @@
 #define ISSUES_PER_CYCLE 4
 #define RF_READS_PER_CYCLE 3
 
-OOOCore::OOOCore(FilterCache* _l1i, FilterCache* _l1d, g_string& _name) : Core(_name), l1i(_l1i), l1d(_l1d), cRec(0, _name) {
+OOOCore::OOOCore(FilterCache* _l1i, FilterCache* _l1d, uint32_t _domain, g_string& _name) : Core(_name), l1i(_l1i), l1d(_l1d), cRec(_domain, _name) {
     decodeCycle = DECODE_STAGE;  // allow subtracting from it
     curCycle = 0;
     phaseEndCycle = zinfo->phaseLength;
@@ -457,6 +457,16 @@ void OOOCore::leave() {
     cRec.notifyLeave(curCycle);
 }
 
+void OOOCore::stall(uint64_t cycles) {
+    if (cycles) advance(curCycle + cycles);
+}
+
+void OOOCore::copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines) {
+    uint64_t respCycle = l1d->copyLines(srcLineAddr, dstLineAddr, numLines, curCycle);
+    cRec.record(curCycle, curCycle, respCycle);
+    if (respCycle > curCycle) advance(respCycle);
+}
+
 void OOOCore::cSimStart() {
     uint64_t targetCycle = cRec.cSimStart(curCycle);
     assert(targetCycle >= curCycle);
@@ -434,7 +434,7 @@ class OOOCore : public Core {
         OOOCoreRecorder cRec;
 
     public:
-        OOOCore(FilterCache* _l1i, FilterCache* _l1d, g_string& _name);
+        OOOCore(FilterCache* _l1i, FilterCache* _l1d, uint32_t _domain, g_string& _name);
 
         void initStats(AggregateStat* parentStat);
 
@@ -446,6 +446,8 @@ class OOOCore : public Core {
 
         virtual void join();
         virtual void leave();
+        void stall(uint64_t cycles) override;
+        void copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines) override;
 
         InstrFuncPtrs GetFuncPtrs();
 
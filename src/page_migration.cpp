@@ -0,0 +1,245 @@
+#include "page_migration.h"
+#include <algorithm>
+#include "numa_map.h"
+#include "zsim.h"
+
+//#define DEBUG(args...) info(args)
+#define DEBUG(args...)
+
+static const char* replicaReadNames[] = {"local", "remote"};
+
+PageMigrationEngine::PageMigrationEngine(uint32_t _numNodes, const Params& _params, const g_string& _name)
+    : numNodes(_numNodes), params(_params), linesPerPage(1 << (pageBits - lineBits)), name(_name)
+{
+    if (!zinfo->numaMap) panic("%s: page migration requires a NUMA system", name.c_str());
+    if (params.epochPhases == 0) panic("%s: epoch must be at least one phase", name.c_str());
+    if (params.samplingRate == 0) panic("%s: sampling rate must be positive", name.c_str());
+    if (params.replicate && numNodes > 64) panic("%s: page replication supports up to 64 NUMA nodes", name.c_str());
+
+    shards = gm_memalign<SampleShard>(CACHE_LINE_BYTES, SAMPLE_SHARDS);
+    for (uint32_t i = 0; i < SAMPLE_SHARDS; i++) {
+        new (&shards[i]) SampleShard();
+        futex_init(&shards[i].lock);
+    }
+    samples.resize(numNodes);
+    sampledLocal = sampledRemote = 0;
+    epochPhasesLeft = params.epochPhases;
+
+    copies = gm_memalign<NodeCopies>(CACHE_LINE_BYTES, numNodes);
+    for (uint32_t n = 0; n < numNodes; n++) {
+        new (&copies[n]) NodeCopies();
+        copies[n].pending = 0;
+        futex_init(&copies[n].lock);
+    }
+
+    zinfo->eventQueue->insert(new PhaseEvent(this));
+}
+
+void PageMigrationEngine::initStats(AggregateStat* parentStat) {
+    AggregateStat* migStat = new AggregateStat();
+    migStat->init(name.c_str(), "Page migration stats");
+    profEpochs.init("epochs", "Migration epochs");
+    profMigrations.init("migrations", "Migrated pages");
+    profMigratedBytes.init("migratedBytes", "Bytes of migrated pages");
+    profCopyLines.init("copyLines", "Lines copied by migrations");
+    profDroppedCopies.init("droppedCopies", "Pending page copies dropped because the page migrated again");
+    profSampledLocal.init("sampledLocal", "Sampled accesses to the local node");
+    profSampledRemote.init("sampledRemote", "Sampled accesses to remote nodes");
+    profEpochLocalPct.init("epochLocalPct", "Local ratio of the sampled accesses per epoch (10\% bins)", 10);
+    migStat->append(&profEpochs);
+    migStat->append(&profMigrations);
+    migStat->append(&profMigratedBytes);
+    migStat->append(&profCopyLines);
+    migStat->append(&profDroppedCopies);
+    migStat->append(&profSampledLocal);
+    migStat->append(&profSampledRemote);
+    migStat->append(&profEpochLocalPct);
+    if (params.replicate) {
+        profReplications.init("replications", "Page replicas created");
+        profReplicatedBytes.init("replicatedBytes", "Bytes of created page replicas");
+        profCollapses.init("collapses", "Writes that collapsed replicated pages");
+        profCollapsedReplicas.init("collapsedReplicas", "Page replicas dropped by writes");
+        profReplicaReads.init("replicaReads", "Reads to replicated pages, served by the local node or not", 2, replicaReadNames);
+        auto replicaPagesStat = makeLambdaStat([]() { return zinfo->numaMap->getReplicaPages(); });
+        replicaPagesStat->init("replicaPages", "Current footprint of page replicas, in pages");
+        auto maxReplicaPagesStat = makeLambdaStat([]() { return zinfo->numaMap->getMaxReplicaPages(); });
+        maxReplicaPagesStat->init("maxReplicaPages", "Peak footprint of page replicas, in pages");
+        migStat->append(&profReplications);
+        migStat->append(&profReplicatedBytes);
+        migStat->append(&profCollapses);
+        migStat->append(&profCollapsedReplicas);
+        migStat->append(&profReplicaReads);
+        migStat->append(replicaPagesStat);
+        migStat->append(maxReplicaPagesStat);
+    }
+    parentStat->append(migStat);
+}
+
+bool PageMigrationEngine::nextCopy(uint32_t node, Address* lineAddr, uint32_t* srcNode) {
+    assert(node < numNodes);
+    NodeCopies& nc = copies[node];
+    if (likely(!nc.pending)) return false;
+
+    bool found = false;
+    futex_lock(&nc.lock);
+    if (!nc.jobs.empty()) {
+        CopyJob& job = nc.jobs.back();
+        *lineAddr = (job.pageAddr << (pageBits - lineBits)) + job.nextLine;
+        *srcNode = job.srcNode;
+        found = true;
+        if (++job.nextLine == linesPerPage) {
+            nc.jobs.pop_back();
+            nc.pending = nc.jobs.size();
+        }
+    }
+    futex_unlock(&nc.lock);
+    if (found) profCopyLines.atomicInc();
+    return found;
+}
+
+void PageMigrationEngine::replicasCollapsed(Address pageAddr, uint32_t numReplicas) {
+    profCollapses.atomicInc();
+    profCollapsedReplicas.atomicInc(numReplicas);
+    profDroppedCopies.atomicInc(dropCopies(pageAddr));
+}
+
+uint32_t PageMigrationEngine::dropCopies(Address pageAddr) {
+    uint32_t dropped = 0;
+    for (uint32_t n = 0; n < numNodes; n++) {
+        NodeCopies& nc = copies[n];
+        if (likely(!nc.pending)) continue;
+        futex_lock(&nc.lock);
+        auto it = std::find_if(nc.jobs.begin(), nc.jobs.end(), [pageAddr](const CopyJob& j) { return j.pageAddr == pageAddr; });
+        if (it != nc.jobs.end()) {
+            nc.jobs.erase(it);
+            nc.pending = nc.jobs.size();
+            dropped++;
+        }
+        futex_unlock(&nc.lock);
+    }
+    return dropped;
+}
+
+void PageMigrationEngine::phase() {
+    for (uint32_t i = 0; i < SAMPLE_SHARDS; i++) {
+        SampleShard& ss = shards[i];
+        for (const Sample& smp : ss.buf) {
+            PageSamples& ps = samples[smp.node][smp.pageAddr];
+            if (smp.write) ps.writes++;
+            else ps.reads++;
+            if (smp.local) sampledLocal++;
+            else sampledRemote++;
+        }
+        ss.buf.clear();
+    }
+
+    if (--epochPhasesLeft == 0) {
+        epochPhasesLeft = params.epochPhases;
+        epoch();
+    }
+}
+
+void PageMigrationEngine::epoch() {
+    profEpochs.inc();
+
+    // Find the dominant accessor of each page, and its hot remote readers.
+    struct PageInfo {
+        uint32_t homeNode;
+        uint32_t homeCount;
+        uint32_t bestNode;
+        uint32_t bestCount;
+        uint64_t hotReaders;  // bitmask, with replication only
+        uint32_t hotReads;
+        bool written;
+    };
+    g_unordered_map<Address, PageInfo> pages;
+    for (uint32_t n = 0; n < numNodes; n++) {
+        for (const auto& kv : samples[n]) {
+            auto it = pages.find(kv.first);
+            if (it == pages.end()) {
+                uint32_t home = zinfo->numaMap->lookupNodeOfPage(kv.first);
+                if (home == NUMAMap::INVALID_NODE) continue;  // unmapped since
+                it = pages.insert(std::make_pair(kv.first, PageInfo{home, 0, NUMAMap::INVALID_NODE, 0, 0, 0, false})).first;
+            }
+            PageInfo& pi = it->second;
+            const PageSamples& ps = kv.second;
+            uint32_t count = ps.reads + ps.writes;
+            if (ps.writes) pi.written = true;
+            if (n == pi.homeNode) {
+                pi.homeCount = count;
+            } else {
+                if (count > pi.bestCount) {
+                    pi.bestNode = n;
+                    pi.bestCount = count;
+                }
+                if (params.replicate && ps.reads >= params.hotThreshold) {
+                    pi.hotReaders |= 1uL << n;
+                    pi.hotReads += ps.reads;
+                }
+            }
+        }
+        samples[n].clear();
+    }
+    uint64_t local = sampledLocal;
+    uint64_t remote = sampledRemote;
+    sampledLocal = sampledRemote = 0;
+
+    profSampledLocal.inc(local);
+    profSampledRemote.inc(remote);
+    if (local + remote) profEpochLocalPct.inc(std::min((uint64_t)9, 10 * local / (local + remote)));
+
+    // Pick the hottest pages to replicate or migrate.
+    struct Candidate {
+        uint32_t count;
+        Address pageAddr;
+        bool replicate;
+    };
+    g_vector<Candidate> candidates;
+    for (auto& kv : pages) {
+        PageInfo& pi = kv.second;
+        uint64_t replicas = zinfo->numaMap->getReplicasOfPage(kv.first);
+        pi.hotReaders &= ~replicas;
+        if (pi.hotReaders && !pi.written) {
+            candidates.push_back({pi.hotReads, kv.first, true});
+        } else if (!replicas && pi.bestCount >= params.hotThreshold && pi.bestCount > pi.homeCount) {
+            // Replicated pages are left in place until a write collapses them
+            candidates.push_back({pi.bestCount, kv.first, false});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.count > b.count; });
+
+    // Remap and queue the copies, up to maxPagesPerEpoch of them.
+    uint32_t budget = params.maxPagesPerEpoch;
+    for (uint32_t i = 0; i < candidates.size() && budget; i++) {
+        Address pageAddr = candidates[i].pageAddr;
+        const PageInfo& pi = pages[pageAddr];
+
+        if (candidates[i].replicate) {
+            for (uint32_t n = 0; n < numNodes && budget; n++) {
+                if (!(pi.hotReaders & (1uL << n)) || !zinfo->numaMap->addReplica(pageAddr, n)) continue;
+                DEBUG("%s: replicate page 0x%lx from node %u to %u", name.c_str(), pageAddr, pi.homeNode, n);
+                NodeCopies& nc = copies[n];
+                nc.jobs.push_back({pageAddr, pi.homeNode, 0});
+                nc.pending = nc.jobs.size();
+                profReplications.inc();
+                profReplicatedBytes.inc(1uL << pageBits);
+                budget--;
+            }
+            continue;
+        }
+
+        DEBUG("%s: migrate page 0x%lx from node %u to %u, %u vs %u sampled accesses",
+                name.c_str(), pageAddr, pi.homeNode, pi.bestNode, pi.homeCount, pi.bestCount);
+        zinfo->numaMap->movePagesToNode(pageAddr, 1, pi.bestNode);
+
+        // A page still being copied from its previous migration goes on from its current data.
+        profDroppedCopies.inc(dropCopies(pageAddr));
+        NodeCopies& nc = copies[pi.bestNode];
+        nc.jobs.push_back({pageAddr, pi.homeNode, 0});
+        nc.pending = nc.jobs.size();
+
+        profMigrations.inc();
+        profMigratedBytes.inc(1uL << pageBits);
+        budget--;
+    }
+}
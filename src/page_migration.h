@@ -0,0 +1,153 @@
+#ifndef PAGE_MIGRATION_H_
+#define PAGE_MIGRATION_H_
+
+#include "event_queue.h"
+#include "g_std/g_string.h"
+#include "g_std/g_unordered_map.h"
+#include "g_std/g_vector.h"
+#include "locks.h"
+#include "memory_hierarchy.h"
+#include "pad.h"
+#include "stats.h"
+
+/**
+ * Automatic migration of hot remote pages between NUMA nodes.
+ *
+ * The engine samples the memory accesses of each node per page (e.g., the LLC misses that go through an interconnect
+ * interface to memory). At the end of each epoch, it remaps the hottest pages whose dominant accessor is a remote node
+ * to that node in NUMAMap, and queues their copy. The copy is issued line by line as real memory traffic by the
+ * accesses from the new home node, off their critical path, see MemInterconnectInterface.
+ *
+ * With replication, pages that were only read in the epoch get read-only replicas on all their hot remote readers
+ * instead, copied the same way. A write to a replicated page collapses it back to its home.
+ *
+ * Lines cached with the old mapping keep their original parents until evicted, see CoherentParentMap.
+ */
+class PageMigrationEngine : public GlobAlloc {
+    public:
+        struct Params {
+            uint32_t epochPhases;  // phases between migration decisions
+            uint32_t samplingRate;  // sample 1 in samplingRate lines, by address
+            uint32_t hotThreshold;  // min sampled accesses of the dominant node in an epoch
+            uint32_t maxPagesPerEpoch;
+            uint32_t copyLinesPerAccess;  // lines to copy per access from the new home node
+            bool replicate;  // replicate read-only pages instead of migrating them
+        };
+
+    private:
+        const uint32_t numNodes;
+        const Params params;
+        const uint32_t linesPerPage;
+
+        // Sampled accesses, buffered per source core shard in the bound phase, so that sampling takes no shared lock
+        // and does no map insert. The buffers are merged into the per-node page counts at the end of each phase.
+        struct Sample {
+            Address pageAddr;
+            uint32_t node;
+            bool write;
+            bool local;
+        };
+        struct SampleShard {
+            g_vector<Sample> buf;
+            lock_t lock;  // only contended by cores that share the shard
+            PAD();
+        };
+        static const uint32_t SAMPLE_SHARDS = 32;  // must be a power of 2
+        SampleShard* shards;
+
+        // Sampled accesses per page in the current epoch, one map per accessing node.
+        struct PageSamples {
+            uint32_t reads;
+            uint32_t writes;
+        };
+        g_vector<g_unordered_map<Address, PageSamples>> samples;
+        uint64_t sampledLocal;
+        uint64_t sampledRemote;
+        uint32_t epochPhasesLeft;
+
+        // Pending page copies, per new home or replica node.
+        struct CopyJob {
+            Address pageAddr;
+            uint32_t srcNode;
+            uint32_t nextLine;
+        };
+        struct NodeCopies {
+            g_vector<CopyJob> jobs;
+            volatile uint32_t pending;  // jobs not yet fully issued, read without the lock
+            lock_t lock;
+            PAD();
+        };
+        NodeCopies* copies;
+
+        const g_string name;
+
+        Counter profEpochs;
+        Counter profMigrations;
+        Counter profMigratedBytes;
+        Counter profCopyLines;
+        Counter profDroppedCopies;
+        Counter profSampledLocal;
+        Counter profSampledRemote;
+        VectorCounter profEpochLocalPct;  // local ratio of the sampled accesses of each epoch, 10% bins
+        Counter profReplications;
+        Counter profReplicatedBytes;
+        Counter profCollapses;
+        Counter profCollapsedReplicas;
+        ShardedVectorCounter profReplicaReads;  // reads to replicated pages, served by the local node or not
+
+        class PhaseEvent : public Event {
+            private:
+                PageMigrationEngine* engine;
+            public:
+                explicit PhaseEvent(PageMigrationEngine* _engine) : Event(1), engine(_engine) {}
+                void callback() { engine->phase(); }
+        };
+
+    public:
+        PageMigrationEngine(uint32_t _numNodes, const Params& _params, const g_string& _name);
+
+        void initStats(AggregateStat* parentStat);
+
+        const char* getName() const { return name.c_str(); }
+
+        /* Bound phase. */
+
+        // Record an access to lineAddr from core srcId of node, served by homeNode (the home or a replica of its page).
+        inline void sample(Address lineAddr, uint32_t srcId, uint32_t node, uint32_t homeNode, bool write) {
+            // Sample by address hash, so that all accesses to a sampled line are counted
+            if (params.samplingRate > 1 && ((lineAddr * 0x9E3779B97F4A7C15uL) >> 40) % params.samplingRate) return;
+            assert(node < numNodes);
+            SampleShard& ss = shards[srcId & (SAMPLE_SHARDS - 1)];
+            Address pageAddr = lineAddr >> (pageBits - lineBits);
+            futex_lock(&ss.lock);
+            ss.buf.push_back({pageAddr, node, write, node == homeNode});
+            futex_unlock(&ss.lock);
+        }
+
+        // Get the next line to copy to node. Return false if none is pending.
+        bool nextCopy(uint32_t node, Address* lineAddr, uint32_t* srcNode);
+
+        uint32_t getCopyLinesPerAccess() const { return params.copyLinesPerAccess; }
+
+        bool isReplicating() const { return params.replicate; }
+
+        // Record a read from a core of node to a replicated page, served by its local replica or not.
+        inline void replicaRead(uint32_t srcId, bool local) {
+            profReplicaReads.inc(srcId, local ? 0 : 1);
+        }
+
+        // Record a write that collapsed numReplicas replicas of the page, and stop copying to them.
+        void replicasCollapsed(Address pageAddr, uint32_t numReplicas);
+
+    private:
+        // Called at the end of each phase, while no thread is running. Merges the sample buffers, and ends the epoch
+        // every epochPhases phases.
+        void phase();
+
+        void epoch();
+
+        // Drop the pending copies of the page to any node. Return the number of dropped jobs.
+        uint32_t dropCopies(Address pageAddr);
+};
+
+#endif  // PAGE_MIGRATION_H_
@@ -24,51 +24,189 @@
  */
 
 #include "prefetcher.h"
+#include <string.h>
 #include "bithacks.h"
+#include "pin.H"
+#include "timing_event.h"
+#include "zsim.h"
 
 //#define DBG(args...) info(args)
 #define DBG(args...)
 
-void StreamPrefetcher::setParents(uint32_t _childId, const g_vector<MemObject*>& parents, Network* network) {
+/* Prefetcher */
+
+Prefetcher::Prefetcher(const g_string& _name, const PrefetcherParams& _params)
+    : level(THROTTLE_LEVELS), intAccesses(0), intIssued(0), intUseful(0), intLate(0), intLatency(0), curReq(nullptr),
+      curRespCycle(0), params(_params), parent(nullptr), child(nullptr), childId(0), name(_name)
+{
+    if (!isPow2(params.trackerEntries)) panic("%s: trackerEntries must be a power of 2, %d given", name.c_str(), params.trackerEntries);
+    if (params.degree == 0 || params.distance == 0) panic("%s: degree and distance must be non-zero", name.c_str());
+    tracker = gm_calloc<TrackedPrefetch>(params.trackerEntries);
+    for (uint32_t i = 0; i < params.trackerEntries; i++) tracker[i].lineAddr = INVALID_ADDR;
+    trackerMask = params.trackerEntries - 1;
+    curRec.clear();
+}
+
+void Prefetcher::setParents(uint32_t _childId, const g_vector<MemObject*>& parents, Network* network) {
     childId = _childId;
     if (parents.size() != 1) panic("Must have one parent");
     if (network) panic("Network not handled");
     parent = parents[0];
 }
 
-void StreamPrefetcher::setChildren(const g_vector<BaseCache*>& children, Network* network) {
+void Prefetcher::setChildren(const g_vector<BaseCache*>& children, Network* network) {
     if (children.size() != 1) panic("Must have one children");
     if (network) panic("Network not handled");
     child = children[0];
 }
 
-void StreamPrefetcher::initStats(AggregateStat* parentStat) {
+void Prefetcher::initStats(AggregateStat* parentStat) {
     AggregateStat* s = new AggregateStat();
     s->init(name.c_str(), "Prefetcher stats");
     profAccesses.init("acc", "Accesses"); s->append(&profAccesses);
     profPrefetches.init("pf", "Issued prefetches"); s->append(&profPrefetches);
-    profDoublePrefetches.init("dpf", "Issued double prefetches"); s->append(&profDoublePrefetches);
-    profPageHits.init("pghit", "Page/entry hit"); s->append(&profPageHits);
     profHits.init("hit", "Prefetch buffer hits, short and full"); s->append(&profHits);
     profShortHits.init("shortHit", "Prefetch buffer short hits"); s->append(&profShortHits);
-    profStrideSwitches.init("strideSwitches", "Predicted stride switches"); s->append(&profStrideSwitches);
-    profLowConfAccs.init("lcAccs", "Low-confidence accesses with no prefetches"); s->append(&profLowConfAccs);
+    profUseful.init("useful", "Useful prefetches (demand hits on prefetched lines, including stores)"); s->append(&profUseful);
+    profLate.init("late", "Late prefetches (useful, but the demand waited for them)"); s->append(&profLate);
+    profUnused.init("unused", "Prefetches dropped from the tracker without being used"); s->append(&profUnused);
+    profRedundant.init("redundant", "Prefetches not issued because they were already in flight"); s->append(&profRedundant);
+    profThrottleUps.init("throttleUps", "Aggressiveness increases"); s->append(&profThrottleUps);
+    profThrottleDowns.init("throttleDowns", "Aggressiveness decreases"); s->append(&profThrottleDowns);
+    profLevel.init("level", "Current aggressiveness level", &level); s->append(&profLevel);
+    initPrefetcherStats(s);
     parentStat->append(s);
 }
 
-uint64_t StreamPrefetcher::access(MemReq& req) {
+uint64_t Prefetcher::access(MemReq& req) {
     uint32_t origChildId = req.childId;
     req.childId = childId;
 
-    if (req.type != GETS) return parent->access(req); //other reqs ignored, including stores
+    uint64_t respCycle = parent->access(req);
 
-    profAccesses.inc();
+    if (IsGet(req.type)) {
+        //Prefetch hit? The parent serviced the demand as a hit, but data is only there when the prefetch completes
+        TrackedPrefetch& tp = tracker[trackerIdx(req.lineAddr)];
+        bool pfHit = (tp.lineAddr == req.lineAddr);
+        bool pfLate = false;
+        if (pfHit) {
+            profUseful.inc();
+            intUseful++;
+            if (tp.respCycle > respCycle) {
+                pfLate = true;
+                profLate.inc();
+                intLate++;
+                respCycle = tp.respCycle;
+            }
+            tp.lineAddr = INVALID_ADDR;
+        }
 
-    uint64_t reqCycle = req.cycle;
-    uint64_t respCycle = parent->access(req);
+        if (req.type == GETS) { //other reqs ignored, including stores
+            profAccesses.inc();
+            if (pfHit) {
+                profHits.inc();
+                if (pfLate) profShortHits.inc();
+            }
+
+            // Enforce single-record invariant: take the demand's record (if any), and stitch prefetch records to it
+            EventRecorder* evRec = zinfo->eventRecorders[req.srcId];
+            curRec.clear();
+            if (unlikely(evRec && evRec->hasRecord())) curRec = evRec->popRecord();
+            curReq = &req;
+            curRespCycle = respCycle;
+
+            train(req, respCycle, pfHit, pfLate);
+
+            if (unlikely(curRec.isValid())) evRec->pushRecord(curRec);
+            curReq = nullptr;
+
+            if (params.throttle && ++intAccesses == params.throttleInterval) adjustThrottle();
+        }
+    }
+
+    req.childId = origChildId;
+    return respCycle;
+}
+
+uint64_t Prefetcher::issue(Address lineAddr) {
+    assert(curReq);
+    TrackedPrefetch& tp = tracker[trackerIdx(lineAddr)];
+    if (tp.lineAddr == lineAddr) {
+        profRedundant.inc();
+        return 0;
+    }
+    if (tp.lineAddr != INVALID_ADDR) profUnused.inc();
+
+    uint64_t reqCycle = curReq->cycle;
+    MESIState state = I;
+    MemReq pfReq = {lineAddr, GETS, childId, &state, reqCycle, curReq->childLock, state, curReq->srcId, MemReq::PREFETCH};
+    uint64_t pfRespCycle = parent->access(pfReq);
+    assert(state == I);  // prefetch access should not give us any permissions
+
+    tp.lineAddr = lineAddr;
+    tp.respCycle = pfRespCycle;
+    profPrefetches.inc();
+    intIssued++;
+    intLatency += pfRespCycle - reqCycle;
+    DBG("%s: prefetch 0x%lx on 0x%lx, resp %ld", name.c_str(), lineAddr, curReq->lineAddr, pfRespCycle);
+
+    // The prefetch is off the demand's critical path, but its events must still run in the weave phase
+    EventRecorder* evRec = zinfo->eventRecorders[curReq->srcId];
+    if (unlikely(evRec && evRec->hasRecord())) {
+        TimingRecord pfRec = evRec->popRecord();
+        if (!curRec.isValid()) {
+            //The demand has no record (e.g., it hit in the parent), so model its latency as a fixed delay
+            DelayEvent* dEv = new (evRec) DelayEvent(curRespCycle - reqCycle);
+            dEv->setMinStartCycle(reqCycle);
+            curRec = {curReq->lineAddr, reqCycle, curRespCycle, curReq->type, dEv, dEv};
+        }
+        evRec->pushRecord(curRec);
+        StitchOffPathRecord(evRec, pfRec, reqCycle);
+        curRec = evRec->popRecord();
+    }
+    return pfRespCycle;
+}
+
+void Prefetcher::adjustThrottle() {
+    if (intIssued) {
+        double accuracy = ((double)intUseful)/intIssued;
+        double lateness = intUseful? ((double)intLate)/intUseful : 0.0;
+        bool bwSaturated = params.latencyThreshold && (intLatency/intIssued > params.latencyThreshold);
+
+        if (accuracy < params.accLow || (bwSaturated && accuracy < params.accHigh)) {
+            if (level > 1) {
+                level--;
+                profThrottleDowns.inc();
+            }
+        } else if (lateness > params.lateThreshold && !bwSaturated) {
+            if (level < THROTTLE_LEVELS) {
+                level++;
+                profThrottleUps.inc();
+            }
+        }
+        DBG("%s: interval accuracy %.2f lateness %.2f bwSaturated %d -> level %ld", name.c_str(), accuracy, lateness, bwSaturated, level);
+    }
+    intAccesses = intIssued = intUseful = intLate = intLatency = 0;
+}
+
+// nop for now; do we need to invalidate our own state?
+uint64_t Prefetcher::invalidate(const InvReq& req) {
+    return child->invalidate(req);
+}
 
+/* StreamPrefetcher */
+
+void StreamPrefetcher::initPrefetcherStats(AggregateStat* s) {
+    profDoublePrefetches.init("dpf", "Issued double prefetches"); s->append(&profDoublePrefetches);
+    profPageHits.init("pghit", "Page/entry hit"); s->append(&profPageHits);
+    profStrideSwitches.init("strideSwitches", "Predicted stride switches"); s->append(&profStrideSwitches);
+    profLowConfAccs.init("lcAccs", "Low-confidence accesses with no prefetches"); s->append(&profLowConfAccs);
+}
+
+void StreamPrefetcher::train(const MemReq& req, uint64_t respCycle, bool pfHit, bool pfLate) {
+    uint64_t reqCycle = req.cycle;
     Address pageAddr = req.lineAddr >> 6;
-    uint32_t pos = req.lineAddr & (64-1);
+    int32_t pos = req.lineAddr & (64-1);
     uint32_t idx = 16;
     // This loop gets unrolled and there are no control dependences. Way faster than a break (but should watch for the avoidable loop-carried dep)
     for (uint32_t i = 0; i < 16; i++) {
@@ -81,14 +219,8 @@ uint64_t StreamPrefetcher::access(MemReq& req) {
     if (idx == 16) {  // entry miss
         uint32_t cand = 16;
         uint64_t candScore = -1;
-        //uint64_t candScore = 0;
         for (uint32_t i = 0; i < 16; i++) {
             if (array[i].lastCycle > reqCycle + 500) continue;  // warm prefetches, not even a candidate
-            /*uint64_t score = (reqCycle - array[i].lastCycle)*(3 - array[i].conf.counter());
-            if (score > candScore) {
-                cand = i;
-                candScore = score;
-            }*/
             if (array[i].ts < candScore) {  // just LRU
                 cand = i;
                 candScore = array[i].ts;
@@ -110,17 +242,7 @@ uint64_t StreamPrefetcher::access(MemReq& req) {
         DBG("%s: PAGE HIT idx %d", name.c_str(), idx);
 
         // 1. Did we prefetch-hit?
-        bool shortPrefetch = false;
-        if (e.valid[pos]) {
-            uint64_t pfRespCycle = e.times[pos].respCycle;
-            shortPrefetch = pfRespCycle > respCycle;
-            e.valid[pos] = false;  // close, will help with long-lived transactions
-            respCycle = MAX(pfRespCycle, respCycle);
-            e.lastCycle = MAX(respCycle, e.lastCycle);
-            profHits.inc();
-            if (shortPrefetch) profShortHits.inc();
-            DBG("%s: pos %d prefetched on %ld, pf resp %ld, demand resp %ld, short %d", name.c_str(), pos, e.times[pos].startCycle, pfRespCycle, respCycle, shortPrefetch);
-        }
+        if (pfHit) e.lastCycle = MAX(respCycle, e.lastCycle);
 
         // 2. Update predictors, issue prefetches
         int32_t stride = pos - e.lastPos;
@@ -128,33 +250,20 @@ uint64_t StreamPrefetcher::access(MemReq& req) {
         if (e.stride == stride) {
             e.conf.inc();
             if (e.conf.pred()) {  // do prefetches
-                int32_t fetchDepth = (e.lastPrefetchPos - e.lastPos)/stride;
-                uint32_t prefetchPos = e.lastPrefetchPos + stride;
-                if (fetchDepth < 1) {
-                    prefetchPos = pos + stride;
-                    fetchDepth = 1;
-                }
-                DBG("%s: pos %d stride %d conf %d lastPrefetchPos %d prefetchPos %d fetchDepth %d", name.c_str(), pos, stride, e.conf.counter(), e.lastPrefetchPos, prefetchPos, fetchDepth);
-
-                if (prefetchPos < 64 && !e.valid[prefetchPos]) {
-                    MESIState state = I;
-                    MemReq pfReq = {req.lineAddr + prefetchPos - pos, GETS, req.childId, &state, reqCycle, req.childLock, state, req.srcId, MemReq::PREFETCH};
-                    uint64_t pfRespCycle = parent->access(pfReq);  // FIXME, might segfault
-                    e.valid[prefetchPos] = true;
-                    e.times[prefetchPos].fill(reqCycle, pfRespCycle);
-                    profPrefetches.inc();
-
-                    if (shortPrefetch && fetchDepth < 8 && prefetchPos + stride < 64 && !e.valid[prefetchPos + stride]) {
-                        prefetchPos += stride;
-                        pfReq.lineAddr += stride;
-                        pfRespCycle = parent->access(pfReq);
-                        e.valid[prefetchPos] = true;
-                        e.times[prefetchPos].fill(reqCycle, pfRespCycle);
-                        profPrefetches.inc();
-                        profDoublePrefetches.inc();
-                    }
+                // Continue where the last prefetches left off, unless the demand stream caught up with them
+                int32_t prefetchPos = ((e.lastPrefetchPos - pos)/stride > 0)? e.lastPrefetchPos + stride : pos + stride;
+                int32_t maxPos = pos + stride*(int32_t)distance();
+                // A short prefetch hit means the demands caught up with the prefetches, so get one more line ahead
+                uint32_t maxIssued = degree() + (pfLate? 1 : 0);
+                uint32_t issued = 0;
+                DBG("%s: pos %d stride %d conf %d lastPrefetchPos %d prefetchPos %d maxPos %d", name.c_str(), pos, stride, e.conf.counter(), e.lastPrefetchPos, prefetchPos, maxPos);
+                while (issued < maxIssued && prefetchPos >= 0 && prefetchPos < 64 &&
+                        ((stride > 0)? prefetchPos <= maxPos : prefetchPos >= maxPos)) {
+                    issue(req.lineAddr + prefetchPos - pos);
+                    if (issued >= degree()) profDoublePrefetches.inc();
                     e.lastPrefetchPos = prefetchPos;
-                    assert(state == I);  // prefetch access should not give us any permissions
+                    prefetchPos += stride;
+                    issued++;
                 }
             } else {
                 profLowConfAccs.inc();
@@ -177,14 +286,260 @@ uint64_t StreamPrefetcher::access(MemReq& req) {
         e.lastLastPos = e.lastPos;
         e.lastPos = pos;
     }
+}
 
-    req.childId = origChildId;
-    return respCycle;
+/* BestOffsetPrefetcher */
+
+BestOffsetPrefetcher::BestOffsetPrefetcher(const g_string& _name, const PrefetcherParams& _params, uint32_t rrEntries)
+    : Prefetcher(_name, _params), testIdx(0), round(0), bestIdx(0), bestOffset(1)
+{
+    if (!isPow2(rrEntries)) panic("%s: rrEntries must be a power of 2, %d given", name.c_str(), rrEntries);
+    // Offsets of the form 2^i * 3^j * 5^k, up to a page (64 lines)
+    for (int32_t d = 1; d < 64; d++) {
+        int32_t r = d;
+        while (r % 2 == 0) r /= 2;
+        while (r % 3 == 0) r /= 3;
+        while (r % 5 == 0) r /= 5;
+        if (r == 1) offsets.push_back(d);
+    }
+    scores.resize(offsets.size(), 0);
+    rrTable.resize(rrEntries, {~((Address)0), 0});
+    rrMask = rrEntries - 1;
 }
 
-// nop for now; do we need to invalidate our own state?
-uint64_t StreamPrefetcher::invalidate(const InvReq& req) {
-    return child->invalidate(req);
+void BestOffsetPrefetcher::initPrefetcherStats(AggregateStat* s) {
+    profPhases.init("phases", "Learning phases"); s->append(&profPhases);
+    profOffPhases.init("offPhases", "Learning phases that turned prefetching off"); s->append(&profOffPhases);
+    profOffset.init("offset", "Current best offset (0 if off)", &bestOffset); s->append(&profOffset);
+}
+
+void BestOffsetPrefetcher::train(const MemReq& req, uint64_t respCycle, bool pfHit, bool pfLate) {
+    Address lineAddr = req.lineAddr;
+
+    // 1. Learning: test one offset per access
+    if (rrHit(lineAddr - offsets[testIdx], req.cycle)) {
+        scores[testIdx]++;
+        if (scores[testIdx] > scores[bestIdx]) bestIdx = testIdx;
+    }
+    bool endPhase = scores[testIdx] >= SCORE_MAX;
+    if (++testIdx == offsets.size()) {
+        testIdx = 0;
+        if (++round >= ROUND_MAX) endPhase = true;
+    }
+    if (endPhase) {
+        bestOffset = (scores[bestIdx] > BAD_SCORE)? offsets[bestIdx] : 0;
+        DBG("%s: phase done, best offset %ld (score %d)", name.c_str(), bestOffset, scores[bestIdx]);
+        profPhases.inc();
+        if (!bestOffset) profOffPhases.inc();
+        for (uint32_t& sc : scores) sc = 0;
+        testIdx = round = bestIdx = 0;
+    }
+
+    // 2. Prefetch within the page, and record when the base line would be covered
+    Address pageAddr = lineAddr >> 6;
+    if (bestOffset) {
+        for (uint32_t k = 1; k <= degree(); k++) {
+            Address pfLineAddr = lineAddr + k*bestOffset;
+            if ((pfLineAddr >> 6) != pageAddr) break;
+            uint64_t pfRespCycle = issue(pfLineAddr);
+            if (k == 1 && pfRespCycle) rrTable[rrIdx(lineAddr)] = {lineAddr, pfRespCycle};
+        }
+    } else {
+        rrTable[rrIdx(lineAddr)] = {lineAddr, respCycle};
+    }
 }
 
+/* IndirectPrefetcher */
+
+IndirectPrefetcher::IndirectPrefetcher(const g_string& _name, const PrefetcherParams& _params, uint32_t _indexBytes)
+    : Prefetcher(_name, _params), indexBytes(_indexBytes)
+{
+    if (indexBytes != 4 && indexBytes != 8) panic("%s: indexBytes must be 4 or 8, %d given", name.c_str(), indexBytes);
+    assert(lineBits <= 8);
+    idxPerLine = (1 << lineBits)/indexBytes;
+    procStates.resize(zinfo->numProcs);
+    for (ProcState& ps : procStates) {
+        for (Address& h : ps.streamHeads) h = ~((Address)0);
+        ps.nextHead = 0;
+        ps.idxLine = ~((Address)0);
+        ps.idxVals.resize(idxPerLine);
+        ps.nextVals.resize(idxPerLine);
+        ps.nextValid = false;
+        ps.idxPos = ps.pfPos = 0;
+        ps.pattern = false;
+        ps.shift = 0;
+        ps.baseLo = ps.baseHi = 0;
+        ps.hasCand = false;
+        ps.candLine = 0;
+    }
+}
+
+void IndirectPrefetcher::initPrefetcherStats(AggregateStat* s) {
+    profIndexLines.init("idxLines", "Index stream lines"); s->append(&profIndexLines);
+    profMatches.init("matches", "Indirect accesses that matched the pattern"); s->append(&profMatches);
+    profMismatches.init("mismatches", "Accesses that did not match the pattern"); s->append(&profMismatches);
+    profPatterns.init("patterns", "Indirect patterns learned"); s->append(&profPatterns);
+}
+
+bool IndirectPrefetcher::isStream(ProcState& ps, Address vLineAddr) {
+    if (vLineAddr == ps.idxLine + 1) return true;
+    for (Address& h : ps.streamHeads) {
+        if (vLineAddr == h + 1) {
+            h = vLineAddr;
+            return true;
+        }
+        if (vLineAddr == h) return false;
+    }
+    ps.streamHeads[ps.nextHead] = vLineAddr;
+    ps.nextHead = (ps.nextHead + 1) % (sizeof(ps.streamHeads)/sizeof(Address));
+    return false;
+}
+
+bool IndirectPrefetcher::readLine(Address vLineAddr, g_vector<uint64_t>& vals) const {
+    uint8_t buf[256];
+    uint32_t lineSize = 1 << lineBits;
+    if (PIN_SafeCopy(buf, (const void*)(vLineAddr << lineBits), lineSize) != lineSize) return false;
+    for (uint32_t i = 0; i < idxPerLine; i++) {
+        if (indexBytes == 4) {
+            uint32_t v;
+            memcpy(&v, buf + 4*i, 4);
+            vals[i] = v;
+        } else {
+            memcpy(&vals[i], buf + 8*i, 8);
+        }
+    }
+    return true;
+}
 
+bool IndirectPrefetcher::indexValue(const ProcState& ps, uint32_t pos, uint64_t* val) const {
+    if (pos < idxPerLine) {
+        *val = ps.idxVals[pos];
+        return true;
+    } else if (pos < 2*idxPerLine && ps.nextValid) {
+        *val = ps.nextVals[pos - idxPerLine];
+        return true;
+    }
+    return false;
+}
+
+// Base address that puts an element of value val, scaled by 1 << s, at addr; false if the base would be negative
+static inline bool getBase(Address addr, uint64_t val, uint32_t s, Address* base) {
+    if (s && (val >> (64 - s))) return false;  // val << s overflows
+    if ((val << s) > addr) return false;
+    *base = addr - (val << s);
+    return true;
+}
+
+bool IndirectPrefetcher::matches(Address vLineAddr, uint64_t val, Address lo, Address hi, uint32_t s) const {
+    return vLineAddr >= ((lo + (val << s)) >> lineBits) && vLineAddr <= ((hi - 1 + (val << s)) >> lineBits);
+}
+
+void IndirectPrefetcher::train(const MemReq& req, uint64_t respCycle, bool pfHit, bool pfLate) {
+    if (req.flags & MemReq::IFETCH) return;
+    Address vLineAddr = req.lineAddr ^ procMask;
+    if (vLineAddr >> (64 - lineBits)) return;  // another process's line; we cannot read its memory
+    ProcState& ps = procStates[procIdx];
+
+    const uint32_t pageLineBits = 12 - lineBits;
+    if (isStream(ps, vLineAddr)) {
+        bool advance = (vLineAddr == ps.idxLine + 1);
+        if (ps.pattern && !advance) return;  // another stream, not the index array
+        // Values of lines in the page of a line the core just accessed are readable
+        if (advance && ps.nextValid) {
+            ps.idxVals.swap(ps.nextVals);
+        } else if (!readLine(vLineAddr, ps.idxVals)) {
+            ps.idxLine = ~((Address)0);
+            ps.pattern = ps.hasCand = false;
+            return;
+        }
+        ps.idxPos = (advance && ps.idxPos >= idxPerLine)? ps.idxPos - idxPerLine : 0;
+        ps.pfPos = (advance && ps.pfPos >= idxPerLine)? ps.pfPos - idxPerLine : 0;
+        ps.idxLine = vLineAddr;
+        bool samePage = ((vLineAddr + 1) >> pageLineBits) == (vLineAddr >> pageLineBits);
+        ps.nextValid = samePage && readLine(vLineAddr + 1, ps.nextVals);
+        ps.hasCand = false;
+        profIndexLines.inc();
+        if (ps.pattern && ps.conf.pred() && samePage) issue((vLineAddr + 1) | procMask);
+        return;
+    }
+
+    if (ps.idxLine == ~((Address)0)) return;
+
+    if (ps.pattern) {
+        for (uint32_t j = ps.idxPos; j < ps.idxPos + MATCH_WINDOW; j++) {
+            uint64_t v;
+            if (!indexValue(ps, j, &v)) break;
+            if (matches(vLineAddr, v, ps.baseLo, ps.baseHi, ps.shift)) {
+                // Large index values may only match through wraparound; those are not matches
+                Address lo, hi;
+                if (!getBase(vLineAddr << lineBits, v, ps.shift, &lo)) continue;
+                if (!getBase((vLineAddr + 1) << lineBits, v, ps.shift, &hi)) continue;
+                lo = MAX(ps.baseLo, lo);
+                hi = MIN(ps.baseHi, hi);
+                if (lo >= hi) continue;
+                ps.baseLo = lo;
+                ps.baseHi = hi;
+                ps.conf.inc();
+                profMatches.inc();
+                ps.idxPos = j + 1;
+                prefetchTargets(ps, j + distance());
+                return;
+            }
+        }
+        profMismatches.inc();
+        ps.conf.dec();
+        if (ps.conf.counter() == 0) ps.pattern = ps.hasCand = false;
+        return;
+    }
+
+    learn(ps, vLineAddr);
+}
+
+void IndirectPrefetcher::learn(ProcState& ps, Address vLineAddr) {
+    uint32_t lineSize = 1 << lineBits;
+    if (ps.hasCand && vLineAddr != ps.candLine) {
+        // Find an index position p and shift s such that the previous access was to A[B[p]], and this one is to
+        // A[B[j]] for a slightly later j
+        for (uint32_t p = 0; p < idxPerLine; p++) {
+            for (uint32_t s = 0; s <= MAX_SHIFT; s++) {
+                Address lo;
+                if (!getBase(ps.candLine << lineBits, ps.idxVals[p], s, &lo)) continue;
+                Address hi = lo + lineSize;
+                for (uint32_t j = p + 1; j <= p + MATCH_WINDOW; j++) {
+                    uint64_t v;
+                    if (!indexValue(ps, j, &v)) break;
+                    if (v != ps.idxVals[p] && matches(vLineAddr, v, lo, hi, s)) {
+                        Address vLo, vHi;
+                        if (!getBase(vLineAddr << lineBits, v, s, &vLo)) continue;
+                        if (!getBase((vLineAddr + 1) << lineBits, v, s, &vHi)) continue;
+                        if (MAX(lo, vLo) >= MIN(hi, vHi)) continue;
+                        ps.pattern = true;
+                        ps.shift = s;
+                        ps.baseLo = MAX(lo, vLo);
+                        ps.baseHi = MIN(hi, vHi);
+                        ps.conf.reset();
+                        ps.idxPos = j + 1;
+                        ps.hasCand = false;
+                        profPatterns.inc();
+                        DBG("%s: pattern base [0x%lx, 0x%lx) shift %d at pos %d", name.c_str(), ps.baseLo, ps.baseHi, ps.shift, j);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+    ps.hasCand = true;
+    ps.candLine = vLineAddr;
+}
+
+void IndirectPrefetcher::prefetchTargets(ProcState& ps, uint32_t fromPos) {
+    if (!ps.conf.pred()) return;
+    Address base = ps.baseLo + (ps.baseHi - ps.baseLo)/2;
+    uint32_t toPos = fromPos + degree();
+    for (uint32_t pos = MAX(fromPos, ps.pfPos); pos < toPos; pos++) {
+        uint64_t v;
+        if (!indexValue(ps, pos, &v)) break;  // we only know the values of the current and next index lines
+        issue(((base + (v << ps.shift)) >> lineBits) | procMask);
+        ps.pfPos = pos + 1;
+    }
+}
@@ -26,9 +26,10 @@
 #ifndef PREFETCHER_H_
 #define PREFETCHER_H_
 
-#include <bitset>
 #include "bithacks.h"
+#include "event_recorder.h"
 #include "g_std/g_string.h"
+#include "g_std/g_vector.h"
 #include "memory_hierarchy.h"
 #include "stats.h"
 
@@ -50,33 +51,112 @@ class SatCounter {
         uint32_t counter() const { return count; }
 };
 
+struct PrefetcherParams {
+    uint32_t degree;            // max prefetches issued per trigger
+    uint32_t distance;          // how far ahead of the demand stream to prefetch, in prefetcher-specific units
+    uint32_t trackerEntries;    // issued prefetches tracked for usefulness/timeliness; power of 2
+
+    // Feedback-directed throttling (see Srinath et al., HPCA 2007): every throttleInterval demand accesses, lower the
+    // aggressiveness (which scales degree and distance) if accuracy is low or bandwidth is saturated, and raise it
+    // if prefetches are accurate but late
+    bool throttle;
+    uint32_t throttleInterval;
+    double accHigh, accLow;     // accuracy thresholds (useful/issued)
+    double lateThreshold;       // late/useful above which prefetches are considered late
+    uint32_t latencyThreshold;  // average prefetch latency (cycles) above which bandwidth is saturated; 0 to disable
+
+    // Defaults match the original stream prefetcher: one prefetch per trigger, at most 8 lines ahead, no throttling
+    PrefetcherParams() : degree(1), distance(8), trackerEntries(256), throttle(false), throttleInterval(2048),
+        accHigh(0.75), accLow(0.40), lateThreshold(0.10), latencyThreshold(0) {}
+};
+
+/* Common prefetcher infrastructure. A prefetcher sits between a child cache and its parent, observes the child's
+ * demand GETS, and issues PREFETCH GETS to the parent, which only fill the parent (see MESICC::processAccess()).
+ * Subclasses implement train(), and call issue() for each line they want; the base class drops duplicates,
+ * tracks issued prefetches to classify them as useful, late or unused, throttles degree and distance, and
+ * stitches the timing records of prefetches off the demand's critical path, so weave models see their traffic.
+ * Polluting prefetches are detected by the parent cache (see MESICC's prefetch pollution filter).
+ */
+class Prefetcher : public BaseCache {
+    private:
+        struct TrackedPrefetch {
+            Address lineAddr;
+            uint64_t respCycle;
+        };
+
+        TrackedPrefetch* tracker;
+        uint32_t trackerMask;
+
+        //Throttling state
+        uint64_t level;  // aggressiveness, 1..THROTTLE_LEVELS
+        uint64_t intAccesses, intIssued, intUseful, intLate, intLatency;
+
+        //Current demand access, valid during train()
+        const MemReq* curReq;
+        uint64_t curRespCycle;
+        TimingRecord curRec;
+
+        Counter profAccesses, profPrefetches, profHits, profShortHits, profUseful, profLate, profUnused, profRedundant;
+        Counter profThrottleUps, profThrottleDowns;
+        ProxyStat profLevel;
+
+        static const Address INVALID_ADDR = ~((Address)0);
+
+    protected:
+        static const uint32_t THROTTLE_LEVELS = 4;
+
+        PrefetcherParams params;
+        MemObject* parent;
+        BaseCache* child;
+        uint32_t childId;
+        g_string name;
+
+    public:
+        Prefetcher(const g_string& _name, const PrefetcherParams& _params);
+        void initStats(AggregateStat* parentStat);
+        const char* getName() { return name.c_str();}
+        void setParents(uint32_t _childId, const g_vector<MemObject*>& parents, Network* network);
+        void setChildren(const g_vector<BaseCache*>& children, Network* network);
+
+        uint64_t access(MemReq& req);
+        uint64_t invalidate(const InvReq& req);
+
+    protected:
+        //Called on every demand GETS, after the demand access; pfHit is true if the line was prefetched, and pfLate
+        //if the demand had to wait for that prefetch
+        virtual void train(const MemReq& req, uint64_t respCycle, bool pfHit, bool pfLate) = 0;
+        virtual void initPrefetcherStats(AggregateStat* s) {}
+
+        //Issues a prefetch of lineAddr at the current demand's cycle. Returns the prefetch's response cycle, or 0
+        //if it was not issued because it is already in flight.
+        uint64_t issue(Address lineAddr);
+
+        //Throttled degree and distance
+        uint32_t degree() const { return MAX(1ul, params.degree*level/THROTTLE_LEVELS); }
+        uint32_t distance() const { return MAX(1ul, params.distance*level/THROTTLE_LEVELS); }
+
+    private:
+        inline uint32_t trackerIdx(Address lineAddr) const { return (lineAddr ^ (lineAddr >> 12)) & trackerMask; }
+        void adjustThrottle();
+};
+
 /* This is basically a souped-up version of the DLP L2 prefetcher in Nehalem: 16 stream buffers,
  * but (a) no up/down distinction, and (b) strided operation based on dominant stride detection
- * to try to subsume as much of the L1 IP/strided prefetcher as possible.
+ * to try to subsume as much of the L1 IP/strided prefetcher as possible. Prefetches run up to
+ * distance strides ahead of the demand stream, degree at a time.
  *
  * FIXME: For now, mostly hardcoded; 64-line entries (4KB w/64-byte lines), fixed granularities, etc.
- * TODO: Adapt to use weave models
  */
-class StreamPrefetcher : public BaseCache {
+class StreamPrefetcher : public Prefetcher {
     private:
         struct Entry {
             // Two competing strides; at most one active
             int32_t stride;
             SatCounter<3, 2, 1> conf;
 
-            struct AccessTimes {
-                uint64_t startCycle;  // FIXME: Dead for now, we should use it for profiling
-                uint64_t respCycle;
-
-                void fill(uint32_t s, uint64_t r) { startCycle = s; respCycle = r; }
-            };
-
-            AccessTimes times[64];
-            std::bitset<64> valid;
-
-            uint32_t lastPos;
-            uint32_t lastLastPos;
-            uint32_t lastPrefetchPos;
+            int32_t lastPos;
+            int32_t lastLastPos;
+            int32_t lastPrefetchPos;
             uint64_t lastCycle;  // updated on alloc and hit
             uint64_t ts;
 
@@ -86,7 +166,6 @@ class StreamPrefetcher : public BaseCache {
                 lastLastPos = 0;
                 lastPrefetchPos = 0;
                 conf.reset();
-                valid.reset();
                 lastCycle = curCycle;
             }
         };
@@ -95,22 +174,121 @@ class StreamPrefetcher : public BaseCache {
         Address tag[16];
         Entry array[16];
 
-        Counter profAccesses, profPrefetches, profDoublePrefetches, profPageHits, profHits, profShortHits, profStrideSwitches, profLowConfAccs;
+        Counter profDoublePrefetches, profPageHits, profStrideSwitches, profLowConfAccs;
 
-        MemObject* parent;
-        BaseCache* child;
-        uint32_t childId;
-        g_string name;
+    public:
+        StreamPrefetcher(const g_string& _name, const PrefetcherParams& _params) : Prefetcher(_name, _params), timestamp(0) {}
+
+    protected:
+        void train(const MemReq& req, uint64_t respCycle, bool pfHit, bool pfLate);
+        void initPrefetcherStats(AggregateStat* s);
+};
+
+/* Best-offset prefetcher, see "Best-Offset Hardware Prefetching", Michaud, HPCA 2016. Learns the line offset D
+ * that would have made past prefetches timely: on each access X, it tests one candidate offset d by checking
+ * whether X-d is in the recent requests (RR) table, i.e., whether a prefetch of X issued on an access to X-d would
+ * have completed by now. RR entries record when the (actual or would-be) prefetch completes, so late prefetches
+ * do not score. Prefetches X+D, ..., X+degree*D within the same 4KB page. Distance is unused (D is learned).
+ */
+class BestOffsetPrefetcher : public Prefetcher {
+    private:
+        struct RREntry {
+            Address lineAddr;
+            uint64_t readyCycle;
+        };
+
+        g_vector<int32_t> offsets;
+        g_vector<uint32_t> scores;
+        g_vector<RREntry> rrTable;
+        uint32_t rrMask;
+
+        uint32_t testIdx;
+        uint32_t round;
+        uint32_t bestIdx;
+        uint64_t bestOffset;  // 0 if prefetching is off
+
+        Counter profPhases, profOffPhases;
+        ProxyStat profOffset;
+
+        static const uint32_t SCORE_MAX = 31;
+        static const uint32_t ROUND_MAX = 100;
+        static const uint32_t BAD_SCORE = 1;
 
     public:
-        explicit StreamPrefetcher(const g_string& _name) : timestamp(0), name(_name) {}
-        void initStats(AggregateStat* parentStat);
-        const char* getName() { return name.c_str();}
-        void setParents(uint32_t _childId, const g_vector<MemObject*>& parents, Network* network);
-        void setChildren(const g_vector<BaseCache*>& children, Network* network);
+        BestOffsetPrefetcher(const g_string& _name, const PrefetcherParams& _params, uint32_t rrEntries);
 
-        uint64_t access(MemReq& req);
-        uint64_t invalidate(const InvReq& req);
+    protected:
+        void train(const MemReq& req, uint64_t respCycle, bool pfHit, bool pfLate);
+        void initPrefetcherStats(AggregateStat* s);
+
+    private:
+        inline uint32_t rrIdx(Address lineAddr) const { return (lineAddr ^ (lineAddr >> 8)) & rrMask; }
+        inline bool rrHit(Address lineAddr, uint64_t cycle) const {
+            const RREntry& e = rrTable[rrIdx(lineAddr)];
+            return e.lineAddr == lineAddr && e.readyCycle <= cycle;
+        }
+};
+
+/* Indirect memory prefetcher, after IMP (Yu et al., MICRO 2015): detects A[B[i]] access patterns, where B is a
+ * sequentially-accessed index array, and prefetches A[B[i+distance]]..A[B[i+distance+degree-1]].
+ *
+ * IMP uses load PCs and exact addresses; MemReqs carry neither, so this version learns at line granularity:
+ *  - The index stream is the most recent sequential stream of lines; index values are read from the simulated
+ *    process's memory (only within the page of a line the core just accessed).
+ *  - An indirect access X to index position j fixes A's base to within a line, [X - (B[j] << shift), +lineSize).
+ *    Learning pairs two consecutive indirect accesses to find the position and shift (element size of A, 1-16
+ *    bytes) that explain both; later matches narrow the base range.
+ * Index lines are also prefetched one line ahead.
+ */
+class IndirectPrefetcher : public Prefetcher {
+    private:
+        uint32_t indexBytes;  // element size of the index array B (4 or 8)
+        uint32_t idxPerLine;
+
+        //Per-process state: processes have separate address spaces, so one's accesses must not disturb the streams
+        //and pattern learned from another's. Line addresses here are virtual, i.e., without procMask
+        struct ProcState {
+            //Index stream
+            Address streamHeads[32];  // recently accessed lines, to detect sequential streams among indirect accesses
+            uint32_t nextHead;
+            Address idxLine;
+            g_vector<uint64_t> idxVals;   // values in idxLine
+            g_vector<uint64_t> nextVals;  // values in idxLine + 1, if readable
+            bool nextValid;
+            uint32_t idxPos;              // next index position expected to be consumed
+            uint32_t pfPos;               // next index position whose target has not been prefetched
+
+            //Pattern
+            bool pattern;
+            uint32_t shift;
+            Address baseLo, baseHi;  // byte address range of A's base
+            SatCounter<3, 2, 1> conf;  // prefetch when confident, drop the pattern when it reaches 0
+
+            //Learning: the previous indirect access
+            bool hasCand;
+            Address candLine;
+        };
+        g_vector<ProcState> procStates;  // indexed by procIdx
+
+        Counter profIndexLines, profMatches, profMismatches, profPatterns;
+
+        static const uint32_t MATCH_WINDOW = 4;
+        static const uint32_t MAX_SHIFT = 4;
+
+    public:
+        IndirectPrefetcher(const g_string& _name, const PrefetcherParams& _params, uint32_t _indexBytes);
+
+    protected:
+        void train(const MemReq& req, uint64_t respCycle, bool pfHit, bool pfLate);
+        void initPrefetcherStats(AggregateStat* s);
+
+    private:
+        bool isStream(ProcState& ps, Address lineAddr);
+        bool readLine(Address lineAddr, g_vector<uint64_t>& vals) const;
+        bool indexValue(const ProcState& ps, uint32_t pos, uint64_t* val) const;
+        bool matches(Address vLineAddr, uint64_t val, Address lo, Address hi, uint32_t s) const;
+        void learn(ProcState& ps, Address lineAddr);
+        void prefetchTargets(ProcState& ps, uint32_t fromPos);
 };
 
 #endif  // PREFETCHER_H_
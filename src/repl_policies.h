@@ -372,6 +372,261 @@ class LFUReplPolicy : public LegacyReplPolicy {
         }
 };
 
+/* Re-Reference Interval Prediction (RRIP), see "High Performance Cache Replacement Using
+ * Re-Reference Interval Prediction (RRIP)", Jaleel et al., ISCA 2010.
+ *
+ * Each line has an M-bit re-reference prediction value (RRPV). Hits promote lines to
+ * RRPV 0, and insertions use either a long (SRRIP) or mostly a distant (BRRIP)
+ * re-reference interval, which makes the policy scan-resistant. DRRIP chooses between
+ * both through set dueling: a few leader sets always use SRRIP or BRRIP, their misses
+ * drive a saturating PSEL counter, and the remaining (follower) sets use the winner.
+ *
+ * The candidate-based formulation works on both SetAssocArray and ZArray: rank() ages
+ * all candidates until one reaches the max RRPV, instead of aging the whole set. Sets
+ * for dueling are id/ways, which is exactly the set on SetAssocArray and a fixed group
+ * of line slots on ZArray (still a valid sample of insertions).
+ */
+class RRIPReplPolicy : public ReplPolicy {
+    public:
+        enum Insertion {SRRIP, BRRIP, DRRIP};
+
+    protected:
+        uint8_t* rrpv;
+        uint32_t numLines;
+        uint32_t ways;
+        uint8_t maxRRPV;
+        static const uint8_t INSERT_RRPV = 0xFF; // set by replaced(), consumed by the next update()
+
+        Insertion insertion;
+        uint32_t brripThrottle; // BRRIP inserts at maxRRPV-1 once every brripThrottle insertions (on average)
+        MTRand rnd;
+
+        // Set dueling
+        uint32_t duelPeriod; // one SRRIP and one BRRIP leader set every duelPeriod sets
+        uint64_t psel;
+        uint64_t pselMax;
+
+        Counter profSRRIPLeaderMisses, profBRRIPLeaderMisses;
+        Counter profSRRIPFollowerIns, profBRRIPFollowerIns;
+        ProxyStat profPSEL;
+
+    public:
+        RRIPReplPolicy(uint32_t _numLines, uint32_t _ways, uint32_t rrpvBits, Insertion _insertion,
+                uint32_t _brripThrottle, uint32_t leaderSets, uint32_t pselBits)
+            : numLines(_numLines), ways(_ways), insertion(_insertion), brripThrottle(_brripThrottle), rnd(0x5851F + (uint64_t)this)
+        {
+            if (rrpvBits == 0 || rrpvBits > 7) panic("RRIP needs 1-7 RRPV bits, %d given", rrpvBits);
+            if (brripThrottle == 0) panic("RRIP needs a non-zero BRRIP throttle");
+            if (pselBits == 0 || pselBits > 32) panic("RRIP needs 1-32 PSEL bits, %d given", pselBits);
+            maxRRPV = (1 << rrpvBits) - 1;
+            rrpv = gm_calloc<uint8_t>(numLines);
+            for (uint32_t i = 0; i < numLines; i++) rrpv[i] = maxRRPV;
+
+            uint32_t numSets = numLines/ways;
+            duelPeriod = MAX(numSets/MAX(leaderSets, 1u), 4u); //small caches still keep half their sets as followers
+            if (insertion == DRRIP && numSets < 2) panic("DRRIP set dueling needs at least 2 sets, %d lines and %d ways given", numLines, ways);
+            pselMax = (1ul << pselBits) - 1;
+            psel = pselMax/2;
+        }
+
+        ~RRIPReplPolicy() {
+            gm_free(rrpv);
+        }
+
+        void initStats(AggregateStat* parentStat) {
+            if (insertion != DRRIP) return;
+            profSRRIPLeaderMisses.init("srripLeaderMisses", "Misses (insertions) in SRRIP leader sets");
+            profBRRIPLeaderMisses.init("brripLeaderMisses", "Misses (insertions) in BRRIP leader sets");
+            profSRRIPFollowerIns.init("srripFollowerIns", "Follower set insertions that used SRRIP (dueling winner)");
+            profBRRIPFollowerIns.init("brripFollowerIns", "Follower set insertions that used BRRIP (dueling winner)");
+            profPSEL.init("psel", "Current PSEL value (above half the max selects BRRIP)", &psel);
+            parentStat->append(&profSRRIPLeaderMisses);
+            parentStat->append(&profBRRIPLeaderMisses);
+            parentStat->append(&profSRRIPFollowerIns);
+            parentStat->append(&profBRRIPFollowerIns);
+            parentStat->append(&profPSEL);
+        }
+
+        void update(uint32_t id, const MemReq* req) {
+            if (rrpv[id] == INSERT_RRPV) {
+                rrpv[id] = insertionRRPV(id);
+            } else {
+                rrpv[id] = 0; //hit priority
+            }
+        }
+
+        void replaced(uint32_t id) {
+            rrpv[id] = INSERT_RRPV;
+        }
+
+        template <typename C> inline uint32_t rank(const MemReq* req, C cands) {
+            //Prioritize (1) invalid lines, (2) lines without sharers, and (3) higher RRPVs
+            uint32_t bestCand = -1;
+            uint32_t bestScore = 0;
+            for (auto ci = cands.begin(); ci != cands.end(); ci.inc()) {
+                uint32_t id = *ci;
+                if (!cc->isValid(id)) return id;
+                uint32_t s = 1 + rrpv[id] + (cc->numSharers(id)? 0 : maxRRPV + 1);
+                if (s > bestScore) {
+                    bestCand = id;
+                    bestScore = s;
+                }
+            }
+            assert(bestCand != (uint32_t)-1);
+
+            //Age all candidates until the victim reaches maxRRPV
+            uint8_t delta = maxRRPV - rrpv[bestCand];
+            if (delta) {
+                for (auto ci = cands.begin(); ci != cands.end(); ci.inc()) {
+                    rrpv[*ci] = MIN(rrpv[*ci] + delta, maxRRPV);
+                }
+            }
+            return bestCand;
+        }
+
+        DECL_RANK_BINDINGS;
+
+    protected:
+        inline uint8_t insertionRRPV(uint32_t id) {
+            bool useBRRIP;
+            if (insertion == DRRIP) {
+                uint32_t leader = (id/ways) % duelPeriod;
+                if (leader == 0) { //SRRIP leader, a miss here favors BRRIP
+                    useBRRIP = false;
+                    psel = MIN(psel + 1, pselMax);
+                    profSRRIPLeaderMisses.inc();
+                } else if (leader == 1) { //BRRIP leader
+                    useBRRIP = true;
+                    if (psel) psel--;
+                    profBRRIPLeaderMisses.inc();
+                } else {
+                    useBRRIP = psel > pselMax/2;
+                    if (useBRRIP) profBRRIPFollowerIns.inc();
+                    else profSRRIPFollowerIns.inc();
+                }
+            } else {
+                useBRRIP = (insertion == BRRIP);
+            }
+
+            if (useBRRIP && rnd.randInt(brripThrottle - 1) != 0) return maxRRPV;
+            return maxRRPV - 1;
+        }
+};
+
+/* Signature-based Hit Predictor (SHiP), see "SHiP: Signature-based Hit Predictor for High
+ * Performance Caching", Wu et al., MICRO 2011. Layered on top of RRIP insertion.
+ *
+ * Each inserted line records a signature. A table of saturating counters (SHCT), indexed
+ * by signature, learns whether lines with that signature are re-referenced: hits increment
+ * the counter, and evictions of never-reused lines decrement it. Lines whose signature has
+ * a zero counter are predicted dead and inserted at the distant RRPV.
+ *
+ * MemReq does not carry the requesting instruction's PC, so signatures come from the
+ * requesting core (srcId) or from the memory region of the line (SHiP-Mem).
+ */
+class SHiPReplPolicy : public RRIPReplPolicy {
+    public:
+        enum Signature {CORE, REGION};
+
+    private:
+        struct LineInfo {
+            uint32_t sig;
+            bool valid;
+            bool reused;
+            bool predDead;
+        };
+
+        LineInfo* lineInfo;
+        uint8_t* shct;
+        uint32_t shctMask;
+        uint8_t shctMax;
+        Signature sigType;
+        uint32_t regionBits;
+
+        Counter profPredDeadIns, profPredReuseIns;
+        Counter profDeadCorrect, profDeadWrong, profReuseCorrect, profReuseWrong;
+
+    public:
+        SHiPReplPolicy(uint32_t _numLines, uint32_t _ways, uint32_t rrpvBits, Insertion _insertion,
+                uint32_t _brripThrottle, uint32_t leaderSets, uint32_t pselBits,
+                Signature _sigType, uint32_t shctEntries, uint32_t shctBits, uint32_t _regionBits)
+            : RRIPReplPolicy(_numLines, _ways, rrpvBits, _insertion, _brripThrottle, leaderSets, pselBits),
+              sigType(_sigType), regionBits(_regionBits)
+        {
+            if (!isPow2(shctEntries)) panic("SHiP needs a power of 2 SHCT entries, %d given", shctEntries);
+            if (shctBits == 0 || shctBits > 8) panic("SHiP needs 1-8 SHCT counter bits, %d given", shctBits);
+            lineInfo = gm_calloc<LineInfo>(numLines);
+            shct = gm_calloc<uint8_t>(shctEntries);
+            shctMask = shctEntries - 1;
+            shctMax = (1 << shctBits) - 1;
+            for (uint32_t i = 0; i < shctEntries; i++) shct[i] = 1; //weakly reused
+        }
+
+        ~SHiPReplPolicy() {
+            gm_free(lineInfo);
+            gm_free(shct);
+        }
+
+        void initStats(AggregateStat* parentStat) {
+            RRIPReplPolicy::initStats(parentStat);
+            profPredDeadIns.init("shipDeadIns", "Insertions predicted dead (distant RRPV)");
+            profPredReuseIns.init("shipReuseIns", "Insertions predicted reused");
+            profDeadCorrect.init("shipDeadCorrect", "Evicted lines correctly predicted dead");
+            profDeadWrong.init("shipDeadWrong", "Evicted lines predicted dead that were reused");
+            profReuseCorrect.init("shipReuseCorrect", "Evicted lines correctly predicted reused");
+            profReuseWrong.init("shipReuseWrong", "Evicted lines predicted reused that were not reused");
+            parentStat->append(&profPredDeadIns);
+            parentStat->append(&profPredReuseIns);
+            parentStat->append(&profDeadCorrect);
+            parentStat->append(&profDeadWrong);
+            parentStat->append(&profReuseCorrect);
+            parentStat->append(&profReuseWrong);
+        }
+
+        void update(uint32_t id, const MemReq* req) {
+            LineInfo& li = lineInfo[id];
+            if (rrpv[id] == INSERT_RRPV) {
+                li.sig = signature(req);
+                li.valid = true;
+                li.reused = false;
+                li.predDead = (shct[li.sig] == 0);
+                if (li.predDead) {
+                    rrpv[id] = maxRRPV;
+                    profPredDeadIns.inc();
+                } else {
+                    rrpv[id] = insertionRRPV(id);
+                    profPredReuseIns.inc();
+                }
+            } else {
+                rrpv[id] = 0;
+                li.reused = true;
+                if (shct[li.sig] < shctMax) shct[li.sig]++;
+            }
+        }
+
+        void replaced(uint32_t id) {
+            LineInfo& li = lineInfo[id];
+            if (li.valid) {
+                if (!li.reused && shct[li.sig]) shct[li.sig]--;
+                if (li.predDead) {
+                    if (li.reused) profDeadWrong.inc();
+                    else profDeadCorrect.inc();
+                } else {
+                    if (li.reused) profReuseCorrect.inc();
+                    else profReuseWrong.inc();
+                }
+                li.valid = false;
+            }
+            RRIPReplPolicy::replaced(id);
+        }
+
+    private:
+        inline uint32_t signature(const MemReq* req) const {
+            uint64_t key = (sigType == CORE)? req->srcId : (req->lineAddr >> regionBits);
+            return (uint32_t)((key * 0x9E3779B97F4A7C15ul) >> 32) & shctMask;
+        }
+};
+
 //Extends a given replacement policy to profile access ordering violations
 template <class T>
 class ProfViolReplPolicy : public T {
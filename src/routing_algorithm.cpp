@@ -94,6 +94,70 @@ uint32_t TreeRoutingAlgorithm::uptrace(uint32_t& id1, uint32_t& id2) const {
     return level;
 }
 
+DragonflyRoutingAlgorithm::DragonflyRoutingAlgorithm(uint32_t _groups, uint32_t _routersPerGroup, uint32_t _globalPorts, uint32_t _concentration)
+    : groups(_groups), routersPerGroup(_routersPerGroup), globalPorts(_globalPorts), concentration(_concentration),
+      numTerminals(_groups * _routersPerGroup * _concentration), routerIdOffset(_concentration == 1 ? 0 : numTerminals)
+{
+    if (!groups || !routersPerGroup || !concentration) panic("DragonflyRoutingAlgorithm: empty network!?");
+    if (routersPerGroup * globalPorts < groups - 1)
+        panic("DragonflyRoutingAlgorithm: %u routers with %u global ports each cannot connect %u groups",
+                routersPerGroup, globalPorts, groups);
+    if (routersPerGroup * globalPorts > groups - 1)
+        warn("DragonflyRoutingAlgorithm: %u global links per group, only %u used", routersPerGroup * globalPorts, groups - 1);
+}
+
+void DragonflyRoutingAlgorithm::nextHop(uint32_t currentId, uint32_t destinationId, uint32_t* nextId, uint32_t* portId) {
+    // The destination may also be a router, e.g., the center router when used as a level of a hierarchy.
+    assert(destinationId < getNumRouters());
+    assert(currentId != destinationId);
+
+    if (currentId < routerIdOffset) {
+        // At a terminal node, go up to its router.
+        *nextId = routerIdOffset + currentId / concentration;
+        *portId = 0;
+        return;
+    }
+
+    uint32_t cur = routerOf(currentId);
+    uint32_t dst = routerOf(destinationId);
+    uint32_t curGroup = cur / routersPerGroup;
+    uint32_t dstGroup = dst / routersPerGroup;
+
+    if (cur == dst) {
+        // At the destination router, go down to the terminal.
+        assert(destinationId < routerIdOffset);
+        *nextId = destinationId;
+        *portId = destinationId % concentration;
+    } else if (curGroup == dstGroup) {
+        // Local hop to the destination router.
+        *nextId = routerIdOffset + dst;
+        *portId = concentration + dst % routersPerGroup;
+    } else {
+        uint32_t gwRouter, gwPort;
+        globalLink(curGroup, dstGroup, &gwRouter, &gwPort);
+        if (cur % routersPerGroup != gwRouter) {
+            // Local hop to the router with the global link to the destination group.
+            *nextId = routerIdOffset + curGroup * routersPerGroup + gwRouter;
+            *portId = concentration + gwRouter;
+        } else {
+            // Global hop, arriving at the router with the link back to this group.
+            uint32_t inRouter, inPort;
+            globalLink(dstGroup, curGroup, &inRouter, &inPort);
+            *nextId = routerIdOffset + dstGroup * routersPerGroup + inRouter;
+            *portId = concentration + routersPerGroup + gwPort;
+        }
+    }
+
+    DEBUG("DragonflyRoutingAlgorithm: %u -> %u: %u, port %u", currentId, destinationId, *nextId, *portId);
+}
+
+uint32_t DragonflyRoutingAlgorithm::getVCClass(uint32_t currentId, uint32_t destinationId) {
+    if (currentId < routerIdOffset) return 0;
+    uint32_t curGroup = routerOf(currentId) / routersPerGroup;
+    uint32_t dstGroup = routerOf(destinationId) / routersPerGroup;
+    return curGroup == dstGroup ? 1 : 0;
+}
+
 
 HomoHierRoutingAlgorithm::HomoHierRoutingAlgorithm(const g_vector<RoutingAlgorithm*>& _levels)
     : levels(_levels)
@@ -194,6 +258,27 @@ void HomoHierRoutingAlgorithm::nextHop(uint32_t currentId, uint32_t destinationI
             curAnc.str().c_str(), nxtAnc.str().c_str(), dstAnc.str().c_str());
 }
 
+uint32_t HomoHierRoutingAlgorithm::getNumVCClasses() const {
+    uint32_t n = 1;
+    for (auto l : levels) n = MAX(n, l->getNumVCClasses());
+    return n;
+}
+
+uint32_t HomoHierRoutingAlgorithm::getVCClass(uint32_t currentId, uint32_t destinationId) {
+    // Mirror nextHop(). Moving between levels never closes a cycle within a level, so those hops use class 0.
+    uint32_t level = tuples[currentId].level;
+    auto curAnc = getAncestor(currentId, level);
+    auto dstAnc = getAncestor(destinationId, level);
+    if (curAnc.group == dstAnc.group) {
+        if (curAnc.local == dstAnc.local) return 0;
+        return levels[level]->getVCClass(curAnc.local, dstAnc.local);
+    } else {
+        uint32_t center = levels[level]->getCenterRouterId();
+        if (curAnc.local == center) return 0;
+        return levels[level]->getVCClass(curAnc.local, center);
+    }
+}
+
 uint32_t HomoHierRoutingAlgorithm::tuple2Id(const RouterTuple& tuple) const {
     uint32_t numTerminals = levels[tuple.level]->getNumTerminals();
     uint32_t numRouters = levels[tuple.level]->getNumRouters();
@@ -6,6 +6,16 @@
 #include "log.h"
 #include "str.h"
 
+/**
+ * Congestion feedback to adaptive routing algorithms.
+ *
+ * Reports the load of an output port measured in the previous phase, as a percentage of the port bandwidth.
+ */
+class RoutingLoadFeedback {
+    public:
+        virtual uint32_t getPortLoad(uint32_t routerId, uint32_t portId) = 0;
+};
+
 class RoutingAlgorithm : public GlobAlloc {
     /** The first N routers are terminal routers if there are N terminals. */
     public:
@@ -14,6 +24,22 @@ class RoutingAlgorithm : public GlobAlloc {
         virtual uint32_t getNumPorts() const = 0;
         virtual uint32_t getCenterRouterId() const = 0;
         virtual void nextHop(uint32_t currentId, uint32_t destinationId, uint32_t* nextId, uint32_t* portId) = 0;
+
+        /* Adaptive routing. */
+
+        // Whether nextHop() only depends on the current and destination routers, so paths can be cached.
+        virtual bool isDeterministic() const { return true; }
+
+        // Called by the interconnect with its router load feedback. Ignored by oblivious algorithms.
+        virtual void setLoadFeedback(RoutingLoadFeedback* feedback) {}
+
+        /* Deadlock avoidance. */
+
+        // Number of virtual channel classes the algorithm needs to be deadlock-free.
+        virtual uint32_t getNumVCClasses() const { return 1; }
+
+        // Virtual channel class of the next hop from currentId towards destinationId.
+        virtual uint32_t getVCClass(uint32_t currentId, uint32_t destinationId) { return 0; }
 };
 
 /**
@@ -125,6 +151,318 @@ class Mesh2DDimensionOrderRoutingAlgorithm : public RoutingAlgorithm {
         }
 };
 
+/**
+ * Minimal adaptive routing for 2D mesh network. Same topology and port numbering as dimension-order routing.
+ *
+ * The turn model restricts the admissible output ports:
+ * - WestFirst: all west hops go first, then adaptive among E, N, S.
+ * - OddEven: no E->N/S turns in even columns, no N/S->W turns in odd columns (Chiu, TPDS'00). The exemption for
+ *   turns at the source column is dropped since nextHop() does not know the source; the admissible set is never empty.
+ * - Minimal: any productive direction. Deadlock is not modeled, so this is fine for timing purposes.
+ *
+ * When two ports are admissible, the static selection picks one by a hash of the (current, destination) pair,
+ * weighted by the hops left in each dimension, which spreads flows to each destination over the admissible minimal
+ * paths; it stays deterministic, so paths can be precomputed. If congestion aware and given load feedback, flows are
+ * instead split between the two ports in inverse proportion to their load in the previous phase. Congestion-aware
+ * selection needs router Ids of this network, so it falls back to the static selection when used as a level of a
+ * hierarchy.
+ */
+class Mesh2DAdaptiveRoutingAlgorithm : public RoutingAlgorithm {
+    public:
+        enum TurnModel {
+            WestFirst,
+            OddEven,
+            Minimal,
+        };
+
+    private:
+        const uint32_t dimX;
+        const uint32_t dimY;
+        const TurnModel turnModel;
+        const bool congestionAware;
+        RoutingLoadFeedback* feedback;
+
+    public:
+        const uint32_t PortE = 0;
+        const uint32_t PortW = 1;
+        const uint32_t PortN = 2;
+        const uint32_t PortS = 3;
+        const uint32_t PortL = 4;
+        const uint32_t PortNum = 5;
+
+    public:
+        Mesh2DAdaptiveRoutingAlgorithm(uint32_t _dimX, uint32_t _dimY, TurnModel _turnModel, bool _congestionAware)
+            : dimX(_dimX), dimY(_dimY), turnModel(_turnModel), congestionAware(_congestionAware), feedback(nullptr) {}
+
+        uint32_t getNumTerminals() const { return dimX * dimY; }
+
+        uint32_t getNumRouters() const { return dimX * dimY; }
+
+        uint32_t getNumPorts() const { return PortNum; }
+
+        uint32_t getCenterRouterId() const { return (dimX / 2) * dimY + (dimY / 2); }
+
+        bool isDeterministic() const { return !(congestionAware && feedback); }
+
+        void setLoadFeedback(RoutingLoadFeedback* _feedback) { feedback = _feedback; }
+
+        void nextHop(uint32_t currentId, uint32_t destinationId, uint32_t* nextId, uint32_t* portId) {
+            auto curX = currentId / dimY;
+            auto curY = currentId % dimY;
+            auto dstX = destinationId / dimY;
+            auto dstY = destinationId % dimY;
+            assert(curX < dimX);
+            assert(dstX < dimX);
+            assert(currentId != destinationId);
+
+            uint32_t distX = (curX > dstX) ? curX - dstX : dstX - curX;
+            uint32_t distY = (curY > dstY) ? curY - dstY : dstY - curY;
+            uint32_t portX = (curX > dstX) ? PortW : PortE;
+            uint32_t portY = (curY > dstY) ? PortS : PortN;
+
+            // Admissible productive directions.
+            bool canX = distX;
+            bool canY = distY;
+            if (canX && canY) {
+                switch (turnModel) {
+                    case WestFirst:
+                        if (curX > dstX) canY = false;
+                        break;
+                    case OddEven:
+                        if (curX < dstX) {
+                            // Eastbound: turning to N/S only in odd columns; going E only if the last column turn is legal.
+                            canY = curX % 2 == 1;
+                            canX = dstX % 2 == 1 || distX != 1;
+                        } else {
+                            // Westbound: turning from N/S to W is only legal in even columns, so leave them early.
+                            canY = curX % 2 == 0;
+                        }
+                        break;
+                    case Minimal:
+                        break;
+                }
+            }
+            assert(canX || canY);
+
+            bool goX;
+            if (!(canX && canY)) {
+                goX = canX;
+            } else if (congestionAware && feedback) {
+                // Split flows between the two ports in inverse proportion to their load, so that all flows do not
+                // herd onto the same port for a whole phase. The split is a hash of the flow to stay deterministic.
+                uint32_t loadX = feedback->getPortLoad(currentId, portX) + 1;
+                uint32_t loadY = feedback->getPortLoad(currentId, portY) + 1;
+                goX = flowHash(currentId, destinationId) % (loadX + loadY) < loadY;
+            } else {
+                // Go X with probability distX / (distX + distY), i.e., uniformly over the minimal paths
+                goX = flowHash(currentId, destinationId) % (distX + distY) < distX;
+            }
+
+            uint32_t nextX = curX;
+            uint32_t nextY = curY;
+            if (goX) {
+                nextX = (curX > dstX) ? curX - 1 : curX + 1;
+                *portId = portX;
+            } else {
+                nextY = (curY > dstY) ? curY - 1 : curY + 1;
+                *portId = portY;
+            }
+            assert(nextX < dimX);
+            assert(nextY < dimY);
+            *nextId = nextX * dimY + nextY;
+        }
+
+    private:
+        static uint32_t flowHash(uint32_t currentId, uint32_t destinationId) {
+            uint32_t h = (currentId * 0x9E3779B1u) ^ (destinationId * 0x85EBCA77u);
+            h ^= h >> 15;
+            h *= 0xC2B2AE3Du;
+            h ^= h >> 13;
+            return h;
+        }
+};
+
+/**
+ * Dimension-order (X -> Y) routing for 2D torus network.
+ *
+ * Same port numbering as the 2D mesh. Each dimension is a ring, and packets take the shorter direction (E or N on
+ * ties). For deadlock freedom, each ring has a dateline on its wraparound link: a packet whose remaining path in the
+ * current dimension crosses the wraparound link uses VC class 1 up to and including that link, and class 0 otherwise.
+ * Class 0 then never uses a wraparound link, and class 1 only leads into class 0, so neither has a cyclic dependency.
+ */
+class Torus2DRoutingAlgorithm : public RoutingAlgorithm {
+    private:
+        const uint32_t dimX;
+        const uint32_t dimY;
+
+    public:
+        const uint32_t PortE = 0;
+        const uint32_t PortW = 1;
+        const uint32_t PortN = 2;
+        const uint32_t PortS = 3;
+        const uint32_t PortL = 4;
+        const uint32_t PortNum = 5;
+
+    public:
+        Torus2DRoutingAlgorithm(uint32_t _dimX, uint32_t _dimY)
+            : dimX(_dimX), dimY(_dimY) {}
+
+        uint32_t getNumTerminals() const { return dimX * dimY; }
+
+        uint32_t getNumRouters() const { return dimX * dimY; }
+
+        uint32_t getNumPorts() const { return PortNum; }
+
+        uint32_t getCenterRouterId() const { return (dimX / 2) * dimY + (dimY / 2); }
+
+        void nextHop(uint32_t currentId, uint32_t destinationId, uint32_t* nextId, uint32_t* portId) {
+            auto curX = currentId / dimY;
+            auto curY = currentId % dimY;
+            auto dstX = destinationId / dimY;
+            auto dstY = destinationId % dimY;
+            assert(curX < dimX);
+            assert(dstX < dimX);
+            uint32_t nextX = curX;
+            uint32_t nextY = curY;
+            if (curX != dstX) {
+                // Route on X.
+                bool inc = increasing(curX, dstX, dimX);
+                nextX = inc ? (curX + 1) % dimX : (curX + dimX - 1) % dimX;
+                *portId = inc ? PortE : PortW;
+            } else {
+                // Route on Y.
+                bool inc = increasing(curY, dstY, dimY);
+                nextY = inc ? (curY + 1) % dimY : (curY + dimY - 1) % dimY;
+                *portId = inc ? PortN : PortS;
+            }
+            *nextId = nextX * dimY + nextY;
+        }
+
+        uint32_t getNumVCClasses() const { return 2; }
+
+        uint32_t getVCClass(uint32_t currentId, uint32_t destinationId) {
+            auto curX = currentId / dimY;
+            auto curY = currentId % dimY;
+            auto dstX = destinationId / dimY;
+            auto dstY = destinationId % dimY;
+            if (curX != dstX) return wraps(curX, dstX, dimX) ? 1 : 0;
+            return wraps(curY, dstY, dimY) ? 1 : 0;
+        }
+
+    private:
+        // Whether the shorter way from cur to dst in a ring of size dim is the increasing direction.
+        static bool increasing(uint32_t cur, uint32_t dst, uint32_t dim) {
+            uint32_t fwd = (dst + dim - cur) % dim;
+            return fwd <= dim - fwd;
+        }
+
+        // Whether the remaining path from cur to dst crosses the wraparound link between dim - 1 and 0.
+        static bool wraps(uint32_t cur, uint32_t dst, uint32_t dim) {
+            return increasing(cur, dst, dim) ? dst < cur : dst > cur;
+        }
+};
+
+/**
+ * Dimension-order (X -> Y) routing for 2D flattened butterfly network (Kim, ISCA'07; as in Simba, MICRO'19).
+ *
+ * Each router is directly connected to all other routers in the same row and in the same column, so any packet takes
+ * at most two hops. Ports 0 to dimX - 1 go to the router with that X in the same row, ports dimX to dimX + dimY - 1
+ * go to the router with that Y in the same column, and the last port is local. Dimension order is deadlock-free.
+ */
+class FlattenedButterfly2DRoutingAlgorithm : public RoutingAlgorithm {
+    private:
+        const uint32_t dimX;
+        const uint32_t dimY;
+
+    public:
+        FlattenedButterfly2DRoutingAlgorithm(uint32_t _dimX, uint32_t _dimY)
+            : dimX(_dimX), dimY(_dimY) {}
+
+        uint32_t getNumTerminals() const { return dimX * dimY; }
+
+        uint32_t getNumRouters() const { return dimX * dimY; }
+
+        uint32_t getNumPorts() const { return dimX + dimY + 1; }
+
+        uint32_t getCenterRouterId() const { return (dimX / 2) * dimY + (dimY / 2); }
+
+        void nextHop(uint32_t currentId, uint32_t destinationId, uint32_t* nextId, uint32_t* portId) {
+            auto curX = currentId / dimY;
+            auto curY = currentId % dimY;
+            auto dstX = destinationId / dimY;
+            auto dstY = destinationId % dimY;
+            assert(curX < dimX);
+            assert(dstX < dimX);
+            if (curX != dstX) {
+                // Route on X.
+                *nextId = dstX * dimY + curY;
+                *portId = dstX;
+            } else {
+                // Route on Y.
+                *nextId = curX * dimY + dstY;
+                *portId = dimX + dstY;
+            }
+        }
+};
+
+/**
+ * Minimal routing for dragonfly network (Kim, ISCA'08).
+ *
+ * There are \c groups groups of \c routersPerGroup routers each. Routers in a group are fully connected by local
+ * links, and each router has \c globalPorts global links to other groups. Global link k (numbered over all routers
+ * of the group) of group G goes to group (G + k + 1) % groups, so routersPerGroup * globalPorts must be at least
+ * groups - 1 for all groups to be connected.
+ *
+ * Each router has \c concentration terminals. With a concentration of 1 routers are the terminals themselves;
+ * otherwise terminals are separate single-port nodes numbered first, followed by the routers.
+ *
+ * Router ports: the first \c concentration ports go down to terminals, the next \c routersPerGroup ports go to the
+ * router with that index in the group, and the last \c globalPorts ports are global. Terminal nodes use port 0.
+ *
+ * Packets use VC class 0 in the source group and class 1 after the global hop, which is deadlock-free for minimal
+ * routing.
+ */
+class DragonflyRoutingAlgorithm : public RoutingAlgorithm {
+    private:
+        const uint32_t groups;
+        const uint32_t routersPerGroup;
+        const uint32_t globalPorts;
+        const uint32_t concentration;
+
+        const uint32_t numTerminals;
+        const uint32_t routerIdOffset;  // Id of router 0
+
+    public:
+        DragonflyRoutingAlgorithm(uint32_t _groups, uint32_t _routersPerGroup, uint32_t _globalPorts, uint32_t _concentration);
+
+        uint32_t getNumTerminals() const { return numTerminals; }
+
+        uint32_t getNumRouters() const { return routerIdOffset + groups * routersPerGroup; }
+
+        uint32_t getNumPorts() const { return concentration + routersPerGroup + globalPorts; }
+
+        uint32_t getCenterRouterId() const { return routerIdOffset; }
+
+        void nextHop(uint32_t currentId, uint32_t destinationId, uint32_t* nextId, uint32_t* portId);
+
+        uint32_t getNumVCClasses() const { return 2; }
+
+        uint32_t getVCClass(uint32_t currentId, uint32_t destinationId);
+
+    private:
+        // Router (index over all groups) of the given terminal or router Id.
+        uint32_t routerOf(uint32_t id) const {
+            return id < routerIdOffset ? id / concentration : id - routerIdOffset;
+        }
+
+        // Router (index within the group) holding the global link from group src to group dst, and its global port.
+        void globalLink(uint32_t src, uint32_t dst, uint32_t* router, uint32_t* port) const {
+            uint32_t k = (dst + groups - src - 1) % groups;
+            *router = k / globalPorts;
+            *port = k % globalPorts;
+        }
+};
+
 /**
  * Star-topology routing, with \c chains chains, each of which has length \c length.
  *
@@ -274,6 +612,10 @@ class HomoHierRoutingAlgorithm : public RoutingAlgorithm {
 
         void nextHop(uint32_t currentId, uint32_t destinationId, uint32_t* nextId, uint32_t* portId);
 
+        uint32_t getNumVCClasses() const;
+
+        uint32_t getVCClass(uint32_t currentId, uint32_t destinationId);
+
     private:
         const g_vector<RoutingAlgorithm*> levels;
 
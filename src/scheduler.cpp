@@ -28,6 +28,7 @@
 #include <fstream>
 #include <regex.h>  // POSIX regex instead of C++11 regex
 #include "config.h" // for ParseList
+#include "numa_map.h"
 #include "pin.H"
 #include "process_tree.h"
 #include "profile_stats.h"
@@ -90,6 +91,39 @@ bool IsSleepingInFutex(uint32_t linuxPid, uint32_t linuxTid, uintptr_t futexAddr
 }
 
 
+void Scheduler::initNodes() {
+    NUMAMap* numaMap = zinfo->numaMap;
+    if (!numaMap) {
+        if (localityPlacement) warn("Locality-aware scheduling without a NUMA map, all cores are in one node");
+        return;
+    }
+
+    uint32_t numNodes = numaMap->getMaxNode() + 1;
+    nodeCores.assign(numNodes, CoreSet(numCores));
+    uint32_t nodelessCores = 0;
+    for (uint32_t c = 0; c < numCores; c++) {
+        uint32_t node = numaMap->getNodeOfCore(c);
+        if (node == NUMAMap::INVALID_NODE) {
+            // Not in the cpumap of any node of the patched root; place it with node 0
+            node = 0;
+            nodelessCores++;
+        }
+        coreNode[c] = node;
+        nodeCores[node].set(c);
+    }
+    if (nodelessCores) warn("Scheduler: %u cores are in no NUMA node, treating them as part of node 0", nodelessCores);
+
+    nodeOrder.assign(numNodes, g_vector<uint32_t>());
+    for (uint32_t n = 0; n < numNodes; n++) {
+        for (uint32_t m = 0; m < numNodes; m++) {
+            if (!nodeCores[m].empty()) nodeOrder[n].push_back(m);
+        }
+        // Ours first, even if the distance table says otherwise
+        auto dist = [&](uint32_t m) { return (m == n)? 0 : numaMap->getNodeDistance(n, m); };
+        std::stable_sort(nodeOrder[n].begin(), nodeOrder[n].end(), [&](uint32_t a, uint32_t b) { return dist(a) < dist(b); });
+    }
+}
+
 void Scheduler::watchdogThreadFunc() {
     info("Started scheduler watchdog thread");
     uint64_t lastPhase = 0;
@@ -315,7 +349,7 @@ void Scheduler::notifyFutexWakeStart(uint32_t pid, uint32_t tid, uint32_t maxWak
     // Programs sometimes call FUTEX_WAIT with maxWakes = UINT_MAX to wake
     // everyone waiting on it; we cap to a reasonably high number to avoid
     // overflows on maxAllowedFutexWakeups
-    maxWakes = MIN(maxWakes, 1<<24 /*16M wakes*/);
+    maxWakes = MIN(maxWakes, 1u<<24 /*16M wakes*/);
 
     maxAllowedFutexWakeups += maxWakes;
     th->futexJoin.maxWakes = maxWakes;
@@ -29,7 +29,6 @@
 
 #include <algorithm>
 #include <iomanip>
-#include <list>
 #include <sstream>
 #include <vector>
 #include "barrier.h"
@@ -41,9 +40,98 @@
 #include "intrusive_list.h"
 #include "proc_stats.h"
 #include "process_stats.h"
+#include "profile_stats.h"
 #include "stats.h"
 #include "zsim.h"
 
+/* Set of cores, as a bitmask. Lets the scheduler intersect affinity masks with the free or available contexts a word
+ * (64 cores) at a time.
+ */
+class CoreSet {
+    private:
+        g_vector<uint64_t> words;  // bits past the last core are always 0
+        uint32_t numCores;
+
+    public:
+        CoreSet() : numCores(0) {}
+        explicit CoreSet(uint32_t _numCores) : words((_numCores + 63)/64, 0), numCores(_numCores) {}
+
+        explicit CoreSet(const g_vector<bool>& mask) : CoreSet(mask.size()) {
+            for (uint32_t c = 0; c < numCores; c++) if (mask[c]) set(c);
+        }
+
+        void set(uint32_t c) { words[c/64] |= 1uL << (c % 64); }
+        void clear(uint32_t c) { words[c/64] &= ~(1uL << (c % 64)); }
+        bool test(uint32_t c) const { return words[c/64] & (1uL << (c % 64)); }
+
+        void fill() {
+            for (uint32_t c = 0; c < numCores; c++) set(c);
+        }
+
+        // Make this set the cores in both a and b, which must have the same size
+        void setIntersection(const CoreSet& a, const CoreSet& b) {
+            words.resize(a.words.size());
+            numCores = a.numCores;
+            for (uint32_t w = 0; w < words.size(); w++) words[w] = a.words[w] & b.words[w];
+        }
+
+        // Remove the cores of other from this set
+        void remove(const CoreSet& other) {
+            for (uint32_t w = 0; w < words.size(); w++) words[w] &= ~other.words[w];
+        }
+
+        bool empty() const {
+            for (uint64_t word : words) if (word) return false;
+            return true;
+        }
+
+        uint32_t count() const {
+            uint32_t n = 0;
+            for (uint64_t word : words) n += __builtin_popcountl(word);
+            return n;
+        }
+
+        bool operator==(const CoreSet& other) const { return words == other.words; }
+
+        uint64_t hash() const {
+            uint64_t h = 0xcbf29ce484222325uL;  // FNV-1a over words
+            for (uint64_t word : words) h = (h ^ word) * 0x100000001b3uL;
+            return h;
+        }
+
+        // First core in both sets at or after start, wrapping around; -1 if there is none
+        uint32_t firstCommon(const CoreSet& other, uint32_t start) const {
+            uint32_t w = start/64;
+            uint64_t common = words[w] & other.words[w] & (~0uL << (start % 64));
+            for (uint32_t i = 0; i < words.size(); i++) {
+                if (common) return w*64 + __builtin_ctzl(common);
+                w = (w + 1 == words.size())? 0 : w + 1;
+                common = words[w] & other.words[w];
+            }
+            return common? w*64 + __builtin_ctzl(common) : -1;  // back at the first word, cores before start
+        }
+
+        uint32_t countCommon(const CoreSet& other) const {
+            uint32_t n = 0;
+            for (uint32_t w = 0; w < words.size(); w++) n += __builtin_popcountl(words[w] & other.words[w]);
+            return n;
+        }
+
+        // n-th (from 0) core in both sets; n must be below countCommon(other)
+        uint32_t nthCommon(const CoreSet& other, uint32_t n) const {
+            for (uint32_t w = 0; w < words.size(); w++) {
+                uint64_t common = words[w] & other.words[w];
+                uint32_t wordCount = __builtin_popcountl(common);
+                if (n < wordCount) {
+                    for (; n > 0; n--) common &= common - 1;  // drop lowest bits
+                    return w*64 + __builtin_ctzl(common);
+                }
+                n -= wordCount;
+            }
+            panic("CoreSet::nthCommon(): not enough common cores");
+        }
+};
+
 /**
  * TODO (dsm): This class is due for a heavy pass or rewrite. Some things are more complex than they should:
  * - The OUT state is unnecessary. It is done as a weak link between a thread that left and its context to preserve affinity, but
@@ -79,8 +167,11 @@ class Scheduler : public GlobAlloc, public Callee {
         Barrier bar;
         uint32_t numCores;
         uint32_t schedQuantum; //in phases
+        const bool localityPlacement; //if set, place threads near their last context, see schedThread() and schedTick()
+        const bool profileSched; //if set, time the policy functions in schedNs
 
         struct FakeLeaveInfo;
+        struct RunQueue;
 
         enum FutexJoinAction {FJA_NONE, FJA_WAKE, FJA_WAIT};
         struct FutexJoinInfo {
@@ -96,6 +187,7 @@ class Scheduler : public GlobAlloc, public Callee {
 
             ThreadState state;
             uint32_t cid; //only current if RUNNING; otherwise, it's the last one used.
+            bool hasRun; //if false, cid is not a last context, so it says nothing about locality
 
             volatile ThreadInfo* handoffThread; //if at the end of a sync() this is not nullptr, we need to transfer our current context to the thread pointed here.
             volatile uint32_t futexWord;
@@ -105,6 +197,10 @@ class Scheduler : public GlobAlloc, public Callee {
             uint64_t wakeupPhase; //if SLEEPING, when do we have to wake up?
 
             g_vector<bool> mask;
+            CoreSet coreMask;  // same as mask
+
+            RunQueue* runQueue;  // if QUEUED, the one we're in; nullptr if being handed off a context
+            uint64_t queueSeq;  // if QUEUED, order of arrival to the run queues
 
             FakeLeaveInfo* fakeLeave; // for accurate join-leaves, see below
             volatile uint32_t flWord; // if non-zero, currently transiting fake leave to true leave
@@ -112,25 +208,41 @@ class Scheduler : public GlobAlloc, public Callee {
             FutexJoinInfo futexJoin;
 
             ThreadInfo(uint32_t _gid, uint32_t _linuxPid, uint32_t _linuxTid, const g_vector<bool>& _mask) :
-                InListNode<ThreadInfo>(), gid(_gid), linuxPid(_linuxPid), linuxTid(_linuxTid), mask(_mask)
+                InListNode<ThreadInfo>(), gid(_gid), linuxPid(_linuxPid), linuxTid(_linuxTid), mask(_mask), coreMask(_mask)
             {
                 state = STARTED;
                 cid = 0;
+                hasRun = false;
                 handoffThread = nullptr;
                 futexWord = 0;
                 markedForSleep = false;
                 wakeupPhase = 0;
+                runQueue = nullptr;
+                queueSeq = 0;
                 assert(mask.size() == zinfo->numCores);
-                uint32_t count = 0;
-                for (auto b : mask) if (b) count++;
-                if (count == 0) panic("Empty mask on gid %d!", gid);
+                if (coreMask.empty()) panic("Empty mask on gid %d!", gid);
                 fakeLeave = nullptr;
                 flWord = 0;
                 futexJoin.action = FJA_NONE;
             }
+
+            void setMask(const g_vector<bool>& _mask) {
+                mask = _mask;
+                coreMask = CoreSet(_mask);
+            }
+        };
+
+        /* Queued threads with the same mask, in FIFO order. These act as per-core run queues: each core indexes the
+         * run queues of the masks that include it, and takes the longest-queued thread among them. Masks are few
+         * (typically, all cores, or one or a few per node/process), so both queueing and picking are O(1) in practice.
+         */
+        struct RunQueue : GlobAlloc {
+            const CoreSet mask;
+            InList<ThreadInfo> threads;
+            explicit RunQueue(const CoreSet& _mask) : mask(_mask) {}
         };
 
-        struct ContextInfo : InListNode<ContextInfo> {
+        struct ContextInfo {
             uint32_t cid;
             ContextState state;
             ThreadInfo* curThread; //only current if used, otherwise nullptr
@@ -141,9 +253,22 @@ class Scheduler : public GlobAlloc, public Callee {
 
         g_unordered_map<uint32_t, g_vector<bool>> pendingMaskMap; // for those threads who set masks but still in FF and not start
 
-        InList<ContextInfo> freeList;
+        CoreSet freeSet;  // IDLE contexts
+        CoreSet outSet;  // contexts of the threads in outQueue
+
+        g_vector<RunQueue*> runQueues;  // never freed, there are few distinct masks
+        g_unordered_map<uint64_t, g_vector<RunQueue*>> runQueueMap;  // mask hash -> run queues
+        g_vector<g_vector<RunQueue*>> coreRunQueues;  // per context, run queues of the masks that include it
+        uint32_t queuedThreads;
+        uint64_t nextQueueSeq;
+        g_vector<ThreadInfo*> tickHeads;  // schedTick() scratch space
+        CoreSet candSet;  // schedThread() and schedTick() scratch space
+
+        // NUMA nodes of contexts, set by initNodes(); a single node without a NUMAMap
+        g_vector<uint32_t> coreNode;
+        g_vector<CoreSet> nodeCores;  // per node, its contexts
+        g_vector<g_vector<uint32_t>> nodeOrder;  // per node, the nodes with contexts from nearest to farthest
 
-        InList<ThreadInfo> runQueue;
         InList<ThreadInfo> outQueue;
         InList<ThreadInfo> sleepQueue; //contains all the sleeping threads, it is ORDERED by wakeup time
 
@@ -164,26 +289,42 @@ class Scheduler : public GlobAlloc, public Callee {
         Counter scheduleEvents, waitEvents, handoffEvents, sleepEvents;
         Counter idlePhases, idlePeriods;
         VectorCounter occHist, runQueueHist;
+        VectorCounter schedNs;  // host time in the policy functions, see SchedFunc; only if profileSched
+        Counter schedTicks;
+        Counter migrations, nodeMigrations;
         uint32_t scheduledThreads;
 
+        enum SchedFunc {SF_THREAD, SF_CONTEXT, SF_TICK, SF_NUM};
+
         // gid <-> (pid, tid) xlat functions
         inline uint32_t getGid(uint32_t pid, uint32_t tid) const {return (pid << 16) | tid;}
         inline uint32_t getPid(uint32_t gid) const {return gid >> 16;}
         inline uint32_t getTid(uint32_t gid) const {return gid & 0x0FFFF;}
 
     public:
-        Scheduler(void (*_atSyncFunc)(void), uint32_t _parallelThreads, uint32_t _numCores, uint32_t _schedQuantum) :
-            atSyncFunc(_atSyncFunc), bar(_parallelThreads, this), numCores(_numCores), schedQuantum(_schedQuantum), rnd(0x5C73D9134)
+        Scheduler(void (*_atSyncFunc)(void), uint32_t _parallelThreads, uint32_t _numCores, uint32_t _schedQuantum, bool _localityPlacement,
+                bool _profileSched = false) :
+            atSyncFunc(_atSyncFunc), bar(_parallelThreads, this), numCores(_numCores), schedQuantum(_schedQuantum),
+            localityPlacement(_localityPlacement), profileSched(_profileSched), rnd(0x5C73D9134)
         {
             contexts.resize(numCores);
+            freeSet = CoreSet(numCores);
+            outSet = CoreSet(numCores);
             for (uint32_t i = 0; i < numCores; i++) {
                 contexts[i].cid = i;
                 contexts[i].state = IDLE;
                 contexts[i].curThread = nullptr;
-                freeList.push_back(&contexts[i]);
+                freeSet.set(i);
             }
+            coreRunQueues.resize(numCores);
+            coreNode.resize(numCores, 0);
+            nodeCores.resize(1, CoreSet(numCores));
+            nodeCores[0].fill();
+            nodeOrder.resize(1, g_vector<uint32_t>(1, 0));
+            queuedThreads = 0;
+            nextQueueSeq = 0;
             schedLock = 0;
-            //nextVictim = 0; //only used when freeList is empty.
+            //nextVictim = 0; //only used when freeSet is empty.
             curPhase = 0;
             scheduledThreads = 0;
 
@@ -192,13 +333,16 @@ class Scheduler : public GlobAlloc, public Callee {
 
             blockingSyscalls.resize(MAX_THREADS /* TODO: max # procs */);
 
-            info("Started RR scheduler, quantum=%d phases", schedQuantum);
+            info("Started %s scheduler, quantum=%d phases", localityPlacement? "locality-aware" : "RR", schedQuantum);
             terminateWatchdogThread = false;
             startWatchdogThread();
         }
 
         ~Scheduler() {}
 
+        // Place contexts in the nodes of NUMAMap, which is built after the scheduler
+        void initNodes();
+
         void initStats(AggregateStat* parentStat) {
             AggregateStat* schedStats = new AggregateStat();
             schedStats->init("sched", "Scheduler stats");
@@ -213,6 +357,15 @@ class Scheduler : public GlobAlloc, public Callee {
             occHist.init("occHist", "Occupancy histogram", numCores+1); schedStats->append(&occHist);
             uint32_t runQueueHistSize = ((numCores > 16)? numCores : 16) + 1;
             runQueueHist.init("rqSzHist", "Run queue size histogram", runQueueHistSize); schedStats->append(&runQueueHist);
+            static const char* schedFuncNames[] = {"thread", "context", "tick"};
+            if (profileSched) {
+                schedNs.init("schedNs", "Host time spent in scheduling decisions (ns)", SF_NUM, schedFuncNames); schedStats->append(&schedNs);
+            }
+            schedTicks.init("schedTicks", "Time slices ended with queued threads"); schedStats->append(&schedTicks);
+            migrations.init("migrations", "Threads scheduled on a context other than their last one"); schedStats->append(&migrations);
+            nodeMigrations.init("nodeMigrations", "Threads scheduled on a NUMA node other than their last one"); schedStats->append(&nodeMigrations);
+            auto runQueuesStat = makeLambdaStat([this]() { return runQueues.size(); });
+            runQueuesStat->init("runQueues", "Distinct masks of queued threads (run queues)"); schedStats->append(runQueuesStat);
             parentStat->append(schedStats);
         }
 
@@ -228,7 +381,7 @@ class Scheduler : public GlobAlloc, public Callee {
             //   guessing it hasn't flushed its cached pid at this point)
             gidMap[gid] = new ThreadInfo(gid, syscall(SYS_getpid), syscall(SYS_gettid), mask);
             if (pendingMaskMap.find(gid) != pendingMaskMap.end()) {
-                gidMap[gid]->mask = pendingMaskMap[gid];
+                gidMap[gid]->setMask(pendingMaskMap[gid]);
                 pendingMaskMap.erase(gid);
             }
             threadsCreated.inc();
@@ -262,14 +415,15 @@ class Scheduler : public GlobAlloc, public Callee {
 
             assert_msg(th->state == STARTED /*might be started but in fastFwd*/ ||th->state == OUT || th->state == BLOCKED || th->state == QUEUED, "gid %d finish with state %d", gid, th->state);
             if (th->state == QUEUED) {
-                assert(th->owner == &runQueue);
-                runQueue.remove(th);
+                assert(th->runQueue);
+                dequeue(th);
             } else if (th->owner) {
                 assert(th->owner == &outQueue);
                 outQueue.remove(th);
+                outSet.clear(th->cid);
                 ContextInfo* ctx = &contexts[th->cid];
                 deschedule(th, ctx, BLOCKED);
-                freeList.push_back(ctx);
+                freeSet.set(ctx->cid);
                 //no need to try to schedule anything; this context was already being considered while in outQueue
                 //assert(runQueue.empty()); need not be the case with masks
                 //info("[G %d] Removed from outQueue and descheduled", gid);
@@ -324,6 +478,7 @@ class Scheduler : public GlobAlloc, public Callee {
             if (th->state == OUT) {
                 th->state = RUNNING;
                 outQueue.remove(th);
+                outSet.clear(th->cid);
                 zinfo->cores[th->cid]->join();
                 bar.join(th->cid, &schedLock); //releases lock
             } else {
@@ -336,7 +491,7 @@ class Scheduler : public GlobAlloc, public Callee {
                     bar.join(th->cid, &schedLock); //releases lock
                 } else {
                     th->state = QUEUED;
-                    runQueue.push_back(th);
+                    enqueue(th);
                     waitForContext(th); //releases lock, might join
                 }
             }
@@ -378,7 +533,7 @@ class Scheduler : public GlobAlloc, public Callee {
                     zinfo->cores[ctx->cid]->join(); //inTh does not do a sched->join, so we need to notify the core since we just called leave() on it
                     wakeup(inTh, false /*no join, we did not leave*/);
                 } else {
-                    freeList.push_back(ctx);
+                    freeSet.set(ctx->cid);
                     bar.leave(cid); //may trigger end of phase
                 }
             } else { //lazily transition to OUT, where we retain our context
@@ -391,11 +546,12 @@ class Scheduler : public GlobAlloc, public Callee {
                     wakeup(inTh, false /*no join, we did not leave*/);
                 } else if (th->mask[th->cid] == false) {
                     deschedule(th, ctx, BLOCKED);
-                    freeList.push_back(ctx);
+                    freeSet.set(ctx->cid);
                     bar.leave(cid); //may trigger end of phase
                 } else { //lazily transition to OUT, where we retain our context
                     th->state = OUT;
                     outQueue.push_back(th);
+                    outSet.set(cid);
                     bar.leave(cid); //may trigger end of phase
                 }
             }
@@ -431,7 +587,7 @@ class Scheduler : public GlobAlloc, public Callee {
                     zinfo->cores[ctx->cid]->join();
                     bar.join(ctx->cid, &schedLock); //releases lock
                 } else {
-                    runQueue.push_back(th);
+                    enqueue(th);
                     waitForContext(th); //releases lock, might join
                 }
             }
@@ -445,7 +601,7 @@ class Scheduler : public GlobAlloc, public Callee {
             //End of phase stats
             assert(scheduledThreads <= numCores);
             occHist.inc(scheduledThreads);
-            uint32_t rqPos = (runQueue.size() < (runQueueHist.size()-1))? runQueue.size() : (runQueueHist.size()-1);
+            uint32_t rqPos = (queuedThreads < (runQueueHist.size()-1))? queuedThreads : (runQueueHist.size()-1);
             runQueueHist.inc(rqPos);
 
             if (atSyncFunc) atSyncFunc(); //call the simulator-defined actions external to the scheduler
@@ -474,7 +630,7 @@ class Scheduler : public GlobAlloc, public Callee {
             }
 
             //Handle rescheduling
-            if (runQueue.empty()) return;
+            if (queuedThreads == 0) return;
 
             if ((curPhase % schedQuantum) == 0) {
                 schedTick();
@@ -596,9 +752,7 @@ class Scheduler : public GlobAlloc, public Callee {
 
         void updateMask(uint32_t pid, uint32_t tid, const g_vector<bool>& mask) {
             assert(mask.size() == zinfo->numCores);
-            uint32_t count = 0;
-            for (auto b : mask) if (b) count++;
-            if (count == 0) panic("Scheduler::setMask(): empty mask on pid=%u, tid=%u!", pid, tid);
+            if (CoreSet(mask).empty()) panic("Scheduler::setMask(): empty mask on pid=%u, tid=%u!", pid, tid);
             futex_lock(&schedLock);
             uint32_t gid = getGid(pid, tid);
             if (gidMap.find(gid) == gidMap.end()) {
@@ -606,7 +760,17 @@ class Scheduler : public GlobAlloc, public Callee {
                 pendingMaskMap[gid] = mask;
             } else {
                 ThreadInfo* th = gidMap[gid];
-                th->mask = mask;
+                if (th->runQueue) {
+                    // Move to the run queue of the new mask, keeping our turn
+                    RunQueue* rq = getRunQueue(CoreSet(mask));
+                    th->runQueue->threads.remove(th);
+                    th->runQueue = rq;
+                    ThreadInfo* prev = rq->threads.back();
+                    while (prev && prev->queueSeq > th->queueSeq) prev = prev->prev;
+                    if (prev) rq->threads.insertAfter(prev, th);
+                    else rq->threads.push_front(th);
+                }
+                th->setMask(mask);
             }
             futex_unlock(&schedLock);
             // Do leave and join outside to clear and set cid in zsim.cpp
@@ -626,8 +790,13 @@ class Scheduler : public GlobAlloc, public Callee {
             assert(th->state == STARTED || th->state == BLOCKED || th->state == QUEUED);
             assert(ctx->state == IDLE);
             assert(ctx->curThread == nullptr);
+            if (th->hasRun && th->cid != ctx->cid) {
+                migrations.inc();
+                if (coreNode[th->cid] != coreNode[ctx->cid]) nodeMigrations.inc();
+            }
             th->state = RUNNING;
             th->cid = ctx->cid;
+            th->hasRun = true;
             ctx->state = USED;
             ctx->curThread = th;
             scheduleEvents.inc();
@@ -706,120 +875,186 @@ class Scheduler : public GlobAlloc, public Callee {
          * - schedThread(): Here's a thread that just became available; return either a ContextInfo* where to schedule it, or nullptr if none are available
          * - schedContext(): Here's a context that just became available; return either a ThreadInfo* to schedule on it, or nullptr if none are available
          * - schedTick(): Current quantum is over, hand off contexts to other threads as you see fit
-         * These functions can REMOVE from runQueue, outQueue, and freeList, but do not INSERT. These are filled in elsewhere. They also have minimal concerns
+         * These functions can REMOVE from the run queues, outQueue, and freeSet, but do not INSERT. These are filled in elsewhere. They also have minimal concerns
          * for thread and context states. Those state machines are implemented and handled elsewhere, except where strictly necessary.
          */
         ContextInfo* schedThread(ThreadInfo* th) {
+            uint64_t startNs = profileSched ? getNs() : 0;
             ContextInfo* ctx = nullptr;
 
             //First, try to get scheduled in the last context we were running at
             assert(th->cid < numCores); //though old, it should be in a valid range
             if (contexts[th->cid].state == IDLE && th->mask[th->cid]) {
-                ctx = &contexts[th->cid];
-                freeList.remove(ctx);
+                ctx = takeFreeContext(th->cid);
+            } else if (localityPlacement && th->hasRun && outSet.test(th->cid) && th->mask[th->cid]) {
+                ctx = stealOutContext(th->cid);
             }
 
-            //Second, check the freeList
-            if (!ctx && !freeList.empty()) {
-                ContextInfo* c = freeList.front();
-                while (c) {
-                    if (th->mask[c->cid]) {
-                        ctx = c;
-                        freeList.remove(ctx);
+            //Threads that never ran have no node to stay near, so they take a free context anywhere before stealing one
+            if (!ctx && localityPlacement && th->hasRun) {
+                //Then, on each node from ours to the farthest, a free context, or else one from the outQueue
+                for (uint32_t node : nodeOrder[coreNode[th->cid]]) {
+                    candSet.setIntersection(th->coreMask, nodeCores[node]);
+                    uint32_t cid = candSet.firstCommon(freeSet, th->cid);
+                    if (cid != (uint32_t)-1) {
+                        ctx = takeFreeContext(cid);
                         break;
-                    } else {
-                        c = c->next;
                     }
-                }
-            }
-
-            //Third, try to steal from the outQueue (block a thread, take its cid)
-            if (!ctx && !outQueue.empty()) {
-                ThreadInfo* outTh = outQueue.front();
-                while (outTh) {
-                    if (th->mask[outTh->cid]) {
-                        ctx = &contexts[outTh->cid];
-                        outQueue.remove(outTh);
-                        deschedule(outTh, ctx, BLOCKED);
+                    cid = candSet.firstCommon(outSet, th->cid);
+                    if (cid != (uint32_t)-1) {
+                        ctx = stealOutContext(cid);
                         break;
-                    } else {
-                        outTh = outTh->next;
                     }
                 }
+            } else if (!ctx) {
+                //Second, look for a free context in our mask, starting from the last one
+                uint32_t cid = th->coreMask.firstCommon(freeSet, th->cid);
+                if (cid != (uint32_t)-1) ctx = takeFreeContext(cid);
+
+                //Third, try to steal from the outQueue (block a thread, take its cid)
+                if (!ctx) {
+                    cid = th->coreMask.firstCommon(outSet, th->cid);
+                    if (cid != (uint32_t)-1) ctx = stealOutContext(cid);
+                }
             }
 
             if (ctx) assert(th->mask[ctx->cid]);
 
             //info("schedThread done, gid %d, success %d", th->gid, ctx != nullptr);
             //printState();
+            if (profileSched) schedNs.inc(SF_THREAD, getNs() - startNs);
+            return ctx;
+        }
+
+        ContextInfo* takeFreeContext(uint32_t cid) {
+            assert(freeSet.test(cid));
+            freeSet.clear(cid);
+            return &contexts[cid];
+        }
+
+        ContextInfo* stealOutContext(uint32_t cid) {
+            ContextInfo* ctx = &contexts[cid];
+            ThreadInfo* outTh = ctx->curThread;
+            assert(outTh && outTh->owner == &outQueue);
+            outQueue.remove(outTh);
+            outSet.clear(cid);
+            deschedule(outTh, ctx, BLOCKED);
             return ctx;
         }
 
         ThreadInfo* schedContext(ContextInfo* ctx) {
+            uint64_t startNs = profileSched ? getNs() : 0;
             ThreadInfo* th = nullptr;
-            ThreadInfo* blockedTh = runQueue.front();  // null if empty
-            while (blockedTh) {
-                if (blockedTh->mask[ctx->cid]) {
-                    th = blockedTh;
-                    runQueue.remove(blockedTh);
-                    break;
-                } else {
-                    blockedTh = blockedTh->next;
-                }
+            for (RunQueue* rq : coreRunQueues[ctx->cid]) {
+                ThreadInfo* head = rq->threads.front();  // null if empty
+                if (head && (!th || head->queueSeq < th->queueSeq)) th = head;
             }
+            if (th) dequeue(th);
 
             //info("schedContext done, cid %d, success %d (gid %d)", ctx->cid, th != nullptr, th? th->gid : 0);
             //printState();
+            if (profileSched) schedNs.inc(SF_CONTEXT, getNs() - startNs);
             return th;
         }
 
         void schedTick() {
-            std::vector<uint32_t> availVec;
-            availVec.resize(zinfo->numCores);
-            for (uint32_t i = 0; i < zinfo->numCores; i++) availVec[i] = i;
-
-            //Random shuffle (Fisher-Yates)
-            for (uint32_t i = zinfo->numCores - 1; i > 0; i--) {
-                uint32_t j = rnd.randInt(i); //j is in 0,...,i
-                std::swap(availVec[i], availVec[j]);
-            }
-
-            std::list<uint32_t> avail(availVec.begin(), availVec.end());
+            uint64_t startNs = profileSched ? getNs() : 0;
 
-            /* NOTE: avail has all cores, including those in freeList, which may not be empty.
-             * But we will never match anything in the freeList, because schedContext and
-             * schedThread would have matched them out. So, no need to prioritize the freeList.
+            /* Contexts in freeSet are not candidates: schedContext and schedThread would have matched them out already.
+             * Each queued thread, longest-queued first, is handed off an available context in its mask, see pickTickContext().
              */
+            CoreSet avail(numCores);
+            avail.fill();
+            avail.remove(freeSet);
 
-            uint32_t contextSwitches = 0;
+            tickHeads.clear();  // next thread to consider of each non-empty run queue
+            for (RunQueue* rq : runQueues) {
+                if (!rq->threads.empty()) tickHeads.push_back(rq->threads.front());
+            }
 
-            ThreadInfo* th = runQueue.front();
-            while (th && !avail.empty()) {
-                bool scheduled = false;
-                for (std::list<uint32_t>::iterator it = avail.begin(); it != avail.end(); it++) {
-                    uint32_t cid = *it;
-                    if (th->mask[cid]) {
-                        ContextInfo* ctx = &contexts[cid];
-                        ThreadInfo* victimTh = ctx->curThread;
-                        assert(victimTh);
-                        victimTh->handoffThread = th;
-                        contextSwitches++;
-
-                        scheduled = true;
-                        avail.erase(it);
-                        break;
-                    }
+            uint32_t contextSwitches = 0;
+            while (!tickHeads.empty() && !avail.empty()) {
+                uint32_t h = 0;
+                for (uint32_t i = 1; i < tickHeads.size(); i++) {
+                    if (tickHeads[i]->queueSeq < tickHeads[h]->queueSeq) h = i;
+                }
+                ThreadInfo* th = tickHeads[h];
+
+                uint32_t cid = pickTickContext(th, avail);
+                if (cid != (uint32_t)-1) {
+                    ContextInfo* ctx = &contexts[cid];
+                    ThreadInfo* victimTh = ctx->curThread;
+                    assert(victimTh);
+                    victimTh->handoffThread = th;
+                    contextSwitches++;
+                    avail.clear(cid);
+
+                    if (th->next) tickHeads[h] = th->next;
+                    else tickHeads[h] = nullptr;
+                    dequeue(th);
+                } else {
+                    tickHeads[h] = nullptr;  // the rest of its run queue has the same mask, so skip it
                 }
 
-                ThreadInfo* pth = th;
-                th = th->next;
-                if (scheduled) runQueue.remove(pth);
+                if (!tickHeads[h]) {
+                    tickHeads[h] = tickHeads.back();
+                    tickHeads.pop_back();
+                }
             }
 
-            info("Time slice ended, context-switched %d threads, runQueue size %ld, available %ld", contextSwitches, runQueue.size(), avail.size());
+            schedTicks.inc();
+            if (profileSched) schedNs.inc(SF_TICK, getNs() - startNs);
+            info("Time slice ended, context-switched %d threads, runQueue size %d, available %d", contextSwitches, queuedThreads, avail.count());
             printState();
         }
 
+        // Random context of avail in the mask of the thread; -1 if none. With locality placement, the last context of
+        // the thread if available, or else a random one from the nearest node that has any.
+        uint32_t pickTickContext(ThreadInfo* th, const CoreSet& avail) {
+            if (!localityPlacement || !th->hasRun) {
+                uint32_t numAvail = th->coreMask.countCommon(avail);
+                return numAvail? th->coreMask.nthCommon(avail, rnd.randInt(numAvail - 1)) : -1;
+            }
+
+            if (avail.test(th->cid) && th->mask[th->cid]) return th->cid;
+            for (uint32_t node : nodeOrder[coreNode[th->cid]]) {
+                candSet.setIntersection(th->coreMask, nodeCores[node]);
+                uint32_t numAvail = candSet.countCommon(avail);
+                if (numAvail) return candSet.nthCommon(avail, rnd.randInt(numAvail - 1));
+            }
+            return -1;
+        }
+
+        // Run queue management. Threads enter the back of the run queue of their mask.
+        RunQueue* getRunQueue(const CoreSet& mask) {
+            g_vector<RunQueue*>& bucket = runQueueMap[mask.hash()];
+            for (RunQueue* rq : bucket) if (rq->mask == mask) return rq;
+
+            RunQueue* rq = new RunQueue(mask);
+            bucket.push_back(rq);
+            runQueues.push_back(rq);
+            for (uint32_t c = 0; c < numCores; c++) {
+                if (mask.test(c)) coreRunQueues[c].push_back(rq);
+            }
+            return rq;
+        }
+
+        void enqueue(ThreadInfo* th) {
+            assert(th->state == QUEUED && !th->runQueue);
+            th->runQueue = getRunQueue(th->coreMask);
+            th->queueSeq = nextQueueSeq++;
+            th->runQueue->threads.push_back(th);
+            queuedThreads++;
+        }
+
+        // Leaves the thread QUEUED, the caller hands it a context
+        void dequeue(ThreadInfo* th) {
+            assert(th->runQueue);
+            th->runQueue->threads.remove(th);
+            th->runQueue = nullptr;
+            queuedThreads--;
+        }
+
         //Watchdog thread functions
         /* With sleeping threads, we have to drive time forward if no thread is scheduled and some threads are sleeping; otherwise, we can deadlock.
          * This initially was the responsibility of the last leaving thread, but led to horribly long syscalls being simulated. For example, if you
@@ -55,6 +55,10 @@ void SimpleCore::store(Address addr) {
     curCycle = l1d->store(addr, curCycle);
 }
 
+void SimpleCore::copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines) {
+    curCycle = l1d->copyLines(srcLineAddr, dstLineAddr, numLines, curCycle);
+}
+
 void SimpleCore::bbl(Address bblAddr, BblInfo* bblInfo) {
     //info("BBL %s %p", name.c_str(), bblInfo);
     //info("%d %d", bblInfo->instrs, bblInfo->bytes);
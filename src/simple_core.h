@@ -54,6 +54,8 @@ class SimpleCore : public Core {
 
         void contextSwitch(int32_t gid);
         virtual void join();
+        void stall(uint64_t cycles) override {curCycle += cycles;}
+        void copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines) override;
 
         InstrFuncPtrs GetFuncPtrs();
 
@@ -44,6 +44,11 @@
  *   like to treat as raw counters because e.g. they have a different type,
  *   or for efficiency reasons (e.g. the per-thread phase cycles count is
  *   updated on every BBL, and may be an uint32_t)
+ * - ShardedCounter and ShardedVectorCounter: Counters updated concurrently
+ *   from many bound-phase threads (e.g., in shared routers and memory
+ *   controllers). Updates go to a per-thread cache line-padded shard, and
+ *   shards are summed when the value is read, so hot counters do not bounce
+ *   lines across host cores.
  *
  * Groups of stats are contained in aggregates (AggregateStat), representing
  * a collection of stats. At initialization time, all stats are registered
@@ -75,9 +80,12 @@
 /* TODO: I want these to be POD types, but polymorphism (needed by virtual functions) probably disables it. Dang. */
 
 #include <stdint.h>
+#include <string.h>
 #include <string>
 #include "g_std/g_vector.h"
+#include "galloc.h"
 #include "log.h"
+#include "pad.h"
 
 enum StatType {
     AGGREGATE = (1u << 0),
@@ -316,6 +324,150 @@ class VectorCounter : public VectorStat {
         }
 };
 
+/* Sharded counters
+ *
+ * Callers pass their shard, typically the core (or thread) id, so that each
+ * bound-phase thread updates its own line. Shard ids wrap around the number
+ * of shards, and several threads may then share a shard, so updates are
+ * atomic, but uncontended in the common case.
+ */
+
+#define STATS_SHARDS 32  // must be a power of 2
+
+class ShardedCounter : public ScalarStat {
+    private:
+        struct Shard {
+            uint64_t count;
+            PAD_SZ(sizeof(uint64_t));
+        };
+        Shard* volatile _shards;
+
+        // Allocated on the first update rather than at init, so that like Counter, it can be updated even if never
+        // initialized (e.g., stats skipped), and counters of components that are never used take no memory.
+        Shard* allocShards() {
+            Shard* shards = gm_memalign<Shard>(CACHE_LINE_BYTES, STATS_SHARDS);
+            memset(shards, 0, sizeof(Shard) * STATS_SHARDS);
+            if (!__sync_bool_compare_and_swap(&_shards, nullptr, shards)) {
+                gm_free(shards);  // another thread won the race
+                shards = _shards;
+            }
+            return shards;
+        }
+
+    public:
+        ShardedCounter() : ScalarStat(), _shards(nullptr) {}
+
+        void init(const char* name, const char* desc) {
+            initStat(name, desc);
+        }
+
+        inline void inc(uint32_t shard, uint64_t delta) {
+            Shard* shards = _shards;
+            if (unlikely(!shards)) shards = allocShards();
+            __sync_fetch_and_add(&shards[shard & (STATS_SHARDS - 1)].count, delta);
+        }
+
+        inline void inc(uint32_t shard) {
+            inc(shard, 1);
+        }
+
+        uint64_t get() const {
+            Shard* shards = _shards;
+            if (!shards) return 0;
+            uint64_t sum = 0;
+            for (uint32_t i = 0; i < STATS_SHARDS; i++) sum += shards[i].count;
+            return sum;
+        }
+};
+
+class ShardedVectorCounter : public VectorStat {
+    private:
+        uint64_t* _counters;  // one line-aligned row per shard
+        uint32_t _size;
+        uint32_t _rowSize;
+
+    public:
+        ShardedVectorCounter() : VectorStat(), _counters(nullptr), _size(0), _rowSize(0) {}
+
+        /* Without counter names */
+        virtual void init(const char* name, const char* desc, uint32_t size) {
+            initStat(name, desc);
+            assert(size > 0);
+            _size = size;
+            uint32_t lineCounters = CACHE_LINE_BYTES / sizeof(uint64_t);
+            _rowSize = (size + lineCounters - 1) / lineCounters * lineCounters;
+            _counters = gm_memalign<uint64_t>(CACHE_LINE_BYTES, _rowSize * STATS_SHARDS);
+            memset(_counters, 0, sizeof(uint64_t) * _rowSize * STATS_SHARDS);
+            _counterNames = nullptr;
+        }
+
+        /* With counter names */
+        virtual void init(const char* name, const char* desc, uint32_t size, const char** counterNames) {
+            init(name, desc, size);
+            assert(counterNames);
+            _counterNames = gm_dup<const char*>(counterNames, size);
+        }
+
+        inline void inc(uint32_t shard, uint32_t idx, uint64_t delta) {
+            assert(idx < _size);
+            __sync_fetch_and_add(&_counters[(shard & (STATS_SHARDS - 1)) * _rowSize + idx], delta);
+        }
+
+        inline void inc(uint32_t shard, uint32_t idx) {
+            inc(shard, idx, 1);
+        }
+
+        inline virtual uint64_t count(uint32_t idx) const {
+            assert(idx < _size);
+            uint64_t sum = 0;
+            for (uint32_t i = 0; i < STATS_SHARDS; i++) sum += _counters[i * _rowSize + idx];
+            return sum;
+        }
+
+        inline uint32_t size() const {
+            return _size;
+        }
+};
+
+/* Not a stat: sharded accumulators with the same layout, for bound-phase
+ * load estimates that are drained at the end of each phase, when no thread
+ * updates them.
+ */
+class ShardedAccumulator {
+    private:
+        uint64_t* _counters;
+        uint32_t _size;
+        uint32_t _rowSize;
+
+    public:
+        ShardedAccumulator() : _counters(nullptr), _size(0), _rowSize(0) {}
+
+        void init(uint32_t size) {
+            assert(size > 0);
+            _size = size;
+            uint32_t lineCounters = CACHE_LINE_BYTES / sizeof(uint64_t);
+            _rowSize = (size + lineCounters - 1) / lineCounters * lineCounters;
+            _counters = gm_memalign<uint64_t>(CACHE_LINE_BYTES, _rowSize * STATS_SHARDS);
+            memset(_counters, 0, sizeof(uint64_t) * _rowSize * STATS_SHARDS);
+        }
+
+        inline void add(uint32_t shard, uint32_t idx, uint64_t delta) {
+            assert(idx < _size);
+            __sync_fetch_and_add(&_counters[(shard & (STATS_SHARDS - 1)) * _rowSize + idx], delta);
+        }
+
+        // Return the sum and reset it. Not thread-safe against add().
+        uint64_t drain(uint32_t idx) {
+            assert(idx < _size);
+            uint64_t sum = 0;
+            for (uint32_t i = 0; i < STATS_SHARDS; i++) {
+                sum += _counters[i * _rowSize + idx];
+                _counters[i * _rowSize + idx] = 0;
+            }
+            return sum;
+        }
+};
+
 /*
 class Histogram : public Stat {
     //TBD
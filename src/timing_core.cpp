@@ -89,6 +89,12 @@ void TimingCore::storeAndRecord(Address addr) {
     cRec.record(startCycle);
 }
 
+void TimingCore::copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines) {
+    uint64_t startCycle = curCycle;
+    curCycle = l1d->copyLines(srcLineAddr, dstLineAddr, numLines, curCycle);
+    cRec.record(startCycle);
+}
+
 void TimingCore::bblAndRecord(Address bblAddr, BblInfo* bblInfo) {
     instrs += bblInfo->instrs;
     curCycle += bblInfo->instrs;
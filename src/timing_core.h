@@ -57,6 +57,8 @@ class TimingCore : public Core {
         void contextSwitch(int32_t gid);
         virtual void join();
         virtual void leave();
+        void stall(uint64_t cycles) override {curCycle += cycles;}
+        void copyLines(Address srcLineAddr, Address dstLineAddr, uint32_t numLines) override;
 
         InstrFuncPtrs GetFuncPtrs();
 
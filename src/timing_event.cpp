@@ -28,6 +28,33 @@
 #include "contention_sim.h"
 #include "zsim.h"
 
+void StitchOffPathRecord(EventRecorder* evRec, TimingRecord& offRec, uint64_t reqCycle) {
+    assert(offRec.isValid());
+    if (!evRec->hasRecord()) {
+        // Downstream should not care about endEvent for off-path accesses (e.g., PUTs)
+        offRec.endEvent = nullptr;
+        evRec->pushRecord(offRec);
+    } else {
+        // Connect both events
+        TimingRecord acc = evRec->popRecord();
+        assert(offRec.reqCycle >= reqCycle);
+        assert(acc.reqCycle >= reqCycle);
+        DelayEvent* startEv = new (evRec) DelayEvent(0);
+        DelayEvent* dOffEv = new (evRec) DelayEvent(offRec.reqCycle - reqCycle);
+        DelayEvent* dAccEv = new (evRec) DelayEvent(acc.reqCycle - reqCycle);
+        startEv->setMinStartCycle(reqCycle);
+        dOffEv->setMinStartCycle(reqCycle);
+        dAccEv->setMinStartCycle(reqCycle);
+        startEv->addChild(dOffEv, evRec)->addChild(offRec.startEvent, evRec);
+        startEv->addChild(dAccEv, evRec)->addChild(acc.startEvent, evRec);
+
+        acc.reqCycle = reqCycle;
+        acc.startEvent = startEv;
+        // endEvent / endCycle stay the same; offRec's endEvent not connected
+        evRec->pushRecord(acc);
+    }
+}
+
 /* TimingEvent */
 
 void TimingEvent::parentDone(uint64_t startCycle) {
@@ -358,5 +358,10 @@ class CrossingEvent : public TimingEvent {
         friend class ContentionSim;
 };
 
+/* Adds the record of an off-critical-path access (e.g., a writeback) issued on behalf of an access that started at
+ * reqCycle. If the recorder already holds the access's own record, both are stitched under a common start event and
+ * the access's end event is kept; otherwise, offRec becomes the record, with no end event.
+ */
+void StitchOffPathRecord(EventRecorder* evRec, TimingRecord& offRec, uint64_t reqCycle);
 
 #endif  // TIMING_EVENT_H_
@@ -3,6 +3,7 @@
 #include "log.h"
 #include "memory_hierarchy.h"
 #include "numa_map.h"
+#include "numa_migration_cost.h"
 #include "virt/common.h"
 #include "zsim.h"
 
@@ -141,6 +142,28 @@ static inline size_t addAddrRangeThreadPolicy(void* addr, unsigned long len, uin
 }
 
 
+// Page migration cost.
+// Whether to charge the thread for the pages its syscall migrates; not while fast-forwarding, as it has no core.
+// NOTE: call before the syscall, since thread will leave after entering it.
+static inline bool chargesMigrations(uint32_t tid) {
+    return zinfo->numaMigrationCost && getCid(tid) < zinfo->numCores;
+}
+
+static inline void getMappedAddrRange(void* addr, unsigned long len, g_vector<NUMAMap::MappedRange>& ranges) {
+    zinfo->numaMap->getMappedRanges(getPageAddress(addr), getPageAddressEnd(addr, len), ranges);
+}
+
+// Queue the copies of the pages that were mapped in ranges and are now on another node.
+static inline void queueMigrations(uint32_t tid, const g_vector<NUMAMap::MappedRange>& ranges) {
+    for (const auto& range : ranges) {
+        for (Address pageAddr = range.pageAddr; pageAddr < range.pageAddr + range.pageCount; pageAddr++) {
+            uint32_t node = zinfo->numaMap->lookupNodeOfPage(pageAddr);
+            if (node != range.node) zinfo->numaMigrationCost->queue(tid, pageAddr, range.node);
+        }
+    }
+}
+
+
 /* Patches. */
 
 PostPatchFn getErrorPostPatch(int err) {
@@ -313,6 +336,7 @@ PostPatchFn PatchMbind(PrePatchArgs args) {
     }
 
     // We must get the core info now, since thread will leave after entering syscall.
+    bool charge = (flags & MPOL_MF_MOVE) && chargesMigrations(args.tid);
     uint32_t cid = getCid(args.tid);
     if (mode == MPOL_DEFAULT && cid >= zinfo->numCores) {
         warn("Thread %u uses default mempolicy but runs on core %u (are we in FF?); fall back to default core 0", args.tid, cid);
@@ -329,10 +353,13 @@ PostPatchFn PatchMbind(PrePatchArgs args) {
         // Add all non-existing pages; either move or ignore existing pages depending on flags.
         bool isStrict = (flags & MPOL_MF_STRICT);
         bool movePages = (flags & MPOL_MF_MOVE);
+        g_vector<NUMAMap::MappedRange> moved;
+        if (charge) getMappedAddrRange(addr, len, moved);
         if (movePages) {
             removeAddrRange(addr, len);
         }
         auto ignoredCount = addAddrRangeThreadPolicy(addr, len, args.tid, cid, policy);
+        if (charge) queueMigrations(args.tid, moved);
         if (isStrict && ignoredCount != 0) {
             // Some pages do not follow the policy or could not be moved.
             PIN_SetSyscallNumber(args.ctxt, args.std, (ADDRINT)-EIO);
@@ -353,14 +380,51 @@ PostPatchFn PatchMigratePages(PrePatchArgs args) {
         return getErrorPostPatch(ENOSYS);
     }
 
+    uint32_t linuxPid = PIN_GetSyscallArgument(args.ctxt, args.std, 0);
+    unsigned long maxnode = PIN_GetSyscallArgument(args.ctxt, args.std, 1);
+    unsigned long* oldNodemask = reinterpret_cast<unsigned long*>(PIN_GetSyscallArgument(args.ctxt, args.std, 2));
+    unsigned long* newNodemask = reinterpret_cast<unsigned long*>(PIN_GetSyscallArgument(args.ctxt, args.std, 3));
+
     PIN_SetSyscallNumber(args.ctxt, args.std, (ADDRINT)SYS_getpid);  // no effect on host
 
-    return [](PostPatchArgs args) {
-        // FIXME(mgao12): current NUMAMap does not provide interface to migrate all pages
-        // associated with a node in a process, so we do not patch migrate_page for now.
-        warn("SYS_migrate_pages is not supported for now!");
-        // Make it a failure.
-        PIN_SetSyscallNumber(args.ctxt, args.std, (ADDRINT)-EPERM);
+    // Validate. Other processes would need their own procMask, and their threads could not be charged for the copies.
+    if (linuxPid != 0) {
+        warn("SYS_migrate_pages does not support non-zero pid!");
+        return getErrorPostPatch(EPERM);
+    }
+
+    // Translate nodemasks.
+    g_vector<bool> oldVec, newVec;
+    int err = nodemask2vector(oldNodemask, maxnode, oldVec);
+    if (err) return getErrorPostPatch(err);
+    err = nodemask2vector(newNodemask, maxnode, newVec);
+    if (err) return getErrorPostPatch(err);
+
+    bool charge = chargesMigrations(args.tid);
+
+    return [=](PostPatchArgs args) {
+        // Map the i-th old node to the (i % n)-th new node, n being the number of new nodes, like the kernel.
+        g_vector<uint32_t> newNodes;
+        for (uint32_t n = 0; n < newVec.size(); n++) if (newVec[n]) newNodes.push_back(n);
+        g_vector<uint32_t> target(oldVec.size(), NUMAMap::INVALID_NODE);
+        uint32_t i = 0;
+        for (uint32_t n = 0; n < oldVec.size() && !newNodes.empty(); n++) {
+            if (oldVec[n]) target[n] = newNodes[i++ % newNodes.size()];
+        }
+
+        // Move all the mapped pages of the process in the user address space.
+        Address beginPageAddr = procMask >> (pageBits - lineBits);
+        g_vector<NUMAMap::MappedRange> ranges;
+        zinfo->numaMap->getMappedRanges(beginPageAddr, beginPageAddr + (1uL << (48 - pageBits)), ranges);
+        for (const auto& range : ranges) {
+            // Pages on nodes beyond maxnode are not in the old nodes, so they stay
+            uint32_t node = (range.node < target.size()) ? target[range.node] : NUMAMap::INVALID_NODE;
+            if (node == NUMAMap::INVALID_NODE || node == range.node) continue;
+            zinfo->numaMap->movePagesToNode(range.pageAddr, range.pageCount, node);
+        }
+        if (charge) queueMigrations(args.tid, ranges);
+
+        PIN_SetSyscallNumber(args.ctxt, args.std, (ADDRINT)0);  // all pages moved
         return PPA_NOTHING;
     };
 }
@@ -387,6 +451,7 @@ PostPatchFn PatchMovePages(PrePatchArgs args) {
         return getErrorPostPatch(EPERM);
     }
     if (pages == nullptr) return getErrorPostPatch(EINVAL);
+    bool charge = (nodes != nullptr) && chargesMigrations(args.tid);
 
     return [=](PostPatchArgs args) {
         int err = 0;
@@ -411,8 +476,11 @@ PostPatchFn PatchMovePages(PrePatchArgs args) {
                     err = ENODEV;
                     break;
                 }
+                g_vector<NUMAMap::MappedRange> moved;
+                if (charge) getMappedAddrRange(page, 1, moved);
                 removeAddrRange(page, 1);
                 assert(addAddrRangeToNode(page, 1, node) == 0);
+                if (charge) queueMigrations(args.tid, moved);
                 stat = static_cast<int>(node);
             } else {
                 // Get current node.
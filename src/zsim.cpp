@@ -52,6 +52,8 @@
 #include "galloc.h"
 #include "init.h"
 #include "log.h"
+#include "ndp_offload.h"
+#include "numa_migration_cost.h"
 #include "pin.H"
 #include "pin_cmd.h"
 #include "process_tree.h"
@@ -146,7 +148,7 @@ VOID SimThreadStart(THREADID tid);
 VOID SimThreadFini(THREADID tid);
 VOID SimEnd();
 
-VOID HandleMagicOp(THREADID tid, ADDRINT op);
+VOID HandleMagicOp(THREADID tid, ADDRINT op, ADDRINT arg);
 
 VOID FakeCPUIDPre(THREADID tid, REG eax, REG ecx);
 VOID FakeCPUIDPost(THREADID tid, ADDRINT* eax, ADDRINT* ebx, ADDRINT* ecx, ADDRINT* edx); //REG* eax, REG* ebx, REG* ecx, REG* edx);
@@ -196,12 +198,22 @@ VOID PIN_FAST_ANALYSIS_CALL IndirectPredStoreSingle(THREADID tid, ADDRINT addr,
 
 //Non-simulation variants of analysis functions
 
+// Cycles to charge to the next core a thread joins, e.g., for NDP offload launches and returns
+static uint32_t pendingStalls[MAX_THREADS];
+
 // Join variants: Call join on the next instrumentation poin and return to analysis code
 void Join(uint32_t tid) {
     assert(fPtrs[tid].type == FPTR_JOIN);
     uint32_t cid = zinfo->sched->join(procIdx, tid); //can block
     setCid(tid, cid);
 
+    if (unlikely(pendingStalls[tid])) {
+        cores[tid]->stall(pendingStalls[tid]);
+        if (zinfo->ndpOffload) zinfo->ndpOffload->stalled(pendingStalls[tid]);
+        pendingStalls[tid] = 0;
+    }
+    if (zinfo->numaMigrationCost) zinfo->numaMigrationCost->charge(tid, cores[tid]);
+
     if (unlikely(zinfo->terminationConditionMet)) {
         info("Caught termination condition on join, exiting");
         zinfo->sched->leave(procIdx, tid, cid);
@@ -589,7 +601,7 @@ VOID Instruction(INS ins) {
      */
     if (INS_IsXchg(ins) && INS_OperandReg(ins, 0) == REG_RCX && INS_OperandReg(ins, 1) == REG_RCX) {
         //info("Instrumenting magic op");
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) HandleMagicOp, IARG_THREAD_ID, IARG_REG_VALUE, REG_ECX, IARG_END);
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) HandleMagicOp, IARG_THREAD_ID, IARG_REG_VALUE, REG_ECX, IARG_REG_VALUE, REG_RDX, IARG_END);
     }
 
     if (INS_Opcode(ins) == XED_ICLASS_CPUID) {
@@ -881,6 +893,7 @@ VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
 VOID SimThreadFini(THREADID tid) {
     // zinfo->sched->leave(); //exit syscall (SyscallEnter) already leaves
     zinfo->sched->finish(procIdx, tid);
+    if (zinfo->numaMigrationCost) zinfo->numaMigrationCost->drop(tid);
     activeThreads[tid] = false;
     cids[tid] = UNINITIALIZED_CID; //clear this cid, it might get reused
 }
@@ -932,6 +945,9 @@ VOID SyscallExit(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v) {
     assert(inSyscall[tid]); inSyscall[tid] = false;
 
     PostPatchAction ppa = VirtSyscallExit(tid, ctxt, std);
+    if (zinfo->blockingSyscalls && zinfo->numaMigrationCost && fPtrs[tid].type == FPTR_ANALYSIS) {
+        zinfo->numaMigrationCost->charge(tid, cores[tid]);  // we kept our core
+    }
     if (ppa == PPA_USE_JOIN_PTRS) {
         if (!zinfo->blockingSyscalls) {
             fPtrs[tid] = joinPtrs;
@@ -1145,8 +1161,31 @@ VOID SimEnd() {
 #define ZSIM_MAGIC_OP_ROI_END           (1026)
 #define ZSIM_MAGIC_OP_REGISTER_THREAD   (1027)
 #define ZSIM_MAGIC_OP_HEARTBEAT         (1028)
+#define ZSIM_MAGIC_OP_OFFLOAD_BEGIN     (1034)
+#define ZSIM_MAGIC_OP_OFFLOAD_END       (1035)
+
+// Restrict the thread to the mask. If its core is not allowed, leave it and join an allowed one at the next
+// instrumentation point, paying stallCycles there; otherwise, pay them right away.
+static void MigrateThread(THREADID tid, const g_vector<bool>& mask, uint32_t stallCycles) {
+    zinfo->sched->updateMask(procIdx, tid, mask);
+    if (fPtrs[tid].type == FPTR_JOIN) {  // already left, e.g., on a syscall
+        pendingStalls[tid] += stallCycles;
+        return;
+    }
+    uint32_t cid = getCid(tid);
+    assert(cid != INVALID_CID);
+    if (mask[cid]) {
+        cores[tid]->stall(stallCycles);
+        zinfo->ndpOffload->stalled(stallCycles);
+        return;
+    }
+    clearCid(tid);
+    zinfo->sched->leave(procIdx, tid, cid);
+    pendingStalls[tid] += stallCycles;
+    fPtrs[tid] = joinPtrs;
+}
 
-VOID HandleMagicOp(THREADID tid, ADDRINT op) {
+VOID HandleMagicOp(THREADID tid, ADDRINT op, ADDRINT arg) {
     switch (op) {
         case ZSIM_MAGIC_OP_ROI_BEGIN:
             if (!zinfo->ignoreHooks) {
@@ -1203,6 +1242,25 @@ VOID HandleMagicOp(THREADID tid, ADDRINT op) {
             procTreeNode->heartbeat(); //heartbeats are per process for now
             return;
 
+        case ZSIM_MAGIC_OP_OFFLOAD_BEGIN:
+        case ZSIM_MAGIC_OP_OFFLOAD_END:
+            {
+                // Only simulated threads migrate; fast-forwarded ones run the region in place
+                if (!zinfo->ndpOffload || (fPtrs[tid].type != FPTR_ANALYSIS && fPtrs[tid].type != FPTR_JOIN)) return;
+                g_vector<bool> mask;
+                if (op == ZSIM_MAGIC_OP_OFFLOAD_BEGIN) {
+                    uint32_t cid = (fPtrs[tid].type == FPTR_JOIN) ? INVALID_CID : getCid(tid);
+                    if (zinfo->ndpOffload->begin(procIdx, tid, cid, arg, mask)) {
+                        MigrateThread(tid, mask, zinfo->ndpOffload->getLaunchCycles());
+                    }
+                } else {
+                    if (zinfo->ndpOffload->end(procIdx, tid, mask)) {
+                        MigrateThread(tid, mask, zinfo->ndpOffload->getReturnCycles());
+                    }
+                }
+            }
+            return;
+
         // HACK: Ubik magic ops
         case 1029:
         case 1030:
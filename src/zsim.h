@@ -35,6 +35,8 @@
 
 class Core;
 class NUMAMap;
+class NDPOffload;
+class NUMAMigrationCost;
 class Scheduler;
 class AggregateStat;
 class StatsBackend;
@@ -88,9 +90,12 @@ struct GlobSimInfo {
     EventQueue* eventQueue;
     Scheduler* sched;
     NUMAMap* numaMap;
+    NDPOffload* ndpOffload;
+    NUMAMigrationCost* numaMigrationCost;
 
     //Contention simulation
     uint32_t numDomains;
+    bool topologyDomains;  // domains follow NUMA nodes, see GetDomain() in init.cpp
     ContentionSim* contentionSim;
     EventRecorder** eventRecorders; //CID->EventRecorder* array
 